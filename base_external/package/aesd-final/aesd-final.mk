@@ -18,6 +18,9 @@ endef
 define AESD_ASSIGNMENTS_INSTALL_TARGET_CMDS
 	$(INSTALL) -m 0755 $(@D)/vehicle/vehicle $(TARGET_DIR)/bin
 	$(INSTALL) -m 0755 $(@D)/scan_tool/scan_tool $(TARGET_DIR)/bin
+	$(INSTALL) -m 0755 $(@D)/capture_tool/capture_tool $(TARGET_DIR)/bin
+	$(INSTALL) -m 0755 $(@D)/gateway/gateway $(TARGET_DIR)/bin
+	$(INSTALL) -m 0755 $(@D)/devmem2/devmem2 $(TARGET_DIR)/sbin
 endef
 
 $(eval $(generic-package))
@@ -0,0 +1,284 @@
+/*
+* File: capture_tool.c
+*
+* Description: Print the frames of a capture file within a time window
+*              and PID range.  Uses the capture index to seek directly
+*              to the blocks of interest.  Times are wall clock, taken
+*              from the clock offset stored when the capture started.
+*
+*              capture_tool [-s start] [-e end] [-p pid[-pid]] [-i] file
+*                -s  window start, seconds since the epoch
+*                -e  window end, seconds since the epoch
+*                -p  PID or PID range, decimal or 0x hex
+*                -i  print the index blocks instead of frames
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*
+*/
+
+// Includes
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define NS_PER_SEC      1000000000ULL
+
+// File data and functions
+static const char usage[] =
+   "Usage: %s [-s start] [-e end] [-p pid[-pid]] [-i] file\n";
+
+static uint64_t parse_seconds( const char *text );
+static int parse_pid_range( const char *text, uint8_t *pid_low, uint8_t *pid_high );
+static bool print_record(
+   const capture_record_header *record,
+   const uint8_t *payload,
+   void *context
+   );
+static void print_index( const capture_reader *reader );
+
+
+/*
+* Name: main
+*
+* Description: Parse options and run the capture query.
+*
+* Inputs: argc - number of command line arguments
+*         argv[] - command line arguments
+*         argv[ 0 ] - program name
+*
+* Returns: program exit status
+*
+*/
+int main( int argc, char *argv[] )
+{
+   int return_status = EXIT_SUCCESS;
+   int option;
+   bool show_index = false;
+   uint64_t start_ns = 0;
+   uint64_t end_ns = UINT64_MAX;
+   uint8_t pid_low = 0;
+   uint8_t pid_high = 0xFF;
+   size_t matches;
+   char program[ SYSLOG_BUF_SIZE+1 ];
+   capture_reader reader;
+
+   sprintf( program, "%.*s", SYSLOG_BUF_SIZE, argv[ 0 ] );
+   openlog( program, LOG_NDELAY | LOG_PERROR, LOG_USER );
+
+   while ( ( option = getopt( argc, argv, "s:e:p:i" ) ) != -1 )
+   {
+      switch( option )
+      {
+         case 's':
+         {
+            start_ns = parse_seconds( optarg );
+            break;
+         }
+         case 'e':
+         {
+            end_ns = parse_seconds( optarg );
+            break;
+         }
+         case 'p':
+         {
+            return_status = parse_pid_range( optarg, &pid_low, &pid_high );
+            break;
+         }
+         case 'i':
+         {
+            show_index = true;
+            break;
+         }
+         default:
+         {
+            return_status = EXIT_FAILURE;
+            break;
+         }
+      }
+   }
+
+   if ( ( EXIT_SUCCESS != return_status ) || ( optind >= argc ) )
+   {
+      fprintf( stderr, usage, argv[ 0 ] );
+      closelog();
+      return( EXIT_FAILURE );
+   }
+
+   return_status = capture_reader_open( &reader, argv[ optind ] );
+   if ( EXIT_SUCCESS == return_status )
+   {
+      if ( show_index )
+      {
+         print_index( &reader );
+      }
+      else
+      {
+         matches = capture_query(
+            &reader,
+            start_ns,
+            end_ns,
+            pid_low,
+            pid_high,
+            print_record,
+            &reader
+            );
+         fprintf( stderr, "%zu frames\n", matches );
+      }
+      capture_reader_close( &reader );
+   }
+
+   closelog();
+   return( return_status );
+}
+
+
+/*
+* Name: parse_seconds
+*
+* Description: Convert decimal seconds to nanoseconds
+*
+* Inputs: text - seconds, fraction allowed
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t parse_seconds( const char *text )
+{
+   double seconds = strtod( text, NULL );
+
+   if ( seconds < 0 )
+   {
+      seconds = 0;
+   }
+   return( (uint64_t) ( seconds * NS_PER_SEC ) );
+}
+
+
+/*
+* Name: parse_pid_range
+*
+* Description: Parse "pid" or "pid-pid"
+*
+* Inputs: text - PID range
+*
+* Outputs: pid_low, pid_high - parsed range
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - malformed range
+*
+*/
+int parse_pid_range( const char *text, uint8_t *pid_low, uint8_t *pid_high )
+{
+   char *end;
+   unsigned long low;
+   unsigned long high;
+
+   low = strtoul( text, &end, 0 );
+   high = low;
+   if ( '-' == *end )
+   {
+      high = strtoul( end + 1, &end, 0 );
+   }
+
+   if ( ( *end != '\0' ) || ( low > high ) || ( high > 0xFF ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   *pid_low = (uint8_t) low;
+   *pid_high = (uint8_t) high;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: print_record
+*
+* Description: Print one capture record
+*
+* Inputs: record - record header
+*         payload - frame bytes
+*         context - capture reader, for the wall clock time
+*
+* Returns: true to continue the query
+*
+*/
+bool print_record(
+   const capture_record_header *record,
+   const uint8_t *payload,
+   void *context
+   )
+{
+   uint16_t i;
+   uint64_t wall_ns = capture_wall_time( (const capture_reader *) context, record->timestamp_ns );
+
+   printf(
+      "%llu.%09llu %s %03X %02X:",
+      (unsigned long long) ( wall_ns / NS_PER_SEC ),
+      (unsigned long long) ( wall_ns % NS_PER_SEC ),
+      ( CAPTURE_DIR_RX == record->direction ) ? "RX" : "TX",
+      record->can_id,
+      record->pid
+      );
+   for ( i = 0; i < record->length; i++ )
+   {
+      printf( " %02X", payload[ i ] );
+   }
+   printf( "\n" );
+
+   return( true );
+}
+
+
+/*
+* Name: print_index
+*
+* Description: Print the capture index blocks
+*
+* Inputs: reader - open capture reader
+*
+* Returns: None
+*
+*/
+void print_index( const capture_reader *reader )
+{
+   size_t i;
+   const capture_index_entry *block;
+   uint64_t first_ns;
+   uint64_t last_ns;
+
+   for ( i = 0; i < reader->index_count; i++ )
+   {
+      block = &reader->index[ i ];
+      first_ns = capture_wall_time( reader, block->first_timestamp_ns );
+      last_ns = capture_wall_time( reader, block->last_timestamp_ns );
+      printf(
+         "%6zu %llu.%09llu-%llu.%09llu offset %llu frames %u pids %02X-%02X\n",
+         i,
+         (unsigned long long) ( first_ns / NS_PER_SEC ),
+         (unsigned long long) ( first_ns % NS_PER_SEC ),
+         (unsigned long long) ( last_ns / NS_PER_SEC ),
+         (unsigned long long) ( last_ns % NS_PER_SEC ),
+         (unsigned long long) block->offset,
+         block->frame_count,
+         block->pid_min,
+         block->pid_max
+         );
+   }
+   return;
+}
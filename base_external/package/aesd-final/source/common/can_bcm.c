@@ -0,0 +1,252 @@
+/*
+* File: can_bcm.c
+*
+* Description: Cyclic CAN transmission through the kernel broadcast
+*              manager.  See can_bcm.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://www.kernel.org/doc/html/latest/networking/can.html
+*   linux/can/bcm.h
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <linux/can.h>
+#include <linux/can/bcm.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "can_bcm.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define MS_PER_SEC      1000
+#define USEC_PER_MS     1000
+
+// One broadcast manager operation on a single frame
+typedef struct bcm_message
+{
+   struct bcm_msg_head head;
+   struct can_frame    frame;
+} bcm_message;
+
+// File data and functions
+static int send_operation( int socket_fd, bcm_message *message );
+static void fill_frame( bcm_message *message, uint32_t can_id, const uint8_t *data, uint8_t length );
+
+
+/*
+* Name: can_bcm_open
+*
+* Description: Open a broadcast manager socket on a CAN interface
+*
+* Inputs: ifname - CAN interface, CAN_INTERFACE for the board
+*
+* Outputs: socket_fd - connected broadcast manager socket
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int can_bcm_open( int *socket_fd, const char *ifname )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   struct sockaddr_can address = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   address.can_family = AF_CAN;
+   address.can_ifindex = (int) if_nametoindex( ifname );
+   if ( 0 == address.can_ifindex )
+   {
+      syslog( LOG_ERR, "%s: No CAN interface %s", __func__, ifname );
+      return( EXIT_FAILURE );
+   }
+
+   temp_socket_fd = socket( PF_CAN, SOCK_DGRAM, CAN_BCM );
+   if ( temp_socket_fd != -1 )
+   {
+      if ( 0 == connect( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+      {
+         *socket_fd = temp_socket_fd;
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         close( temp_socket_fd );
+      }
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: can_bcm_tx_start
+*
+* Description: Have the kernel send a frame every period until it is
+*              stopped or the socket is closed
+*
+* Inputs: socket_fd - broadcast manager socket
+*         can_id - frame identifier
+*         period_ms - transmit period
+*         data - payload
+*         length - payload length, at most 8
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int can_bcm_tx_start(
+   int socket_fd,
+   uint32_t can_id,
+   uint32_t period_ms,
+   const uint8_t *data,
+   uint8_t length
+   )
+{
+   bcm_message message;
+
+   fill_frame( &message, can_id, data, length );
+   message.head.opcode = TX_SETUP;
+   message.head.flags = SETTIMER | STARTTIMER;
+   message.head.ival2.tv_sec = (long) ( period_ms / MS_PER_SEC );
+   message.head.ival2.tv_usec = (long) ( ( period_ms % MS_PER_SEC ) * USEC_PER_MS );
+
+   return( send_operation( socket_fd, &message ) );
+}
+
+
+/*
+* Name: can_bcm_tx_update
+*
+* Description: Replace the payload of a cyclic frame, it is sent at
+*              the next period
+*
+* Inputs: socket_fd - broadcast manager socket
+*         can_id - frame identifier
+*         data - new payload
+*         length - payload length, at most 8
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int can_bcm_tx_update( int socket_fd, uint32_t can_id, const uint8_t *data, uint8_t length )
+{
+   bcm_message message;
+
+   // Without SETTIMER the running timer is left alone
+   fill_frame( &message, can_id, data, length );
+   message.head.opcode = TX_SETUP;
+
+   return( send_operation( socket_fd, &message ) );
+}
+
+
+/*
+* Name: can_bcm_tx_stop
+*
+* Description: Stop sending a cyclic frame
+*
+* Inputs: socket_fd - broadcast manager socket
+*         can_id - frame identifier
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int can_bcm_tx_stop( int socket_fd, uint32_t can_id )
+{
+   bcm_message message;
+
+   fill_frame( &message, can_id, NULL, 0 );
+   message.head.opcode = TX_DELETE;
+   message.head.nframes = 0;
+
+   return( send_operation( socket_fd, &message ) );
+}
+
+
+/*
+* Name: send_operation
+*
+* Description: Write one operation to the broadcast manager
+*
+* Inputs: socket_fd - broadcast manager socket
+*         message - operation
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int send_operation( int socket_fd, bcm_message *message )
+{
+   size_t length;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   length = sizeof( message->head ) + message->head.nframes * sizeof( struct can_frame );
+   if ( write( socket_fd, message, length ) != (ssize_t) length )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: fill_frame
+*
+* Description: Start an operation on a single frame
+*
+* Inputs: can_id - frame identifier, sent extended above 11 bits
+*         data - payload or NULL
+*         length - payload length, at most 8
+*
+* Outputs: message - operation with the frame filled in
+*
+* Returns: None
+*
+*/
+void fill_frame( bcm_message *message, uint32_t can_id, const uint8_t *data, uint8_t length )
+{
+   memset( message, 0, sizeof( bcm_message ) );
+
+   if ( can_id > CAN_SFF_MASK )
+   {
+      can_id = ( can_id & CAN_EFF_MASK ) | CAN_EFF_FLAG;
+   }
+   if ( length > CAN_MAX_DLEN )
+   {
+      length = CAN_MAX_DLEN;
+   }
+
+   message->head.can_id = can_id;
+   message->head.nframes = 1;
+   message->frame.can_id = can_id;
+   message->frame.can_dlc = length;
+   if ( data != NULL )
+   {
+      memcpy( message->frame.data, data, length );
+   }
+   return;
+}
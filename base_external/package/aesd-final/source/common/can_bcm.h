@@ -0,0 +1,41 @@
+/*
+* File: can_bcm.h
+*
+* Description: Cyclic CAN transmission through the kernel broadcast
+*              manager (CAN_BCM).
+*
+*              A frame registered with can_bcm_tx_start() is sent by
+*              the kernel every period without waking the process.
+*              can_bcm_tx_update() replaces the payload, the running
+*              timer is kept so the period is not disturbed.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://www.kernel.org/doc/html/latest/networking/can.html
+*   linux/can/bcm.h
+*
+*/
+
+#ifndef CAN_BCM_H
+#define CAN_BCM_H
+
+// Includes
+#include <stdint.h>
+
+int can_bcm_open( int *socket_fd, const char *ifname );
+int can_bcm_tx_start(
+   int socket_fd,
+   uint32_t can_id,
+   uint32_t period_ms,
+   const uint8_t *data,
+   uint8_t length
+   );
+int can_bcm_tx_update( int socket_fd, uint32_t can_id, const uint8_t *data, uint8_t length );
+int can_bcm_tx_stop( int socket_fd, uint32_t can_id );
+
+#endif // CAN_BCM_H
@@ -0,0 +1,960 @@
+/*
+* File: can_bridge.c
+*
+* Description: Frame forwarding between two CAN interfaces.  See
+*              can_bridge.h.
+*
+*              Kernel path: one can-gw job per rule, or one job without
+*              a filter for a source interface without rules, is added
+*              over rtnetlink and removed again on close.  The kernel
+*              keeps a handled and a dropped counter per job.
+*
+*              Userspace path: the rules of a source interface are also
+*              installed as CAN_RAW_FILTER on its socket, so frames
+*              that are not forwarded never wake the process.  The
+*              received frames are sent from the receive buffer, a
+*              rewrite only changes the identifier in place.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://www.kernel.org/doc/html/latest/networking/can.html
+*   linux/can/gw.h, man 7 rtnetlink, man 2 recvmmsg, man 2 sendmmsg
+*
+*/
+
+// Includes
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/can.h>
+#include <linux/can/gw.h>
+#include <linux/can/raw.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "can_bridge.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE      80
+#define NS_PER_SEC           1000000000ULL
+#define NS_PER_USEC          1000ULL
+
+#define CGW_ATTRIBUTE_SPACE  256
+#define NETLINK_BUFFER_SIZE  8192
+
+// Kernel receive timestamp and receive queue overflow count
+#define BRIDGE_CONTROL_SIZE  ( CMSG_SPACE( sizeof( struct timespec ) ) + CMSG_SPACE( sizeof( uint32_t ) ) )
+
+typedef struct cgw_request
+{
+   struct nlmsghdr header;
+   struct rtcanmsg message;
+   uint8_t         attributes[ CGW_ATTRIBUTE_SPACE ];
+} cgw_request;
+
+// File data and functions
+static int open_port( can_bridge *bridge, int port );
+static int start_kernel_jobs( can_bridge *bridge );
+static void stop_kernel_jobs( can_bridge *bridge );
+static int send_kernel_job( can_bridge *bridge, uint16_t type, int source, const can_bridge_rule *rule );
+static int read_kernel_counters( can_bridge *bridge );
+static int netlink_request( int netlink_fd, struct nlmsghdr *header );
+static void add_attribute( struct nlmsghdr *header, uint16_t type, const void *data, size_t length );
+static void rule_filter( const can_bridge_rule *rule, struct can_filter *filter );
+static const can_bridge_rule *match_rule( can_bridge *bridge, int source, canid_t can_id, bool *has_rules );
+static uint32_t frame_id( uint32_t can_id );
+static uint64_t realtime_ns( void );
+
+
+/*
+* Name: can_bridge_init
+*
+* Description: Prepare a bridge between two CAN interfaces
+*
+* Inputs: bridge - bridge to initialize
+*         ifname_a - first interface
+*         ifname_b - second interface
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - unknown interface
+*
+*/
+int can_bridge_init( can_bridge *bridge, const char *ifname_a, const char *ifname_b )
+{
+   int port;
+
+   memset( bridge, 0, sizeof( can_bridge ) );
+   strncpy( bridge->ifname[ 0 ], ifname_a, IF_NAMESIZE - 1 );
+   strncpy( bridge->ifname[ 1 ], ifname_b, IF_NAMESIZE - 1 );
+
+   for ( port = 0; port < CAN_BRIDGE_PORTS; port++ )
+   {
+      bridge->fd[ port ] = -1;
+      bridge->ifindex[ port ] = if_nametoindex( bridge->ifname[ port ] );
+      if ( 0 == bridge->ifindex[ port ] )
+      {
+         syslog( LOG_ERR, "%s: No CAN interface %s", __func__, bridge->ifname[ port ] );
+         return( EXIT_FAILURE );
+      }
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: can_bridge_add_rule
+*
+* Description: Add a forwarding rule, ifname:id[/mask][=new_id].  The
+*              mask defaults to every identifier bit.
+*
+* Inputs: bridge - bridge, not started
+*         spec - rule
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - bad rule or too many rules
+*
+*/
+int can_bridge_add_rule( can_bridge *bridge, const char *spec )
+{
+   can_bridge_rule rule = { 0 };
+   const char *separator;
+   char *next;
+   size_t name_length;
+
+   separator = strchr( spec, ':' );
+   if ( ( NULL == separator ) || ( bridge->rule_count >= CAN_BRIDGE_MAX_RULES ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   name_length = (size_t) ( separator - spec );
+   if (   ( name_length == strlen( bridge->ifname[ 0 ] ) )
+       && ( 0 == strncmp( spec, bridge->ifname[ 0 ], name_length ) )
+      )
+   {
+      rule.source = 0;
+   }
+   else if (   ( name_length == strlen( bridge->ifname[ 1 ] ) )
+            && ( 0 == strncmp( spec, bridge->ifname[ 1 ], name_length ) )
+           )
+   {
+      rule.source = 1;
+   }
+   else
+   {
+      return( EXIT_FAILURE );
+   }
+
+   rule.can_id = (uint32_t) strtoul( separator + 1, &next, 0 );
+   rule.mask = ( rule.can_id > CAN_SFF_MASK ) ? CAN_EFF_MASK : CAN_SFF_MASK;
+   if ( '/' == *next )
+   {
+      rule.mask = (uint32_t) strtoul( next + 1, &next, 0 );
+   }
+   if ( '=' == *next )
+   {
+      rule.rewrite = true;
+      rule.new_id = (uint32_t) strtoul( next + 1, &next, 0 );
+   }
+   if ( ( *next != '\0' ) || ( rule.can_id > CAN_EFF_MASK ) || ( rule.new_id > CAN_EFF_MASK ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   bridge->rules[ bridge->rule_count++ ] = rule;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: can_bridge_start
+*
+* Description: Start forwarding.  The kernel CAN gateway is tried
+*              first when asked for, the userspace path is used when it
+*              is missing or not permitted.
+*
+* Inputs: bridge - bridge with its rules
+*         use_kernel - try the kernel CAN gateway
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int can_bridge_start( can_bridge *bridge, bool use_kernel )
+{
+   int port;
+
+   if ( use_kernel )
+   {
+      if ( EXIT_SUCCESS == start_kernel_jobs( bridge ) )
+      {
+         bridge->kernel = true;
+         syslog( LOG_INFO, "Bridging %s and %s in the kernel", bridge->ifname[ 0 ], bridge->ifname[ 1 ] );
+         return( EXIT_SUCCESS );
+      }
+      syslog( LOG_INFO, "Kernel CAN gateway not available, bridging in userspace" );
+   }
+
+   for ( port = 0; port < CAN_BRIDGE_PORTS; port++ )
+   {
+      if ( EXIT_SUCCESS != open_port( bridge, port ) )
+      {
+         can_bridge_close( bridge );
+         return( EXIT_FAILURE );
+      }
+   }
+
+   syslog( LOG_INFO, "Bridging %s and %s in userspace", bridge->ifname[ 0 ], bridge->ifname[ 1 ] );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: can_bridge_forward
+*
+* Description: Forward one batch of frames received on an interface
+*              to the other.  A full transmit queue is waited out once,
+*              the frames still not sent are dropped.
+*
+* Inputs: bridge - started userspace bridge
+*         source - receiving interface, 0 or 1
+*
+* Returns: Number of frames received, 0 when none were waiting
+*          -1 - receive failed
+*
+*/
+int can_bridge_forward( can_bridge *bridge, int source )
+{
+   struct can_frame frames[ CAN_BRIDGE_BATCH ];
+   struct iovec rx_iov[ CAN_BRIDGE_BATCH ];
+   struct iovec tx_iov[ CAN_BRIDGE_BATCH ];
+   struct mmsghdr rx_messages[ CAN_BRIDGE_BATCH ];
+   struct mmsghdr tx_messages[ CAN_BRIDGE_BATCH ];
+   uint8_t control[ CAN_BRIDGE_BATCH ][ BRIDGE_CONTROL_SIZE ];
+   uint64_t rx_ns[ CAN_BRIDGE_BATCH ];
+   can_bridge_stats *stats = &bridge->stats[ source ];
+   const can_bridge_rule *rule;
+   struct cmsghdr *header;
+   struct timespec stamp;
+   uint32_t overflows;
+   uint64_t now_ns;
+   uint64_t latency_ns;
+   unsigned int count = 0;
+   unsigned int sent = 0;
+   bool has_rules;
+   bool waited = false;
+   int received;
+   int status;
+   int i;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   memset( rx_messages, 0, sizeof( rx_messages ) );
+   for ( i = 0; i < CAN_BRIDGE_BATCH; i++ )
+   {
+      rx_iov[ i ].iov_base = &frames[ i ];
+      rx_iov[ i ].iov_len = sizeof( struct can_frame );
+      rx_messages[ i ].msg_hdr.msg_iov = &rx_iov[ i ];
+      rx_messages[ i ].msg_hdr.msg_iovlen = 1;
+      rx_messages[ i ].msg_hdr.msg_control = control[ i ];
+      rx_messages[ i ].msg_hdr.msg_controllen = BRIDGE_CONTROL_SIZE;
+   }
+
+   received = recvmmsg( bridge->fd[ source ], rx_messages, CAN_BRIDGE_BATCH, MSG_DONTWAIT, NULL );
+   if ( -1 == received )
+   {
+      if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) || ( EINTR == errno ) )
+      {
+         return( 0 );
+      }
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( -1 );
+   }
+
+   memset( tx_messages, 0, sizeof( tx_messages ) );
+   for ( i = 0; i < received; i++ )
+   {
+      rx_ns[ count ] = 0;
+      for (   header = CMSG_FIRSTHDR( &rx_messages[ i ].msg_hdr );
+              header != NULL;
+              header = CMSG_NXTHDR( &rx_messages[ i ].msg_hdr, header )
+          )
+      {
+         if ( ( SOL_SOCKET == header->cmsg_level ) && ( SCM_TIMESTAMPNS == header->cmsg_type ) )
+         {
+            memcpy( &stamp, CMSG_DATA( header ), sizeof( stamp ) );
+            rx_ns[ count ] = (uint64_t) stamp.tv_sec * NS_PER_SEC + (uint64_t) stamp.tv_nsec;
+         }
+         else if ( ( SOL_SOCKET == header->cmsg_level ) && ( SO_RXQ_OVFL == header->cmsg_type ) )
+         {
+            // The socket counts every frame it has dropped so far
+            memcpy( &overflows, CMSG_DATA( header ), sizeof( overflows ) );
+            stats->rx_dropped = overflows;
+         }
+      }
+
+      rule = match_rule( bridge, source, frames[ i ].can_id, &has_rules );
+      if ( has_rules && ( NULL == rule ) )
+      {
+         continue;
+      }
+      if ( ( rule != NULL ) && rule->rewrite )
+      {
+         frames[ i ].can_id = ( frames[ i ].can_id & CAN_RTR_FLAG ) | frame_id( rule->new_id );
+      }
+
+      tx_iov[ count ].iov_base = &frames[ i ];
+      tx_iov[ count ].iov_len = sizeof( struct can_frame );
+      tx_messages[ count ].msg_hdr.msg_iov = &tx_iov[ count ];
+      tx_messages[ count ].msg_hdr.msg_iovlen = 1;
+      count++;
+   }
+   stats->received += (unsigned long) received;
+
+   while ( sent < count )
+   {
+      status = sendmmsg( bridge->fd[ 1 - source ], &tx_messages[ sent ], count - sent, 0 );
+      if ( status > 0 )
+      {
+         sent += (unsigned int) status;
+         continue;
+      }
+
+      // The interface queue reports ENOBUFS instead of blocking
+      if (   !waited
+          && ( -1 == status )
+          && ( ( ENOBUFS == errno ) || ( EAGAIN == errno ) || ( EINTR == errno ) )
+         )
+      {
+         waited = true;
+         poll( NULL, 0, 1 );
+         continue;
+      }
+      break;
+   }
+
+   now_ns = realtime_ns();
+   for ( i = 0; i < (int) sent; i++ )
+   {
+      if ( ( rx_ns[ i ] != 0 ) && ( now_ns > rx_ns[ i ] ) )
+      {
+         latency_ns = now_ns - rx_ns[ i ];
+         stats->latency_total_ns += latency_ns;
+         if ( latency_ns > stats->latency_max_ns )
+         {
+            stats->latency_max_ns = latency_ns;
+         }
+      }
+   }
+   stats->forwarded += sent;
+   stats->tx_dropped += count - sent;
+
+   return( received );
+}
+
+
+/*
+* Name: can_bridge_report
+*
+* Description: Log and print the counters of both directions.  The
+*              kernel path reports the counters of its can-gw jobs.
+*
+* Inputs: bridge - started bridge
+*
+* Returns: None
+*
+*/
+void can_bridge_report( can_bridge *bridge )
+{
+   can_bridge_stats *stats;
+   double average_us;
+   int source;
+
+   if ( bridge->kernel )
+   {
+      read_kernel_counters( bridge );
+   }
+
+   for ( source = 0; source < CAN_BRIDGE_PORTS; source++ )
+   {
+      stats = &bridge->stats[ source ];
+      if ( bridge->kernel )
+      {
+         syslog(
+            LOG_INFO,
+            "%s -> %s (kernel): forwarded %lu, dropped %lu",
+            bridge->ifname[ source ],
+            bridge->ifname[ 1 - source ],
+            stats->forwarded,
+            stats->tx_dropped
+            );
+         printf(
+            "%s -> %s (kernel): forwarded %lu, dropped %lu\n",
+            bridge->ifname[ source ],
+            bridge->ifname[ 1 - source ],
+            stats->forwarded,
+            stats->tx_dropped
+            );
+         continue;
+      }
+
+      average_us = ( stats->forwarded > 0 )
+                 ? (double) stats->latency_total_ns / stats->forwarded / NS_PER_USEC
+                 : 0;
+      syslog(
+         LOG_INFO,
+         "%s -> %s: received %lu, forwarded %lu, dropped rx %lu tx %lu, latency usec avg %.1f max %.1f",
+         bridge->ifname[ source ],
+         bridge->ifname[ 1 - source ],
+         stats->received,
+         stats->forwarded,
+         stats->rx_dropped,
+         stats->tx_dropped,
+         average_us,
+         (double) stats->latency_max_ns / NS_PER_USEC
+         );
+      printf(
+         "%s -> %s: received %lu, forwarded %lu, dropped rx %lu tx %lu, latency usec avg %.1f max %.1f\n",
+         bridge->ifname[ source ],
+         bridge->ifname[ 1 - source ],
+         stats->received,
+         stats->forwarded,
+         stats->rx_dropped,
+         stats->tx_dropped,
+         average_us,
+         (double) stats->latency_max_ns / NS_PER_USEC
+         );
+   }
+   return;
+}
+
+
+/*
+* Name: can_bridge_close
+*
+* Description: Stop forwarding, kernel jobs are removed
+*
+* Inputs: bridge - bridge
+*
+* Returns: None
+*
+*/
+void can_bridge_close( can_bridge *bridge )
+{
+   int port;
+
+   if ( bridge->kernel )
+   {
+      stop_kernel_jobs( bridge );
+      bridge->kernel = false;
+   }
+
+   for ( port = 0; port < CAN_BRIDGE_PORTS; port++ )
+   {
+      if ( bridge->fd[ port ] != -1 )
+      {
+         close( bridge->fd[ port ] );
+         bridge->fd[ port ] = -1;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: open_port
+*
+* Description: Open the raw socket of one interface with receive
+*              timestamps, overflow counts and the rules of the
+*              interface as receive filter
+*
+* Inputs: bridge - bridge
+*         port - interface, 0 or 1
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int open_port( can_bridge *bridge, int port )
+{
+   struct sockaddr_can address = { 0 };
+   struct can_filter filters[ CAN_BRIDGE_MAX_RULES ];
+   unsigned int filter_count = 0;
+   unsigned int i;
+   int enable = 1;
+   int fd;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for ( i = 0; i < bridge->rule_count; i++ )
+   {
+      if ( bridge->rules[ i ].source == port )
+      {
+         rule_filter( &bridge->rules[ i ], &filters[ filter_count++ ] );
+      }
+   }
+
+   address.can_family = AF_CAN;
+   address.can_ifindex = (int) bridge->ifindex[ port ];
+
+   fd = socket( PF_CAN, SOCK_RAW, CAN_RAW );
+   if (   ( -1 == fd )
+       || ( -1 == setsockopt( fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof( enable ) ) )
+       || ( -1 == setsockopt( fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof( enable ) ) )
+       || (   ( filter_count > 0 )
+           && ( -1 == setsockopt( fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, filter_count * sizeof( struct can_filter ) ) )
+          )
+       || ( -1 == bind( fd, (struct sockaddr *) &address, sizeof( address ) ) )
+      )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s: %s", __func__, bridge->ifname[ port ], error );
+      if ( fd != -1 )
+      {
+         close( fd );
+      }
+      return( EXIT_FAILURE );
+   }
+
+   fcntl( fd, F_SETFL, O_NONBLOCK );
+   bridge->fd[ port ] = fd;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: start_kernel_jobs
+*
+* Description: Add the can-gw jobs of both directions, nothing is left
+*              behind when one of them fails
+*
+* Inputs: bridge - bridge
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int start_kernel_jobs( can_bridge *bridge )
+{
+   bool has_rules;
+   unsigned int i;
+   int source;
+
+   for ( source = 0; source < CAN_BRIDGE_PORTS; source++ )
+   {
+      has_rules = false;
+      for ( i = 0; i < bridge->rule_count; i++ )
+      {
+         if ( bridge->rules[ i ].source == source )
+         {
+            has_rules = true;
+            if ( EXIT_SUCCESS != send_kernel_job( bridge, RTM_NEWROUTE, source, &bridge->rules[ i ] ) )
+            {
+               stop_kernel_jobs( bridge );
+               return( EXIT_FAILURE );
+            }
+         }
+      }
+
+      if ( !has_rules && ( EXIT_SUCCESS != send_kernel_job( bridge, RTM_NEWROUTE, source, NULL ) ) )
+      {
+         stop_kernel_jobs( bridge );
+         return( EXIT_FAILURE );
+      }
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: stop_kernel_jobs
+*
+* Description: Remove the can-gw jobs of both directions, jobs that do
+*              not exist are ignored
+*
+* Inputs: bridge - bridge
+*
+* Returns: None
+*
+*/
+void stop_kernel_jobs( can_bridge *bridge )
+{
+   bool has_rules;
+   unsigned int i;
+   int source;
+
+   for ( source = 0; source < CAN_BRIDGE_PORTS; source++ )
+   {
+      has_rules = false;
+      for ( i = 0; i < bridge->rule_count; i++ )
+      {
+         if ( bridge->rules[ i ].source == source )
+         {
+            has_rules = true;
+            send_kernel_job( bridge, RTM_DELROUTE, source, &bridge->rules[ i ] );
+         }
+      }
+
+      if ( !has_rules )
+      {
+         send_kernel_job( bridge, RTM_DELROUTE, source, NULL );
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: send_kernel_job
+*
+* Description: Add or remove one can-gw job
+*
+* Inputs: bridge - bridge
+*         type - RTM_NEWROUTE or RTM_DELROUTE
+*         source - receiving interface, 0 or 1
+*         rule - filter and rewrite, NULL forwards every frame
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int send_kernel_job( can_bridge *bridge, uint16_t type, int source, const can_bridge_rule *rule )
+{
+   cgw_request request;
+   struct can_filter filter;
+   struct cgw_frame_mod modification;
+   uint32_t source_index = bridge->ifindex[ source ];
+   uint32_t target_index = bridge->ifindex[ 1 - source ];
+   int netlink_fd;
+   int return_status;
+
+   memset( &request, 0, sizeof( request ) );
+   request.header.nlmsg_len = NLMSG_LENGTH( sizeof( struct rtcanmsg ) );
+   request.header.nlmsg_type = type;
+   request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+   request.message.can_family = AF_CAN;
+   request.message.gwtype = CGW_TYPE_CAN_CAN;
+
+   add_attribute( &request.header, CGW_SRC_IF, &source_index, sizeof( source_index ) );
+   add_attribute( &request.header, CGW_DST_IF, &target_index, sizeof( target_index ) );
+   if ( rule != NULL )
+   {
+      rule_filter( rule, &filter );
+      add_attribute( &request.header, CGW_FILTER, &filter, sizeof( filter ) );
+
+      if ( rule->rewrite )
+      {
+         memset( &modification, 0, sizeof( modification ) );
+         modification.cf.can_id = frame_id( rule->new_id );
+         modification.modtype = CGW_MOD_ID;
+         add_attribute( &request.header, CGW_MOD_SET, &modification, sizeof( modification ) );
+      }
+   }
+
+   netlink_fd = socket( PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+   if ( -1 == netlink_fd )
+   {
+      return( EXIT_FAILURE );
+   }
+   return_status = netlink_request( netlink_fd, &request.header );
+   close( netlink_fd );
+
+   return( return_status );
+}
+
+
+/*
+* Name: read_kernel_counters
+*
+* Description: Sum the handled and dropped counters of the can-gw jobs
+*              between the two interfaces
+*
+* Inputs: bridge - bridge
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int read_kernel_counters( can_bridge *bridge )
+{
+   cgw_request request;
+   uint8_t buffer[ NETLINK_BUFFER_SIZE ] __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+   struct nlmsghdr *header;
+   struct rtattr *attribute;
+   uint32_t source_index;
+   uint32_t target_index;
+   uint32_t handled;
+   uint32_t dropped;
+   int remaining;
+   int length;
+   int netlink_fd;
+   int source;
+   bool done = false;
+
+   memset( &request, 0, sizeof( request ) );
+   request.header.nlmsg_len = NLMSG_LENGTH( sizeof( struct rtcanmsg ) );
+   request.header.nlmsg_type = RTM_GETROUTE;
+   request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+   request.message.can_family = AF_CAN;
+
+   netlink_fd = socket( PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+   if ( -1 == netlink_fd )
+   {
+      return( EXIT_FAILURE );
+   }
+   if ( send( netlink_fd, &request, request.header.nlmsg_len, 0 ) < 0 )
+   {
+      close( netlink_fd );
+      return( EXIT_FAILURE );
+   }
+
+   for ( source = 0; source < CAN_BRIDGE_PORTS; source++ )
+   {
+      bridge->stats[ source ].forwarded = 0;
+      bridge->stats[ source ].tx_dropped = 0;
+   }
+
+   while ( !done )
+   {
+      length = (int) recv( netlink_fd, buffer, sizeof( buffer ), 0 );
+      if ( length <= 0 )
+      {
+         break;
+      }
+
+      for (   header = (struct nlmsghdr *) buffer;
+              NLMSG_OK( header, (unsigned int) length );
+              header = NLMSG_NEXT( header, length )
+          )
+      {
+         if ( ( NLMSG_DONE == header->nlmsg_type ) || ( NLMSG_ERROR == header->nlmsg_type ) )
+         {
+            done = true;
+            break;
+         }
+
+         source_index = 0;
+         target_index = 0;
+         handled = 0;
+         dropped = 0;
+         attribute = (struct rtattr *) ( (uint8_t *) NLMSG_DATA( header ) + NLMSG_ALIGN( sizeof( struct rtcanmsg ) ) );
+         remaining = (int) NLMSG_PAYLOAD( header, sizeof( struct rtcanmsg ) );
+         for ( ; RTA_OK( attribute, remaining ); attribute = RTA_NEXT( attribute, remaining ) )
+         {
+            switch ( attribute->rta_type )
+            {
+               case CGW_SRC_IF:
+                  memcpy( &source_index, RTA_DATA( attribute ), sizeof( source_index ) );
+                  break;
+               case CGW_DST_IF:
+                  memcpy( &target_index, RTA_DATA( attribute ), sizeof( target_index ) );
+                  break;
+               case CGW_HANDLED:
+                  memcpy( &handled, RTA_DATA( attribute ), sizeof( handled ) );
+                  break;
+               case CGW_DROPPED:
+                  memcpy( &dropped, RTA_DATA( attribute ), sizeof( dropped ) );
+                  break;
+               default:
+                  break;
+            }
+         }
+
+         for ( source = 0; source < CAN_BRIDGE_PORTS; source++ )
+         {
+            if (   ( source_index == bridge->ifindex[ source ] )
+                && ( target_index == bridge->ifindex[ 1 - source ] )
+               )
+            {
+               bridge->stats[ source ].forwarded += handled;
+               bridge->stats[ source ].tx_dropped += dropped;
+            }
+         }
+      }
+   }
+
+   close( netlink_fd );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: netlink_request
+*
+* Description: Send a netlink request and wait for its acknowledgement
+*
+* Inputs: netlink_fd - NETLINK_ROUTE socket
+*         header - request
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - request failed, errno is set
+*
+*/
+int netlink_request( int netlink_fd, struct nlmsghdr *header )
+{
+   uint8_t buffer[ NETLINK_BUFFER_SIZE ] __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+   struct nlmsghdr *reply;
+   struct nlmsgerr *result;
+   int length;
+
+   if ( send( netlink_fd, header, header->nlmsg_len, 0 ) < 0 )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   length = (int) recv( netlink_fd, buffer, sizeof( buffer ), 0 );
+   if ( length <= 0 )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   reply = (struct nlmsghdr *) buffer;
+   if ( !NLMSG_OK( reply, (unsigned int) length ) || ( reply->nlmsg_type != NLMSG_ERROR ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   result = NLMSG_DATA( reply );
+   if ( result->error != 0 )
+   {
+      errno = -result->error;
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: add_attribute
+*
+* Description: Append a route attribute to a netlink request
+*
+* Inputs: header - request with room for the attribute
+*         type - attribute type
+*         data - attribute value
+*         length - value length
+*
+* Returns: None
+*
+*/
+void add_attribute( struct nlmsghdr *header, uint16_t type, const void *data, size_t length )
+{
+   struct rtattr *attribute;
+
+   attribute = (struct rtattr *) ( (uint8_t *) header + NLMSG_ALIGN( header->nlmsg_len ) );
+   attribute->rta_type = type;
+   attribute->rta_len = (unsigned short) RTA_LENGTH( length );
+   memcpy( RTA_DATA( attribute ), data, length );
+   header->nlmsg_len = NLMSG_ALIGN( header->nlmsg_len ) + RTA_ALIGN( attribute->rta_len );
+   return;
+}
+
+
+/*
+* Name: rule_filter
+*
+* Description: Kernel filter of a rule, the frame format has to match
+*              as well as the identifier bits
+*
+* Inputs: rule - forwarding rule
+*
+* Outputs: filter - CAN filter
+*
+* Returns: None
+*
+*/
+void rule_filter( const can_bridge_rule *rule, struct can_filter *filter )
+{
+   filter->can_id = frame_id( rule->can_id );
+   filter->can_mask = ( rule->mask & CAN_EFF_MASK ) | CAN_EFF_FLAG;
+   return;
+}
+
+
+/*
+* Name: match_rule
+*
+* Description: First rule of a source interface matching a frame,
+*              with the same test as the kernel filter
+*
+* Inputs: bridge - bridge
+*         source - receiving interface
+*         can_id - frame identifier with flags
+*
+* Outputs: has_rules - the interface has at least one rule
+*
+* Returns: Matching rule, NULL if none
+*
+*/
+const can_bridge_rule *match_rule( can_bridge *bridge, int source, canid_t can_id, bool *has_rules )
+{
+   struct can_filter filter;
+   unsigned int i;
+
+   *has_rules = false;
+   for ( i = 0; i < bridge->rule_count; i++ )
+   {
+      if ( bridge->rules[ i ].source != source )
+      {
+         continue;
+      }
+
+      *has_rules = true;
+      rule_filter( &bridge->rules[ i ], &filter );
+      if ( 0 == ( ( can_id ^ filter.can_id ) & filter.can_mask ) )
+      {
+         return( &bridge->rules[ i ] );
+      }
+   }
+   return( NULL );
+}
+
+
+/*
+* Name: frame_id
+*
+* Description: CAN identifier with the extended flag set for
+*              identifiers above 11 bits
+*
+* Inputs: can_id - identifier
+*
+* Returns: Identifier as sent on the bus
+*
+*/
+uint32_t frame_id( uint32_t can_id )
+{
+   return( ( can_id > CAN_SFF_MASK ) ? ( ( can_id & CAN_EFF_MASK ) | CAN_EFF_FLAG ) : can_id );
+}
+
+
+/*
+* Name: realtime_ns
+*
+* Description: Wall clock in nanoseconds, the clock of the kernel
+*              receive timestamps
+*
+* Inputs: None
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t realtime_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_REALTIME, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
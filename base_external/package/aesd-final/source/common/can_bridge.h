@@ -0,0 +1,86 @@
+/*
+* File: can_bridge.h
+*
+* Description: Frame forwarding between two CAN interfaces.
+*
+*              Frames received on one interface are sent on the other.
+*              Rules select the frames of a source interface and can
+*              give them a new identifier, a source interface without
+*              rules forwards every frame.  A rule is written
+*
+*                ifname:id[/mask][=new_id]
+*
+*              and matches frames whose identifier equals id in the
+*              bits of mask, e.g. can0:0x7DF or can1:0x7E8/0x7F8=0x7E8.
+*
+*              Frames are forwarded by the kernel CAN gateway (can-gw)
+*              when it is available, otherwise by a userspace loop that
+*              moves batches with recvmmsg()/sendmmsg() straight
+*              between the two sockets.  The userspace loop measures
+*              the latency from the kernel receive timestamp to the
+*              send, and both paths count dropped frames.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://www.kernel.org/doc/html/latest/networking/can.html
+*   linux/can/gw.h, man 2 recvmmsg, man 2 sendmmsg
+*
+*/
+
+#ifndef CAN_BRIDGE_H
+#define CAN_BRIDGE_H
+
+// Includes
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define CAN_BRIDGE_PORTS        2
+#define CAN_BRIDGE_MAX_RULES   16
+#define CAN_BRIDGE_BATCH       32
+
+typedef struct can_bridge_rule
+{
+   int      source;
+   uint32_t can_id;
+   uint32_t mask;
+   bool     rewrite;
+   uint32_t new_id;
+} can_bridge_rule;
+
+// Counters of the frames received on one interface
+typedef struct can_bridge_stats
+{
+   unsigned long received;
+   unsigned long forwarded;
+   unsigned long rx_dropped;
+   unsigned long tx_dropped;
+   uint64_t      latency_total_ns;
+   uint64_t      latency_max_ns;
+} can_bridge_stats;
+
+typedef struct can_bridge
+{
+   char             ifname[ CAN_BRIDGE_PORTS ][ IF_NAMESIZE ];
+   unsigned int     ifindex[ CAN_BRIDGE_PORTS ];
+   int              fd[ CAN_BRIDGE_PORTS ];
+   bool             kernel;
+   can_bridge_rule  rules[ CAN_BRIDGE_MAX_RULES ];
+   unsigned int     rule_count;
+   can_bridge_stats stats[ CAN_BRIDGE_PORTS ];
+} can_bridge;
+
+int can_bridge_init( can_bridge *bridge, const char *ifname_a, const char *ifname_b );
+int can_bridge_add_rule( can_bridge *bridge, const char *spec );
+int can_bridge_start( can_bridge *bridge, bool use_kernel );
+int can_bridge_forward( can_bridge *bridge, int source );
+void can_bridge_report( can_bridge *bridge );
+void can_bridge_close( can_bridge *bridge );
+
+#endif // CAN_BRIDGE_H
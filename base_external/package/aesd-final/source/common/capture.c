@@ -0,0 +1,890 @@
+/*
+* File: capture.c
+*
+* Description: Frame capture file writer and indexed reader.
+*              See capture.h for the file layout.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*   man 2 mmap, man 2 madvise
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "capture.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define NS_PER_MS       1000000ULL
+#define NS_PER_SEC      1000000000ULL
+
+// File data and functions
+static int write_all( int fd, const void *buffer, size_t length );
+static int flush_buffer( capture_writer *writer );
+static int close_block( capture_writer *writer );
+static void reset_block( capture_writer *writer );
+static bool block_has_pid(
+   const capture_index_entry *block,
+   uint8_t pid_low,
+   uint8_t pid_high
+   );
+static size_t scan_block(
+   const capture_reader *reader,
+   uint64_t offset,
+   uint64_t end_offset,
+   uint64_t start_ns,
+   uint64_t end_ns,
+   uint8_t pid_low,
+   uint8_t pid_high,
+   capture_visit_fn visit,
+   void *context,
+   bool *stop
+   );
+static const void *map_file( const char *path, size_t *size );
+static int64_t realtime_offset_ns( void );
+static uint64_t to_capture_time( const capture_reader *reader, uint64_t wall_ns );
+
+
+/*
+* Name: capture_timestamp
+*
+* Description: Time used for capture records, monotonic so a wall
+*              clock step does not reorder them
+*
+* Inputs: None
+*
+* Returns: CLOCK_MONOTONIC nanoseconds
+*
+*/
+uint64_t capture_timestamp( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
+
+
+/*
+* Name: capture_from_realtime
+*
+* Description: Convert a recent wall clock time, such as a kernel
+*              receive timestamp, to the capture clock
+*
+* Inputs: realtime_ns - CLOCK_REALTIME nanoseconds
+*
+* Returns: CLOCK_MONOTONIC nanoseconds
+*
+*/
+uint64_t capture_from_realtime( uint64_t realtime_ns )
+{
+   return( realtime_ns - (uint64_t) realtime_offset_ns() );
+}
+
+
+/*
+* Name: realtime_offset_ns
+*
+* Description: Wall clock minus the monotonic clock
+*
+* Inputs: None
+*
+* Returns: Nanoseconds
+*
+*/
+int64_t realtime_offset_ns( void )
+{
+   struct timespec realtime;
+
+   clock_gettime( CLOCK_REALTIME, &realtime );
+   return(   (int64_t) ( (uint64_t) realtime.tv_sec * NS_PER_SEC + (uint64_t) realtime.tv_nsec )
+           - (int64_t) capture_timestamp() );
+}
+
+
+/*
+* Name: capture_open
+*
+* Description: Create a capture file and its sidecar index.
+*
+* Inputs: writer - writer state to initialize
+*         path - capture file name, index is <path>.idx
+*         block_frames - frames per index block (0 for default)
+*         block_ms - maximum time span of an index block (0 for default)
+*
+* Returns: EXIT_SUCCESS - capture opened
+*          EXIT_FAILURE - failed to open capture
+*
+*/
+int capture_open(
+   capture_writer *writer,
+   const char *path,
+   uint32_t block_frames,
+   uint32_t block_ms
+   )
+{
+   int return_status = EXIT_FAILURE;
+   char index_path[ CAPTURE_PATH_SIZE ];
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+   capture_file_header file_header = { 0 };
+   capture_index_header index_header = { 0 };
+
+   if ( ( writer != NULL ) && ( path != NULL ) )
+   {
+      memset( writer, 0, sizeof( capture_writer ) );
+      writer->block_frames = block_frames ? block_frames : CAPTURE_DEFAULT_BLOCK_FRAMES;
+      block_ms = block_ms ? block_ms : CAPTURE_DEFAULT_BLOCK_MS;
+      writer->block_ns = block_ms * NS_PER_MS;
+
+      snprintf( index_path, sizeof( index_path ), "%s%s", path, CAPTURE_INDEX_SUFFIX );
+
+      writer->data_fd = open(
+         path,
+         O_WRONLY | O_CREAT | O_TRUNC,
+         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+         );
+      writer->index_fd = open(
+         index_path,
+         O_WRONLY | O_CREAT | O_TRUNC,
+         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+         );
+
+      if ( ( writer->data_fd != -1 ) && ( writer->index_fd != -1 ) )
+      {
+         memcpy( file_header.magic, CAPTURE_FILE_MAGIC, sizeof( file_header.magic ) );
+         file_header.version = CAPTURE_FILE_VERSION;
+         file_header.realtime_offset_ns = realtime_offset_ns();
+         memcpy( index_header.magic, CAPTURE_INDEX_MAGIC, sizeof( index_header.magic ) );
+         index_header.block_frames = writer->block_frames;
+         index_header.block_ms = block_ms;
+
+         if (   ( EXIT_SUCCESS == write_all( writer->data_fd, &file_header, sizeof( file_header ) ) )
+             && ( EXIT_SUCCESS == write_all( writer->index_fd, &index_header, sizeof( index_header ) ) )
+            )
+         {
+            writer->offset = sizeof( file_header );
+            reset_block( writer );
+            return_status = EXIT_SUCCESS;
+         }
+      }
+
+      if ( return_status != EXIT_SUCCESS )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s: %s", __func__, path, error );
+
+         if ( writer->data_fd != -1 )
+         {
+            close( writer->data_fd );
+         }
+         if ( writer->index_fd != -1 )
+         {
+            close( writer->index_fd );
+         }
+         writer->data_fd = -1;
+         writer->index_fd = -1;
+      }
+   }
+   else
+   {
+      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: capture_write
+*
+* Description: Append one frame record to the capture.
+*              Records are staged in the writer buffer, the index only
+*              costs a few compares per frame and one write per block.
+*
+* Inputs: writer - open capture writer
+*         timestamp_ns - frame time, see capture_timestamp()
+*         can_id - frame identifier
+*         pid - OBD2 PID carried by the frame
+*         direction - CAPTURE_DIR_RX or CAPTURE_DIR_TX
+*         data - frame bytes
+*         length - number of frame bytes
+*
+* Returns: EXIT_SUCCESS - record written
+*          EXIT_FAILURE - write failed
+*
+*/
+int capture_write(
+   capture_writer *writer,
+   uint64_t timestamp_ns,
+   uint32_t can_id,
+   uint8_t pid,
+   uint8_t direction,
+   const void *data,
+   uint16_t length
+   )
+{
+   int return_status = EXIT_SUCCESS;
+   capture_record_header record = { 0 };
+   size_t record_size;
+   capture_index_entry *block;
+
+   if ( ( writer == NULL ) || ( writer->data_fd == -1 ) || writer->failed || ( data == NULL ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   record_size = CAPTURE_RECORD_ALIGN( sizeof( record ) + length );
+   if ( record_size > CAPTURE_WRITE_BUF_SIZE )
+   {
+      syslog( LOG_ERR, "%s: Record too large: %u", __func__, length );
+      return( EXIT_FAILURE );
+   }
+
+   block = &writer->block;
+
+   // Start a new block when this frame would overflow the current one
+   if (   ( block->frame_count > 0 )
+       && (   ( block->frame_count >= writer->block_frames )
+           || ( timestamp_ns - block->first_timestamp_ns >= writer->block_ns )
+          )
+      )
+   {
+      return_status = close_block( writer );
+   }
+
+   if ( writer->buffered + record_size > CAPTURE_WRITE_BUF_SIZE )
+   {
+      return_status = flush_buffer( writer );
+   }
+   if ( writer->failed )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   record.timestamp_ns = timestamp_ns;
+   record.can_id = can_id;
+   record.length = length;
+   record.pid = pid;
+   record.direction = direction;
+
+   memset( &writer->buffer[ writer->buffered ], 0, record_size );
+   memcpy( &writer->buffer[ writer->buffered ], &record, sizeof( record ) );
+   memcpy( &writer->buffer[ writer->buffered + sizeof( record ) ], data, length );
+   writer->buffered += record_size;
+
+   if ( 0 == block->frame_count )
+   {
+      block->first_timestamp_ns = timestamp_ns;
+      block->offset = writer->offset;
+      block->pid_min = pid;
+      block->pid_max = pid;
+   }
+   block->last_timestamp_ns = timestamp_ns;
+   block->length += record_size;
+   block->frame_count++;
+   block->pid_map[ pid >> 3 ] |= (uint8_t) ( 1 << ( pid & 7 ) );
+   if ( pid < block->pid_min )
+   {
+      block->pid_min = pid;
+   }
+   if ( pid > block->pid_max )
+   {
+      block->pid_max = pid;
+   }
+   writer->offset += record_size;
+
+   return( return_status );
+}
+
+
+/*
+* Name: capture_close
+*
+* Description: Flush the last block and close the capture files
+*
+* Inputs: writer - open capture writer
+*
+* Returns: None
+*
+*/
+void capture_close( capture_writer *writer )
+{
+   if ( ( writer != NULL ) && ( writer->data_fd != -1 ) )
+   {
+      if ( ( writer->block.frame_count > 0 ) && !writer->failed )
+      {
+         close_block( writer );
+      }
+      flush_buffer( writer );
+
+      close( writer->data_fd );
+      close( writer->index_fd );
+      writer->data_fd = -1;
+      writer->index_fd = -1;
+   }
+   return;
+}
+
+
+/*
+* Name: capture_reader_open
+*
+* Description: Map a capture file and its index for reading.
+*              A missing index is not an error, the whole capture is
+*              then treated as one unindexed block.
+*
+* Inputs: reader - reader state to initialize
+*         path - capture file name
+*
+* Returns: EXIT_SUCCESS - capture mapped
+*          EXIT_FAILURE - failed to map capture
+*
+*/
+int capture_reader_open( capture_reader *reader, const char *path )
+{
+   int return_status = EXIT_FAILURE;
+   char index_path[ CAPTURE_PATH_SIZE ];
+   const capture_file_header *file_header;
+   const capture_index_header *index_header;
+
+   if ( ( reader == NULL ) || ( path == NULL ) )
+   {
+      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   memset( reader, 0, sizeof( capture_reader ) );
+
+   reader->data = map_file( path, &reader->data_size );
+   if ( reader->data != NULL )
+   {
+      file_header = (const capture_file_header *) reader->data;
+      if (   ( reader->data_size >= sizeof( capture_file_header ) )
+          && ( 0 == memcmp( file_header->magic, CAPTURE_FILE_MAGIC, sizeof( file_header->magic ) ) )
+          && ( CAPTURE_FILE_VERSION == file_header->version )
+         )
+      {
+         reader->realtime_offset_ns = file_header->realtime_offset_ns;
+
+         // Blocks are visited out of order after the index search
+         madvise( (void *) reader->data, reader->data_size, MADV_RANDOM );
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         syslog( LOG_ERR, "%s: %s: Not a capture file", __func__, path );
+         capture_reader_close( reader );
+      }
+   }
+
+   if ( EXIT_SUCCESS == return_status )
+   {
+      snprintf( index_path, sizeof( index_path ), "%s%s", path, CAPTURE_INDEX_SUFFIX );
+      reader->index_map = map_file( index_path, &reader->index_map_size );
+      if ( reader->index_map != NULL )
+      {
+         index_header = (const capture_index_header *) reader->index_map;
+         if (   ( reader->index_map_size >= sizeof( capture_index_header ) )
+             && ( 0 == memcmp( index_header->magic, CAPTURE_INDEX_MAGIC, sizeof( index_header->magic ) ) )
+            )
+         {
+            reader->index = (const capture_index_entry *)
+               ( reader->index_map + sizeof( capture_index_header ) );
+            reader->index_count =
+               ( reader->index_map_size - sizeof( capture_index_header ) )
+               / sizeof( capture_index_entry );
+         }
+      }
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: capture_query
+*
+* Description: Visit every record in [start_ns, end_ns] whose PID is in
+*              [pid_low, pid_high].  The index is binary searched for the
+*              first block that can hold start_ns and blocks without a
+*              matching PID are skipped without touching their pages.
+*              Records past the last indexed block (writer did not close
+*              cleanly) are scanned linearly.
+*
+* Inputs: reader - open capture reader
+*         start_ns, end_ns - wall clock time window, inclusive
+*         pid_low, pid_high - PID range, inclusive
+*         visit - called for each matching record
+*         context - passed to visit
+*
+* Returns: Number of matching records visited
+*
+*/
+size_t capture_query(
+   const capture_reader *reader,
+   uint64_t start_ns,
+   uint64_t end_ns,
+   uint8_t pid_low,
+   uint8_t pid_high,
+   capture_visit_fn visit,
+   void *context
+   )
+{
+   size_t matches = 0;
+   size_t low;
+   size_t high;
+   size_t middle;
+   size_t i;
+   bool stop = false;
+   uint64_t tail_offset;
+   const capture_index_entry *block;
+
+   if ( ( reader == NULL ) || ( reader->data == NULL ) || ( visit == NULL ) )
+   {
+      return( 0 );
+   }
+
+   tail_offset = sizeof( capture_file_header );
+   start_ns = to_capture_time( reader, start_ns );
+   end_ns = to_capture_time( reader, end_ns );
+
+   // First block whose last frame is not before the window
+   low = 0;
+   high = reader->index_count;
+   while ( low < high )
+   {
+      middle = low + ( high - low ) / 2;
+      if ( reader->index[ middle ].last_timestamp_ns < start_ns )
+      {
+         low = middle + 1;
+      }
+      else
+      {
+         high = middle;
+      }
+   }
+
+   for ( i = low; ( i < reader->index_count ) && !stop; i++ )
+   {
+      block = &reader->index[ i ];
+      if ( block->first_timestamp_ns > end_ns )
+      {
+         break;
+      }
+      if ( block_has_pid( block, pid_low, pid_high ) )
+      {
+         matches += scan_block(
+            reader,
+            block->offset,
+            block->offset + block->length,
+            start_ns,
+            end_ns,
+            pid_low,
+            pid_high,
+            visit,
+            context,
+            &stop
+            );
+      }
+   }
+
+   if ( reader->index_count > 0 )
+   {
+      block = &reader->index[ reader->index_count - 1 ];
+      tail_offset = block->offset + block->length;
+   }
+
+   if ( !stop && ( tail_offset < reader->data_size ) )
+   {
+      matches += scan_block(
+         reader,
+         tail_offset,
+         reader->data_size,
+         start_ns,
+         end_ns,
+         pid_low,
+         pid_high,
+         visit,
+         context,
+         &stop
+         );
+   }
+
+   return( matches );
+}
+
+
+/*
+* Name: capture_wall_time
+*
+* Description: Wall clock time of a record, taken from the clock
+*              offset at the start of the capture
+*
+* Inputs: reader - open capture reader
+*         timestamp_ns - record or index time
+*
+* Returns: Nanoseconds since the epoch
+*
+*/
+uint64_t capture_wall_time( const capture_reader *reader, uint64_t timestamp_ns )
+{
+   return( timestamp_ns + (uint64_t) reader->realtime_offset_ns );
+}
+
+
+/*
+* Name: to_capture_time
+*
+* Description: Convert a wall clock query bound to the record clock,
+*              bounds outside the capture's range are clamped
+*
+* Inputs: reader - open capture reader
+*         wall_ns - nanoseconds since the epoch
+*
+* Returns: Record time
+*
+*/
+uint64_t to_capture_time( const capture_reader *reader, uint64_t wall_ns )
+{
+   int64_t offset_ns = reader->realtime_offset_ns;
+
+   if ( ( offset_ns > 0 ) && ( wall_ns < (uint64_t) offset_ns ) )
+   {
+      return( 0 );
+   }
+   if ( ( offset_ns < 0 ) && ( wall_ns > UINT64_MAX + (uint64_t) offset_ns ) )
+   {
+      return( UINT64_MAX );
+   }
+   return( wall_ns - (uint64_t) offset_ns );
+}
+
+
+/*
+* Name: capture_reader_close
+*
+* Description: Unmap a capture and its index
+*
+* Inputs: reader - open capture reader
+*
+* Returns: None
+*
+*/
+void capture_reader_close( capture_reader *reader )
+{
+   if ( reader != NULL )
+   {
+      if ( reader->data != NULL )
+      {
+         munmap( (void *) reader->data, reader->data_size );
+      }
+      if ( reader->index_map != NULL )
+      {
+         munmap( (void *) reader->index_map, reader->index_map_size );
+      }
+      memset( reader, 0, sizeof( capture_reader ) );
+   }
+   return;
+}
+
+
+/*
+* Name: write_all
+*
+* Description: Write a whole buffer, retrying short writes
+*
+* Inputs: fd - file descriptor
+*         buffer - data to write
+*         length - number of bytes
+*
+* Returns: EXIT_SUCCESS - all bytes written
+*          EXIT_FAILURE - write error
+*
+*/
+int write_all( int fd, const void *buffer, size_t length )
+{
+   const uint8_t *next = buffer;
+   ssize_t tx_bytes;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   while ( length )
+   {
+      tx_bytes = write( fd, next, length );
+      if ( -1 == tx_bytes )
+      {
+         if ( EINTR == errno )
+         {
+            continue;
+         }
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( EXIT_FAILURE );
+      }
+      next += tx_bytes;
+      length -= tx_bytes;
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: flush_buffer
+*
+* Description: Write staged records to the capture file.  A failed
+*              write stops the capture, the file is cut back to the
+*              last whole record so the index still matches it.
+*
+* Inputs: writer - open capture writer
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int flush_buffer( capture_writer *writer )
+{
+   int return_status = EXIT_SUCCESS;
+   uint64_t good_offset;
+
+   if ( writer->failed )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( writer->buffered > 0 )
+   {
+      good_offset = writer->offset - writer->buffered;
+      return_status = write_all( writer->data_fd, writer->buffer, writer->buffered );
+      writer->buffered = 0;
+      if ( return_status != EXIT_SUCCESS )
+      {
+         if ( -1 == ftruncate( writer->data_fd, (off_t) good_offset ) )
+         {
+            syslog( LOG_ERR, "%s: Capture may end in a partial record", __func__ );
+         }
+         writer->offset = good_offset;
+         writer->failed = true;
+         syslog( LOG_ERR, "%s: Capture stopped at %lu bytes", __func__, (unsigned long) good_offset );
+      }
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: close_block
+*
+* Description: Flush the records of the current block and append its
+*              index entry.  Data is written before the index entry so
+*              an entry never points past the end of the capture.
+*
+* Inputs: writer - open capture writer
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int close_block( capture_writer *writer )
+{
+   int return_status;
+
+   return_status = flush_buffer( writer );
+   if ( EXIT_SUCCESS == return_status )
+   {
+      return_status = write_all( writer->index_fd, &writer->block, sizeof( writer->block ) );
+      if ( return_status != EXIT_SUCCESS )
+      {
+         // A partial entry is ignored by the reader, later ones would not be
+         writer->failed = true;
+         syslog( LOG_ERR, "%s: Capture index stopped", __func__ );
+      }
+   }
+   reset_block( writer );
+
+   return( return_status );
+}
+
+
+/*
+* Name: reset_block
+*
+* Description: Start an empty index block
+*
+* Inputs: writer - open capture writer
+*
+* Returns: None
+*
+*/
+void reset_block( capture_writer *writer )
+{
+   memset( &writer->block, 0, sizeof( writer->block ) );
+   writer->block.offset = writer->offset;
+   return;
+}
+
+
+/*
+* Name: block_has_pid
+*
+* Description: Check the block PID bitmap against a PID range
+*
+* Inputs: block - index entry
+*         pid_low, pid_high - PID range, inclusive
+*
+* Returns: true if any PID in the range was captured in the block
+*
+*/
+bool block_has_pid(
+   const capture_index_entry *block,
+   uint8_t pid_low,
+   uint8_t pid_high
+   )
+{
+   unsigned int pid;
+
+   if ( ( pid_high < block->pid_min ) || ( pid_low > block->pid_max ) )
+   {
+      return( false );
+   }
+
+   for ( pid = pid_low; pid <= pid_high; pid++ )
+   {
+      if ( block->pid_map[ pid >> 3 ] & ( 1 << ( pid & 7 ) ) )
+      {
+         return( true );
+      }
+   }
+   return( false );
+}
+
+
+/*
+* Name: scan_block
+*
+* Description: Walk the records between two capture offsets
+*
+* Inputs: reader - open capture reader
+*         offset, end_offset - byte range to walk
+*         start_ns, end_ns - wall clock time window, inclusive
+*         pid_low, pid_high - PID range, inclusive
+*         visit, context - record visitor
+*
+* Outputs: stop - set when the visitor ends the query
+*
+* Returns: Number of matching records visited
+*
+*/
+size_t scan_block(
+   const capture_reader *reader,
+   uint64_t offset,
+   uint64_t end_offset,
+   uint64_t start_ns,
+   uint64_t end_ns,
+   uint8_t pid_low,
+   uint8_t pid_high,
+   capture_visit_fn visit,
+   void *context,
+   bool *stop
+   )
+{
+   size_t matches = 0;
+   size_t record_size;
+   const capture_record_header *record;
+
+   if ( end_offset > reader->data_size )
+   {
+      end_offset = reader->data_size;
+   }
+
+   while ( offset + sizeof( capture_record_header ) <= end_offset )
+   {
+      record = (const capture_record_header *) ( reader->data + offset );
+      record_size = CAPTURE_RECORD_ALIGN( sizeof( capture_record_header ) + record->length );
+      if ( offset + record_size > end_offset )
+      {
+         // Truncated record at the end of an unclean capture
+         break;
+      }
+
+      if ( record->timestamp_ns > end_ns )
+      {
+         break;
+      }
+
+      if (   ( record->timestamp_ns >= start_ns )
+          && ( record->pid >= pid_low )
+          && ( record->pid <= pid_high )
+         )
+      {
+         matches++;
+         if ( !visit( record, (const uint8_t *) ( record + 1 ), context ) )
+         {
+            *stop = true;
+            break;
+         }
+      }
+      offset += record_size;
+   }
+
+   return( matches );
+}
+
+
+/*
+* Name: map_file
+*
+* Description: Map a whole file read only
+*
+* Inputs: path - file name
+*
+* Outputs: size - mapped length
+*
+* Returns: Mapped address, NULL on failure
+*
+*/
+const void *map_file( const char *path, size_t *size )
+{
+   int fd;
+   struct stat file_stat;
+   void *map = NULL;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   fd = open( path, O_RDONLY );
+   if ( fd != -1 )
+   {
+      if ( ( 0 == fstat( fd, &file_stat ) ) && ( file_stat.st_size > 0 ) )
+      {
+         map = mmap( NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+         if ( MAP_FAILED == map )
+         {
+            strerror_r( errno, error, SYSLOG_BUF_SIZE );
+            syslog( LOG_ERR, "%s: %s: %s", __func__, path, error );
+            map = NULL;
+         }
+         else
+         {
+            *size = file_stat.st_size;
+         }
+      }
+      close( fd );
+   }
+
+   return( map );
+}
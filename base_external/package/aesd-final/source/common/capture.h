@@ -0,0 +1,158 @@
+/*
+* File: capture.h
+*
+* Description: Frame capture file writer and indexed reader.
+*
+*              A capture is a flat file of timestamped frame records.
+*              The writer groups records into blocks (every N frames
+*              or M milliseconds) and appends one index entry per block
+*              to a sidecar file (<capture>.idx).  Readers mmap both
+*              files and binary search the index to reach a time window
+*              without scanning the whole capture.
+*
+*              Records are stamped with CLOCK_MONOTONIC so they stay in
+*              order when the wall clock is stepped, the board has no
+*              RTC and NTP sets it after boot.  The file header keeps
+*              the wall clock minus the monotonic clock at the start of
+*              the capture, readers take and print wall clock times.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define CAPTURE_FILE_MAGIC          "OBDCAP01"
+#define CAPTURE_INDEX_MAGIC         "OBDIDX01"
+#define CAPTURE_INDEX_SUFFIX        ".idx"
+#define CAPTURE_FILE_VERSION          1
+#define CAPTURE_PATH_SIZE           256
+#define CAPTURE_WRITE_BUF_SIZE      16384
+
+#define CAPTURE_DEFAULT_BLOCK_FRAMES  256
+#define CAPTURE_DEFAULT_BLOCK_MS     1000
+
+#define CAPTURE_DIR_RX                0
+#define CAPTURE_DIR_TX                1
+
+#define CAPTURE_PID_MAP_SIZE  ( 256 / 8 )
+
+// Records are padded so every header in the mmap is 8 byte aligned
+#define CAPTURE_RECORD_ALIGN( x )  ( ((x) + 7) & ~((size_t) 7) )
+
+typedef struct capture_file_header
+{
+   char     magic[ 8 ];
+   uint32_t version;
+   uint32_t reserved;
+   int64_t  realtime_offset_ns;    // wall clock - record time
+} capture_file_header;
+
+typedef struct capture_record_header
+{
+   uint64_t timestamp_ns;
+   uint32_t can_id;
+   uint16_t length;
+   uint8_t  pid;
+   uint8_t  direction;
+} capture_record_header;
+
+typedef struct capture_index_header
+{
+   char     magic[ 8 ];
+   uint32_t block_frames;
+   uint32_t block_ms;
+} capture_index_header;
+
+typedef struct capture_index_entry
+{
+   uint64_t first_timestamp_ns;
+   uint64_t last_timestamp_ns;
+   uint64_t offset;
+   uint32_t length;
+   uint32_t frame_count;
+   uint8_t  pid_min;
+   uint8_t  pid_max;
+   uint8_t  reserved[ 6 ];
+   uint8_t  pid_map[ CAPTURE_PID_MAP_SIZE ];
+} capture_index_entry;
+
+typedef struct capture_writer
+{
+   int      data_fd;
+   int      index_fd;
+   uint64_t offset;
+   uint32_t block_frames;
+   uint64_t block_ns;
+   capture_index_entry block;
+   size_t   buffered;
+   bool     failed;               // a write failed, capture stopped
+   uint8_t  buffer[ CAPTURE_WRITE_BUF_SIZE ];
+} capture_writer;
+
+typedef struct capture_reader
+{
+   const uint8_t *data;
+   size_t         data_size;
+   const uint8_t *index_map;
+   size_t         index_map_size;
+   const capture_index_entry *index;
+   size_t         index_count;
+   int64_t        realtime_offset_ns;   // wall clock - record time
+} capture_reader;
+
+// Return false from the visitor to stop a query early
+typedef bool (*capture_visit_fn)(
+   const capture_record_header *record,
+   const uint8_t *payload,
+   void *context
+   );
+
+uint64_t capture_timestamp( void );
+uint64_t capture_from_realtime( uint64_t realtime_ns );
+
+int capture_open(
+   capture_writer *writer,
+   const char *path,
+   uint32_t block_frames,
+   uint32_t block_ms
+   );
+int capture_write(
+   capture_writer *writer,
+   uint64_t timestamp_ns,
+   uint32_t can_id,
+   uint8_t pid,
+   uint8_t direction,
+   const void *data,
+   uint16_t length
+   );
+void capture_close( capture_writer *writer );
+
+int capture_reader_open( capture_reader *reader, const char *path );
+size_t capture_query(
+   const capture_reader *reader,
+   uint64_t start_ns,
+   uint64_t end_ns,
+   uint8_t pid_low,
+   uint8_t pid_high,
+   capture_visit_fn visit,
+   void *context
+   );
+uint64_t capture_wall_time( const capture_reader *reader, uint64_t timestamp_ns );
+void capture_reader_close( capture_reader *reader );
+
+#endif // CAPTURE_H
@@ -0,0 +1,301 @@
+/*
+* File: handoff.c
+*
+* Description: Pass sockets between server processes with SCM_RIGHTS.
+*              See handoff.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   man 7 unix, man 3 cmsg
+*
+*/
+
+// Includes
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+
+// File data and functions
+static void log_error( const char *function );
+
+
+/*
+* Name: handoff_listen
+*
+* Description: Listen for a replacement server.  A socket file left by
+*              a crashed server is removed first.
+*
+* Inputs: path - socket path
+*
+* Outputs: socket_fd - non-blocking listening socket
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int handoff_listen( int *socket_fd, const char *path )
+{
+   int temp_socket_fd;
+   struct sockaddr_un address = { 0 };
+
+   address.sun_family = AF_UNIX;
+   strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+
+   temp_socket_fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   if ( -1 == temp_socket_fd )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   unlink( path );
+   if (   ( -1 == bind( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+       || ( -1 == listen( temp_socket_fd, 1 ) )
+      )
+   {
+      log_error( __func__ );
+      close( temp_socket_fd );
+      return( EXIT_FAILURE );
+   }
+
+   *socket_fd = temp_socket_fd;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: handoff_accept
+*
+* Description: Accept a waiting replacement server, does not block
+*
+* Inputs: listen_fd - socket from handoff_listen()
+*
+* Outputs: socket_fd - blocking connection
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - nobody is waiting
+*
+*/
+int handoff_accept( int listen_fd, int *socket_fd )
+{
+   int temp_socket_fd;
+
+   temp_socket_fd = accept4( listen_fd, NULL, NULL, SOCK_CLOEXEC );
+   if ( -1 == temp_socket_fd )
+   {
+      if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) )
+      {
+         log_error( __func__ );
+      }
+      return( EXIT_FAILURE );
+   }
+
+   *socket_fd = temp_socket_fd;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: handoff_connect
+*
+* Description: Connect to a running server
+*
+* Inputs: path - socket path
+*
+* Outputs: socket_fd - blocking connection
+*          peer_pid - process ID of the running server
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - no server is running, nothing is logged
+*
+*/
+int handoff_connect( int *socket_fd, const char *path, pid_t *peer_pid )
+{
+   int temp_socket_fd;
+   struct sockaddr_un address = { 0 };
+   struct ucred credentials;
+   socklen_t length = sizeof( credentials );
+
+   address.sun_family = AF_UNIX;
+   strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+
+   temp_socket_fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+   if ( -1 == temp_socket_fd )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   if (   ( -1 == connect( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+       || ( -1 == getsockopt( temp_socket_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length ) )
+      )
+   {
+      close( temp_socket_fd );
+      return( EXIT_FAILURE );
+   }
+
+   *socket_fd = temp_socket_fd;
+   *peer_pid = credentials.pid;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: handoff_send
+*
+* Description: Send one message, with a descriptor when passed_fd is
+*              not -1.  The receiver gets its own descriptor to the same
+*              socket, the sender may close its one afterwards.
+*
+* Inputs: socket_fd - handoff connection
+*         message - message, magic is filled in
+*         passed_fd - descriptor to pass, or -1
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int handoff_send( int socket_fd, const handoff_message *message, int passed_fd )
+{
+   handoff_message outgoing = *message;
+   struct iovec vector;
+   struct msghdr header = { 0 };
+   struct cmsghdr *control;
+   union
+   {
+      char           buffer[ CMSG_SPACE( sizeof( int ) ) ];
+      struct cmsghdr align;
+   } control_buffer;
+
+   outgoing.magic = HANDOFF_MAGIC;
+   vector.iov_base = &outgoing;
+   vector.iov_len = sizeof( outgoing );
+   header.msg_iov = &vector;
+   header.msg_iovlen = 1;
+
+   if ( passed_fd != -1 )
+   {
+      memset( &control_buffer, 0, sizeof( control_buffer ) );
+      header.msg_control = control_buffer.buffer;
+      header.msg_controllen = sizeof( control_buffer.buffer );
+      control = CMSG_FIRSTHDR( &header );
+      control->cmsg_level = SOL_SOCKET;
+      control->cmsg_type = SCM_RIGHTS;
+      control->cmsg_len = CMSG_LEN( sizeof( int ) );
+      memcpy( CMSG_DATA( control ), &passed_fd, sizeof( int ) );
+   }
+
+   if ( sendmsg( socket_fd, &header, MSG_NOSIGNAL ) != (ssize_t) sizeof( outgoing ) )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: handoff_receive
+*
+* Description: Receive one message and the descriptor it carries
+*
+* Inputs: socket_fd - handoff connection
+*         timeout_ms - longest wait
+*
+* Outputs: message - message
+*          passed_fd - received descriptor, -1 without one
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - timed out, closed or not a handoff message
+*
+*/
+int handoff_receive( int socket_fd, handoff_message *message, int *passed_fd, int timeout_ms )
+{
+   struct pollfd wait = { socket_fd, POLLIN, 0 };
+   struct iovec vector;
+   struct msghdr header = { 0 };
+   struct cmsghdr *control;
+   ssize_t length;
+   union
+   {
+      char           buffer[ CMSG_SPACE( sizeof( int ) ) ];
+      struct cmsghdr align;
+   } control_buffer;
+
+   *passed_fd = -1;
+   if ( poll( &wait, 1, timeout_ms ) != 1 )
+   {
+      syslog( LOG_ERR, "%s: No message from the other server", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   vector.iov_base = message;
+   vector.iov_len = sizeof( handoff_message );
+   header.msg_iov = &vector;
+   header.msg_iovlen = 1;
+   header.msg_control = control_buffer.buffer;
+   header.msg_controllen = sizeof( control_buffer.buffer );
+
+   length = recvmsg( socket_fd, &header, MSG_CMSG_CLOEXEC );
+   if ( -1 == length )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   for ( control = CMSG_FIRSTHDR( &header ); control != NULL; control = CMSG_NXTHDR( &header, control ) )
+   {
+      if ( ( SOL_SOCKET == control->cmsg_level ) && ( SCM_RIGHTS == control->cmsg_type ) )
+      {
+         memcpy( passed_fd, CMSG_DATA( control ), sizeof( int ) );
+      }
+   }
+
+   if ( ( length != (ssize_t) sizeof( handoff_message ) ) || ( message->magic != HANDOFF_MAGIC ) )
+   {
+      syslog( LOG_ERR, "%s: Not a handoff message", __func__ );
+      if ( *passed_fd != -1 )
+      {
+         close( *passed_fd );
+         *passed_fd = -1;
+      }
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: log_error
+*
+* Description: Log errno for a function
+*
+* Inputs: function - name of the failing function
+*
+* Returns: None
+*
+*/
+static void log_error( const char *function )
+{
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   strerror_r( errno, error, SYSLOG_BUF_SIZE );
+   syslog( LOG_ERR, "%s: %s", function, error );
+   return;
+}
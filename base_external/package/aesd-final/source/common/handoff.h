@@ -0,0 +1,64 @@
+/*
+* File: handoff.h
+*
+* Description: Pass listening and connected sockets from a running
+*              server to its replacement over a unix socket, with
+*              SCM_RIGHTS.
+*
+*              The running server listens on HANDOFF_SOCKET_PATH.  The
+*              new server connects, sends a request, learns the running
+*              server's PID from the connection credentials and signals
+*              it.  The running server answers with one message per
+*              socket, each carrying one descriptor, and a final
+*              message without one.  The kernel keeps every socket open
+*              while a descriptor to it exists, so clients never see a
+*              refused connection or a reset.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   man 7 unix, SCM_RIGHTS and SO_PEERCRED
+*   man 3 cmsg
+*
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Includes
+#include <stdint.h>
+#include <sys/types.h>
+
+// File defines and typedefs
+#define HANDOFF_SOCKET_PATH    "/var/tmp/aesd_vehicle.handoff"
+#define HANDOFF_MAGIC          0x48534541    // "AESH"
+#define HANDOFF_TIMEOUT_MS     5000
+
+// Message kinds
+#define HANDOFF_REQUEST           1
+#define HANDOFF_LISTENER          2
+#define HANDOFF_SESSION           3
+#define HANDOFF_DONE              4
+
+// Request flags
+#define HANDOFF_WANT_SESSIONS  0x01
+
+typedef struct handoff_message
+{
+   uint32_t magic;
+   uint32_t kind;
+   uint32_t flags;
+   int32_t  family;     // of the listener, AF_INET or AF_UNIX
+} handoff_message;
+
+int handoff_listen( int *socket_fd, const char *path );
+int handoff_accept( int listen_fd, int *socket_fd );
+int handoff_connect( int *socket_fd, const char *path, pid_t *peer_pid );
+int handoff_send( int socket_fd, const handoff_message *message, int passed_fd );
+int handoff_receive( int socket_fd, handoff_message *message, int *passed_fd, int timeout_ms );
+
+#endif // HANDOFF_H
@@ -0,0 +1,512 @@
+/*
+* File: isotp.c
+*
+* Description: ISO-TP segmentation of diagnostic messages.  See
+*              isotp.h.
+*
+*              Protocol control information, the first data bytes of
+*              each frame:
+*                single frame       0x0L                 L = 1..7
+*                                   0x00 L               CAN FD, L > 7
+*                first frame        0x1H LL              length 0xHLL
+*                consecutive frame  0x2N                 N = sequence
+*                flow control       0x3S BS STmin        S = 0 continue,
+*                                                        1 wait,
+*                                                        2 overflow
+*              Frames are padded with 0xCC, a CAN FD frame to the next
+*              length its DLC can code.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   ISO 15765-2:2016, Diagnostic communication over CAN
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "isotp.h"
+#include "vbus.h"
+
+// File defines and typedefs
+#define NS_PER_MS          1000000ULL
+#define NS_PER_USEC        1000ULL
+
+#define PCI_SINGLE_FRAME       0x0
+#define PCI_FIRST_FRAME        0x1
+#define PCI_CONSECUTIVE_FRAME  0x2
+#define PCI_FLOW_CONTROL       0x3
+
+#define FLOW_CONTINUE          0x0
+#define FLOW_WAIT              0x1
+#define FLOW_OVERFLOW          0x2
+
+#define SEQUENCE_MASK          0x0F
+#define PADDING_BYTE           0xCC
+
+// Classic single frames hold up to 7 bytes after a one byte length
+#define CLASSIC_SINGLE_MAX        7
+
+// STmin codes, milliseconds up to 0x7F, then 100 to 900 usec
+#define ST_MIN_MAX_MS          0x7F
+#define ST_MIN_USEC_FIRST      0xF1
+#define ST_MIN_USEC_LAST       0xF9
+
+// File data and functions
+static int send_frame( isotp_channel *channel, const uint8_t *data, size_t length );
+static int send_flow_control( isotp_channel *channel, uint8_t status );
+static int receive_frame( isotp_channel *channel, uint8_t *data, uint64_t deadline_ns );
+static void wait_st_min( uint8_t st_min );
+static uint64_t monotonic_ns( void );
+
+
+/*
+* Name: isotp_init
+*
+* Description: Set up a channel on an open can or vbus transport
+*
+* Inputs: channel - channel to initialize
+*         link - open transport, CAN FD enabled for an fd channel
+*         tx_id - identifier of the frames we send
+*         rx_id - identifier of the frames we receive
+*         fd - send CAN FD frames
+*
+* Returns: None
+*
+*/
+void isotp_init( isotp_channel *channel, transport *link, uint32_t tx_id, uint32_t rx_id, bool fd )
+{
+   memset( channel, 0, sizeof( isotp_channel ) );
+   channel->link = link;
+   channel->tx_id = tx_id;
+   channel->rx_id = rx_id;
+   channel->fd = fd;
+   return;
+}
+
+
+/*
+* Name: isotp_send
+*
+* Description: Send a message, segmented when it does not fit a single
+*              frame.  Waits for the receiver's flow control between
+*              blocks of consecutive frames.
+*
+* Inputs: channel - channel
+*         payload - message
+*         length - message length, at most ISOTP_MAX_LENGTH
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - send failed, no flow control or overflow
+*
+*/
+int isotp_send( isotp_channel *channel, const uint8_t *payload, size_t length )
+{
+   uint8_t frame[ ISOTP_FD_FRAME ];
+   size_t frame_size = channel->fd ? ISOTP_FD_FRAME : ISOTP_CLASSIC_FRAME;
+   size_t offset;
+   size_t chunk;
+   uint8_t sequence = 1;
+   uint8_t block_size = 0;
+   uint8_t st_min = 0;
+   unsigned int block;
+   int rx_length;
+
+   if ( length > ISOTP_MAX_LENGTH )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( length <= CLASSIC_SINGLE_MAX )
+   {
+      frame[ 0 ] = (uint8_t) ( ( PCI_SINGLE_FRAME << 4 ) | length );
+      memcpy( frame + 1, payload, length );
+      return( send_frame( channel, frame, length + 1 ) );
+   }
+   if ( length <= frame_size - 2 )
+   {
+      // CAN FD single frame, the length moves to the second byte
+      frame[ 0 ] = PCI_SINGLE_FRAME << 4;
+      frame[ 1 ] = (uint8_t) length;
+      memcpy( frame + 2, payload, length );
+      return( send_frame( channel, frame, length + 2 ) );
+   }
+
+   frame[ 0 ] = (uint8_t) ( ( PCI_FIRST_FRAME << 4 ) | ( length >> 8 ) );
+   frame[ 1 ] = (uint8_t) ( length & 0xFF );
+   offset = frame_size - 2;
+   memcpy( frame + 2, payload, offset );
+   if ( EXIT_SUCCESS != send_frame( channel, frame, frame_size ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   while ( offset < length )
+   {
+      // Every block starts with a flow control from the receiver
+      for(;;)
+      {
+         rx_length = receive_frame( channel, frame, monotonic_ns() + ISOTP_TIMEOUT_MS * NS_PER_MS );
+         if ( rx_length <= 0 )
+         {
+            syslog( LOG_ERR, "%s: No flow control", __func__ );
+            return( EXIT_FAILURE );
+         }
+         if ( ( rx_length < 3 ) || ( ( frame[ 0 ] >> 4 ) != PCI_FLOW_CONTROL ) )
+         {
+            continue;
+         }
+         if ( FLOW_WAIT == ( frame[ 0 ] & 0x0F ) )
+         {
+            continue;
+         }
+         if ( FLOW_CONTINUE != ( frame[ 0 ] & 0x0F ) )
+         {
+            syslog( LOG_ERR, "%s: Receiver refused %zu bytes", __func__, length );
+            return( EXIT_FAILURE );
+         }
+         block_size = frame[ 1 ];
+         st_min = frame[ 2 ];
+         break;
+      }
+
+      for ( block = 0; ( offset < length ) && ( ( 0 == block_size ) || ( block < block_size ) ); block++ )
+      {
+         if ( block > 0 )
+         {
+            wait_st_min( st_min );
+         }
+
+         chunk = length - offset;
+         if ( chunk > frame_size - 1 )
+         {
+            chunk = frame_size - 1;
+         }
+         frame[ 0 ] = (uint8_t) ( ( PCI_CONSECUTIVE_FRAME << 4 ) | sequence );
+         memcpy( frame + 1, payload + offset, chunk );
+         if ( EXIT_SUCCESS != send_frame( channel, frame, chunk + 1 ) )
+         {
+            return( EXIT_FAILURE );
+         }
+
+         offset += chunk;
+         sequence = ( sequence + 1 ) & SEQUENCE_MASK;
+      }
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: isotp_receive
+*
+* Description: Receive one message, answering a first frame with flow
+*              control and collecting its consecutive frames
+*
+* Inputs: channel - channel
+*         size - payload buffer size
+*         timeout_ms - maximum wait for the first frame
+*
+* Outputs: payload - message
+*
+* Returns: Message length
+*          ISOTP_TIMEOUT - nothing received in time
+*          ISOTP_ERROR - transport failed, message too long or a
+*                        consecutive frame was lost
+*
+*/
+int isotp_receive( isotp_channel *channel, uint8_t *payload, size_t size, int timeout_ms )
+{
+   uint8_t frame[ ISOTP_FD_FRAME ];
+   uint64_t deadline_ns = monotonic_ns() + (uint64_t) timeout_ms * NS_PER_MS;
+   size_t length;
+   size_t received;
+   size_t chunk;
+   size_t start;
+   uint8_t sequence;
+   unsigned int block;
+   int rx_length;
+
+   for(;;)
+   {
+      rx_length = receive_frame( channel, frame, deadline_ns );
+      if ( rx_length <= 0 )
+      {
+         return( rx_length );
+      }
+
+      if ( PCI_SINGLE_FRAME == ( frame[ 0 ] >> 4 ) )
+      {
+         length = frame[ 0 ] & 0x0F;
+         start = 1;
+         if ( ( 0 == length ) && ( rx_length > ISOTP_CLASSIC_FRAME ) )
+         {
+            length = frame[ 1 ];
+            start = 2;
+         }
+         if ( ( 0 == length ) || ( length > (size_t) rx_length - start ) )
+         {
+            continue;
+         }
+         memcpy( payload, frame + start, ( length < size ) ? length : size );
+         return( (int) length );
+      }
+
+      if ( ( PCI_FIRST_FRAME == ( frame[ 0 ] >> 4 ) ) && ( rx_length > 2 ) )
+      {
+         break;
+      }
+   }
+
+   length = ( (size_t) ( frame[ 0 ] & 0x0F ) << 8 ) | frame[ 1 ];
+   if ( length > size )
+   {
+      send_flow_control( channel, FLOW_OVERFLOW );
+      return( ISOTP_ERROR );
+   }
+
+   received = (size_t) rx_length - 2;
+   if ( received > length )
+   {
+      received = length;
+   }
+   memcpy( payload, frame + 2, received );
+
+   if ( EXIT_SUCCESS != send_flow_control( channel, FLOW_CONTINUE ) )
+   {
+      return( ISOTP_ERROR );
+   }
+
+   sequence = 1;
+   block = 0;
+   while ( received < length )
+   {
+      rx_length = receive_frame( channel, frame, monotonic_ns() + ISOTP_TIMEOUT_MS * NS_PER_MS );
+      if ( rx_length <= 0 )
+      {
+         return( ( ISOTP_TIMEOUT == rx_length ) ? ISOTP_ERROR : rx_length );
+      }
+      if ( ( rx_length < 2 ) || ( ( frame[ 0 ] >> 4 ) != PCI_CONSECUTIVE_FRAME ) )
+      {
+         continue;
+      }
+      if ( ( frame[ 0 ] & SEQUENCE_MASK ) != sequence )
+      {
+         syslog( LOG_ERR, "%s: Consecutive frame %u lost", __func__, sequence );
+         return( ISOTP_ERROR );
+      }
+
+      chunk = (size_t) rx_length - 1;
+      if ( chunk > length - received )
+      {
+         chunk = length - received;
+      }
+      memcpy( payload + received, frame + 1, chunk );
+      received += chunk;
+      sequence = ( sequence + 1 ) & SEQUENCE_MASK;
+
+      block++;
+      if ( ( channel->block_size > 0 ) && ( block == channel->block_size ) && ( received < length ) )
+      {
+         block = 0;
+         if ( EXIT_SUCCESS != send_flow_control( channel, FLOW_CONTINUE ) )
+         {
+            return( ISOTP_ERROR );
+         }
+      }
+   }
+   return( (int) length );
+}
+
+
+/*
+* Name: send_frame
+*
+* Description: Pad and send one frame of the channel
+*
+* Inputs: channel - channel
+*         data - frame data
+*         length - data length
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int send_frame( isotp_channel *channel, const uint8_t *data, size_t length )
+{
+   uint8_t message[ TRANSPORT_CAN_MTU ];
+   size_t padded;
+   int return_status;
+
+   padded = channel->fd ? vbus_fd_length( (uint8_t) length ) : ISOTP_CLASSIC_FRAME;
+   if ( padded < length )
+   {
+      padded = length;
+   }
+
+   memcpy( message, &channel->tx_id, sizeof( channel->tx_id ) );
+   memcpy( message + sizeof( channel->tx_id ), data, length );
+   memset( message + sizeof( channel->tx_id ) + length, PADDING_BYTE, padded - length );
+
+   channel->link->tx_fd = channel->fd;
+   return_status = transport_send( channel->link, message, sizeof( channel->tx_id ) + padded );
+   channel->link->tx_fd = false;
+
+   channel->tx_frames++;
+   return( return_status );
+}
+
+
+/*
+* Name: send_flow_control
+*
+* Description: Send a flow control frame with the channel's block size
+*              and minimum separation time
+*
+* Inputs: channel - channel
+*         status - FLOW_CONTINUE, FLOW_WAIT or FLOW_OVERFLOW
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int send_flow_control( isotp_channel *channel, uint8_t status )
+{
+   uint8_t frame[ 3 ];
+
+   frame[ 0 ] = (uint8_t) ( ( PCI_FLOW_CONTROL << 4 ) | status );
+   frame[ 1 ] = channel->block_size;
+   frame[ 2 ] = channel->st_min;
+   return( send_frame( channel, frame, sizeof( frame ) ) );
+}
+
+
+/*
+* Name: receive_frame
+*
+* Description: Wait for the next frame with the channel's receive
+*              identifier, other frames are dropped
+*
+* Inputs: channel - channel
+*         deadline_ns - monotonic time to give up
+*
+* Outputs: data - frame data, up to ISOTP_FD_FRAME bytes
+*
+* Returns: Data length
+*          ISOTP_TIMEOUT
+*          ISOTP_ERROR
+*
+*/
+int receive_frame( isotp_channel *channel, uint8_t *data, uint64_t deadline_ns )
+{
+   uint8_t message[ TRANSPORT_CAN_MTU ];
+   uint32_t can_id;
+   uint64_t now_ns;
+   int rx_length;
+
+   for(;;)
+   {
+      now_ns = monotonic_ns();
+      if ( now_ns >= deadline_ns )
+      {
+         return( ISOTP_TIMEOUT );
+      }
+
+      rx_length = transport_receive(
+         channel->link,
+         message,
+         sizeof( message ),
+         (int) ( ( deadline_ns - now_ns + NS_PER_MS - 1 ) / NS_PER_MS )
+         );
+      if ( TRANSPORT_TIMEOUT == rx_length )
+      {
+         continue;
+      }
+      if ( rx_length < 0 )
+      {
+         return( ISOTP_ERROR );
+      }
+
+      memcpy( &can_id, message, sizeof( can_id ) );
+      if ( ( can_id != channel->rx_id ) || ( rx_length <= (int) sizeof( can_id ) ) )
+      {
+         continue;
+      }
+
+      channel->rx_frames++;
+      rx_length -= (int) sizeof( can_id );
+      memcpy( data, message + sizeof( can_id ), (size_t) rx_length );
+      return( rx_length );
+   }
+}
+
+
+/*
+* Name: wait_st_min
+*
+* Description: Wait the minimum separation time between consecutive
+*              frames.  Reserved codes wait the longest time.
+*
+* Inputs: st_min - STmin code from the flow control
+*
+* Returns: None
+*
+*/
+void wait_st_min( uint8_t st_min )
+{
+   struct timespec gap = { 0 };
+   uint64_t gap_ns;
+
+   if ( 0 == st_min )
+   {
+      return;
+   }
+
+   if ( st_min <= ST_MIN_MAX_MS )
+   {
+      gap_ns = st_min * NS_PER_MS;
+   }
+   else if ( ( st_min >= ST_MIN_USEC_FIRST ) && ( st_min <= ST_MIN_USEC_LAST ) )
+   {
+      gap_ns = ( st_min - ST_MIN_USEC_FIRST + 1 ) * 100 * NS_PER_USEC;
+   }
+   else
+   {
+      gap_ns = ST_MIN_MAX_MS * NS_PER_MS;
+   }
+
+   gap.tv_sec = (time_t) ( gap_ns / ( 1000 * NS_PER_MS ) );
+   gap.tv_nsec = (long) ( gap_ns % ( 1000 * NS_PER_MS ) );
+   while ( ( -1 == nanosleep( &gap, &gap ) ) && ( EINTR == errno ) )
+   {
+   }
+   return;
+}
+
+
+/*
+* Name: monotonic_ns
+*
+* Description: Monotonic clock for the ISO-TP timeouts
+*
+* Inputs: None
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t monotonic_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * 1000 * NS_PER_MS + (uint64_t) now.tv_nsec );
+}
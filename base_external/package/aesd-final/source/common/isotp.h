@@ -0,0 +1,72 @@
+/*
+* File: isotp.h
+*
+* Description: ISO-TP (ISO 15765-2) segmentation of diagnostic
+*              messages on a can or vbus transport.
+*
+*              A message that fits one frame is sent as a single
+*              frame, a longer one as a first frame followed by
+*              consecutive frames.  The receiver answers the first
+*              frame with a flow control frame that sets the block
+*              size and the minimum gap between consecutive frames.
+*
+*              Classic CAN frames carry 7 bytes of a single frame and
+*              7 of each consecutive frame.  CAN FD frames carry up to
+*              62 and 63, so most OBD2 multi-frame responses, such as a
+*              mode 09 VIN or a response to several PIDs, fit a single
+*              CAN FD frame.
+*
+*              A channel uses one identifier in each direction.  Frames
+*              with other identifiers seen while a transfer waits are
+*              dropped.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   ISO 15765-2:2016, Diagnostic communication over CAN
+*
+*/
+
+#ifndef ISOTP_H
+#define ISOTP_H
+
+// Includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+// File defines and typedefs
+#define ISOTP_MAX_LENGTH      4095
+#define ISOTP_CLASSIC_FRAME      8
+#define ISOTP_FD_FRAME          64
+
+// N_Bs and N_Cr, longest wait for a flow control or consecutive frame
+#define ISOTP_TIMEOUT_MS      1000
+
+// Returned with a length when the transfer failed
+#define ISOTP_TIMEOUT            0
+#define ISOTP_ERROR             -1
+
+typedef struct isotp_channel
+{
+   transport    *link;
+   uint32_t      tx_id;
+   uint32_t      rx_id;
+   bool          fd;
+   uint8_t       block_size;     // sent in our flow control, 0 for no limit
+   uint8_t       st_min;         // sent in our flow control
+   unsigned long tx_frames;
+   unsigned long rx_frames;
+} isotp_channel;
+
+void isotp_init( isotp_channel *channel, transport *link, uint32_t tx_id, uint32_t rx_id, bool fd );
+int isotp_send( isotp_channel *channel, const uint8_t *payload, size_t length );
+int isotp_receive( isotp_channel *channel, uint8_t *payload, size_t size, int timeout_ms );
+
+#endif // ISOTP_H
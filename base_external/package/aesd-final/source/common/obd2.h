@@ -0,0 +1,35 @@
+/*
+* File: obd2.h
+*
+* Description: OBD-II message exchanged by the vehicle, the scan tool
+*              and the gateway on every transport.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   SAE J1979
+*
+*/
+
+#ifndef OBD2_H
+#define OBD2_H
+
+// Includes
+#include <stdint.h>
+
+// File defines and typedefs
+typedef struct obd2_message
+{
+   uint32_t id;
+   uint8_t  num_bytes;
+   uint8_t  mode;
+   uint8_t  pid;
+   uint8_t  data[ 4 ];
+   uint8_t  unused;
+} obd2_message;
+
+#endif // OBD2_H
@@ -0,0 +1,345 @@
+/*
+* File: poll_scheduler.c
+*
+* Description: Rate monotonic PID poll scheduler with a bus load
+*              ceiling.  See poll_scheduler.h.
+*
+*              Bus load of a rate r polls/s:
+*                r * POLL_FRAMES * CAN_FRAME_BITS / bitrate
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Liu and Layland, Scheduling Algorithms for Multiprogramming in a
+*   Hard-Real-Time Environment (JACM 1973)
+*
+*/
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+#include "poll_scheduler.h"
+
+// File defines and typedefs
+#define MS_PER_SEC  1000.0
+
+// File data and functions
+static double poll_bits( void );
+
+
+/*
+* Name: poll_scheduler_init
+*
+* Description: Start an empty schedule
+*
+* Inputs: scheduler - scheduler to initialize
+*         bitrate - bus bitrate in bit/s
+*         load_ceiling - largest bus share to use, 0 to 1
+*
+* Returns: None
+*
+*/
+void poll_scheduler_init( poll_scheduler *scheduler, uint32_t bitrate, double load_ceiling )
+{
+   memset( scheduler, 0, sizeof( poll_scheduler ) );
+   scheduler->bitrate = bitrate;
+   scheduler->load_ceiling = load_ceiling;
+   return;
+}
+
+
+/*
+* Name: poll_scheduler_add
+*
+* Description: Add a PID to the schedule, call poll_scheduler_plan()
+*              once all PIDs are added
+*
+* Inputs: scheduler - scheduler
+*         pid - PID to poll
+*         target_hz - fastest rate wanted
+*         priority - higher keeps its rate longer under the ceiling
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - schedule is full or rate is not positive
+*
+*/
+int poll_scheduler_add(
+   poll_scheduler *scheduler,
+   uint8_t pid,
+   double target_hz,
+   uint8_t priority
+   )
+{
+   poll_entry *entry;
+
+   if ( ( scheduler->count >= POLL_MAX_ENTRIES ) || !( target_hz > 0 ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   entry = &scheduler->entries[ scheduler->count++ ];
+   memset( entry, 0, sizeof( poll_entry ) );
+   entry->pid = pid;
+   entry->priority = priority;
+   entry->target_hz = target_hz;
+   entry->adaptive_hz = target_hz;
+   entry->rate_hz = target_hz;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: poll_scheduler_plan
+*
+* Description: Fit the adaptive rates under the bus load ceiling.
+*              Lowest priorities give up rate first, down to
+*              1/POLL_MAX_BACKOFF of their target.  If that is not
+*              enough every rate is scaled down by the same factor.
+*
+* Inputs: scheduler - scheduler
+*
+* Returns: None
+*
+*/
+void poll_scheduler_plan( poll_scheduler *scheduler )
+{
+   poll_entry *entry;
+   double budget_hz;
+   double demand_hz = 0;
+   double excess_hz;
+   double floor_hz;
+   double cut_hz;
+   unsigned int i;
+   int priority;
+
+   budget_hz = scheduler->load_ceiling * scheduler->bitrate / poll_bits();
+
+   for ( i = 0; i < scheduler->count; i++ )
+   {
+      entry = &scheduler->entries[ i ];
+      entry->rate_hz = entry->adaptive_hz;
+      demand_hz += entry->rate_hz;
+   }
+
+   excess_hz = demand_hz - budget_hz;
+   for ( priority = 0; ( priority <= UINT8_MAX ) && ( excess_hz > 0 ); priority++ )
+   {
+      for ( i = 0; ( i < scheduler->count ) && ( excess_hz > 0 ); i++ )
+      {
+         entry = &scheduler->entries[ i ];
+         if ( entry->priority != priority )
+         {
+            continue;
+         }
+
+         floor_hz = entry->target_hz / POLL_MAX_BACKOFF;
+         if ( entry->rate_hz > floor_hz )
+         {
+            cut_hz = entry->rate_hz - floor_hz;
+            if ( cut_hz > excess_hz )
+            {
+               cut_hz = excess_hz;
+            }
+            entry->rate_hz -= cut_hz;
+            demand_hz -= cut_hz;
+            excess_hz -= cut_hz;
+         }
+      }
+   }
+
+   if ( excess_hz > 0 )
+   {
+      for ( i = 0; i < scheduler->count; i++ )
+      {
+         scheduler->entries[ i ].rate_hz *= budget_hz / demand_hz;
+      }
+      demand_hz = budget_hz;
+   }
+
+   scheduler->expected_load = demand_hz * poll_bits() / scheduler->bitrate;
+   return;
+}
+
+
+/*
+* Name: poll_scheduler_next
+*
+* Description: Pick the due PID with the shortest period, rate
+*              monotonic order, ties go to the higher priority
+*
+* Inputs: scheduler - scheduler
+*         now_ms - monotonic time
+*
+* Outputs: wait_ms - time until the next PID is due, when none is due
+*
+* Returns: PID to poll now, NULL if none is due
+*
+*/
+poll_entry *poll_scheduler_next( poll_scheduler *scheduler, uint64_t now_ms, int *wait_ms )
+{
+   poll_entry *entry;
+   poll_entry *next = NULL;
+   uint64_t next_due_ms = UINT64_MAX;
+   uint64_t period_ms;
+   unsigned int i;
+
+   for ( i = 0; i < scheduler->count; i++ )
+   {
+      entry = &scheduler->entries[ i ];
+      if ( entry->next_ms <= now_ms )
+      {
+         if (   ( NULL == next )
+             || ( entry->rate_hz > next->rate_hz )
+             || ( ( entry->rate_hz == next->rate_hz ) && ( entry->priority > next->priority ) )
+            )
+         {
+            next = entry;
+         }
+      }
+      else if ( entry->next_ms < next_due_ms )
+      {
+         next_due_ms = entry->next_ms;
+      }
+   }
+
+   if ( NULL == next )
+   {
+      *wait_ms = ( UINT64_MAX == next_due_ms ) ? 0 : (int) ( next_due_ms - now_ms );
+   }
+   else
+   {
+      // Late polls are not made up, the period restarts from now
+      period_ms = (uint64_t) ( MS_PER_SEC / next->rate_hz );
+      next->next_ms += period_ms;
+      if ( next->next_ms < now_ms )
+      {
+         next->next_ms = now_ms + period_ms;
+      }
+      *wait_ms = 0;
+   }
+   return( next );
+}
+
+
+/*
+* Name: poll_scheduler_complete
+*
+* Description: Record the result of a poll.  A change speeds the PID
+*              back up towards its target, POLL_STABLE_COUNT polls
+*              without a change halve its rate.  The schedule is
+*              re-planned when a rate changes.
+*
+* Inputs: scheduler - scheduler
+*         entry - polled PID
+*         data - 4 response data bytes
+*         answered - false when no response came, data is ignored
+*
+* Returns: true - value changed since the last poll
+*          false - value unchanged or no response
+*
+*/
+bool poll_scheduler_complete(
+   poll_scheduler *scheduler,
+   poll_entry *entry,
+   const uint8_t *data,
+   bool answered
+   )
+{
+   bool changed = false;
+   double adaptive_hz = entry->adaptive_hz;
+
+   entry->polls++;
+   entry->window_polls++;
+   scheduler->window_frames += answered ? POLL_FRAMES : 1;
+
+   if ( !answered )
+   {
+      return( false );
+   }
+
+   if ( !entry->have_last || ( memcmp( entry->last_data, data, sizeof( entry->last_data ) ) != 0 ) )
+   {
+      changed = true;
+      memcpy( entry->last_data, data, sizeof( entry->last_data ) );
+      entry->have_last = true;
+      entry->unchanged = 0;
+
+      adaptive_hz *= 2;
+      if ( adaptive_hz > entry->target_hz )
+      {
+         adaptive_hz = entry->target_hz;
+      }
+   }
+   else if ( ++entry->unchanged >= POLL_STABLE_COUNT )
+   {
+      entry->unchanged = 0;
+
+      adaptive_hz /= 2;
+      if ( adaptive_hz < entry->target_hz / POLL_MAX_BACKOFF )
+      {
+         adaptive_hz = entry->target_hz / POLL_MAX_BACKOFF;
+      }
+   }
+
+   if ( adaptive_hz != entry->adaptive_hz )
+   {
+      entry->adaptive_hz = adaptive_hz;
+      poll_scheduler_plan( scheduler );
+   }
+   return( changed );
+}
+
+
+/*
+* Name: poll_scheduler_actual_load
+*
+* Description: Bus load measured since the last call, and start a new
+*              measurement window
+*
+* Inputs: scheduler - scheduler
+*         now_ms - monotonic time
+*
+* Returns: measured bus share, 0 to 1
+*
+*/
+double poll_scheduler_actual_load( poll_scheduler *scheduler, uint64_t now_ms )
+{
+   double load = 0;
+   double seconds;
+   unsigned int i;
+
+   seconds = ( now_ms - scheduler->window_start_ms ) / MS_PER_SEC;
+   if ( ( scheduler->window_start_ms != 0 ) && ( seconds > 0 ) )
+   {
+      load = scheduler->window_frames * (double) CAN_FRAME_BITS / ( scheduler->bitrate * seconds );
+   }
+
+   scheduler->window_start_ms = now_ms;
+   scheduler->window_frames = 0;
+   for ( i = 0; i < scheduler->count; i++ )
+   {
+      scheduler->entries[ i ].window_polls = 0;
+   }
+   return( load );
+}
+
+
+/*
+* Name: poll_bits
+*
+* Description: Bus bits used by one poll
+*
+* Inputs: None
+*
+* Returns: bits
+*
+*/
+double poll_bits( void )
+{
+   return( (double) POLL_FRAMES * CAN_FRAME_BITS );
+}
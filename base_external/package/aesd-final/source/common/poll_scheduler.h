@@ -0,0 +1,89 @@
+/*
+* File: poll_scheduler.h
+*
+* Description: Rate monotonic PID poll scheduler with a bus load
+*              ceiling.
+*
+*              Each PID has a target rate and a priority.  The rate
+*              actually polled adapts to the data: a PID whose value
+*              keeps changing is polled at its target rate, a stable
+*              PID backs off to as little as 1/POLL_MAX_BACKOFF of it.
+*              When the rates do not fit under the bus load ceiling the
+*              lowest priorities are slowed first.  Due PIDs are polled
+*              shortest period first.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Liu and Layland, Scheduling Algorithms for Multiprogramming in a
+*   Hard-Real-Time Environment (JACM 1973)
+*   Bosch CAN Specification 2.0
+*
+*/
+
+#ifndef POLL_SCHEDULER_H
+#define POLL_SCHEDULER_H
+
+// Includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define POLL_MAX_ENTRIES       16
+#define POLL_MAX_BACKOFF       16
+#define POLL_STABLE_COUNT       4
+
+// Standard frame with 8 data bytes and worst case bit stuffing,
+// a poll is one request and one response frame
+#define CAN_FRAME_BITS        135
+#define POLL_FRAMES             2
+
+typedef struct poll_entry
+{
+   uint8_t       pid;
+   uint8_t       priority;
+   double        target_hz;
+   double        adaptive_hz;
+   double        rate_hz;
+   uint64_t      next_ms;
+   uint8_t       last_data[ 4 ];
+   bool          have_last;
+   unsigned int  unchanged;
+   unsigned long polls;
+   unsigned long window_polls;
+} poll_entry;
+
+typedef struct poll_scheduler
+{
+   poll_entry    entries[ POLL_MAX_ENTRIES ];
+   unsigned int  count;
+   uint32_t      bitrate;
+   double        load_ceiling;
+   double        expected_load;
+   uint64_t      window_start_ms;
+   unsigned long window_frames;
+} poll_scheduler;
+
+void poll_scheduler_init( poll_scheduler *scheduler, uint32_t bitrate, double load_ceiling );
+int poll_scheduler_add(
+   poll_scheduler *scheduler,
+   uint8_t pid,
+   double target_hz,
+   uint8_t priority
+   );
+void poll_scheduler_plan( poll_scheduler *scheduler );
+poll_entry *poll_scheduler_next( poll_scheduler *scheduler, uint64_t now_ms, int *wait_ms );
+bool poll_scheduler_complete(
+   poll_scheduler *scheduler,
+   poll_entry *entry,
+   const uint8_t *data,
+   bool answered
+   );
+double poll_scheduler_actual_load( poll_scheduler *scheduler, uint64_t now_ms );
+
+#endif // POLL_SCHEDULER_H
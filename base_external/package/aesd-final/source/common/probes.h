@@ -0,0 +1,64 @@
+/*
+* File: probes.h
+*
+* Description: Static tracepoints (USDT) for perf and bpftrace.
+*
+*              make USDT=1 builds them with <sys/sdt.h> from systemtap,
+*              otherwise PROBE() expands to nothing.  Each probe has a
+*              semaphore that perf and bpftrace raise while they are
+*              attached, so a probe that nobody traces costs one load
+*              and a branch and its arguments, the timestamp included,
+*              are not evaluated.
+*
+*              Every probe a file fires needs its PROBE_SEMAPHORE() at
+*              file scope.  Timestamp arguments are CLOCK_MONOTONIC,
+*              the clock of bpftrace's nsecs.  The probes and the
+*              scripts that use them are listed in trace/README.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://sourceware.org/systemtap/wiki/UserSpaceProbeImplementation
+*   man 1 bpftrace, usdt probes
+*
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// Includes
+#ifdef USE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+
+// File defines and typedefs
+#ifdef USE_USDT
+
+#define PROBE_SEMAPHORE( provider, name ) \
+   volatile unsigned short provider##_##name##_semaphore \
+      __attribute__( ( unused, section( ".probes" ) ) )
+
+#define PROBE( provider, name, ... ) \
+   do \
+   { \
+      if ( __builtin_expect( provider##_##name##_semaphore != 0, 0 ) ) \
+      { \
+         STAP_PROBEV( provider, name, __VA_ARGS__ ); \
+      } \
+   } while ( 0 )
+
+#else
+
+#define PROBE_SEMAPHORE( provider, name ) \
+   extern volatile unsigned short provider##_##name##_semaphore
+
+#define PROBE( provider, name, ... ) do { } while ( 0 )
+
+#endif
+
+#endif // PROBES_H
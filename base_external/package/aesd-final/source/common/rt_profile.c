@@ -0,0 +1,356 @@
+/*
+* File: rt_profile.c
+*
+* Description: Real-time execution profile and latency statistics.
+*              See rt_profile.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   man 2 sched_setscheduler, man 2 mlockall, man 2 clock_nanosleep
+*   https://wiki.linuxfoundation.org/realtime/documentation/howto/applications/application_base
+*
+*/
+
+// Includes
+#define _GNU_SOURCE
+#include <alloca.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rt_profile.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define NS_PER_SEC   1000000000ULL
+#define NS_PER_USEC        1000ULL
+
+// File data and functions
+static void prefault_stack( size_t length );
+
+
+/*
+* Name: rt_profile_init
+*
+* Description: Default profile, SCHED_FIFO RT_DEFAULT_PRIORITY on the
+*              current cores
+*
+* Inputs: profile - profile to initialize
+*
+* Returns: None
+*
+*/
+void rt_profile_init( rt_profile *profile )
+{
+   profile->priority = RT_DEFAULT_PRIORITY;
+   profile->cpu = RT_ANY_CPU;
+   profile->stack_bytes = RT_STACK_PREFAULT;
+   return;
+}
+
+
+/*
+* Name: rt_profile_apply
+*
+* Description: Apply a profile to the calling process.  Memory is
+*              locked first, current and future mappings, then the
+*              stack is grown and touched while locked.  Locking faults
+*              in every mapped page, buffers allocated later included,
+*              only the stack has to grow first.  The scheduling
+*              class is changed last so the setup itself does not hold
+*              a core.
+*
+* Inputs: profile - profile to apply
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - a step failed, usually missing CAP_SYS_NICE
+*                         or CAP_IPC_LOCK, see syslog
+*
+*/
+int rt_profile_apply( const rt_profile *profile )
+{
+   struct sched_param param;
+   cpu_set_t cpus;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( profile->cpu != RT_ANY_CPU )
+   {
+      CPU_ZERO( &cpus );
+      CPU_SET( profile->cpu, &cpus );
+      if ( -1 == sched_setaffinity( 0, sizeof( cpus ), &cpus ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: cpu %d: %s", __func__, profile->cpu, error );
+         return( EXIT_FAILURE );
+      }
+   }
+
+   if ( -1 == mlockall( MCL_CURRENT | MCL_FUTURE ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: mlockall: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+
+   prefault_stack( profile->stack_bytes );
+
+   memset( &param, 0, sizeof( param ) );
+   param.sched_priority = profile->priority;
+   if ( -1 == sched_setscheduler( 0, SCHED_FIFO, &param ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: SCHED_FIFO %d: %s", __func__, profile->priority, error );
+      return( EXIT_FAILURE );
+   }
+
+   syslog(
+      LOG_INFO,
+      "Real-time profile: SCHED_FIFO %d, cpu %d, memory locked, %zu stack bytes prefaulted",
+      profile->priority,
+      profile->cpu,
+      profile->stack_bytes
+      );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: prefault_stack
+*
+* Description: Grow the stack by length bytes while the memory is
+*              locked, the pages stay mapped once the call returns
+*
+* Inputs: length - bytes
+*
+* Returns: None
+*
+*/
+static void __attribute__(( noinline )) prefault_stack( size_t length )
+{
+   volatile uint8_t *stack = alloca( length );
+   size_t page = (size_t) sysconf( _SC_PAGESIZE );
+   size_t offset;
+
+   for ( offset = 0; offset < length; offset += page )
+   {
+      stack[ offset ] = 0;
+   }
+   return;
+}
+
+
+/*
+* Name: jitter_clock_ns
+*
+* Description: Monotonic clock in nanoseconds
+*
+* Inputs: None
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t jitter_clock_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
+
+
+/*
+* Name: jitter_reset
+*
+* Description: Clear latency statistics
+*
+* Inputs: stats - statistics
+*
+* Returns: None
+*
+*/
+void jitter_reset( jitter_stats *stats )
+{
+   memset( stats, 0, sizeof( jitter_stats ) );
+   stats->min_ns = UINT64_MAX;
+   return;
+}
+
+
+/*
+* Name: jitter_add
+*
+* Description: Record one latency
+*
+* Inputs: stats - statistics
+*         latency_ns - latency
+*
+* Returns: None
+*
+*/
+void jitter_add( jitter_stats *stats, uint64_t latency_ns )
+{
+   uint64_t bucket = latency_ns / NS_PER_USEC;
+
+   if ( bucket >= JITTER_BUCKETS )
+   {
+      bucket = JITTER_BUCKETS - 1;
+   }
+   stats->histogram[ bucket ]++;
+
+   if ( latency_ns < stats->min_ns )
+   {
+      stats->min_ns = latency_ns;
+   }
+   if ( latency_ns > stats->max_ns )
+   {
+      stats->max_ns = latency_ns;
+   }
+   stats->total_ns += latency_ns;
+   stats->samples++;
+   return;
+}
+
+
+/*
+* Name: jitter_percentile_us
+*
+* Description: Latency below which a share of the samples fall, to
+*              the histogram resolution.  A percentile in the overflow
+*              bucket is reported as the maximum.
+*
+* Inputs: stats - statistics
+*         percentile - 0 to 100
+*
+* Returns: Microseconds, 0 without samples
+*
+*/
+double jitter_percentile_us( const jitter_stats *stats, double percentile )
+{
+   unsigned long rank;
+   unsigned long seen = 0;
+   unsigned int i;
+
+   if ( 0 == stats->samples )
+   {
+      return( 0 );
+   }
+
+   rank = (unsigned long) ( stats->samples * percentile / 100.0 );
+   if ( rank >= stats->samples )
+   {
+      rank = stats->samples - 1;
+   }
+
+   for ( i = 0; i < JITTER_BUCKETS - 1; i++ )
+   {
+      seen += stats->histogram[ i ];
+      if ( seen > rank )
+      {
+         return( i + 1 );
+      }
+   }
+   return( (double) stats->max_ns / NS_PER_USEC );
+}
+
+
+/*
+* Name: jitter_measure
+*
+* Description: Sleep to an absolute deadline every interval and record
+*              how late each wakeup was.  A late wakeup does not move
+*              the following deadlines, as in cyclictest.
+*
+* Inputs: stats - statistics, added to
+*         interval_us - period
+*         loops - wakeups to measure
+*         stop - set to end early, may be NULL
+*
+* Returns: EXIT_SUCCESS - measured, or ended by a signal or stop
+*          EXIT_FAILURE - clock_nanosleep() failed
+*
+*/
+int jitter_measure( jitter_stats *stats, unsigned int interval_us, unsigned long loops, atomic_bool *stop )
+{
+   struct timespec deadline;
+   uint64_t deadline_ns;
+   uint64_t now_ns;
+   unsigned long i;
+   int status;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   deadline_ns = jitter_clock_ns();
+   for ( i = 0; i < loops; i++ )
+   {
+      if ( ( stop != NULL ) && atomic_load( stop ) )
+      {
+         break;
+      }
+
+      deadline_ns += (uint64_t) interval_us * NS_PER_USEC;
+      deadline.tv_sec = (time_t) ( deadline_ns / NS_PER_SEC );
+      deadline.tv_nsec = (long) ( deadline_ns % NS_PER_SEC );
+
+      status = clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL );
+      if ( EINTR == status )
+      {
+         break;
+      }
+      if ( status != 0 )
+      {
+         strerror_r( status, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( EXIT_FAILURE );
+      }
+
+      now_ns = jitter_clock_ns();
+      jitter_add( stats, ( now_ns > deadline_ns ) ? now_ns - deadline_ns : 0 );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: jitter_summary
+*
+* Description: Format latency statistics in microseconds
+*
+* Inputs: stats - statistics
+*         size - size of text
+*
+* Outputs: text - summary
+*
+* Returns: None
+*
+*/
+void jitter_summary( const jitter_stats *stats, char *text, size_t size )
+{
+   if ( 0 == stats->samples )
+   {
+      snprintf( text, size, "no samples" );
+      return;
+   }
+
+   snprintf(
+      text,
+      size,
+      "%lu samples, usec min %.1f avg %.1f p99 %.0f p99.9 %.0f max %.1f",
+      stats->samples,
+      (double) stats->min_ns / NS_PER_USEC,
+      (double) stats->total_ns / stats->samples / NS_PER_USEC,
+      jitter_percentile_us( stats, 99.0 ),
+      jitter_percentile_us( stats, 99.9 ),
+      (double) stats->max_ns / NS_PER_USEC
+      );
+   return;
+}
@@ -0,0 +1,75 @@
+/*
+* File: rt_profile.h
+*
+* Description: Real-time execution profile and latency statistics.
+*
+*              The profile pins the process to a core, runs it
+*              SCHED_FIFO, locks its memory and prefaults its stack so
+*              a response never waits for a page fault or a lower
+*              priority task.  Apply it after the daemon fork, memory
+*              locks are not inherited, and before threads are started,
+*              they inherit the policy and affinity.
+*
+*              The jitter harness is a cyclictest style loop: sleep to
+*              an absolute deadline every interval and record how late
+*              the wakeup was.  Latencies go in a 1 usec histogram so
+*              the tail can be read, not only the average.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   man 2 sched_setscheduler, man 2 mlockall
+*   https://wiki.linuxfoundation.org/realtime/documentation/howto/applications/application_base
+*   https://wiki.linuxfoundation.org/realtime/documentation/howto/tools/cyclictest/start
+*
+*/
+
+#ifndef RT_PROFILE_H
+#define RT_PROFILE_H
+
+// Includes
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define RT_DEFAULT_PRIORITY      80
+#define RT_ANY_CPU               -1
+#define RT_STACK_PREFAULT  ( 256 * 1024 )
+
+// 1 usec buckets, the last one counts everything longer
+#define JITTER_BUCKETS         1000
+#define JITTER_INTERVAL_US     1000
+
+typedef struct rt_profile
+{
+   int      priority;      // SCHED_FIFO 1 to 99
+   int      cpu;           // RT_ANY_CPU to keep the current affinity
+   size_t   stack_bytes;   // stack touched while locked
+} rt_profile;
+
+typedef struct jitter_stats
+{
+   unsigned long samples;
+   uint64_t      min_ns;
+   uint64_t      max_ns;
+   uint64_t      total_ns;
+   unsigned long histogram[ JITTER_BUCKETS ];
+} jitter_stats;
+
+void rt_profile_init( rt_profile *profile );
+int rt_profile_apply( const rt_profile *profile );
+
+uint64_t jitter_clock_ns( void );
+void jitter_reset( jitter_stats *stats );
+void jitter_add( jitter_stats *stats, uint64_t latency_ns );
+double jitter_percentile_us( const jitter_stats *stats, double percentile );
+int jitter_measure( jitter_stats *stats, unsigned int interval_us, unsigned long loops, atomic_bool *stop );
+void jitter_summary( const jitter_stats *stats, char *text, size_t size );
+
+#endif // RT_PROFILE_H
@@ -0,0 +1,485 @@
+/*
+* File: rtt_estimator.c
+*
+* Description: Request timeout and hedge delay from observed round
+*              trip times.  See rtt_estimator.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   RFC 6298, Computing TCP's Retransmission Timer
+*
+*/
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+
+#include "rtt_estimator.h"
+
+// File defines and typedefs
+#define RTT_ALPHA        0.125
+#define RTT_BETA         0.25
+#define RTT_K            4
+#define USEC_PER_MS      1000.0
+
+// File data and functions
+static unsigned int rtt_bucket( uint64_t rtt_us );
+static uint64_t rtt_bucket_limit_us( unsigned int bucket );
+static double latency_percentile_ms( const rtt_latency *latency, double percentile );
+static double histogram_percentile_us(
+   const unsigned long *histogram,
+   unsigned long samples,
+   double percentile
+   );
+
+
+/*
+* Name: rtt_init
+*
+* Description: Start without samples, the timeout is P2
+*
+* Inputs: rtt - estimator to initialize
+*
+* Returns: None
+*
+*/
+void rtt_init( rtt_estimator *rtt )
+{
+   memset( rtt, 0, sizeof( rtt_estimator ) );
+   return;
+}
+
+
+/*
+* Name: rtt_answered
+*
+* Description: Record an answered request.  An unambiguous RTT updates
+*              the estimate and the histogram and ends a timeout
+*              backoff.
+*
+* Inputs: rtt - estimator
+*         rtt_us - time from the first send to the answer
+*         ambiguous - the answer may belong to another send
+*
+* Returns: None
+*
+*/
+void rtt_answered( rtt_estimator *rtt, uint64_t rtt_us, bool ambiguous )
+{
+   double error_us;
+   unsigned int i;
+
+   rtt->answers++;
+   if ( ambiguous )
+   {
+      return;
+   }
+
+   if ( !rtt->have_sample )
+   {
+      rtt->srtt_us = (double) rtt_us;
+      rtt->rttvar_us = rtt_us / 2.0;
+      rtt->have_sample = true;
+   }
+   else
+   {
+      error_us = (double) rtt_us - rtt->srtt_us;
+      rtt->rttvar_us += RTT_BETA * ( ( error_us < 0 ? -error_us : error_us ) - rtt->rttvar_us );
+      rtt->srtt_us += RTT_ALPHA * error_us;
+   }
+   rtt->backoff = 0;
+
+   if ( ++rtt->history > RTT_HISTORY )
+   {
+      rtt->history = 0;
+      for ( i = 0; i < RTT_BUCKETS; i++ )
+      {
+         rtt->histogram[ i ] /= 2;
+         rtt->history += rtt->histogram[ i ];
+      }
+      rtt->history++;
+   }
+   rtt->histogram[ rtt_bucket( rtt_us ) ]++;
+   rtt->samples++;
+   return;
+}
+
+
+/*
+* Name: rtt_expired
+*
+* Description: Record a request that was not answered in time, the
+*              next timeout is doubled
+*
+* Inputs: rtt - estimator
+*
+* Returns: None
+*
+*/
+void rtt_expired( rtt_estimator *rtt )
+{
+   rtt->timeouts++;
+   if ( rtt->backoff < RTT_MAX_BACKOFF )
+   {
+      rtt->backoff++;
+   }
+   return;
+}
+
+
+/*
+* Name: rtt_hedged
+*
+* Description: Record a hedged request, counted against the budget
+*
+* Inputs: rtt - estimator
+*
+* Returns: None
+*
+*/
+void rtt_hedged( rtt_estimator *rtt )
+{
+   rtt->hedges++;
+   return;
+}
+
+
+/*
+* Name: rtt_timeout_us
+*
+* Description: How long to wait for the answer to the next request
+*
+* Inputs: rtt - estimator
+*
+* Returns: Microseconds
+*
+*/
+uint64_t rtt_timeout_us( const rtt_estimator *rtt )
+{
+   uint64_t timeout_us = RTT_INITIAL_TIMEOUT_US;
+
+   if ( rtt->have_sample )
+   {
+      timeout_us = (uint64_t) ( rtt->srtt_us + RTT_K * rtt->rttvar_us );
+      if ( timeout_us < RTT_MIN_TIMEOUT_US )
+      {
+         timeout_us = RTT_MIN_TIMEOUT_US;
+      }
+   }
+
+   timeout_us <<= rtt->backoff;
+   if ( timeout_us > RTT_MAX_TIMEOUT_US )
+   {
+      timeout_us = RTT_MAX_TIMEOUT_US;
+   }
+   return( timeout_us );
+}
+
+
+/*
+* Name: rtt_hedge_us
+*
+* Description: When to send a second copy of the next request if it
+*              is still unanswered.  No hedge before enough samples,
+*              past the budget, or when it would not come before the
+*              timeout.
+*
+* Inputs: rtt - estimator
+*
+* Returns: Microseconds after the first send, 0 for no hedge
+*
+*/
+uint64_t rtt_hedge_us( const rtt_estimator *rtt )
+{
+   uint64_t hedge_us;
+   unsigned long requests = rtt->answers + rtt->timeouts;
+
+   if (   ( rtt->samples < RTT_HEDGE_MIN_SAMPLES )
+       || (   ( rtt->hedges + 1 ) * 100
+            > requests * RTT_HEDGE_BUDGET_PERCENT + RTT_HEDGE_BURST * 100 )
+      )
+   {
+      return( 0 );
+   }
+
+   hedge_us = (uint64_t) rtt_percentile_us( rtt, RTT_HEDGE_PERCENTILE );
+   if ( hedge_us < RTT_MIN_HEDGE_US )
+   {
+      hedge_us = RTT_MIN_HEDGE_US;
+   }
+   if ( hedge_us >= rtt_timeout_us( rtt ) )
+   {
+      return( 0 );
+   }
+   return( hedge_us );
+}
+
+
+/*
+* Name: rtt_percentile_us
+*
+* Description: RTT below which a share of the recent samples fall, to
+*              the bucket resolution
+*
+* Inputs: rtt - estimator
+*         percentile - 0 to 100
+*
+* Returns: Upper edge of the bucket in microseconds, 0 without samples
+*
+*/
+double rtt_percentile_us( const rtt_estimator *rtt, double percentile )
+{
+   return( histogram_percentile_us( rtt->histogram, rtt->history, percentile ) );
+}
+
+
+/*
+* Name: rtt_summary
+*
+* Description: Format the estimate, percentiles and counts
+*
+* Inputs: rtt - estimator
+*         size - size of text
+*
+* Outputs: text - summary
+*
+* Returns: None
+*
+*/
+void rtt_summary( const rtt_estimator *rtt, char *text, size_t size )
+{
+   snprintf(
+      text,
+      size,
+      "%lu answers, usec srtt %.0f rttvar %.0f p50 %.0f p99 %.0f, timeout %.1f ms, %lu timeouts, %lu hedged",
+      rtt->answers,
+      rtt->srtt_us,
+      rtt->rttvar_us,
+      rtt_percentile_us( rtt, 50.0 ),
+      rtt_percentile_us( rtt, 99.0 ),
+      rtt_timeout_us( rtt ) / USEC_PER_MS,
+      rtt->timeouts,
+      rtt->hedges
+      );
+   return;
+}
+
+
+/*
+* Name: rtt_latency_reset
+*
+* Description: Clear a latency histogram
+*
+* Inputs: latency - histogram
+*
+* Returns: None
+*
+*/
+void rtt_latency_reset( rtt_latency *latency )
+{
+   memset( latency, 0, sizeof( rtt_latency ) );
+   return;
+}
+
+
+/*
+* Name: rtt_latency_add
+*
+* Description: Record one latency
+*
+* Inputs: latency - histogram
+*         latency_us - latency
+*
+* Returns: None
+*
+*/
+void rtt_latency_add( rtt_latency *latency, uint64_t latency_us )
+{
+   latency->histogram[ rtt_bucket( latency_us ) ]++;
+   if ( latency_us > latency->max_us )
+   {
+      latency->max_us = latency_us;
+   }
+   latency->samples++;
+   return;
+}
+
+
+/*
+* Name: rtt_latency_percentile_us
+*
+* Description: Latency below which a share of the samples fall, to the
+*              bucket resolution
+*
+* Inputs: latency - histogram
+*         percentile - 0 to 100
+*
+* Returns: Upper edge of the bucket in microseconds, 0 without samples
+*
+*/
+double rtt_latency_percentile_us( const rtt_latency *latency, double percentile )
+{
+   return( histogram_percentile_us( latency->histogram, latency->samples, percentile ) );
+}
+
+
+/*
+* Name: rtt_latency_summary
+*
+* Description: Format latency percentiles in milliseconds
+*
+* Inputs: latency - histogram
+*         size - size of text
+*
+* Outputs: text - summary
+*
+* Returns: None
+*
+*/
+void rtt_latency_summary( const rtt_latency *latency, char *text, size_t size )
+{
+   snprintf(
+      text,
+      size,
+      "%lu samples, ms p50 %.3f p99 %.3f p99.9 %.3f max %.3f",
+      latency->samples,
+      latency_percentile_ms( latency, 50.0 ),
+      latency_percentile_ms( latency, 99.0 ),
+      latency_percentile_ms( latency, 99.9 ),
+      latency->max_us / USEC_PER_MS
+      );
+   return;
+}
+
+
+/*
+* Name: latency_percentile_ms
+*
+* Description: Percentile for the summary, the bucket edge is capped at
+*              the largest latency seen
+*
+* Inputs: latency - histogram
+*         percentile - 0 to 100
+*
+* Returns: Milliseconds
+*
+*/
+static double latency_percentile_ms( const rtt_latency *latency, double percentile )
+{
+   double latency_us = rtt_latency_percentile_us( latency, percentile );
+
+   if ( latency_us > latency->max_us )
+   {
+      latency_us = (double) latency->max_us;
+   }
+   return( latency_us / USEC_PER_MS );
+}
+
+
+/*
+* Name: histogram_percentile_us
+*
+* Description: Value below which a share of the samples of a histogram
+*              fall
+*
+* Inputs: histogram - RTT_BUCKETS counts
+*         samples - sum of the counts
+*         percentile - 0 to 100
+*
+* Returns: Upper edge of the bucket in microseconds, 0 without samples
+*
+*/
+static double histogram_percentile_us(
+   const unsigned long *histogram,
+   unsigned long samples,
+   double percentile
+   )
+{
+   unsigned long rank;
+   unsigned long seen = 0;
+   unsigned int i;
+
+   if ( 0 == samples )
+   {
+      return( 0 );
+   }
+
+   rank = (unsigned long) ( samples * percentile / 100.0 );
+   if ( rank >= samples )
+   {
+      rank = samples - 1;
+   }
+
+   for ( i = 0; i < RTT_BUCKETS - 1; i++ )
+   {
+      seen += histogram[ i ];
+      if ( seen > rank )
+      {
+         break;
+      }
+   }
+   return( (double) rtt_bucket_limit_us( i ) );
+}
+
+
+/*
+* Name: rtt_bucket
+*
+* Description: Histogram bucket of an RTT, the octave above
+*              RTT_BUCKET_BASE_US and the next two bits
+*
+* Inputs: rtt_us - RTT
+*
+* Returns: Bucket index
+*
+*/
+static unsigned int rtt_bucket( uint64_t rtt_us )
+{
+   unsigned int octave;
+   unsigned int sub;
+
+   if ( rtt_us < RTT_BUCKET_BASE_US )
+   {
+      return( 0 );
+   }
+
+   // RTT_BUCKET_BASE_US is 2^4, the two bits below the top one pick
+   // one of RTT_SUB_BUCKETS
+   octave = ( 63 - __builtin_clzll( rtt_us ) ) - 4;
+   if ( octave >= RTT_OCTAVES )
+   {
+      return( RTT_BUCKETS - 1 );
+   }
+   sub = (unsigned int) ( rtt_us >> ( octave + 2 ) ) & ( RTT_SUB_BUCKETS - 1 );
+   return( 1 + octave * RTT_SUB_BUCKETS + sub );
+}
+
+
+/*
+* Name: rtt_bucket_limit_us
+*
+* Description: Upper edge of a histogram bucket
+*
+* Inputs: bucket - bucket index
+*
+* Returns: Microseconds
+*
+*/
+static uint64_t rtt_bucket_limit_us( unsigned int bucket )
+{
+   unsigned int octave;
+   unsigned int sub;
+
+   if ( 0 == bucket )
+   {
+      return( RTT_BUCKET_BASE_US );
+   }
+   octave = ( bucket - 1 ) / RTT_SUB_BUCKETS;
+   sub = ( bucket - 1 ) % RTT_SUB_BUCKETS;
+   return( (uint64_t) ( RTT_SUB_BUCKETS + sub + 1 ) << ( octave + 2 ) );
+}
@@ -0,0 +1,99 @@
+/*
+* File: rtt_estimator.h
+*
+* Description: Request timeout and hedge delay from observed round
+*              trip times.
+*
+*              The smoothed RTT and its variance follow RFC 6298, the
+*              timeout is srtt + 4 * rttvar between RTT_MIN_TIMEOUT_US
+*              and P2*, doubled for every timeout in a row.  Answers
+*              that could belong to more than one request, after a
+*              hedge or a response pending, are not sampled (Karn).
+*
+*              The hedge delay is a high percentile of recent RTTs,
+*              read from a histogram with RTT_SUB_BUCKETS buckets per
+*              octave.  Past RTT_HISTORY samples the counts are halved,
+*              so the percentile follows the current link.  Hedges are
+*              limited to RTT_HEDGE_BUDGET_PERCENT of the requests so a
+*              stalled vehicle does not double the bus load.
+*
+*              A latency histogram with the same buckets, without
+*              aging, gives the percentiles of a whole run.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   RFC 6298, Computing TCP's Retransmission Timer
+*   Dean and Barroso, The Tail at Scale (CACM 2013)
+*
+*/
+
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+// Includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define RTT_INITIAL_TIMEOUT_US      50000    // P2 until the first sample
+#define RTT_MIN_TIMEOUT_US          10000
+#define RTT_MAX_TIMEOUT_US        5000000    // P2*
+#define RTT_MAX_BACKOFF                 6
+
+#define RTT_HEDGE_PERCENTILE         95.0
+#define RTT_HEDGE_MIN_SAMPLES          20
+#define RTT_MIN_HEDGE_US             1000
+#define RTT_HEDGE_BUDGET_PERCENT        5
+#define RTT_HEDGE_BURST                10
+
+// Buckets from RTT_BUCKET_BASE_US up, about 19% wide, the first one
+// holds everything faster
+#define RTT_BUCKET_BASE_US             16
+#define RTT_SUB_BUCKETS                 4
+#define RTT_OCTAVES                    18
+#define RTT_BUCKETS          ( 1 + RTT_OCTAVES * RTT_SUB_BUCKETS )
+#define RTT_HISTORY                  1024
+
+typedef struct rtt_estimator
+{
+   bool          have_sample;
+   double        srtt_us;
+   double        rttvar_us;
+   unsigned int  backoff;            // timeouts in a row
+   uint64_t      ambiguous_until_us; // a late duplicate answer may come
+   unsigned long history;
+   unsigned long histogram[ RTT_BUCKETS ];
+   unsigned long answers;
+   unsigned long samples;
+   unsigned long timeouts;
+   unsigned long hedges;
+} rtt_estimator;
+
+typedef struct rtt_latency
+{
+   unsigned long samples;
+   uint64_t      max_us;
+   unsigned long histogram[ RTT_BUCKETS ];
+} rtt_latency;
+
+void rtt_init( rtt_estimator *rtt );
+void rtt_answered( rtt_estimator *rtt, uint64_t rtt_us, bool ambiguous );
+void rtt_expired( rtt_estimator *rtt );
+void rtt_hedged( rtt_estimator *rtt );
+uint64_t rtt_timeout_us( const rtt_estimator *rtt );
+uint64_t rtt_hedge_us( const rtt_estimator *rtt );
+double rtt_percentile_us( const rtt_estimator *rtt, double percentile );
+void rtt_summary( const rtt_estimator *rtt, char *text, size_t size );
+
+void rtt_latency_reset( rtt_latency *latency );
+void rtt_latency_add( rtt_latency *latency, uint64_t latency_us );
+double rtt_latency_percentile_us( const rtt_latency *latency, double percentile );
+void rtt_latency_summary( const rtt_latency *latency, char *text, size_t size );
+
+#endif // RTT_ESTIMATOR_H
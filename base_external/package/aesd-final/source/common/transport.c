@@ -0,0 +1,2258 @@
+/*
+* File: transport.c
+*
+* Description: Message transport between the scan tool and the vehicle.
+*              See transport.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*   man 2 futex, man 7 shm_overview
+*   https://www.kernel.org/doc/Documentation/circular-buffers.txt
+*   man 7 unix, man 2 recvmmsg, man 2 sendmmsg
+*   Bosch CAN Specification 2.0
+*   https://www.kernel.org/doc/html/latest/networking/can.html
+*
+*/
+
+// Includes
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "transport.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define MS_PER_SEC      1000
+#define NS_PER_MS       1000000
+#define NS_PER_SEC      1000000000ULL
+
+// Kernel receive timestamp and receive queue overflow count of a frame
+#define CAN_CONTROL_SIZE  ( CMSG_SPACE( sizeof( struct timespec ) ) + CMSG_SPACE( sizeof( uint32_t ) ) )
+
+// Polls of an empty ring before sleeping, only worth it with a second core
+#define SHM_SPIN_COUNT  2000
+// Longest a CAN send waits for room in the interface queue, a bus-off
+// or down interface never drains it
+#define CAN_SEND_RETRY_MS  100
+// Longest a non-blocking send waits to finish a message the socket
+// took in part, the stream is out of step otherwise
+#define TCP_FINISH_MS  100
+// Yields of a full ring between checks that the consumer still runs
+#define SHM_LIVENESS_YIELDS  1000
+
+// File data and functions
+static int tcp_send( transport *link, const void *message, size_t length );
+static int tcp_receive( transport *link, void *message, size_t length, int timeout_ms );
+static int tcp_send_batch( transport *link, const void *messages, size_t length, unsigned int count );
+static int tcp_try_send_batch( transport *link, const void *messages, size_t length, unsigned int count );
+static int tcp_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms );
+static void tcp_close( transport *link );
+
+static int unix_send( transport *link, const void *message, size_t length );
+static int unix_receive( transport *link, void *message, size_t length, int timeout_ms );
+static int unix_send_batch( transport *link, const void *messages, size_t length, unsigned int count );
+static int unix_try_send_batch( transport *link, const void *messages, size_t length, unsigned int count );
+static int unix_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms );
+static int wait_readable( int fd, int timeout_ms );
+static uint64_t monotonic_ms( void );
+
+static int can_send( transport *link, const void *message, size_t length );
+static int can_receive( transport *link, void *message, size_t length, int timeout_ms );
+static int can_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms );
+static int can_read_frames(
+   transport *link,
+   void *messages,
+   size_t length,
+   unsigned int count,
+   int timeout_ms,
+   int *first_length
+   );
+
+static int shm_send( transport *link, const void *message, size_t length );
+static int shm_receive( transport *link, void *message, size_t length, int timeout_ms );
+static void shm_close( transport *link );
+static int shm_map( transport *link, int flags );
+static void shm_reset( shm_channel *channel );
+static bool shm_peer_gone( transport *link );
+static int vbus_link_send( transport *link, const void *message, size_t length );
+static int vbus_link_receive( transport *link, void *message, size_t length, int timeout_ms );
+static int vbus_link_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms );
+static size_t vbus_link_message( transport *link, unsigned int index, const vbus_frame *frame, void *message, size_t length );
+static void vbus_link_close( transport *link );
+
+static int futex_wait( _Atomic uint32_t *address, uint32_t value, int timeout_ms );
+static void futex_wake( _Atomic uint32_t *address );
+
+static const transport_ops tcp_ops =
+{
+   tcp_send,
+   tcp_receive,
+   tcp_send_batch,
+   tcp_receive_batch,
+   tcp_try_send_batch,
+   tcp_close
+};
+
+static const transport_ops shm_ops =
+{
+   shm_send,
+   shm_receive,
+   NULL,
+   NULL,
+   NULL,
+   shm_close
+};
+
+static const transport_ops unix_ops =
+{
+   unix_send,
+   unix_receive,
+   unix_send_batch,
+   unix_receive_batch,
+   unix_try_send_batch,
+   tcp_close
+};
+
+static const transport_ops can_ops =
+{
+   can_send,
+   can_receive,
+   NULL,
+   can_receive_batch,
+   NULL,
+   tcp_close
+};
+
+static const transport_ops vbus_ops =
+{
+   vbus_link_send,
+   vbus_link_receive,
+   NULL,
+   vbus_link_receive_batch,
+   NULL,
+   vbus_link_close
+};
+
+
+/*
+* Name: transport_parse
+*
+* Description: Convert a transport name to its type
+*
+* Inputs: name - "tcp", "shm", "unix", "vbus" or "can"
+*
+* Returns: Transport type, -1 if unknown
+*
+*/
+int transport_parse( const char *name )
+{
+   int type = -1;
+
+   if ( name != NULL )
+   {
+      if ( 0 == strcmp( name, "tcp" ) )
+      {
+         type = TRANSPORT_TCP;
+      }
+      else if ( 0 == strcmp( name, "shm" ) )
+      {
+         type = TRANSPORT_SHM;
+      }
+      else if ( 0 == strcmp( name, "unix" ) )
+      {
+         type = TRANSPORT_UNIX;
+      }
+      else if ( 0 == strcmp( name, "vbus" ) )
+      {
+         type = TRANSPORT_VBUS;
+      }
+      else if ( 0 == strcmp( name, "can" ) )
+      {
+         type = TRANSPORT_CAN;
+      }
+   }
+   return( type );
+}
+
+
+/*
+* Name: transport_tcp_init
+*
+* Description: Wrap a connected TCP socket
+*
+* Inputs: link - transport to initialize
+*         socket_fd - connected socket, owned by the transport
+*
+* Returns: None
+*
+*/
+void transport_tcp_init( transport *link, int socket_fd )
+{
+   memset( link, 0, sizeof( transport ) );
+   link->ops = &tcp_ops;
+   link->type = TRANSPORT_TCP;
+   link->fd = socket_fd;
+   return;
+}
+
+
+/*
+* Name: transport_tcp_connect
+*
+* Description: Connect to the vehicle's TCP port on this host
+*
+* Inputs: link - transport to initialize
+*         port - port number as a string
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_tcp_connect( transport *link, const char *port )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   struct addrinfo select_address = { 0 };
+   struct addrinfo *socket_address = NULL;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   temp_socket_fd = socket( AF_INET, SOCK_STREAM, 0 );
+   if ( temp_socket_fd != -1 )
+   {
+      select_address.ai_family   = AF_INET;
+      select_address.ai_socktype = SOCK_STREAM;
+      select_address.ai_flags    = AI_PASSIVE;
+
+      if (   ( 0 == getaddrinfo( NULL, port, &select_address, &socket_address ) )
+          && ( 0 == connect( temp_socket_fd, socket_address->ai_addr, socket_address->ai_addrlen ) )
+         )
+      {
+         fcntl( temp_socket_fd, F_SETFL, O_NONBLOCK );
+         transport_tcp_init( link, temp_socket_fd );
+         return_status = EXIT_SUCCESS;
+      }
+
+      if ( socket_address != NULL )
+      {
+         freeaddrinfo( socket_address );
+      }
+
+      if ( return_status != EXIT_SUCCESS )
+      {
+         close( temp_socket_fd );
+      }
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_unix_init
+*
+* Description: Wrap a connected unix SOCK_SEQPACKET socket
+*
+* Inputs: link - transport to initialize
+*         socket_fd - connected socket, owned by the transport
+*
+* Returns: None
+*
+*/
+void transport_unix_init( transport *link, int socket_fd )
+{
+   memset( link, 0, sizeof( transport ) );
+   link->ops = &unix_ops;
+   link->type = TRANSPORT_UNIX;
+   link->fd = socket_fd;
+   return;
+}
+
+
+/*
+* Name: transport_unix_listen
+*
+* Description: Create a unix SOCK_SEQPACKET listening socket
+*
+* Inputs: path - socket path, UNIX_SOCKET_PATH for the vehicle
+*
+* Outputs: socket_fd - listening socket
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_unix_listen( int *socket_fd, const char *path )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   struct sockaddr_un address = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   address.sun_family = AF_UNIX;
+   strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+
+   temp_socket_fd = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+   if ( temp_socket_fd != -1 )
+   {
+      // Remove a socket left behind by a crashed server
+      unlink( path );
+
+      if (   ( 0 == bind( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+          && ( 0 == listen( temp_socket_fd, UNIX_LISTEN_BACKLOG ) )
+         )
+      {
+         fcntl( temp_socket_fd, F_SETFL, O_NONBLOCK );
+         *socket_fd = temp_socket_fd;
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         close( temp_socket_fd );
+      }
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_unix_connect
+*
+* Description: Connect to a unix SOCK_SEQPACKET socket
+*
+* Inputs: link - transport to initialize
+*         path - socket path, UNIX_SOCKET_PATH for the vehicle
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_unix_connect( transport *link, const char *path )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   struct sockaddr_un address = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   address.sun_family = AF_UNIX;
+   strncpy( address.sun_path, path, sizeof( address.sun_path ) - 1 );
+
+   temp_socket_fd = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+   if ( temp_socket_fd != -1 )
+   {
+      if ( 0 == connect( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+      {
+         fcntl( temp_socket_fd, F_SETFL, O_NONBLOCK );
+         transport_unix_init( link, temp_socket_fd );
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         close( temp_socket_fd );
+      }
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_shm_create
+*
+* Description: Create the shared memory segment (vehicle side).
+*              The vehicle consumes the request ring and produces the
+*              response ring.
+*
+* Inputs: link - transport to initialize
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_shm_create( transport *link )
+{
+   int return_status;
+
+   memset( link, 0, sizeof( transport ) );
+   link->owner = true;
+
+   // Remove a segment left behind by a crashed vehicle
+   shm_unlink( SHM_NAME );
+
+   return_status = shm_map( link, O_RDWR | O_CREAT | O_EXCL );
+   if ( EXIT_SUCCESS == return_status )
+   {
+      memset( link->channel, 0, sizeof( shm_channel ) );
+      link->channel->magic = SHM_MAGIC;
+      atomic_store( &link->channel->vehicle_pid, (int32_t) getpid() );
+      link->rx_ring = &link->channel->request;
+      link->tx_ring = &link->channel->response;
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_shm_attach
+*
+* Description: Attach to the vehicle shared memory segment (scan tool
+*              side).  Only one scan tool can be attached at a time.  A
+*              scan tool that died while attached is marked closed so
+*              the vehicle resets the channel, then the attach is tried
+*              again.
+*
+* Inputs: link - transport to initialize
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_shm_attach( transport *link )
+{
+   int return_status;
+   uint32_t detached = 0;
+   bool attached = false;
+
+   memset( link, 0, sizeof( transport ) );
+
+   return_status = shm_map( link, O_RDWR );
+   if ( EXIT_SUCCESS == return_status )
+   {
+      if ( SHM_MAGIC == link->channel->magic )
+      {
+         attached = atomic_compare_exchange_strong( &link->channel->attached, &detached, 1 );
+         if ( !attached && shm_peer_gone( link ) )
+         {
+            syslog( LOG_INFO, "%s: Previous scan tool is gone, waiting for the reset", __func__ );
+            atomic_store( &link->channel->closed, 1 );
+            futex_wake( &link->channel->request.head );
+            futex_wait( &link->channel->attached, 1, SHM_TAKEOVER_MS );
+            detached = 0;
+            attached = atomic_compare_exchange_strong( &link->channel->attached, &detached, 1 );
+         }
+      }
+
+      if ( !attached )
+      {
+         syslog( LOG_ERR, "%s: Vehicle busy or not ready", __func__ );
+         munmap( link->channel, sizeof( shm_channel ) );
+         link->channel = NULL;
+         return_status = EXIT_FAILURE;
+      }
+      else
+      {
+         atomic_store( &link->channel->scan_tool_pid, (int32_t) getpid() );
+         link->rx_ring = &link->channel->response;
+         link->tx_ring = &link->channel->request;
+         futex_wake( &link->channel->attached );
+      }
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_shm_wait
+*
+* Description: Wait for a scan tool to attach (vehicle side).  A
+*              previous session that has closed is cleared first.
+*
+* Inputs: link - vehicle shared memory transport
+*         timeout_ms - maximum wait
+*
+* Returns: EXIT_SUCCESS - scan tool attached
+*          EXIT_FAILURE - timed out
+*
+*/
+int transport_shm_wait( transport *link, int timeout_ms )
+{
+   shm_channel *channel = link->channel;
+
+   if ( atomic_load( &channel->closed ) )
+   {
+      shm_reset( channel );
+   }
+
+   if ( 0 == atomic_load( &channel->attached ) )
+   {
+      futex_wait( &channel->attached, 0, timeout_ms );
+   }
+
+   return( atomic_load( &channel->attached ) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+
+/*
+* Name: transport_vbus_create
+*
+* Description: Create a virtual CAN bus, start its engine and join it
+*              as the first node (vehicle side)
+*
+* Inputs: link - transport to initialize
+*         name - shared memory name, VBUS_NAME for the vehicle, NULL
+*                for a bus whose nodes all run in this process
+*         config - bus bitrate, error rate and background traffic
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_vbus_create( transport *link, const char *name, const vbus_config *config )
+{
+   memset( link, 0, sizeof( transport ) );
+
+   if ( EXIT_SUCCESS != vbus_create( &link->bus, name, config ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( EXIT_SUCCESS != vbus_join( link->bus, &link->node ) )
+   {
+      vbus_destroy( link->bus );
+      link->bus = NULL;
+      return( EXIT_FAILURE );
+   }
+
+   link->ops = &vbus_ops;
+   link->type = TRANSPORT_VBUS;
+   link->owner = true;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: transport_vbus_attach
+*
+* Description: Join a virtual CAN bus created by another process (scan
+*              tool side)
+*
+* Inputs: link - transport to initialize
+*         name - shared memory name of the bus
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_vbus_attach( transport *link, const char *name )
+{
+   memset( link, 0, sizeof( transport ) );
+
+   if ( EXIT_SUCCESS != vbus_attach( &link->bus, name ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( EXIT_SUCCESS != vbus_join( link->bus, &link->node ) )
+   {
+      vbus_detach( link->bus );
+      link->bus = NULL;
+      return( EXIT_FAILURE );
+   }
+
+   link->ops = &vbus_ops;
+   link->type = TRANSPORT_VBUS;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: transport_vbus_join
+*
+* Description: Add another node of this process to a bus, sharing the
+*              mapping of an open bus transport
+*
+* Inputs: link - transport to initialize
+*         bus_link - open vbus transport, must stay open while link is
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_vbus_join( transport *link, const transport *bus_link )
+{
+   memset( link, 0, sizeof( transport ) );
+
+   if ( ( NULL == bus_link->bus ) || ( EXIT_SUCCESS != vbus_join( bus_link->bus, &link->node ) ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   link->ops = &vbus_ops;
+   link->type = TRANSPORT_VBUS;
+   link->bus = bus_link->bus;
+   link->joined = true;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: transport_can_open
+*
+* Description: Open a SocketCAN raw socket on a CAN interface.  Frames
+*              carry the kernel receive time, see rx_timestamp_ns, and
+*              frames lost to a full socket queue are counted in
+*              rx_dropped.
+*
+* Inputs: link - transport to initialize
+*         ifname - CAN interface, CAN_INTERFACE for the board
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_can_open( transport *link, const char *ifname )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   struct sockaddr_can address = { 0 };
+   int enable = 1;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   address.can_family = AF_CAN;
+   address.can_ifindex = (int) if_nametoindex( ifname );
+   if ( 0 == address.can_ifindex )
+   {
+      syslog( LOG_ERR, "%s: No CAN interface %s", __func__, ifname );
+      return( EXIT_FAILURE );
+   }
+
+   temp_socket_fd = socket( PF_CAN, SOCK_RAW, CAN_RAW );
+   if ( temp_socket_fd != -1 )
+   {
+      if (   ( 0 == setsockopt( temp_socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof( enable ) ) )
+          && ( 0 == setsockopt( temp_socket_fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof( enable ) ) )
+          && ( 0 == bind( temp_socket_fd, (struct sockaddr *) &address, sizeof( address ) ) )
+         )
+      {
+         fcntl( temp_socket_fd, F_SETFL, O_NONBLOCK );
+         memset( link, 0, sizeof( transport ) );
+         link->ops = &can_ops;
+         link->type = TRANSPORT_CAN;
+         link->fd = temp_socket_fd;
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         close( temp_socket_fd );
+      }
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: transport_can_filter
+*
+* Description: Only receive frames whose identifier matches can_id in
+*              the bits set in mask, the kernel drops the rest
+*
+* Inputs: link - open can transport
+*         can_id - identifier to receive
+*         mask - identifier bits to compare
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_can_filter( transport *link, uint32_t can_id, uint32_t mask )
+{
+   struct can_filter filter;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   filter.can_id = can_id;
+   filter.can_mask = mask;
+   if ( -1 == setsockopt( link->fd, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof( filter ) ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: transport_enable_fd
+*
+* Description: Allow CAN FD frames on a can or vbus transport.  A can
+*              transport then also receives CAN FD frames, a vbus
+*              transport needs a bus with a data bitrate.
+*
+* Inputs: link - open can or vbus transport
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - interface or bus without CAN FD
+*
+*/
+int transport_enable_fd( transport *link )
+{
+   int enable = 1;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( TRANSPORT_VBUS == link->type )
+   {
+      link->fd_capable = ( link->bus->config.data_bitrate > 0 );
+   }
+   else if ( TRANSPORT_CAN == link->type )
+   {
+      if ( -1 == setsockopt( link->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof( enable ) ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( EXIT_FAILURE );
+      }
+      link->fd_capable = true;
+   }
+
+   return( link->fd_capable ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+
+/*
+* Name: transport_send
+*
+* Description: Send one message
+*
+* Inputs: link - open transport
+*         message - message to send
+*         length - message length
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_send( transport *link, const void *message, size_t length )
+{
+   if ( ( link == NULL ) || ( link->ops == NULL ) || ( message == NULL ) )
+   {
+      return( EXIT_FAILURE );
+   }
+   return( link->ops->send( link, message, length ) );
+}
+
+
+/*
+* Name: transport_receive
+*
+* Description: Receive one message
+*
+* Inputs: link - open transport
+*         length - expected message length
+*         timeout_ms - maximum wait, TRANSPORT_WAIT_FOREVER to block
+*
+* Outputs: message - received message
+*
+* Returns: Message length
+*          TRANSPORT_TIMEOUT - nothing received in time
+*          TRANSPORT_CLOSED - peer closed the transport
+*          TRANSPORT_ERROR - transport failed
+*
+*/
+int transport_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   if ( ( link == NULL ) || ( link->ops == NULL ) || ( message == NULL ) )
+   {
+      return( TRANSPORT_ERROR );
+   }
+   return( link->ops->receive( link, message, length, timeout_ms ) );
+}
+
+
+/*
+* Name: transport_send_batch
+*
+* Description: Send several messages with as few system calls as the
+*              transport allows
+*
+* Inputs: link - open transport
+*         messages - array of messages
+*         length - length of each message
+*         count - number of messages
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int transport_send_batch(
+   transport *link,
+   const void *messages,
+   size_t length,
+   unsigned int count
+   )
+{
+   const uint8_t *next = messages;
+   unsigned int i;
+
+   if ( ( link == NULL ) || ( link->ops == NULL ) || ( messages == NULL ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( link->ops->send_batch != NULL )
+   {
+      return( link->ops->send_batch( link, messages, length, count ) );
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      if ( EXIT_SUCCESS != link->ops->send( link, next, length ) )
+      {
+         return( EXIT_FAILURE );
+      }
+      next += length;
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: transport_try_send_batch
+*
+* Description: Send what the transport takes without waiting, for a
+*              server that must not block on one slow peer.
+*              Transports without a non-blocking send send the whole
+*              batch.
+*
+* Inputs: link - open transport
+*         messages - array of messages
+*         length - length of each message
+*         count - number of messages
+*
+* Returns: Number of messages sent, 0 when the peer is not reading
+*          TRANSPORT_CLOSED - peer closed the transport
+*          TRANSPORT_ERROR - transport failed
+*
+*/
+int transport_try_send_batch(
+   transport *link,
+   const void *messages,
+   size_t length,
+   unsigned int count
+   )
+{
+   if ( ( link == NULL ) || ( link->ops == NULL ) || ( messages == NULL ) )
+   {
+      return( TRANSPORT_ERROR );
+   }
+
+   if ( link->ops->try_send_batch != NULL )
+   {
+      return( link->ops->try_send_batch( link, messages, length, count ) );
+   }
+
+   if ( EXIT_SUCCESS != transport_send_batch( link, messages, length, count ) )
+   {
+      return( TRANSPORT_ERROR );
+   }
+   return( (int) count );
+}
+
+
+/*
+* Name: transport_receive_batch
+*
+* Description: Wait for at least one message, then take every message
+*              already queued, up to count
+*
+* Inputs: link - open transport
+*         length - length of each message
+*         count - size of the messages array
+*         timeout_ms - maximum wait for the first message
+*
+* Outputs: messages - received messages
+*
+* Returns: Number of messages received
+*          TRANSPORT_TIMEOUT - nothing received in time
+*          TRANSPORT_CLOSED - peer closed the transport
+*          TRANSPORT_ERROR - transport failed
+*
+*/
+int transport_receive_batch(
+   transport *link,
+   void *messages,
+   size_t length,
+   unsigned int count,
+   int timeout_ms
+   )
+{
+   uint8_t *next = messages;
+   unsigned int received;
+   int rx_bytes;
+
+   if ( ( link == NULL ) || ( link->ops == NULL ) || ( messages == NULL ) || ( 0 == count ) )
+   {
+      return( TRANSPORT_ERROR );
+   }
+
+   if ( link->ops->receive_batch != NULL )
+   {
+      return( link->ops->receive_batch( link, messages, length, count, timeout_ms ) );
+   }
+
+   rx_bytes = link->ops->receive( link, next, length, timeout_ms );
+   if ( rx_bytes <= 0 )
+   {
+      return( rx_bytes );
+   }
+
+   for ( received = 1; received < count; received++ )
+   {
+      next += length;
+      if ( link->ops->receive( link, next, length, 0 ) <= 0 )
+      {
+         break;
+      }
+   }
+   return( (int) received );
+}
+
+
+/*
+* Name: transport_close
+*
+* Description: Close a transport
+*
+* Inputs: link - open transport
+*
+* Returns: None
+*
+*/
+void transport_close( transport *link )
+{
+   if ( ( link != NULL ) && ( link->ops != NULL ) )
+   {
+      link->ops->close( link );
+      link->ops = NULL;
+   }
+   return;
+}
+
+
+/*
+* Name: tcp_send
+*
+* Description: Send a whole message on a TCP socket
+*
+*/
+int tcp_send( transport *link, const void *message, size_t length )
+{
+   const uint8_t *next = message;
+   ssize_t tx_bytes;
+   struct pollfd socket_poll = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   socket_poll.fd = link->fd;
+   socket_poll.events = POLLOUT;
+
+   while ( length )
+   {
+      tx_bytes = send( link->fd, next, length, MSG_NOSIGNAL );
+      if ( -1 == tx_bytes )
+      {
+         if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) )
+         {
+            poll( &socket_poll, 1, -1 );
+            continue;
+         }
+         if ( EINTR == errno )
+         {
+            continue;
+         }
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( EXIT_FAILURE );
+      }
+      next += tx_bytes;
+      length -= tx_bytes;
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: tcp_receive
+*
+* Description: Receive exactly one message from a TCP socket.  The
+*              stream carries fixed size messages.  Bytes of a message
+*              that is not complete when the wait ends are kept in the
+*              link and the message is finished by a later call, so a
+*              slow or stalled peer never holds up the caller beyond
+*              timeout_ms.
+*
+*/
+int tcp_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   uint8_t *bytes = message;
+   size_t have = link->rx_partial_length;
+   ssize_t rx_bytes;
+   int status;
+   int wait_ms = timeout_ms;
+   uint64_t deadline_ms = 0;
+   uint64_t now_ms;
+   struct pollfd socket_poll = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( length > sizeof( link->rx_partial ) )
+   {
+      syslog( LOG_ERR, "%s: Message of %zu bytes is too long", __func__, length );
+      return( TRANSPORT_ERROR );
+   }
+
+   socket_poll.fd = link->fd;
+   socket_poll.events = POLLIN;
+   if ( timeout_ms > 0 )
+   {
+      deadline_ms = monotonic_ms() + (uint64_t) timeout_ms;
+   }
+
+   memcpy( bytes, link->rx_partial, have );
+   while ( have < length )
+   {
+      rx_bytes = recv( link->fd, bytes + have, length - have, MSG_DONTWAIT );
+      if ( 0 == rx_bytes )
+      {
+         link->rx_partial_length = 0;
+         return( TRANSPORT_CLOSED );
+      }
+      if ( rx_bytes > 0 )
+      {
+         have += (size_t) rx_bytes;
+         continue;
+      }
+      if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) && ( errno != EINTR ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         link->rx_partial_length = 0;
+         return( TRANSPORT_ERROR );
+      }
+
+      // Nothing queued, wait for the rest of the time
+      if ( 0 == timeout_ms )
+      {
+         break;
+      }
+      if ( timeout_ms > 0 )
+      {
+         now_ms = monotonic_ms();
+         if ( now_ms >= deadline_ms )
+         {
+            break;
+         }
+         wait_ms = (int) ( deadline_ms - now_ms );
+      }
+      status = poll( &socket_poll, 1, wait_ms );
+      if ( status <= 0 )
+      {
+         // Timed out or interrupted, the bytes are kept
+         break;
+      }
+   }
+
+   if ( have < length )
+   {
+      memcpy( link->rx_partial, bytes, have );
+      link->rx_partial_length = have;
+      return( TRANSPORT_TIMEOUT );
+   }
+   link->rx_partial_length = 0;
+   return( (int) length );
+}
+
+
+/*
+* Name: tcp_send_batch
+*
+* Description: Send consecutive messages as one stream write
+*
+*/
+int tcp_send_batch( transport *link, const void *messages, size_t length, unsigned int count )
+{
+   return( tcp_send( link, messages, length * count ) );
+}
+
+
+/*
+* Name: tcp_try_send_batch
+*
+* Description: Send the whole messages the socket takes without
+*              waiting.  A message the socket took in part is finished
+*              within TCP_FINISH_MS, the link fails otherwise.
+*
+*/
+int tcp_try_send_batch( transport *link, const void *messages, size_t length, unsigned int count )
+{
+   const uint8_t *next = messages;
+   ssize_t tx_bytes;
+   size_t rest;
+   uint64_t deadline_ms;
+   struct pollfd socket_poll = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   do
+   {
+      tx_bytes = send( link->fd, next, length * count, MSG_NOSIGNAL | MSG_DONTWAIT );
+   } while ( ( -1 == tx_bytes ) && ( EINTR == errno ) );
+
+   if ( -1 == tx_bytes )
+   {
+      if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) )
+      {
+         return( 0 );
+      }
+      tx_bytes = ( ( EPIPE == errno ) || ( ECONNRESET == errno ) ) ? TRANSPORT_CLOSED : TRANSPORT_ERROR;
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( (int) tx_bytes );
+   }
+
+   rest = ( length - (size_t) tx_bytes % length ) % length;
+   next += tx_bytes;
+   socket_poll.fd = link->fd;
+   socket_poll.events = POLLOUT;
+   deadline_ms = monotonic_ms() + TCP_FINISH_MS;
+   while ( rest > 0 )
+   {
+      tx_bytes = send( link->fd, next, rest, MSG_NOSIGNAL | MSG_DONTWAIT );
+      if ( tx_bytes > 0 )
+      {
+         next += tx_bytes;
+         rest -= (size_t) tx_bytes;
+      }
+      else if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) || ( EINTR == errno ) )
+      {
+         if ( ( monotonic_ms() >= deadline_ms ) || ( poll( &socket_poll, 1, TCP_FINISH_MS ) <= 0 ) )
+         {
+            syslog( LOG_ERR, "%s: Message cut, peer is not reading", __func__ );
+            return( TRANSPORT_ERROR );
+         }
+      }
+      else
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( TRANSPORT_ERROR );
+      }
+   }
+   return( (int) ( ( next - (const uint8_t *) messages ) / length ) );
+}
+
+
+/*
+* Name: tcp_receive_batch
+*
+* Description: Receive one message, then every whole message already
+*              queued on the socket with a single recv().  A message cut
+*              by the end of the queued bytes is kept for the next call.
+*
+*/
+int tcp_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms )
+{
+   uint8_t *next = (uint8_t *) messages + length;
+   ssize_t rx_bytes;
+   size_t extra;
+
+   rx_bytes = tcp_receive( link, messages, length, timeout_ms );
+   if ( ( rx_bytes <= 0 ) || ( count < 2 ) )
+   {
+      return( (int) ( rx_bytes > 0 ? 1 : rx_bytes ) );
+   }
+
+   // The first message left no partial one behind
+   rx_bytes = recv( link->fd, next, length * ( count - 1 ), MSG_DONTWAIT );
+   if ( rx_bytes <= 0 )
+   {
+      // A close or error is seen by the next call
+      return( 1 );
+   }
+
+   extra = (size_t) rx_bytes / length;
+   link->rx_partial_length = (size_t) rx_bytes % length;
+   memcpy( link->rx_partial, next + extra * length, link->rx_partial_length );
+   return( (int) ( 1 + extra ) );
+}
+
+
+/*
+* Name: tcp_close
+*
+* Description: Close the TCP socket
+*
+*/
+void tcp_close( transport *link )
+{
+   if ( link->fd != -1 )
+   {
+      close( link->fd );
+      link->fd = -1;
+   }
+   return;
+}
+
+
+/*
+* Name: unix_send
+*
+* Description: Send one message on a SOCK_SEQPACKET socket
+*
+*/
+int unix_send( transport *link, const void *message, size_t length )
+{
+   ssize_t tx_bytes;
+   struct pollfd socket_poll = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   socket_poll.fd = link->fd;
+   socket_poll.events = POLLOUT;
+
+   for(;;)
+   {
+      tx_bytes = send( link->fd, message, length, MSG_NOSIGNAL );
+      if ( tx_bytes == (ssize_t) length )
+      {
+         return( EXIT_SUCCESS );
+      }
+      if ( ( -1 == tx_bytes ) && ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) ) )
+      {
+         poll( &socket_poll, 1, -1 );
+         continue;
+      }
+      if ( ( -1 == tx_bytes ) && ( EINTR == errno ) )
+      {
+         continue;
+      }
+      break;
+   }
+
+   strerror_r( errno, error, SYSLOG_BUF_SIZE );
+   syslog( LOG_ERR, "%s: %s", __func__, error );
+   return( EXIT_FAILURE );
+}
+
+
+/*
+* Name: unix_receive
+*
+* Description: Receive one message from a SOCK_SEQPACKET socket
+*
+*/
+int unix_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   int received;
+
+   received = unix_receive_batch( link, message, length, 1, timeout_ms );
+   return( ( received > 0 ) ? (int) length : received );
+}
+
+
+/*
+* Name: unix_send_batch
+*
+* Description: Send several messages with sendmmsg()
+*
+*/
+int unix_send_batch( transport *link, const void *messages, size_t length, unsigned int count )
+{
+   struct pollfd socket_poll = { 0 };
+   const uint8_t *next = messages;
+   int sent;
+
+   socket_poll.fd = link->fd;
+   socket_poll.events = POLLOUT;
+
+   while ( count > 0 )
+   {
+      sent = unix_try_send_batch( link, next, length, count );
+      if ( sent < 0 )
+      {
+         return( EXIT_FAILURE );
+      }
+      if ( 0 == sent )
+      {
+         poll( &socket_poll, 1, -1 );
+         continue;
+      }
+
+      next += (size_t) sent * length;
+      count -= (unsigned int) sent;
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: unix_try_send_batch
+*
+* Description: Send up to TRANSPORT_BATCH_SIZE messages with one
+*              sendmmsg(), stopping where the socket buffer is full
+*
+*/
+int unix_try_send_batch( transport *link, const void *messages, size_t length, unsigned int count )
+{
+   struct mmsghdr headers[ TRANSPORT_BATCH_SIZE ];
+   struct iovec vectors[ TRANSPORT_BATCH_SIZE ];
+   const uint8_t *next = messages;
+   unsigned int batch;
+   unsigned int i;
+   int sent;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   batch = ( count < TRANSPORT_BATCH_SIZE ) ? count : TRANSPORT_BATCH_SIZE;
+   memset( headers, 0, sizeof( headers[ 0 ] ) * batch );
+   for ( i = 0; i < batch; i++ )
+   {
+      vectors[ i ].iov_base = (void *) ( next + i * length );
+      vectors[ i ].iov_len = length;
+      headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+      headers[ i ].msg_hdr.msg_iovlen = 1;
+   }
+
+   do
+   {
+      sent = sendmmsg( link->fd, headers, batch, MSG_NOSIGNAL | MSG_DONTWAIT );
+   } while ( ( -1 == sent ) && ( EINTR == errno ) );
+
+   if ( -1 == sent )
+   {
+      if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) )
+      {
+         return( 0 );
+      }
+      sent = ( ( EPIPE == errno ) || ( ECONNRESET == errno ) ) ? TRANSPORT_CLOSED : TRANSPORT_ERROR;
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( sent );
+}
+
+
+/*
+* Name: unix_receive_batch
+*
+* Description: Wait for the socket, then take every queued message up
+*              to count with one recvmmsg().  Datagrams of the wrong
+*              length, truncated ones included, are counted in
+*              rx_invalid and left out, the messages after them are
+*              kept.  A closed peer reads as empty datagrams, as does a
+*              real empty datagram, so the close is taken from the
+*              socket's hang-up state once no message is left.
+*
+*/
+int unix_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms )
+{
+   struct mmsghdr headers[ TRANSPORT_BATCH_SIZE ];
+   struct iovec vectors[ TRANSPORT_BATCH_SIZE ];
+   struct pollfd socket_poll = { 0 };
+   uint8_t *next = messages;
+   unsigned int i;
+   unsigned int kept = 0;
+   bool empty = false;
+   int status;
+   int received;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   status = wait_readable( link->fd, timeout_ms );
+   if ( status <= 0 )
+   {
+      return( status );
+   }
+
+   if ( count > TRANSPORT_BATCH_SIZE )
+   {
+      count = TRANSPORT_BATCH_SIZE;
+   }
+   memset( headers, 0, sizeof( headers[ 0 ] ) * count );
+   for ( i = 0; i < count; i++ )
+   {
+      vectors[ i ].iov_base = next + i * length;
+      vectors[ i ].iov_len = length;
+      headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+      headers[ i ].msg_hdr.msg_iovlen = 1;
+   }
+
+   received = recvmmsg( link->fd, headers, count, MSG_DONTWAIT, NULL );
+   if ( received > 0 )
+   {
+      for ( i = 0; i < (unsigned int) received; i++ )
+      {
+         if ( 0 == headers[ i ].msg_len )
+         {
+            empty = true;
+            continue;
+         }
+         if (   ( headers[ i ].msg_len != length )
+             || ( headers[ i ].msg_hdr.msg_flags & MSG_TRUNC )
+            )
+         {
+            link->rx_invalid++;
+            continue;
+         }
+         if ( kept != i )
+         {
+            memmove( next + kept * length, next + i * length, length );
+         }
+         kept++;
+      }
+      if ( kept > 0 )
+      {
+         return( (int) kept );
+      }
+
+      // Only empty or invalid datagrams, closed if the peer hung up
+      socket_poll.fd = link->fd;
+      socket_poll.events = POLLRDHUP;
+      if (   empty
+          && ( 1 == poll( &socket_poll, 1, 0 ) )
+          && ( socket_poll.revents & ( POLLRDHUP | POLLHUP ) )
+         )
+      {
+         return( TRANSPORT_CLOSED );
+      }
+      return( TRANSPORT_TIMEOUT );
+   }
+
+   if ( 0 == received )
+   {
+      return( TRANSPORT_CLOSED );
+   }
+
+   if ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) || ( EINTR == errno ) )
+   {
+      return( TRANSPORT_TIMEOUT );
+   }
+
+   strerror_r( errno, error, SYSLOG_BUF_SIZE );
+   syslog( LOG_ERR, "%s: %s", __func__, error );
+   return( TRANSPORT_ERROR );
+}
+
+
+/*
+* Name: wait_readable
+*
+* Description: Wait until a socket has data or an error
+*
+* Inputs: fd - socket
+*         timeout_ms - maximum wait
+*
+* Returns: 1 - readable
+*          TRANSPORT_TIMEOUT
+*          TRANSPORT_ERROR
+*
+*/
+int wait_readable( int fd, int timeout_ms )
+{
+   int status;
+   struct pollfd socket_poll = { 0 };
+
+   socket_poll.fd = fd;
+   socket_poll.events = POLLIN;
+
+   status = poll( &socket_poll, 1, timeout_ms );
+   if ( status > 0 )
+   {
+      return( 1 );
+   }
+   if ( ( 0 == status ) || ( EINTR == errno ) )
+   {
+      return( TRANSPORT_TIMEOUT );
+   }
+   return( TRANSPORT_ERROR );
+}
+
+
+/*
+* Name: monotonic_ms
+*
+* Description: Monotonic clock in milliseconds
+*
+* Inputs: None
+*
+* Returns: Milliseconds
+*
+*/
+uint64_t monotonic_ms( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * MS_PER_SEC + (uint64_t) now.tv_nsec / NS_PER_MS );
+}
+
+
+/*
+* Name: can_send
+*
+* Description: Send a message as one CAN frame, the first 4 bytes are
+*              the identifier and the rest the data.  More than 8 data
+*              bytes, or tx_fd, send a CAN FD frame with bit rate
+*              switch.  A full interface queue is waited out.
+*
+*/
+int can_send( transport *link, const void *message, size_t length )
+{
+   struct canfd_frame frame = { 0 };
+   size_t data_length;
+   size_t frame_size = CAN_MTU;
+   ssize_t tx_bytes;
+   unsigned int retries = 0;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   data_length = length - sizeof( uint32_t );
+   if (   ( length < sizeof( uint32_t ) )
+       || ( data_length > CANFD_MAX_DLEN )
+       || ( ( data_length > CAN_MAX_DLEN ) && !link->fd_capable )
+      )
+   {
+      syslog( LOG_ERR, "%s: Message does not fit a CAN frame", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   memcpy( &frame.can_id, message, sizeof( uint32_t ) );
+   if ( frame.can_id > CAN_SFF_MASK )
+   {
+      frame.can_id = ( frame.can_id & CAN_EFF_MASK ) | CAN_EFF_FLAG;
+   }
+   frame.len = (uint8_t) data_length;
+   memcpy( frame.data, (const uint8_t *) message + sizeof( uint32_t ), data_length );
+
+   if ( link->fd_capable && ( link->tx_fd || ( data_length > CAN_MAX_DLEN ) ) )
+   {
+      // The data is zero padded to a length the DLC can code
+      frame.len = vbus_fd_length( frame.len );
+      frame.flags = CANFD_BRS;
+      frame_size = CANFD_MTU;
+   }
+
+   for(;;)
+   {
+      tx_bytes = write( link->fd, &frame, frame_size );
+      if ( tx_bytes == (ssize_t) frame_size )
+      {
+         return( EXIT_SUCCESS );
+      }
+      // The interface queue reports ENOBUFS instead of blocking
+      if (   ( -1 == tx_bytes )
+          && ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) || ( ENOBUFS == errno ) )
+          && ( retries++ < CAN_SEND_RETRY_MS )
+         )
+      {
+         poll( NULL, 0, 1 );
+         continue;
+      }
+      if ( ( -1 == tx_bytes ) && ( EINTR == errno ) )
+      {
+         continue;
+      }
+      break;
+   }
+
+   strerror_r( errno, error, SYSLOG_BUF_SIZE );
+   syslog( LOG_ERR, "%s: %s", __func__, error );
+   return( EXIT_FAILURE );
+}
+
+
+/*
+* Name: can_receive
+*
+* Description: Receive one CAN frame as a message
+*
+*/
+int can_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   int first_length = 0;
+   int received;
+
+   received = can_read_frames( link, message, length, 1, timeout_ms, &first_length );
+   return( ( received > 0 ) ? first_length : received );
+}
+
+
+/*
+* Name: can_receive_batch
+*
+* Description: Receive the queued CAN frames as messages, up to count
+*
+*/
+int can_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms )
+{
+   int first_length;
+
+   return( can_read_frames( link, messages, length, count, timeout_ms, &first_length ) );
+}
+
+
+/*
+* Name: can_read_frames
+*
+* Description: Wait for the socket, then take every queued frame up to
+*              count with one recvmmsg().  Error and remote frames are
+*              skipped.  The kernel receive time of message i is kept
+*              in rx_timestamp_ns[ i ].
+*
+* Inputs: link - open can transport
+*         length - length of each message
+*         count - size of the messages array
+*         timeout_ms - maximum wait for the first frame
+*
+* Outputs: messages - identifier and data of each frame
+*          first_length - length of the first message
+*
+* Returns: Number of messages received
+*          TRANSPORT_TIMEOUT
+*          TRANSPORT_ERROR
+*
+*/
+int can_read_frames(
+   transport *link,
+   void *messages,
+   size_t length,
+   unsigned int count,
+   int timeout_ms,
+   int *first_length
+   )
+{
+   struct canfd_frame frames[ TRANSPORT_BATCH_SIZE ];
+   struct mmsghdr headers[ TRANSPORT_BATCH_SIZE ];
+   struct iovec vectors[ TRANSPORT_BATCH_SIZE ];
+   uint8_t control[ TRANSPORT_BATCH_SIZE ][ CAN_CONTROL_SIZE ];
+   uint8_t buffer[ sizeof( uint32_t ) + CANFD_MAX_DLEN ];
+   uint8_t *next = messages;
+   uint8_t max_length;
+   struct cmsghdr *control_header;
+   struct timespec stamp;
+   uint32_t overflows;
+   uint32_t can_id;
+   size_t rx_length;
+   unsigned int kept;
+   unsigned int i;
+   int received;
+   int status;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( count > TRANSPORT_BATCH_SIZE )
+   {
+      count = TRANSPORT_BATCH_SIZE;
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      vectors[ i ].iov_base = &frames[ i ];
+      vectors[ i ].iov_len = CANFD_MTU;
+   }
+
+   for(;;)
+   {
+      // Control lengths are updated by the kernel, reset every pass
+      memset( headers, 0, sizeof( headers[ 0 ] ) * count );
+      for ( i = 0; i < count; i++ )
+      {
+         headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+         headers[ i ].msg_hdr.msg_iovlen = 1;
+         headers[ i ].msg_hdr.msg_control = control[ i ];
+         headers[ i ].msg_hdr.msg_controllen = CAN_CONTROL_SIZE;
+      }
+
+      received = recvmmsg( link->fd, headers, count, MSG_DONTWAIT, NULL );
+      if ( received > 0 )
+      {
+         kept = 0;
+         for ( i = 0; i < (unsigned int) received; i++ )
+         {
+            if (   ( ( headers[ i ].msg_len != CAN_MTU ) && ( headers[ i ].msg_len != CANFD_MTU ) )
+                || ( frames[ i ].can_id & ( CAN_ERR_FLAG | CAN_RTR_FLAG ) )
+               )
+            {
+               continue;
+            }
+            link->rx_fd[ kept ] = ( CANFD_MTU == headers[ i ].msg_len );
+
+            link->rx_timestamp_ns[ kept ] = 0;
+            for (   control_header = CMSG_FIRSTHDR( &headers[ i ].msg_hdr );
+                    control_header != NULL;
+                    control_header = CMSG_NXTHDR( &headers[ i ].msg_hdr, control_header )
+                )
+            {
+               if ( SOL_SOCKET != control_header->cmsg_level )
+               {
+                  continue;
+               }
+               if ( SCM_TIMESTAMPNS == control_header->cmsg_type )
+               {
+                  memcpy( &stamp, CMSG_DATA( control_header ), sizeof( stamp ) );
+                  link->rx_timestamp_ns[ kept ] = (uint64_t) stamp.tv_sec * NS_PER_SEC + (uint64_t) stamp.tv_nsec;
+               }
+               else if ( SO_RXQ_OVFL == control_header->cmsg_type )
+               {
+                  // The socket counts every frame it has dropped so far
+                  memcpy( &overflows, CMSG_DATA( control_header ), sizeof( overflows ) );
+                  link->rx_dropped = overflows;
+               }
+            }
+
+            can_id = frames[ i ].can_id;
+            can_id &= ( can_id & CAN_EFF_FLAG ) ? CAN_EFF_MASK : CAN_SFF_MASK;
+            max_length = link->rx_fd[ kept ] ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+            if ( frames[ i ].len > max_length )
+            {
+               frames[ i ].len = max_length;
+            }
+            memcpy( buffer, &can_id, sizeof( can_id ) );
+            memcpy( buffer + sizeof( can_id ), frames[ i ].data, frames[ i ].len );
+
+            rx_length = sizeof( can_id ) + frames[ i ].len;
+            if ( rx_length > length )
+            {
+               rx_length = length;
+            }
+            memcpy( next + kept * length, buffer, rx_length );
+            if ( 0 == kept )
+            {
+               *first_length = (int) rx_length;
+            }
+            kept++;
+         }
+
+         if ( kept > 0 )
+         {
+            return( (int) kept );
+         }
+         continue;
+      }
+
+      if ( ( -1 == received ) && ( ( EAGAIN == errno ) || ( EWOULDBLOCK == errno ) ) )
+      {
+         status = wait_readable( link->fd, timeout_ms );
+         if ( status != 1 )
+         {
+            return( status );
+         }
+         continue;
+      }
+      if ( ( -1 == received ) && ( EINTR == errno ) )
+      {
+         return( TRANSPORT_TIMEOUT );
+      }
+
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( TRANSPORT_ERROR );
+   }
+}
+
+
+/*
+* Name: shm_send
+*
+* Description: Push a message on the transmit ring.  The consumer is
+*              only woken when it has gone to sleep on an empty ring, a
+*              busy consumer costs the producer no system call.
+*
+*/
+int shm_send( transport *link, const void *message, size_t length )
+{
+   shm_ring *ring = link->tx_ring;
+   uint32_t head;
+   unsigned int yields = 0;
+   shm_slot *slot;
+
+   if ( length > SHM_MESSAGE_SIZE )
+   {
+      syslog( LOG_ERR, "%s: Message too large: %zu", __func__, length );
+      return( EXIT_FAILURE );
+   }
+
+   head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+
+   // Ring full, the consumer is behind; yield until a slot frees up
+   while ( head - atomic_load_explicit( &ring->tail, memory_order_acquire ) >= SHM_RING_SLOTS )
+   {
+      if (   atomic_load( &link->channel->closed )
+          || ( ( ++yields % SHM_LIVENESS_YIELDS ) == 0 && shm_peer_gone( link ) )
+         )
+      {
+         atomic_store( &link->channel->closed, 1 );
+         return( EXIT_FAILURE );
+      }
+      sched_yield();
+   }
+
+   slot = &ring->slots[ head % SHM_RING_SLOTS ];
+   slot->length = (uint32_t) length;
+   memcpy( slot->data, message, length );
+
+   atomic_store_explicit( &ring->head, head + 1, memory_order_seq_cst );
+   if ( atomic_load_explicit( &ring->waiting, memory_order_seq_cst ) )
+   {
+      futex_wake( &ring->head );
+   }
+
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: shm_receive
+*
+* Description: Pop a message from the receive ring.  An empty ring is
+*              polled briefly on multi-core boards, then the consumer
+*              sleeps on the ring head until the producer wakes it.
+*
+*/
+int shm_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   shm_ring *ring = link->rx_ring;
+   uint32_t tail;
+   uint32_t head;
+   unsigned int spin;
+   shm_slot *slot;
+   size_t rx_length;
+
+   tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+
+   for ( spin = 0; ; spin++ )
+   {
+      head = atomic_load_explicit( &ring->head, memory_order_acquire );
+      if ( head != tail )
+      {
+         break;
+      }
+
+      if ( atomic_load( &link->channel->closed ) )
+      {
+         return( TRANSPORT_CLOSED );
+      }
+
+      if ( ( spin >= link->spin ) || ( 0 == timeout_ms ) )
+      {
+         if ( 0 == timeout_ms )
+         {
+            return( TRANSPORT_TIMEOUT );
+         }
+
+         // Publish that we are going to sleep, then check once more so
+         // a message pushed in between is not missed
+         atomic_store_explicit( &ring->waiting, 1, memory_order_seq_cst );
+         head = atomic_load_explicit( &ring->head, memory_order_seq_cst );
+         if ( head == tail )
+         {
+            if ( -1 == futex_wait( &ring->head, head, timeout_ms ) )
+            {
+               if ( ( ETIMEDOUT == errno ) || ( EINTR == errno ) )
+               {
+                  atomic_store_explicit( &ring->waiting, 0, memory_order_relaxed );
+                  if ( shm_peer_gone( link ) )
+                  {
+                     // Died without closing, nothing more will come
+                     atomic_store( &link->channel->closed, 1 );
+                     return( TRANSPORT_CLOSED );
+                  }
+                  return( TRANSPORT_TIMEOUT );
+               }
+            }
+         }
+         atomic_store_explicit( &ring->waiting, 0, memory_order_relaxed );
+         spin = 0;
+      }
+   }
+
+   slot = &ring->slots[ tail % SHM_RING_SLOTS ];
+   rx_length = slot->length;
+   if ( rx_length > length )
+   {
+      rx_length = length;
+   }
+   memcpy( message, slot->data, rx_length );
+
+   atomic_store_explicit( &ring->tail, tail + 1, memory_order_release );
+
+   return( (int) rx_length );
+}
+
+
+/*
+* Name: shm_close
+*
+* Description: Detach from the segment and tell the peer.  The vehicle
+*              also removes the segment name.
+*
+*/
+void shm_close( transport *link )
+{
+   if ( link->channel != NULL )
+   {
+      atomic_store( &link->channel->closed, 1 );
+      futex_wake( &link->channel->request.head );
+      futex_wake( &link->channel->response.head );
+
+      munmap( link->channel, sizeof( shm_channel ) );
+      link->channel = NULL;
+
+      if ( link->owner )
+      {
+         shm_unlink( SHM_NAME );
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: shm_map
+*
+* Description: Open and map the shared memory segment
+*
+* Inputs: link - transport to initialize
+*         flags - shm_open flags
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int shm_map( transport *link, int flags )
+{
+   int return_status = EXIT_FAILURE;
+   int fd;
+   void *map;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   fd = shm_open( SHM_NAME, flags, S_IRUSR | S_IWUSR );
+   if ( fd != -1 )
+   {
+      if (   ( 0 == ( flags & O_CREAT ) )
+          || ( 0 == ftruncate( fd, sizeof( shm_channel ) ) )
+         )
+      {
+         map = mmap(
+            NULL,
+            sizeof( shm_channel ),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0
+            );
+         if ( map != MAP_FAILED )
+         {
+            link->ops = &shm_ops;
+            link->type = TRANSPORT_SHM;
+            link->fd = -1;
+            link->channel = map;
+            link->spin = ( sysconf( _SC_NPROCESSORS_ONLN ) > 1 ) ? SHM_SPIN_COUNT : 0;
+            return_status = EXIT_SUCCESS;
+         }
+      }
+      close( fd );
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: shm_reset
+*
+* Description: Empty both rings after a scan tool has detached
+*
+* Inputs: channel - mapped segment
+*
+* Returns: None
+*
+*/
+void shm_reset( shm_channel *channel )
+{
+   atomic_store( &channel->request.head, 0 );
+   atomic_store( &channel->request.tail, 0 );
+   atomic_store( &channel->request.waiting, 0 );
+   atomic_store( &channel->response.head, 0 );
+   atomic_store( &channel->response.tail, 0 );
+   atomic_store( &channel->response.waiting, 0 );
+   atomic_store( &channel->scan_tool_pid, 0 );
+   atomic_store( &channel->closed, 0 );
+   atomic_store( &channel->attached, 0 );
+   futex_wake( &channel->attached );
+   return;
+}
+
+
+/*
+* Name: shm_peer_gone
+*
+* Description: Whether the process on the other side of the channel
+*              has exited, closed or not
+*
+* Inputs: link - shared memory transport
+*
+* Returns: true - the peer process no longer exists
+*          false - it runs, or is not known yet
+*
+*/
+bool shm_peer_gone( transport *link )
+{
+   pid_t pid;
+
+   pid = link->owner
+       ? atomic_load( &link->channel->scan_tool_pid )
+       : atomic_load( &link->channel->vehicle_pid );
+
+   // EPERM means the process exists under another user
+   return( ( pid > 0 ) && ( -1 == kill( pid, 0 ) ) && ( ESRCH == errno ) );
+}
+
+
+/*
+* Name: vbus_link_send
+*
+* Description: Queue a message as one CAN frame, the first 4 bytes are
+*              the identifier and the rest the data.  More than 8 data
+*              bytes, or tx_fd, send a CAN FD frame.
+*
+*/
+int vbus_link_send( transport *link, const void *message, size_t length )
+{
+   vbus_frame frame = { 0 };
+   size_t data_length = length - sizeof( frame.id );
+
+   if (   ( length < sizeof( frame.id ) )
+       || ( data_length > VBUS_MAX_FD_LENGTH )
+       || ( ( data_length > VBUS_MAX_DLC ) && !link->fd_capable )
+      )
+   {
+      syslog( LOG_ERR, "%s: Message does not fit a CAN frame", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   memcpy( &frame.id, message, sizeof( frame.id ) );
+   frame.dlc = (uint8_t) data_length;
+   frame.fd = link->fd_capable && ( link->tx_fd || ( data_length > VBUS_MAX_DLC ) );
+   memcpy( frame.data, (const uint8_t *) message + sizeof( frame.id ), frame.dlc );
+
+   return( vbus_send( link->bus, link->node, &frame ) );
+}
+
+
+/*
+* Name: vbus_link_receive
+*
+* Description: Take the next frame seen on the bus as a message
+*
+*/
+int vbus_link_receive( transport *link, void *message, size_t length, int timeout_ms )
+{
+   vbus_frame frame;
+   int received;
+
+   received = vbus_receive( link->bus, link->node, &frame, timeout_ms );
+   if ( received <= 0 )
+   {
+      return( ( 0 == received ) ? TRANSPORT_TIMEOUT : TRANSPORT_CLOSED );
+   }
+
+   return( (int) vbus_link_message( link, 0, &frame, message, length ) );
+}
+
+
+/*
+* Name: vbus_link_receive_batch
+*
+* Description: Wait for a frame, then take the frames already
+*              delivered up to count
+*
+*/
+int vbus_link_receive_batch( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms )
+{
+   vbus_frame frame;
+   uint8_t *next = messages;
+   unsigned int received = 0;
+   int status;
+
+   if ( count > TRANSPORT_BATCH_SIZE )
+   {
+      count = TRANSPORT_BATCH_SIZE;
+   }
+
+   while ( received < count )
+   {
+      status = vbus_receive( link->bus, link->node, &frame, ( 0 == received ) ? timeout_ms : 0 );
+      if ( status <= 0 )
+      {
+         if ( received > 0 )
+         {
+            break;
+         }
+         return( ( 0 == status ) ? TRANSPORT_TIMEOUT : TRANSPORT_CLOSED );
+      }
+
+      vbus_link_message( link, received, &frame, next + received * length, length );
+      received++;
+   }
+   return( (int) received );
+}
+
+
+/*
+* Name: vbus_link_message
+*
+* Description: Copy a frame into a message and note its format
+*
+* Inputs: link - vbus transport
+*         index - message of the current receive
+*         frame - received frame
+*         length - message size
+*
+* Outputs: message - identifier and data
+*
+* Returns: Message length
+*
+*/
+size_t vbus_link_message( transport *link, unsigned int index, const vbus_frame *frame, void *message, size_t length )
+{
+   uint8_t buffer[ sizeof( frame->id ) + VBUS_MAX_FD_LENGTH ];
+   size_t rx_length;
+
+   memcpy( buffer, &frame->id, sizeof( frame->id ) );
+   memcpy( buffer + sizeof( frame->id ), frame->data, frame->dlc );
+
+   rx_length = sizeof( frame->id ) + frame->dlc;
+   if ( rx_length > length )
+   {
+      rx_length = length;
+   }
+   memcpy( message, buffer, rx_length );
+
+   link->rx_fd[ index ] = frame->fd;
+   return( rx_length );
+}
+
+
+/*
+* Name: vbus_link_close
+*
+* Description: Leave the bus.  The creator also stops the bus engine
+*              and removes the bus.
+*
+*/
+void vbus_link_close( transport *link )
+{
+   if ( link->bus != NULL )
+   {
+      vbus_leave( link->bus, link->node );
+
+      if ( link->owner )
+      {
+         vbus_destroy( link->bus );
+      }
+      else if ( !link->joined )
+      {
+         vbus_detach( link->bus );
+      }
+      link->bus = NULL;
+   }
+   return;
+}
+
+
+/*
+* Name: futex_wait
+*
+* Description: Sleep while a shared word holds a value
+*
+* Inputs: address - futex word
+*         value - expected value
+*         timeout_ms - maximum wait, TRANSPORT_WAIT_FOREVER to block
+*
+* Returns: 0 - woken or value changed
+*          -1 - errno set, ETIMEDOUT on timeout, EINTR on a signal
+*
+*/
+int futex_wait( _Atomic uint32_t *address, uint32_t value, int timeout_ms )
+{
+   struct timespec timeout;
+   struct timespec *timeout_ptr = NULL;
+   long status;
+
+   if ( timeout_ms >= 0 )
+   {
+      timeout.tv_sec = timeout_ms / MS_PER_SEC;
+      timeout.tv_nsec = ( timeout_ms % MS_PER_SEC ) * NS_PER_MS;
+      timeout_ptr = &timeout;
+   }
+
+   status = syscall( SYS_futex, address, FUTEX_WAIT, value, timeout_ptr, NULL, 0 );
+   if ( ( -1 == status ) && ( EAGAIN == errno ) )
+   {
+      status = 0;
+   }
+   return( (int) status );
+}
+
+
+/*
+* Name: futex_wake
+*
+* Description: Wake every process sleeping on a shared word
+*
+* Inputs: address - futex word
+*
+* Returns: None
+*
+*/
+void futex_wake( _Atomic uint32_t *address )
+{
+   syscall( SYS_futex, address, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+   return;
+}
@@ -0,0 +1,190 @@
+/*
+* File: transport.h
+*
+* Description: Message transport between the scan tool and the vehicle.
+*
+*              A transport moves whole messages.  The TCP transport
+*              wraps a connected socket, the shared memory transport
+*              uses a pair of single producer / single consumer rings in
+*              a POSIX shared memory segment for a vehicle and scan tool
+*              running on the same board.  The unix transport uses a
+*              local SOCK_SEQPACKET socket, the kernel keeps message
+*              boundaries and batches move with recvmmsg()/sendmmsg().
+*              The vbus transport is a node on the virtual CAN bus, a
+*              message is a 4 byte identifier and up to 8 data bytes.
+*              The can transport sends the same messages as frames on a
+*              SocketCAN raw socket.  It drains the socket in batches
+*              with recvmmsg() and keeps the kernel receive time of
+*              each frame.  Both CAN transports carry CAN FD frames of
+*              up to 64 data bytes once enabled.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*   man 2 futex, man 7 shm_overview
+*
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// Includes
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vbus.h"
+
+// File defines and typedefs
+#define TRANSPORT_TCP          0
+#define TRANSPORT_SHM          1
+#define TRANSPORT_UNIX         2
+#define TRANSPORT_VBUS         3
+#define TRANSPORT_CAN          4
+
+// Receive results, a positive value is the message length
+#define TRANSPORT_TIMEOUT      0
+#define TRANSPORT_CLOSED      -1
+#define TRANSPORT_ERROR       -2
+
+#define TRANSPORT_WAIT_FOREVER  -1
+
+// Most messages moved by one batch call
+#define TRANSPORT_BATCH_SIZE   32
+
+// Largest CAN message, 4 byte identifier and a CAN FD payload
+#define TRANSPORT_CAN_MTU      ( 4 + 64 )
+
+// Largest message a stream transport keeps a partial copy of
+#define TRANSPORT_MAX_MESSAGE  TRANSPORT_CAN_MTU
+
+#define UNIX_SOCKET_PATH       "/var/tmp/aesd_obd2.sock"
+#define GATEWAY_SOCKET_PATH    "/var/tmp/aesd_gateway.sock"
+#define UNIX_LISTEN_BACKLOG    8
+
+#define CAN_INTERFACE          "can0"
+
+#define SHM_NAME               "/aesd_obd2"
+#define SHM_MAGIC              0x4F424432
+#define SHM_RING_SLOTS         64
+#define SHM_MESSAGE_SIZE       64
+#define SHM_CACHE_LINE         64
+#define SHM_TAKEOVER_MS        2000
+
+typedef struct shm_slot
+{
+   uint32_t length;
+   uint8_t  data[ SHM_MESSAGE_SIZE ];
+} shm_slot;
+
+// head is only written by the producer, tail only by the consumer.
+// waiting is set by a consumer about to sleep on the head futex.
+typedef struct shm_ring
+{
+   _Atomic uint32_t head __attribute__(( aligned( SHM_CACHE_LINE ) ));
+   _Atomic uint32_t waiting;
+   _Atomic uint32_t tail __attribute__(( aligned( SHM_CACHE_LINE ) ));
+   shm_slot slots[ SHM_RING_SLOTS ] __attribute__(( aligned( SHM_CACHE_LINE ) ));
+} shm_ring;
+
+// The pids let each side notice a peer that died without closing
+typedef struct shm_channel
+{
+   uint32_t         magic;
+   _Atomic uint32_t attached;
+   _Atomic uint32_t closed;
+   _Atomic int32_t  vehicle_pid;
+   _Atomic int32_t  scan_tool_pid;
+   shm_ring         request;
+   shm_ring         response;
+} shm_channel;
+
+typedef struct transport transport;
+
+typedef struct transport_ops
+{
+   int (*send)( transport *link, const void *message, size_t length );
+   int (*receive)( transport *link, void *message, size_t length, int timeout_ms );
+   int (*send_batch)( transport *link, const void *messages, size_t length, unsigned int count );
+   int (*receive_batch)( transport *link, void *messages, size_t length, unsigned int count, int timeout_ms );
+   int (*try_send_batch)( transport *link, const void *messages, size_t length, unsigned int count );
+   void (*close)( transport *link );
+} transport_ops;
+
+struct transport
+{
+   const transport_ops *ops;
+   int                  type;
+   int                  fd;
+   bool                 owner;
+   unsigned int         spin;
+   shm_channel         *channel;
+   shm_ring            *tx_ring;
+   shm_ring            *rx_ring;
+   vbus                *bus;
+   int                  node;
+   bool                 joined;
+   // Kernel receive time of each message of the last receive, wall
+   // clock nanoseconds, 0 when the transport has no timestamps
+   uint64_t             rx_timestamp_ns[ TRANSPORT_BATCH_SIZE ];
+   // Frames dropped by a full socket receive queue since opening
+   unsigned long        rx_dropped;
+   // Datagrams of the wrong length left out since opening
+   unsigned long        rx_invalid;
+   // CAN FD frames allowed, every frame sent as CAN FD, and which
+   // messages of the last receive were CAN FD frames
+   bool                 fd_capable;
+   bool                 tx_fd;
+   bool                 rx_fd[ TRANSPORT_BATCH_SIZE ];
+   // Start of a stream message whose rest has not arrived yet
+   uint8_t              rx_partial[ TRANSPORT_MAX_MESSAGE ];
+   size_t               rx_partial_length;
+};
+
+int transport_parse( const char *name );
+
+void transport_tcp_init( transport *link, int socket_fd );
+int transport_tcp_connect( transport *link, const char *port );
+int transport_shm_create( transport *link );
+int transport_shm_attach( transport *link );
+int transport_shm_wait( transport *link, int timeout_ms );
+void transport_unix_init( transport *link, int socket_fd );
+int transport_unix_listen( int *socket_fd, const char *path );
+int transport_unix_connect( transport *link, const char *path );
+int transport_vbus_create( transport *link, const char *name, const vbus_config *config );
+int transport_vbus_attach( transport *link, const char *name );
+int transport_vbus_join( transport *link, const transport *bus_link );
+int transport_can_open( transport *link, const char *ifname );
+int transport_can_filter( transport *link, uint32_t can_id, uint32_t mask );
+int transport_enable_fd( transport *link );
+
+int transport_send( transport *link, const void *message, size_t length );
+int transport_receive( transport *link, void *message, size_t length, int timeout_ms );
+int transport_send_batch(
+   transport *link,
+   const void *messages,
+   size_t length,
+   unsigned int count
+   );
+int transport_try_send_batch(
+   transport *link,
+   const void *messages,
+   size_t length,
+   unsigned int count
+   );
+int transport_receive_batch(
+   transport *link,
+   void *messages,
+   size_t length,
+   unsigned int count,
+   int timeout_ms
+   );
+void transport_close( transport *link );
+
+#endif // TRANSPORT_H
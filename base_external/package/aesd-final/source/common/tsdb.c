@@ -0,0 +1,804 @@
+/*
+* File: tsdb.c
+*
+* Description: Compressed time series store for decoded PID samples.
+*              See tsdb.h for the block layout.
+*
+*              Timestamp encoding (delta-of-delta, milliseconds):
+*                0                  '0'
+*                [-63, 64]          '10'   + 7 bits
+*                [-255, 256]        '110'  + 9 bits
+*                [-2047, 2048]      '1110' + 12 bits
+*                otherwise          '1111' + 32 bits
+*
+*              Value encoding (XOR with previous value):
+*                same value         '0'
+*                fits last window   '10' + meaningful bits
+*                new window         '11' + 5 bits leading zeros
+*                                        + 6 bits length - 1
+*                                        + meaningful bits
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Gorilla: A Fast, Scalable, In-Memory Time Series Database (VLDB 2015)
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "tsdb.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+
+// Largest encoded sample: 4 + 32 timestamp bits, 2 + 5 + 6 + 64 value bits
+#define MAX_SAMPLE_BITS  113
+#define PAYLOAD_BITS     ( TSDB_PAYLOAD_SIZE * 8 )
+#define NO_WINDOW        0xFF
+
+typedef struct bit_reader
+{
+   const uint8_t *payload;
+   uint32_t position;
+   uint32_t length;
+} bit_reader;
+
+// File data and functions
+static tsdb_series *start_series( tsdb_store *store, uint8_t pid );
+static void start_block( tsdb_store *store, tsdb_series *series, uint64_t timestamp_ms, double value );
+static int write_block( tsdb_store *store, tsdb_series *series );
+static void put_bits( tsdb_block *block, uint64_t value, unsigned int bits );
+static uint64_t get_bits( bit_reader *reader, unsigned int bits );
+static void put_timestamp( tsdb_block *block, int64_t delta_of_delta );
+static int64_t get_timestamp( bit_reader *reader );
+static void put_value( tsdb_series *series, uint64_t bits );
+static size_t decode_block(
+   const tsdb_block *block,
+   uint64_t start_ms,
+   uint64_t end_ms,
+   tsdb_visit_fn visit,
+   void *context,
+   bool *stop
+   );
+static uint64_t double_to_bits( double value );
+static double bits_to_double( uint64_t bits );
+static unsigned int leading_zeros( uint64_t value );
+static unsigned int trailing_zeros( uint64_t value );
+
+
+/*
+* Name: tsdb_open
+*
+* Description: Open or create a store.  New samples are always written
+*              to new blocks appended after the existing ones.
+*
+* Inputs: store - store state to initialize
+*         path - store file name
+*
+* Returns: EXIT_SUCCESS - store opened
+*          EXIT_FAILURE - failed to open store
+*
+*/
+int tsdb_open( tsdb_store *store, const char *path )
+{
+   int return_status = EXIT_FAILURE;
+   struct stat file_stat;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( ( store != NULL ) && ( path != NULL ) )
+   {
+      memset( store, 0, sizeof( tsdb_store ) );
+      store->fd = open(
+         path,
+         O_RDWR | O_CREAT,
+         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+         );
+
+      if ( ( store->fd != -1 ) && ( 0 == fstat( store->fd, &file_stat ) ) )
+      {
+         store->next_slot = ( file_stat.st_size + TSDB_BLOCK_SIZE - 1 ) / TSDB_BLOCK_SIZE;
+         return_status = EXIT_SUCCESS;
+      }
+      else
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s: %s", __func__, path, error );
+         if ( store->fd != -1 )
+         {
+            close( store->fd );
+            store->fd = -1;
+         }
+      }
+   }
+   else
+   {
+      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: tsdb_append
+*
+* Description: Add a sample to the active block of a PID.  A full block
+*              is written out and a new one started.
+*
+* Inputs: store - open store
+*         pid - PID the sample belongs to
+*         timestamp_ms - sample time, milliseconds
+*         value - decoded value
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int tsdb_append(
+   tsdb_store *store,
+   uint8_t pid,
+   uint64_t timestamp_ms,
+   double value
+   )
+{
+   int return_status = EXIT_SUCCESS;
+   tsdb_series *series;
+   tsdb_block_header *header;
+   int64_t delta;
+   int64_t delta_of_delta;
+
+   if ( ( store == NULL ) || ( store->fd == -1 ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   series = store->series[ pid ];
+   if ( NULL == series )
+   {
+      series = start_series( store, pid );
+      if ( NULL == series )
+      {
+         return( EXIT_FAILURE );
+      }
+      start_block( store, series, timestamp_ms, value );
+      return( EXIT_SUCCESS );
+   }
+
+   header = &series->block.header;
+   delta = (int64_t) ( timestamp_ms - header->last_ms );
+   delta_of_delta = delta - series->prev_delta;
+
+   // Time went backwards, the gap does not fit or the block is full
+   if (   ( timestamp_ms < header->last_ms )
+       || ( delta_of_delta > INT32_MAX )
+       || ( delta_of_delta < INT32_MIN )
+       || ( header->bit_length + MAX_SAMPLE_BITS > PAYLOAD_BITS )
+       || ( UINT16_MAX == header->count )
+      )
+   {
+      return_status = write_block( store, series );
+      start_block( store, series, timestamp_ms, value );
+      return( return_status );
+   }
+
+   put_timestamp( &series->block, delta_of_delta );
+   put_value( series, double_to_bits( value ) );
+
+   series->prev_delta = delta;
+   header->last_ms = timestamp_ms;
+   header->count++;
+   if ( value < header->min_value )
+   {
+      header->min_value = value;
+   }
+   if ( value > header->max_value )
+   {
+      header->max_value = value;
+   }
+   series->dirty = true;
+
+   return( return_status );
+}
+
+
+/*
+* Name: tsdb_flush
+*
+* Description: Write every partially filled block to its slot.  The slot
+*              is rewritten as the block fills, so a flush never wastes
+*              space in the file.
+*
+* Inputs: store - open store
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int tsdb_flush( tsdb_store *store )
+{
+   int return_status = EXIT_SUCCESS;
+   int i;
+
+   if ( ( store == NULL ) || ( store->fd == -1 ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   for ( i = 0; i < TSDB_MAX_PIDS; i++ )
+   {
+      if ( ( store->series[ i ] != NULL ) && store->series[ i ]->dirty )
+      {
+         if ( EXIT_SUCCESS != write_block( store, store->series[ i ] ) )
+         {
+            return_status = EXIT_FAILURE;
+         }
+      }
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: tsdb_query
+*
+* Description: Visit the samples of one PID within a time window.
+*              Blocks of other PIDs or outside the window are skipped
+*              by their header without decoding.
+*
+* Inputs: store - open store
+*         pid - PID to read
+*         start_ms, end_ms - time window, inclusive
+*         visit - called for each sample
+*         context - passed to visit
+*
+* Returns: Number of samples visited
+*
+*/
+size_t tsdb_query(
+   tsdb_store *store,
+   uint8_t pid,
+   uint64_t start_ms,
+   uint64_t end_ms,
+   tsdb_visit_fn visit,
+   void *context
+   )
+{
+   size_t samples = 0;
+   size_t map_size;
+   uint32_t slot;
+   bool stop = false;
+   const uint8_t *map;
+   const tsdb_block *block;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( ( store == NULL ) || ( store->fd == -1 ) || ( visit == NULL ) )
+   {
+      return( 0 );
+   }
+
+   tsdb_flush( store );
+
+   map_size = (size_t) store->next_slot * TSDB_BLOCK_SIZE;
+   if ( 0 == map_size )
+   {
+      return( 0 );
+   }
+
+   map = mmap( NULL, map_size, PROT_READ, MAP_SHARED, store->fd, 0 );
+   if ( MAP_FAILED == map )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( 0 );
+   }
+
+   for ( slot = 0; ( slot < store->next_slot ) && !stop; slot++ )
+   {
+      block = (const tsdb_block *) ( map + (size_t) slot * TSDB_BLOCK_SIZE );
+      if (   ( TSDB_BLOCK_MAGIC == block->header.magic )
+          && ( pid == block->header.pid )
+          && ( block->header.first_ms <= end_ms )
+          && ( block->header.last_ms >= start_ms )
+         )
+      {
+         samples += decode_block( block, start_ms, end_ms, visit, context, &stop );
+      }
+   }
+
+   munmap( (void *) map, map_size );
+
+   return( samples );
+}
+
+
+/*
+* Name: tsdb_size
+*
+* Description: Bytes used by the store, including active blocks
+*
+* Inputs: store - open store
+*
+* Returns: Store size in bytes
+*
+*/
+size_t tsdb_size( tsdb_store *store )
+{
+   size_t size = 0;
+
+   if ( store != NULL )
+   {
+      size = (size_t) store->next_slot * TSDB_BLOCK_SIZE;
+   }
+   return( size );
+}
+
+
+/*
+* Name: tsdb_close
+*
+* Description: Flush active blocks and close the store
+*
+* Inputs: store - open store
+*
+* Returns: None
+*
+*/
+void tsdb_close( tsdb_store *store )
+{
+   int i;
+
+   if ( ( store != NULL ) && ( store->fd != -1 ) )
+   {
+      tsdb_flush( store );
+      close( store->fd );
+      store->fd = -1;
+
+      for ( i = 0; i < TSDB_MAX_PIDS; i++ )
+      {
+         free( store->series[ i ] );
+         store->series[ i ] = NULL;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: start_series
+*
+* Description: Allocate the active block state for a PID
+*
+* Inputs: store - open store
+*         pid - PID of the series
+*
+* Returns: New series, NULL on failure
+*
+*/
+tsdb_series *start_series( tsdb_store *store, uint8_t pid )
+{
+   tsdb_series *series;
+
+   series = calloc( 1, sizeof( tsdb_series ) );
+   if ( series != NULL )
+   {
+      series->block.header.pid = pid;
+      store->series[ pid ] = series;
+   }
+   else
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+   }
+   return( series );
+}
+
+
+/*
+* Name: start_block
+*
+* Description: Begin a new block in a fresh slot with its first sample.
+*              The first value is stored uncompressed.
+*
+* Inputs: store - open store
+*         series - series to restart
+*         timestamp_ms - first sample time
+*         value - first sample value
+*
+* Returns: None
+*
+*/
+void start_block( tsdb_store *store, tsdb_series *series, uint64_t timestamp_ms, double value )
+{
+   tsdb_block_header *header = &series->block.header;
+   uint8_t pid = header->pid;
+
+   memset( &series->block, 0, sizeof( series->block ) );
+   header->magic = TSDB_BLOCK_MAGIC;
+   header->pid = pid;
+   header->count = 1;
+   header->first_ms = timestamp_ms;
+   header->last_ms = timestamp_ms;
+   header->min_value = value;
+   header->max_value = value;
+
+   series->slot = store->next_slot++;
+   series->prev_delta = 0;
+   series->prev_bits = double_to_bits( value );
+   series->prev_leading = NO_WINDOW;
+   series->prev_trailing = 0;
+   series->dirty = true;
+
+   put_bits( &series->block, series->prev_bits, 64 );
+   return;
+}
+
+
+/*
+* Name: write_block
+*
+* Description: Write the active block of a series to its slot
+*
+* Inputs: store - open store
+*         series - series to write
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int write_block( tsdb_store *store, tsdb_series *series )
+{
+   ssize_t tx_bytes;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   tx_bytes = pwrite(
+      store->fd,
+      &series->block,
+      TSDB_BLOCK_SIZE,
+      (off_t) series->slot * TSDB_BLOCK_SIZE
+      );
+
+   if ( tx_bytes != TSDB_BLOCK_SIZE )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+
+   series->dirty = false;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: put_bits
+*
+* Description: Append bits to a block payload, most significant first
+*
+* Inputs: block - block to write
+*         value - bits to append, right aligned
+*         bits - number of bits, 64 max
+*
+* Returns: None
+*
+*/
+void put_bits( tsdb_block *block, uint64_t value, unsigned int bits )
+{
+   uint32_t position = block->header.bit_length;
+   unsigned int free_bits;
+   unsigned int take;
+   uint8_t chunk;
+
+   while ( bits > 0 )
+   {
+      free_bits = 8 - ( position & 7 );
+      take = ( bits < free_bits ) ? bits : free_bits;
+      chunk = (uint8_t) ( ( value >> ( bits - take ) ) & ( ( 1U << take ) - 1 ) );
+      block->payload[ position >> 3 ] |= (uint8_t) ( chunk << ( free_bits - take ) );
+      position += take;
+      bits -= take;
+   }
+
+   block->header.bit_length = position;
+   return;
+}
+
+
+/*
+* Name: get_bits
+*
+* Description: Read bits from a block payload, most significant first.
+*              Reads past the encoded length return zero bits.
+*
+* Inputs: reader - payload cursor
+*         bits - number of bits, 64 max
+*
+* Returns: Bits read, right aligned
+*
+*/
+uint64_t get_bits( bit_reader *reader, unsigned int bits )
+{
+   uint64_t value = 0;
+   unsigned int available;
+   unsigned int take;
+   uint8_t byte;
+
+   while ( bits > 0 )
+   {
+      available = 8 - ( reader->position & 7 );
+      take = ( bits < available ) ? bits : available;
+      byte = 0;
+      if ( reader->position < reader->length )
+      {
+         byte = reader->payload[ reader->position >> 3 ];
+      }
+      value = ( value << take )
+            | ( ( byte >> ( available - take ) ) & ( ( 1U << take ) - 1 ) );
+      reader->position += take;
+      bits -= take;
+   }
+
+   return( value );
+}
+
+
+/*
+* Name: put_timestamp
+*
+* Description: Encode a timestamp delta-of-delta
+*
+* Inputs: block - block to write
+*         delta_of_delta - change in sample interval, milliseconds
+*
+* Returns: None
+*
+*/
+void put_timestamp( tsdb_block *block, int64_t delta_of_delta )
+{
+   if ( 0 == delta_of_delta )
+   {
+      put_bits( block, 0x0, 1 );
+   }
+   else if ( ( delta_of_delta >= -63 ) && ( delta_of_delta <= 64 ) )
+   {
+      put_bits( block, 0x2, 2 );
+      put_bits( block, (uint64_t) ( delta_of_delta + 63 ), 7 );
+   }
+   else if ( ( delta_of_delta >= -255 ) && ( delta_of_delta <= 256 ) )
+   {
+      put_bits( block, 0x6, 3 );
+      put_bits( block, (uint64_t) ( delta_of_delta + 255 ), 9 );
+   }
+   else if ( ( delta_of_delta >= -2047 ) && ( delta_of_delta <= 2048 ) )
+   {
+      put_bits( block, 0xE, 4 );
+      put_bits( block, (uint64_t) ( delta_of_delta + 2047 ), 12 );
+   }
+   else
+   {
+      put_bits( block, 0xF, 4 );
+      put_bits( block, (uint32_t) (int32_t) delta_of_delta, 32 );
+   }
+   return;
+}
+
+
+/*
+* Name: get_timestamp
+*
+* Description: Decode a timestamp delta-of-delta
+*
+* Inputs: reader - payload cursor
+*
+* Returns: Change in sample interval, milliseconds
+*
+*/
+int64_t get_timestamp( bit_reader *reader )
+{
+   if ( 0 == get_bits( reader, 1 ) )
+   {
+      return( 0 );
+   }
+   if ( 0 == get_bits( reader, 1 ) )
+   {
+      return( (int64_t) get_bits( reader, 7 ) - 63 );
+   }
+   if ( 0 == get_bits( reader, 1 ) )
+   {
+      return( (int64_t) get_bits( reader, 9 ) - 255 );
+   }
+   if ( 0 == get_bits( reader, 1 ) )
+   {
+      return( (int64_t) get_bits( reader, 12 ) - 2047 );
+   }
+   return( (int32_t) (uint32_t) get_bits( reader, 32 ) );
+}
+
+
+/*
+* Name: put_value
+*
+* Description: XOR encode a value against the previous one
+*
+* Inputs: series - series being appended
+*         bits - IEEE 754 bits of the value
+*
+* Returns: None
+*
+*/
+void put_value( tsdb_series *series, uint64_t bits )
+{
+   uint64_t xor_bits = bits ^ series->prev_bits;
+   unsigned int leading;
+   unsigned int trailing;
+   unsigned int significant;
+
+   if ( 0 == xor_bits )
+   {
+      put_bits( &series->block, 0x0, 1 );
+      return;
+   }
+
+   leading = leading_zeros( xor_bits );
+   trailing = trailing_zeros( xor_bits );
+   if ( leading > 31 )
+   {
+      leading = 31;
+   }
+
+   if (   ( series->prev_leading != NO_WINDOW )
+       && ( leading >= series->prev_leading )
+       && ( trailing >= series->prev_trailing )
+      )
+   {
+      significant = 64 - series->prev_leading - series->prev_trailing;
+      put_bits( &series->block, 0x2, 2 );
+      put_bits( &series->block, xor_bits >> series->prev_trailing, significant );
+   }
+   else
+   {
+      significant = 64 - leading - trailing;
+      put_bits( &series->block, 0x3, 2 );
+      put_bits( &series->block, leading, 5 );
+      put_bits( &series->block, significant - 1, 6 );
+      put_bits( &series->block, xor_bits >> trailing, significant );
+      series->prev_leading = (uint8_t) leading;
+      series->prev_trailing = (uint8_t) trailing;
+   }
+
+   series->prev_bits = bits;
+   return;
+}
+
+
+/*
+* Name: decode_block
+*
+* Description: Decode the samples of a block within a time window
+*
+* Inputs: block - block to decode
+*         start_ms, end_ms - time window, inclusive
+*         visit, context - sample visitor
+*
+* Outputs: stop - set when the visitor ends the query
+*
+* Returns: Number of samples visited
+*
+*/
+size_t decode_block(
+   const tsdb_block *block,
+   uint64_t start_ms,
+   uint64_t end_ms,
+   tsdb_visit_fn visit,
+   void *context,
+   bool *stop
+   )
+{
+   size_t samples = 0;
+   bit_reader reader = { 0 };
+   uint64_t timestamp_ms;
+   int64_t delta = 0;
+   uint64_t bits;
+   uint64_t xor_bits;
+   unsigned int leading = 0;
+   unsigned int trailing = 0;
+   unsigned int significant = 0;
+   uint16_t i;
+
+   reader.payload = block->payload;
+   reader.length = block->header.bit_length;
+
+   timestamp_ms = block->header.first_ms;
+   bits = get_bits( &reader, 64 );
+
+   for ( i = 0; i < block->header.count; i++ )
+   {
+      if ( i > 0 )
+      {
+         delta += get_timestamp( &reader );
+         timestamp_ms += delta;
+
+         if ( get_bits( &reader, 1 ) )
+         {
+            if ( get_bits( &reader, 1 ) )
+            {
+               leading = (unsigned int) get_bits( &reader, 5 );
+               significant = (unsigned int) get_bits( &reader, 6 ) + 1;
+               trailing = 64 - leading - significant;
+            }
+            xor_bits = get_bits( &reader, significant ) << trailing;
+            bits ^= xor_bits;
+         }
+      }
+
+      if ( timestamp_ms > end_ms )
+      {
+         break;
+      }
+      if ( timestamp_ms >= start_ms )
+      {
+         samples++;
+         if ( !visit( block->header.pid, timestamp_ms, bits_to_double( bits ), context ) )
+         {
+            *stop = true;
+            break;
+         }
+      }
+   }
+
+   return( samples );
+}
+
+
+/*
+* Name: double_to_bits, bits_to_double
+*
+* Description: Reinterpret a double as its IEEE 754 bits and back
+*
+*/
+uint64_t double_to_bits( double value )
+{
+   uint64_t bits;
+
+   memcpy( &bits, &value, sizeof( bits ) );
+   return( bits );
+}
+
+double bits_to_double( uint64_t bits )
+{
+   double value;
+
+   memcpy( &value, &bits, sizeof( value ) );
+   return( value );
+}
+
+
+/*
+* Name: leading_zeros, trailing_zeros
+*
+* Description: Count zero bits of a non zero value
+*
+*/
+unsigned int leading_zeros( uint64_t value )
+{
+   return( (unsigned int) __builtin_clzll( value ) );
+}
+
+unsigned int trailing_zeros( uint64_t value )
+{
+   return( (unsigned int) __builtin_ctzll( value ) );
+}
@@ -0,0 +1,103 @@
+/*
+* File: tsdb.h
+*
+* Description: Compressed time series store for decoded PID samples.
+*
+*              Samples are kept per PID in fixed size blocks.  Each block
+*              stands alone: timestamps are delta-of-delta encoded and
+*              values are XOR encoded against the previous value
+*              (Gorilla style), so a block can be flushed, skipped by its
+*              header, or decoded without reading any other block.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Gorilla: A Fast, Scalable, In-Memory Time Series Database (VLDB 2015)
+*
+*/
+
+#ifndef TSDB_H
+#define TSDB_H
+
+// Includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File defines and typedefs
+#define TSDB_BLOCK_MAGIC     0x42445354
+#define TSDB_BLOCK_SIZE      1024
+#define TSDB_MAX_PIDS        256
+
+typedef struct tsdb_block_header
+{
+   uint32_t magic;
+   uint8_t  pid;
+   uint8_t  reserved;
+   uint16_t count;
+   uint32_t bit_length;
+   uint32_t reserved2;
+   uint64_t first_ms;
+   uint64_t last_ms;
+   double   min_value;
+   double   max_value;
+} tsdb_block_header;
+
+#define TSDB_PAYLOAD_SIZE  ( TSDB_BLOCK_SIZE - sizeof( tsdb_block_header ) )
+
+typedef struct tsdb_block
+{
+   tsdb_block_header header;
+   uint8_t           payload[ TSDB_PAYLOAD_SIZE ];
+} tsdb_block;
+
+typedef struct tsdb_series
+{
+   tsdb_block block;
+   uint32_t   slot;
+   bool       dirty;
+   int64_t    prev_delta;
+   uint64_t   prev_bits;
+   uint8_t    prev_leading;
+   uint8_t    prev_trailing;
+} tsdb_series;
+
+typedef struct tsdb_store
+{
+   int          fd;
+   uint32_t     next_slot;
+   tsdb_series *series[ TSDB_MAX_PIDS ];
+} tsdb_store;
+
+// Return false from the visitor to stop a query early
+typedef bool (*tsdb_visit_fn)(
+   uint8_t pid,
+   uint64_t timestamp_ms,
+   double value,
+   void *context
+   );
+
+int tsdb_open( tsdb_store *store, const char *path );
+int tsdb_append(
+   tsdb_store *store,
+   uint8_t pid,
+   uint64_t timestamp_ms,
+   double value
+   );
+int tsdb_flush( tsdb_store *store );
+size_t tsdb_query(
+   tsdb_store *store,
+   uint8_t pid,
+   uint64_t start_ms,
+   uint64_t end_ms,
+   tsdb_visit_fn visit,
+   void *context
+   );
+size_t tsdb_size( tsdb_store *store );
+void tsdb_close( tsdb_store *store );
+
+#endif // TSDB_H
@@ -0,0 +1,591 @@
+/*
+* File: uring.c
+*
+* Description: Minimal io_uring interface.  See uring.h.
+*
+*              The submission queue index array is filled once with
+*              the identity, entry i of the ring always names SQE i.
+*              Head and tail indexes shared with the kernel are read
+*              with acquire and written with release ordering.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://kernel.dk/io_uring.pdf
+*   man 2 io_uring_setup, man 2 io_uring_enter, man 2 io_uring_register
+*   man 7 io_uring
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define MS_PER_SEC      1000
+#define NS_PER_MS       1000000
+
+// Kernel features the server loop depends on
+#define URING_FEATURES  ( IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG )
+
+// File data and functions
+static void prep( struct io_uring_sqe *sqe, uint8_t opcode, int fd, uint64_t user_data );
+static void log_error( const char *function );
+
+
+/*
+* Name: uring_init
+*
+* Description: Create an io_uring and map its rings.  Completions for
+*              the whole server loop are reaped by this thread only,
+*              the kernel is told so when it supports the hint.
+*
+* Inputs: ring - ring to initialize
+*         entries - submission queue entries, a power of 2
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - io_uring missing, disabled or too old
+*
+*/
+int uring_init( uring *ring, unsigned int entries )
+{
+   struct io_uring_params params;
+   uint32_t *sq_array;
+   size_t sq_size;
+   size_t cq_size;
+   uint32_t i;
+   int fd;
+
+   memset( ring, 0, sizeof( uring ) );
+   ring->fd = -1;
+
+   memset( &params, 0, sizeof( params ) );
+   params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+   fd = (int) syscall( __NR_io_uring_setup, entries, &params );
+   if ( ( -1 == fd ) && ( EINVAL == errno ) )
+   {
+      // Kernel before 6.0, the hints are only an optimization
+      memset( &params, 0, sizeof( params ) );
+      fd = (int) syscall( __NR_io_uring_setup, entries, &params );
+   }
+   if ( -1 == fd )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+   ring->fd = fd;
+
+   if ( ( params.features & URING_FEATURES ) != URING_FEATURES )
+   {
+      syslog( LOG_ERR, "%s: Kernel io_uring features 0x%X too old", __func__, params.features );
+      uring_close( ring );
+      return( EXIT_FAILURE );
+   }
+
+   // One mapping holds both rings
+   sq_size = params.sq_off.array + params.sq_entries * sizeof( uint32_t );
+   cq_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+   ring->ring_size = ( sq_size > cq_size ) ? sq_size : cq_size;
+   ring->ring_memory = mmap(
+      NULL,
+      ring->ring_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      fd,
+      IORING_OFF_SQ_RING
+      );
+   if ( MAP_FAILED == ring->ring_memory )
+   {
+      ring->ring_memory = NULL;
+      log_error( __func__ );
+      uring_close( ring );
+      return( EXIT_FAILURE );
+   }
+
+   ring->sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+   ring->sqes = mmap(
+      NULL,
+      ring->sqes_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      fd,
+      IORING_OFF_SQES
+      );
+   if ( MAP_FAILED == ring->sqes )
+   {
+      ring->sqes = NULL;
+      log_error( __func__ );
+      uring_close( ring );
+      return( EXIT_FAILURE );
+   }
+
+   ring->sq_head = (_Atomic uint32_t *) ( (uint8_t *) ring->ring_memory + params.sq_off.head );
+   ring->sq_tail = (_Atomic uint32_t *) ( (uint8_t *) ring->ring_memory + params.sq_off.tail );
+   ring->sq_mask = *(uint32_t *) ( (uint8_t *) ring->ring_memory + params.sq_off.ring_mask );
+   ring->sq_entries = params.sq_entries;
+   ring->sq_local_tail = atomic_load_explicit( ring->sq_tail, memory_order_relaxed );
+
+   sq_array = (uint32_t *) ( (uint8_t *) ring->ring_memory + params.sq_off.array );
+   for ( i = 0; i < params.sq_entries; i++ )
+   {
+      sq_array[ i ] = i;
+   }
+
+   ring->cq_head = (_Atomic uint32_t *) ( (uint8_t *) ring->ring_memory + params.cq_off.head );
+   ring->cq_tail = (_Atomic uint32_t *) ( (uint8_t *) ring->ring_memory + params.cq_off.tail );
+   ring->cq_mask = *(uint32_t *) ( (uint8_t *) ring->ring_memory + params.cq_off.ring_mask );
+   ring->cqes = (struct io_uring_cqe *) ( (uint8_t *) ring->ring_memory + params.cq_off.cqes );
+
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: uring_setup_buffers
+*
+* Description: Register a ring of provided buffers for multishot
+*              receives and hand every buffer to the kernel
+*
+* Inputs: ring - initialized ring
+*         group - buffer group id named by the receives
+*         count - number of buffers, a power of 2
+*         length - bytes per buffer
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int uring_setup_buffers( uring *ring, uint16_t group, unsigned int count, unsigned int length )
+{
+   struct io_uring_buf_reg registration;
+   unsigned int i;
+
+   ring->buffers_size = count * sizeof( struct io_uring_buf );
+   ring->buffers = mmap(
+      NULL,
+      ring->buffers_size,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0
+      );
+   if ( MAP_FAILED == ring->buffers )
+   {
+      ring->buffers = NULL;
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   ring->buffer_memory = malloc( (size_t) count * length );
+   if ( NULL == ring->buffer_memory )
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   memset( &registration, 0, sizeof( registration ) );
+   registration.ring_addr = (uint64_t) (uintptr_t) ring->buffers;
+   registration.ring_entries = count;
+   registration.bgid = group;
+   if ( -1 == syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1 ) )
+   {
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   ring->buffer_count = count;
+   ring->buffer_length = length;
+   ring->buffer_group = group;
+   ring->buffer_tail = 0;
+   for ( i = 0; i < count; i++ )
+   {
+      uring_recycle_buffer( ring, (uint16_t) i );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: uring_get_sqe
+*
+* Description: Next free submission queue entry.  A full queue is
+*              submitted first.
+*
+* Inputs: ring - ring
+*
+* Returns: Cleared entry
+*          NULL - queue still full
+*
+*/
+struct io_uring_sqe *uring_get_sqe( uring *ring )
+{
+   struct io_uring_sqe *sqe;
+   uint32_t head;
+
+   head = atomic_load_explicit( ring->sq_head, memory_order_acquire );
+   if ( ring->sq_local_tail - head >= ring->sq_entries )
+   {
+      uring_submit_and_wait( ring, 0, 0 );
+      head = atomic_load_explicit( ring->sq_head, memory_order_acquire );
+      if ( ring->sq_local_tail - head >= ring->sq_entries )
+      {
+         return( NULL );
+      }
+   }
+
+   sqe = &ring->sqes[ ring->sq_local_tail & ring->sq_mask ];
+   memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+   ring->sq_local_tail++;
+   ring->pending++;
+   return( sqe );
+}
+
+
+/*
+* Name: uring_reserve
+*
+* Description: Make room for several entries, submitting the queue
+*              first if needed, so a linked chain is prepared without
+*              uring_get_sqe() submitting part of it
+*
+* Inputs: ring - ring
+*         count - entries needed
+*
+* Returns: true - count entries free
+*          false - queue still too full
+*
+*/
+bool uring_reserve( uring *ring, unsigned int count )
+{
+   uint32_t head;
+
+   head = atomic_load_explicit( ring->sq_head, memory_order_acquire );
+   if ( ring->sq_local_tail - head + count > ring->sq_entries )
+   {
+      uring_submit_and_wait( ring, 0, 0 );
+      head = atomic_load_explicit( ring->sq_head, memory_order_acquire );
+   }
+   return( ring->sq_local_tail - head + count <= ring->sq_entries );
+}
+
+
+/*
+* Name: uring_prep_accept_multishot
+*
+* Description: Accept connections until cancelled, one completion
+*              with the new socket for each
+*
+* Inputs: sqe - entry to fill
+*         fd - listening socket
+*         user_data - returned with each completion
+*
+* Returns: None
+*
+*/
+void uring_prep_accept_multishot( struct io_uring_sqe *sqe, int fd, uint64_t user_data )
+{
+   prep( sqe, IORING_OP_ACCEPT, fd, user_data );
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   return;
+}
+
+
+/*
+* Name: uring_prep_recv_multishot
+*
+* Description: Receive until the peer closes, each completion carries
+*              the id of the provided buffer holding its data
+*
+* Inputs: sqe - entry to fill
+*         fd - connected socket
+*         group - provided buffer group
+*         user_data - returned with each completion
+*
+* Returns: None
+*
+*/
+void uring_prep_recv_multishot( struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data )
+{
+   prep( sqe, IORING_OP_RECV, fd, user_data );
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = group;
+   return;
+}
+
+
+/*
+* Name: uring_prep_send
+*
+* Description: Send a buffer, a stream socket gets all of it unless
+*              the connection fails.  The buffer must stay unchanged
+*              until the completion.
+*
+* Inputs: sqe - entry to fill
+*         fd - connected socket
+*         buffer - data
+*         length - data length
+*         user_data - returned with the completion
+*
+* Returns: None
+*
+*/
+void uring_prep_send( struct io_uring_sqe *sqe, int fd, const void *buffer, size_t length, uint64_t user_data )
+{
+   prep( sqe, IORING_OP_SEND, fd, user_data );
+   sqe->addr = (uint64_t) (uintptr_t) buffer;
+   sqe->len = (uint32_t) length;
+   sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+   return;
+}
+
+
+/*
+* Name: uring_prep_cancel
+*
+* Description: Cancel the request submitted with user data target,
+*              a multishot request ends with a final completion
+*
+* Inputs: sqe - entry to fill
+*         target - user data of the request to cancel
+*         user_data - returned with the completion of the cancel
+*
+* Returns: None
+*
+*/
+void uring_prep_cancel( struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data )
+{
+   prep( sqe, IORING_OP_ASYNC_CANCEL, -1, user_data );
+   sqe->addr = target;
+   return;
+}
+
+
+/*
+* Name: uring_submit_and_wait
+*
+* Description: Submit the queued entries and wait for completions,
+*              both in one system call
+*
+* Inputs: ring - ring
+*         wait_count - completions to wait for, 0 only submits
+*         timeout_ms - longest wait, negative waits forever
+*
+* Returns: EXIT_SUCCESS - submitted, completions ready or timed out
+*          EXIT_FAILURE
+*
+*/
+int uring_submit_and_wait( uring *ring, unsigned int wait_count, int timeout_ms )
+{
+   struct io_uring_getevents_arg arg;
+   struct __kernel_timespec timeout;
+   unsigned int flags = IORING_ENTER_EXT_ARG;
+   long submitted;
+
+   atomic_store_explicit( ring->sq_tail, ring->sq_local_tail, memory_order_release );
+
+   memset( &arg, 0, sizeof( arg ) );
+   arg.sigmask_sz = _NSIG / 8;
+   if ( timeout_ms >= 0 )
+   {
+      timeout.tv_sec = timeout_ms / MS_PER_SEC;
+      timeout.tv_nsec = (long long) ( timeout_ms % MS_PER_SEC ) * NS_PER_MS;
+      arg.ts = (uint64_t) (uintptr_t) &timeout;
+   }
+   if ( wait_count > 0 )
+   {
+      flags |= IORING_ENTER_GETEVENTS;
+   }
+
+   ring->enter_calls++;
+   submitted = syscall( __NR_io_uring_enter, ring->fd, ring->pending, wait_count, flags, &arg, sizeof( arg ) );
+   if ( -1 == submitted )
+   {
+      // Timed out, interrupted or completions must be reaped first
+      if ( ( ETIME == errno ) || ( EINTR == errno ) || ( EBUSY == errno ) || ( EAGAIN == errno ) )
+      {
+         return( EXIT_SUCCESS );
+      }
+      log_error( __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   ring->pending -= ( (unsigned long) submitted < ring->pending ) ? (unsigned int) submitted : ring->pending;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: uring_peek_cqe
+*
+* Description: Oldest completion, left in the queue until
+*              uring_cqe_seen()
+*
+* Inputs: ring - ring
+*
+* Returns: Completion
+*          NULL - none ready
+*
+*/
+struct io_uring_cqe *uring_peek_cqe( uring *ring )
+{
+   uint32_t head = atomic_load_explicit( ring->cq_head, memory_order_relaxed );
+
+   if ( head == atomic_load_explicit( ring->cq_tail, memory_order_acquire ) )
+   {
+      return( NULL );
+   }
+   return( &ring->cqes[ head & ring->cq_mask ] );
+}
+
+
+/*
+* Name: uring_cqe_seen
+*
+* Description: Release the completion returned by uring_peek_cqe()
+*
+* Inputs: ring - ring
+*
+* Returns: None
+*
+*/
+void uring_cqe_seen( uring *ring )
+{
+   uint32_t head = atomic_load_explicit( ring->cq_head, memory_order_relaxed );
+
+   atomic_store_explicit( ring->cq_head, head + 1, memory_order_release );
+   return;
+}
+
+
+/*
+* Name: uring_buffer
+*
+* Description: Data of a provided buffer named by a completion
+*
+* Inputs: ring - ring
+*         id - buffer id, the upper bits of the completion flags
+*
+* Returns: Buffer
+*
+*/
+uint8_t *uring_buffer( uring *ring, uint16_t id )
+{
+   return( ring->buffer_memory + (size_t) id * ring->buffer_length );
+}
+
+
+/*
+* Name: uring_recycle_buffer
+*
+* Description: Hand a provided buffer back to the kernel
+*
+* Inputs: ring - ring
+*         id - buffer id
+*
+* Returns: None
+*
+*/
+void uring_recycle_buffer( uring *ring, uint16_t id )
+{
+   struct io_uring_buf *entry;
+
+   entry = &ring->buffers->bufs[ ring->buffer_tail & ( ring->buffer_count - 1 ) ];
+   entry->addr = (uint64_t) (uintptr_t) uring_buffer( ring, id );
+   entry->len = ring->buffer_length;
+   entry->bid = id;
+   ring->buffer_tail++;
+
+   atomic_store_explicit(
+      (_Atomic uint16_t *) &ring->buffers->tail,
+      ring->buffer_tail,
+      memory_order_release
+      );
+   return;
+}
+
+
+/*
+* Name: uring_close
+*
+* Description: Unmap the rings and close the io_uring, requests still
+*              in flight are cancelled by the kernel
+*
+* Inputs: ring - ring
+*
+* Returns: None
+*
+*/
+void uring_close( uring *ring )
+{
+   if ( ring->fd != -1 )
+   {
+      close( ring->fd );
+      ring->fd = -1;
+   }
+   if ( ring->sqes != NULL )
+   {
+      munmap( ring->sqes, ring->sqes_size );
+      ring->sqes = NULL;
+   }
+   if ( ring->ring_memory != NULL )
+   {
+      munmap( ring->ring_memory, ring->ring_size );
+      ring->ring_memory = NULL;
+   }
+   if ( ring->buffers != NULL )
+   {
+      munmap( ring->buffers, ring->buffers_size );
+      ring->buffers = NULL;
+   }
+   free( ring->buffer_memory );
+   ring->buffer_memory = NULL;
+   return;
+}
+
+
+/*
+* Name: prep
+*
+* Description: Fill the fields every request uses
+*
+*/
+void prep( struct io_uring_sqe *sqe, uint8_t opcode, int fd, uint64_t user_data )
+{
+   sqe->opcode = opcode;
+   sqe->fd = fd;
+   sqe->user_data = user_data;
+   return;
+}
+
+
+/*
+* Name: log_error
+*
+* Description: Log errno for a failed system call
+*
+*/
+void log_error( const char *function )
+{
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   strerror_r( errno, error, SYSLOG_BUF_SIZE );
+   syslog( LOG_ERR, "%s: %s", function, error );
+   return;
+}
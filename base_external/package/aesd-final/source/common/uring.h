@@ -0,0 +1,93 @@
+/*
+* File: uring.h
+*
+* Description: Minimal io_uring interface over the raw system calls,
+*              the target has no liburing.
+*
+*              Requests are queued in the shared submission ring and
+*              handed to the kernel together with the wait for their
+*              completions, one io_uring_enter() for a whole pass of a
+*              server loop.  A provided buffer ring lets a multishot
+*              receive pick its own buffer for each completion, the
+*              buffer is handed back once its data is consumed.
+*
+*              Needs Linux 6.0 or later for multishot receive and
+*              buffer rings, uring_init() fails on an older kernel so
+*              the caller can fall back to epoll.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   https://kernel.dk/io_uring.pdf
+*   man 2 io_uring_setup, man 2 io_uring_enter, man 2 io_uring_register
+*   man 3 io_uring_setup_buf_ring
+*
+*/
+
+#ifndef URING_H
+#define URING_H
+
+// Includes
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// File defines and typedefs
+#define URING_ENTRIES        256
+
+typedef struct uring
+{
+   int                   fd;
+   void                 *ring_memory;
+   size_t                ring_size;
+   size_t                sqes_size;
+
+   // Submission queue, tail is ours until the next enter
+   _Atomic uint32_t     *sq_head;
+   _Atomic uint32_t     *sq_tail;
+   uint32_t              sq_mask;
+   uint32_t              sq_entries;
+   uint32_t              sq_local_tail;
+   unsigned int          pending;
+   struct io_uring_sqe  *sqes;
+
+   // Completion queue
+   _Atomic uint32_t     *cq_head;
+   _Atomic uint32_t     *cq_tail;
+   uint32_t              cq_mask;
+   struct io_uring_cqe  *cqes;
+
+   // Provided buffer ring
+   struct io_uring_buf_ring *buffers;
+   size_t                buffers_size;
+   uint8_t              *buffer_memory;
+   uint32_t              buffer_count;
+   uint32_t              buffer_length;
+   uint16_t              buffer_group;
+   uint16_t              buffer_tail;
+
+   unsigned long         enter_calls;
+} uring;
+
+int uring_init( uring *ring, unsigned int entries );
+int uring_setup_buffers( uring *ring, uint16_t group, unsigned int count, unsigned int length );
+struct io_uring_sqe *uring_get_sqe( uring *ring );
+bool uring_reserve( uring *ring, unsigned int count );
+void uring_prep_accept_multishot( struct io_uring_sqe *sqe, int fd, uint64_t user_data );
+void uring_prep_recv_multishot( struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data );
+void uring_prep_send( struct io_uring_sqe *sqe, int fd, const void *buffer, size_t length, uint64_t user_data );
+void uring_prep_cancel( struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data );
+int uring_submit_and_wait( uring *ring, unsigned int wait_count, int timeout_ms );
+struct io_uring_cqe *uring_peek_cqe( uring *ring );
+void uring_cqe_seen( uring *ring );
+uint8_t *uring_buffer( uring *ring, uint16_t id );
+void uring_recycle_buffer( uring *ring, uint16_t id );
+void uring_close( uring *ring );
+
+#endif // URING_H
@@ -0,0 +1,1122 @@
+/*
+* File: vbus.c
+*
+* Description: Virtual CAN bus.  See vbus.h.
+*
+*              Frame length in bits:
+*                standard  1 SOF + 11 ID + RTR + IDE + r0 + 4 DLC
+*                extended  1 SOF + 11 ID + SRR + IDE + 18 ID + RTR
+*                          + r1 + r0 + 4 DLC
+*                then      8 * DLC data + 15 CRC
+*                          + stuff bits over all of the above
+*                          + CRC delimiter + 2 ACK + 7 EOF + 3 IFS
+*
+*              A stuff bit of the opposite level follows every five
+*              equal bits, and starts the next run itself.
+*
+*              CAN FD frame length in bits, nominal bitrate:
+*                standard  1 SOF + 11 ID + RRS + IDE + FDF + res + BRS
+*                extended  1 SOF + 11 ID + SRR + IDE + 18 ID + RRS
+*                          + FDF + res + BRS
+*                          + 2 ACK + 7 EOF + 3 IFS
+*              data bitrate:
+*                          ESI + 4 DLC + 8 * length data
+*                          + 4 stuff count + 17 or 21 CRC
+*                          + a fixed stuff bit before the stuff count
+*                            and after every 4 bits that follow
+*                          + CRC delimiter
+*              Dynamic stuff bits are inserted from SOF to the end of
+*              the data, the CRC value does not change the length.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Bosch CAN Specification 2.0, Part A and B
+*   ISO 11898-1:2015, CAN FD
+*
+*/
+
+// Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "vbus.h"
+
+// File defines and typedefs
+#define SYSLOG_BUF_SIZE 80
+#define MS_PER_SEC      1000
+#define NS_PER_MS       1000000ULL
+#define NS_PER_SEC      1000000000ULL
+
+#define CAN_CRC15_POLY       0x4599
+#define CAN_STUFF_RUN        5
+#define CAN_TRAILER_BITS     ( 1 + 2 + 7 + 3 )
+#define CAN_ERROR_FRAME_BITS ( 6 + 8 + 3 )
+#define CAN_MAX_FRAME_BITS   ( 1 + 32 + 6 + VBUS_MAX_DLC * 8 + 15 )
+
+#define CANFD_MAX_FRAME_BITS ( 1 + 32 + 5 + 5 + VBUS_MAX_FD_LENGTH * 8 )
+#define CANFD_CRC17_LENGTH   16
+#define CANFD_FIXED_FIELD    4
+#define CANFD_TRAILER_BITS   ( 2 + 7 + 3 )
+
+// Longest the engine sleeps without checking for new frames
+#define VBUS_IDLE_MS    100
+
+// File data and functions
+static int map_bus( vbus **bus, const char *name, int flags );
+static void lock_bus( vbus *bus );
+static void *run_engine( void *context );
+static uint32_t stuff_bits( const uint8_t *bits, uint32_t count, uint32_t first, uint32_t last );
+static uint64_t frame_time_ns( vbus *bus, const vbus_frame *frame, uint32_t *frame_bits );
+static int pick_frame( vbus *bus, uint64_t now_ns, vbus_frame *frame );
+static void deliver_frame( vbus *bus, int source, const vbus_frame *frame );
+static void wait_bus( vbus *bus, pthread_cond_t *condition, int timeout_ms );
+static uint64_t monotonic_ns( void );
+static void sleep_until( uint64_t deadline_ns );
+
+
+/*
+* Name: vbus_create
+*
+* Description: Create a bus and start its engine
+*
+* Inputs: name - shared memory name, NULL for a bus used only by
+*                threads of this process
+*         config - bitrate, error rate and background traffic
+*
+* Outputs: bus - mapped bus
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int vbus_create( vbus **bus, const char *name, const vbus_config *config )
+{
+   pthread_mutexattr_t mutex_attr;
+   pthread_condattr_t cond_attr;
+   vbus *new_bus;
+   int status;
+
+   if ( name != NULL )
+   {
+      // Remove a segment left behind by a crashed owner
+      shm_unlink( name );
+   }
+
+   if ( EXIT_SUCCESS != map_bus( bus, name, O_RDWR | O_CREAT | O_EXCL ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   new_bus = *bus;
+   memset( new_bus, 0, sizeof( vbus ) );
+   if ( name != NULL )
+   {
+      strncpy( new_bus->name, name, sizeof( new_bus->name ) - 1 );
+   }
+   new_bus->config = *config;
+   if ( 0 == new_bus->config.bitrate )
+   {
+      new_bus->config.bitrate = VBUS_DEFAULT_BITRATE;
+   }
+   new_bus->seed = (unsigned int) monotonic_ns();
+   new_bus->stats.start_ns = monotonic_ns();
+
+   // A node killed while holding the lock must not stop the bus
+   pthread_mutexattr_init( &mutex_attr );
+   pthread_mutexattr_setpshared( &mutex_attr, PTHREAD_PROCESS_SHARED );
+   pthread_mutexattr_setrobust( &mutex_attr, PTHREAD_MUTEX_ROBUST );
+   pthread_mutex_init( &new_bus->lock, &mutex_attr );
+   pthread_mutexattr_destroy( &mutex_attr );
+
+   pthread_condattr_init( &cond_attr );
+   pthread_condattr_setpshared( &cond_attr, PTHREAD_PROCESS_SHARED );
+   pthread_condattr_setclock( &cond_attr, CLOCK_MONOTONIC );
+   pthread_cond_init( &new_bus->tx_ready, &cond_attr );
+   pthread_cond_init( &new_bus->rx_ready, &cond_attr );
+   pthread_condattr_destroy( &cond_attr );
+
+   new_bus->magic = VBUS_MAGIC;
+
+   status = pthread_create( &new_bus->engine, NULL, run_engine, new_bus );
+   if ( status != 0 )
+   {
+      syslog( LOG_ERR, "%s: Engine not started: %d", __func__, status );
+      vbus_detach( new_bus );
+      if ( name != NULL )
+      {
+         shm_unlink( name );
+      }
+      return( EXIT_FAILURE );
+   }
+
+   syslog(
+      LOG_INFO,
+      "Virtual bus %u bit/s, data %u bit/s, %u ppm errors, %u background frames/s",
+      new_bus->config.bitrate,
+      new_bus->config.data_bitrate,
+      new_bus->config.error_ppm,
+      new_bus->config.background_fps
+      );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: vbus_attach
+*
+* Description: Map a bus created by another process
+*
+* Inputs: name - shared memory name
+*
+* Outputs: bus - mapped bus
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - bus does not exist or is not running
+*
+*/
+int vbus_attach( vbus **bus, const char *name )
+{
+   if ( EXIT_SUCCESS != map_bus( bus, name, O_RDWR ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   if ( ( ( *bus )->magic != VBUS_MAGIC ) || ( *bus )->stop )
+   {
+      syslog( LOG_ERR, "%s: Bus not running", __func__ );
+      vbus_detach( *bus );
+      *bus = NULL;
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: vbus_join
+*
+* Description: Take a node slot.  Slots of processes that died without
+*              leaving are taken back first.
+*
+* Inputs: bus - mapped bus
+*
+* Outputs: node - node number
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - every slot is taken
+*
+*/
+int vbus_join( vbus *bus, int *node )
+{
+   int return_status = EXIT_FAILURE;
+   vbus_node *slot;
+   int i;
+
+   lock_bus( bus );
+   for ( i = 0; i < VBUS_MAX_NODES; i++ )
+   {
+      slot = &bus->nodes[ i ];
+      if ( slot->in_use && ( -1 == kill( slot->pid, 0 ) ) && ( ESRCH == errno ) )
+      {
+         slot->in_use = false;
+      }
+
+      if ( !slot->in_use )
+      {
+         memset( slot, 0, sizeof( vbus_node ) );
+         slot->in_use = true;
+         slot->pid = getpid();
+         *node = i;
+         return_status = EXIT_SUCCESS;
+         break;
+      }
+   }
+   pthread_mutex_unlock( &bus->lock );
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      syslog( LOG_ERR, "%s: No free node", __func__ );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: vbus_leave
+*
+* Description: Give back a node slot, frames still queued are dropped
+*
+* Inputs: bus - mapped bus
+*         node - node number
+*
+* Returns: None
+*
+*/
+void vbus_leave( vbus *bus, int node )
+{
+   lock_bus( bus );
+   bus->nodes[ node ].in_use = false;
+   pthread_mutex_unlock( &bus->lock );
+   return;
+}
+
+
+/*
+* Name: vbus_send
+*
+* Description: Queue a frame for transmission, waiting while the
+*              node's transmit ring is full.  A CAN FD frame is
+*              padded with zeros to the next length its DLC can code.
+*
+* Inputs: bus - mapped bus
+*         node - sending node
+*         frame - frame to send
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - bus stopped or invalid frame
+*
+*/
+int vbus_send( vbus *bus, int node, const vbus_frame *frame )
+{
+   vbus_node *slot = &bus->nodes[ node ];
+   vbus_frame *queued;
+   int return_status = EXIT_SUCCESS;
+
+   if ( frame->fd )
+   {
+      if ( ( 0 == bus->config.data_bitrate ) || ( frame->dlc > VBUS_MAX_FD_LENGTH ) )
+      {
+         return( EXIT_FAILURE );
+      }
+   }
+   else if ( frame->dlc > VBUS_MAX_DLC )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   lock_bus( bus );
+   while ( !bus->stop && ( slot->tx_head - slot->tx_tail >= VBUS_TX_SLOTS ) )
+   {
+      wait_bus( bus, &bus->rx_ready, VBUS_IDLE_MS );
+   }
+
+   if ( bus->stop )
+   {
+      return_status = EXIT_FAILURE;
+   }
+   else
+   {
+      queued = &slot->tx[ slot->tx_head % VBUS_TX_SLOTS ];
+      *queued = *frame;
+      if ( queued->fd )
+      {
+         queued->dlc = vbus_fd_length( frame->dlc );
+         memset( queued->data + frame->dlc, 0, queued->dlc - frame->dlc );
+      }
+      slot->tx_head++;
+      pthread_cond_signal( &bus->tx_ready );
+   }
+   pthread_mutex_unlock( &bus->lock );
+
+   return( return_status );
+}
+
+
+/*
+* Name: vbus_receive
+*
+* Description: Take the next frame delivered to a node
+*
+* Inputs: bus - mapped bus
+*         node - receiving node
+*         timeout_ms - maximum wait, -1 to wait until a frame arrives
+*
+* Outputs: frame - received frame
+*
+* Returns: 1 - frame received
+*          0 - nothing received in time
+*          -1 - bus stopped
+*
+*/
+int vbus_receive( vbus *bus, int node, vbus_frame *frame, int timeout_ms )
+{
+   vbus_node *slot = &bus->nodes[ node ];
+   uint64_t deadline_ns = monotonic_ns() + (uint64_t) timeout_ms * NS_PER_MS;
+   uint64_t now_ns;
+   int received = 0;
+
+   lock_bus( bus );
+   for(;;)
+   {
+      if ( slot->rx_head != slot->rx_tail )
+      {
+         *frame = slot->rx[ slot->rx_tail % VBUS_RX_SLOTS ];
+         slot->rx_tail++;
+         received = 1;
+         break;
+      }
+
+      if ( bus->stop )
+      {
+         received = -1;
+         break;
+      }
+
+      if ( timeout_ms < 0 )
+      {
+         wait_bus( bus, &bus->rx_ready, VBUS_IDLE_MS );
+      }
+      else
+      {
+         now_ns = monotonic_ns();
+         if ( now_ns >= deadline_ns )
+         {
+            break;
+         }
+         wait_bus( bus, &bus->rx_ready, (int) ( ( deadline_ns - now_ns + NS_PER_MS - 1 ) / NS_PER_MS ) );
+      }
+   }
+   pthread_mutex_unlock( &bus->lock );
+
+   return( received );
+}
+
+
+/*
+* Name: vbus_detach
+*
+* Description: Unmap a bus
+*
+* Inputs: bus - mapped bus
+*
+* Returns: None
+*
+*/
+void vbus_detach( vbus *bus )
+{
+   munmap( bus, sizeof( vbus ) );
+   return;
+}
+
+
+/*
+* Name: vbus_destroy
+*
+* Description: Stop the engine and remove a bus created by this
+*              process
+*
+* Inputs: bus - mapped bus
+*
+* Returns: None
+*
+*/
+void vbus_destroy( vbus *bus )
+{
+   char name[ VBUS_NAME_SIZE ];
+
+   lock_bus( bus );
+   bus->stop = true;
+   pthread_cond_broadcast( &bus->tx_ready );
+   pthread_cond_broadcast( &bus->rx_ready );
+   pthread_mutex_unlock( &bus->lock );
+
+   pthread_join( bus->engine, NULL );
+   vbus_report( bus );
+
+   memcpy( name, bus->name, sizeof( name ) );
+   vbus_detach( bus );
+   if ( name[ 0 ] != '\0' )
+   {
+      shm_unlink( name );
+   }
+   return;
+}
+
+
+/*
+* Name: vbus_frame_bits
+*
+* Description: Bits a frame occupies on the bus, including stuff bits
+*              and interframe space
+*
+* Inputs: frame - frame to measure
+*
+* Returns: Number of bits
+*
+*/
+uint32_t vbus_frame_bits( const vbus_frame *frame )
+{
+   uint8_t bits[ CAN_MAX_FRAME_BITS ];
+   uint32_t count = 0;
+   uint32_t crc = 0;
+   uint32_t i;
+   int bit;
+
+   bits[ count++ ] = 0;   // SOF
+   if ( frame->id > VBUS_MAX_STANDARD_ID )
+   {
+      for ( bit = 28; bit >= 18; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+      bits[ count++ ] = 1;   // SRR
+      bits[ count++ ] = 1;   // IDE
+      for ( bit = 17; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+      bits[ count++ ] = 0;   // RTR
+      bits[ count++ ] = 0;   // r1
+      bits[ count++ ] = 0;   // r0
+   }
+   else
+   {
+      for ( bit = 10; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+      bits[ count++ ] = 0;   // RTR
+      bits[ count++ ] = 0;   // IDE
+      bits[ count++ ] = 0;   // r0
+   }
+
+   for ( bit = 3; bit >= 0; bit-- )
+   {
+      bits[ count++ ] = ( frame->dlc >> bit ) & 1;
+   }
+   for ( i = 0; i < frame->dlc; i++ )
+   {
+      for ( bit = 7; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( frame->data[ i ] >> bit ) & 1;
+      }
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      if ( bits[ i ] ^ ( ( crc >> 14 ) & 1 ) )
+      {
+         crc = ( ( crc << 1 ) ^ CAN_CRC15_POLY ) & 0x7FFF;
+      }
+      else
+      {
+         crc = ( crc << 1 ) & 0x7FFF;
+      }
+   }
+   for ( bit = 14; bit >= 0; bit-- )
+   {
+      bits[ count++ ] = ( crc >> bit ) & 1;
+   }
+
+   return( count + stuff_bits( bits, count, 0, count ) + CAN_TRAILER_BITS );
+}
+
+
+/*
+* Name: vbus_fd_frame_bits
+*
+* Description: Bits a CAN FD frame occupies on the bus, including
+*              stuff bits and interframe space
+*
+* Inputs: frame - CAN FD frame to measure
+*
+* Outputs: data_bits - bits sent at the data bitrate
+*
+* Returns: Number of bits
+*
+*/
+uint32_t vbus_fd_frame_bits( const vbus_frame *frame, uint32_t *data_bits )
+{
+   uint8_t bits[ CANFD_MAX_FRAME_BITS ];
+   uint8_t length = vbus_fd_length( frame->dlc );
+   uint8_t code = 0;
+   uint32_t count = 0;
+   uint32_t arbitration;
+   uint32_t fixed;
+   uint32_t i;
+   int bit;
+
+   bits[ count++ ] = 0;   // SOF
+   if ( frame->id > VBUS_MAX_STANDARD_ID )
+   {
+      for ( bit = 28; bit >= 18; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+      bits[ count++ ] = 1;   // SRR
+      bits[ count++ ] = 1;   // IDE
+      for ( bit = 17; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+   }
+   else
+   {
+      for ( bit = 10; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( frame->id >> bit ) & 1;
+      }
+      bits[ count++ ] = 0;   // IDE
+   }
+   bits[ count++ ] = 0;   // RRS
+   bits[ count++ ] = 1;   // FDF
+   bits[ count++ ] = 0;   // res
+   bits[ count++ ] = 1;   // BRS
+   arbitration = count;
+
+   if ( length <= 8 )
+   {
+      code = length;
+   }
+   else if ( length <= 24 )
+   {
+      code = (uint8_t) ( 8 + ( length - 8 ) / 4 );
+   }
+   else
+   {
+      code = ( 32 == length ) ? 13 : ( ( 48 == length ) ? 14 : 15 );
+   }
+
+   bits[ count++ ] = 0;   // ESI
+   for ( bit = 3; bit >= 0; bit-- )
+   {
+      bits[ count++ ] = ( code >> bit ) & 1;
+   }
+   for ( i = 0; i < length; i++ )
+   {
+      for ( bit = 7; bit >= 0; bit-- )
+      {
+         bits[ count++ ] = ( ( i < frame->dlc ) ? ( frame->data[ i ] >> bit ) : 0 ) & 1;
+      }
+   }
+
+   // Stuff count and CRC with their fixed stuff bits, then the delimiter
+   fixed = 4 + ( ( length > CANFD_CRC17_LENGTH ) ? 21 : 17 );
+   fixed += ( fixed + CANFD_FIXED_FIELD - 1 ) / CANFD_FIXED_FIELD + 1;
+
+   *data_bits = ( count - arbitration ) + stuff_bits( bits, count, arbitration, count ) + fixed;
+   return( arbitration + stuff_bits( bits, count, 0, arbitration ) + CANFD_TRAILER_BITS + *data_bits );
+}
+
+
+/*
+* Name: vbus_fd_length
+*
+* Description: Smallest CAN FD data length of at least length bytes,
+*              above 8 bytes a DLC codes 12, 16, 20, 24, 32, 48 or 64
+*
+* Inputs: length - data bytes
+*
+* Returns: CAN FD data length
+*
+*/
+uint8_t vbus_fd_length( uint8_t length )
+{
+   if ( length <= 8 )
+   {
+      return( length );
+   }
+   if ( length <= 24 )
+   {
+      return( (uint8_t) ( ( length + 3 ) & ~3 ) );
+   }
+   if ( length <= 32 )
+   {
+      return( 32 );
+   }
+   if ( length <= 48 )
+   {
+      return( 48 );
+   }
+   return( VBUS_MAX_FD_LENGTH );
+}
+
+
+/*
+* Name: stuff_bits
+*
+* Description: Stuff bits the transmitter inserts into part of a bit
+*              stream.  Stuffing runs from the first bit, so the runs
+*              before the part are followed too.
+*
+* Inputs: bits - bit stream
+*         count - stream length
+*         first - first bit of the part
+*         last - bit after the part
+*
+* Returns: Number of stuff bits inserted after bits of the part
+*
+*/
+uint32_t stuff_bits( const uint8_t *bits, uint32_t count, uint32_t first, uint32_t last )
+{
+   uint32_t stuffed = 0;
+   uint32_t run = 1;
+   uint32_t i;
+   uint8_t level = bits[ 0 ];
+
+   for ( i = 1; ( i < count ) && ( i < last ); i++ )
+   {
+      if ( bits[ i ] == level )
+      {
+         run++;
+      }
+      else
+      {
+         level = bits[ i ];
+         run = 1;
+      }
+
+      if ( CAN_STUFF_RUN == run )
+      {
+         if ( i >= first )
+         {
+            stuffed++;
+         }
+         level = !level;
+         run = 1;
+      }
+   }
+   return( stuffed );
+}
+
+
+/*
+* Name: vbus_report
+*
+* Description: Log and print the bus statistics
+*
+* Inputs: bus - mapped bus
+*
+* Returns: None
+*
+*/
+void vbus_report( vbus *bus )
+{
+   vbus_stats *stats = &bus->stats;
+   uint64_t elapsed_ns = monotonic_ns() - stats->start_ns;
+   double load = 0;
+
+   if ( elapsed_ns > 0 )
+   {
+      load = 100.0 * stats->busy_ns / elapsed_ns;
+   }
+
+   syslog(
+      LOG_INFO,
+      "Virtual bus: %llu frames, %llu background, %llu errors, "
+      "%llu arbitration losses, %llu overruns, load %.1f%%",
+      (unsigned long long) stats->frames,
+      (unsigned long long) stats->background_frames,
+      (unsigned long long) stats->errors,
+      (unsigned long long) stats->arbitration_losses,
+      (unsigned long long) stats->rx_overruns,
+      load
+      );
+   printf(
+      "Virtual bus: %llu frames, %llu background, %llu errors, "
+      "%llu arbitration losses, %llu overruns, load %.1f%% of %u bit/s\n",
+      (unsigned long long) stats->frames,
+      (unsigned long long) stats->background_frames,
+      (unsigned long long) stats->errors,
+      (unsigned long long) stats->arbitration_losses,
+      (unsigned long long) stats->rx_overruns,
+      load,
+      bus->config.bitrate
+      );
+   return;
+}
+
+
+/*
+* Name: map_bus
+*
+* Description: Map the bus shared memory, or an anonymous mapping
+*              when there is no name
+*
+* Inputs: name - shared memory name or NULL
+*         flags - shm_open() flags
+*
+* Outputs: bus - mapped bus
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int map_bus( vbus **bus, const char *name, int flags )
+{
+   int fd = -1;
+   void *address;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( NULL == name )
+   {
+      address = mmap( NULL, sizeof( vbus ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+   }
+   else
+   {
+      fd = shm_open( name, flags, S_IRUSR | S_IWUSR );
+      if ( -1 == fd )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return( EXIT_FAILURE );
+      }
+
+      if ( ( flags & O_CREAT ) && ( -1 == ftruncate( fd, sizeof( vbus ) ) ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         close( fd );
+         shm_unlink( name );
+         return( EXIT_FAILURE );
+      }
+
+      address = mmap( NULL, sizeof( vbus ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+      close( fd );
+   }
+
+   if ( MAP_FAILED == address )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+
+   *bus = address;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: lock_bus
+*
+* Description: Take the bus lock, recovering it from a node that died
+*              while holding it
+*
+* Inputs: bus - mapped bus
+*
+* Returns: None
+*
+*/
+void lock_bus( vbus *bus )
+{
+   if ( EOWNERDEAD == pthread_mutex_lock( &bus->lock ) )
+   {
+      pthread_mutex_consistent( &bus->lock );
+   }
+   return;
+}
+
+
+/*
+* Name: run_engine
+*
+* Description: Bus engine thread.  Each round the lowest identifier
+*              among the queued frames wins the bus, the bus is held
+*              for the frame's bit time, then the frame is delivered.
+*              Frames queued while the bus is busy compete in the next
+*              round.
+*
+* Inputs: context - bus
+*
+* Returns: NULL
+*
+*/
+void *run_engine( void *context )
+{
+   vbus *bus = context;
+   vbus_frame frame;
+   uint64_t start_ns;
+   uint64_t end_ns;
+   uint64_t free_ns = 0;
+   uint64_t frame_ns;
+   uint32_t frame_bits;
+   uint32_t bus_bits;
+   bool error;
+   int source;
+
+   lock_bus( bus );
+   while ( !bus->stop )
+   {
+      start_ns = monotonic_ns();
+      if ( start_ns < free_ns )
+      {
+         start_ns = free_ns;
+      }
+
+      source = pick_frame( bus, start_ns, &frame );
+      if ( -1 == source )
+      {
+         wait_bus( bus, &bus->tx_ready, VBUS_IDLE_MS );
+         continue;
+      }
+
+      frame_ns = frame_time_ns( bus, &frame, &frame_bits );
+      bus_bits = frame_bits;
+      error = ( bus->config.error_ppm > 0 )
+           && ( (uint32_t) ( rand_r( &bus->seed ) % 1000000 ) < bus->config.error_ppm );
+      if ( error )
+      {
+         // The error is seen somewhere in the frame, then signalled
+         bus_bits = 1 + rand_r( &bus->seed ) % frame_bits;
+         frame_ns = frame_ns * bus_bits / frame_bits
+                  + (uint64_t) CAN_ERROR_FRAME_BITS * NS_PER_SEC / bus->config.bitrate;
+         bus_bits += CAN_ERROR_FRAME_BITS;
+      }
+      end_ns = start_ns + frame_ns;
+
+      pthread_mutex_unlock( &bus->lock );
+      sleep_until( end_ns );
+      lock_bus( bus );
+
+      free_ns = end_ns;
+      bus->stats.busy_ns += end_ns - start_ns;
+      bus->stats.bits += bus_bits;
+
+      if ( error )
+      {
+         // The frame stays queued and is sent again
+         bus->stats.errors++;
+         continue;
+      }
+
+      frame.timestamp_ns = end_ns;
+      if ( VBUS_MAX_NODES == source )
+      {
+         bus->stats.background_frames++;
+         bus->background_ns += NS_PER_SEC / bus->config.background_fps;
+      }
+      else
+      {
+         bus->stats.frames++;
+         bus->nodes[ source ].tx_tail++;
+      }
+      deliver_frame( bus, source, &frame );
+   }
+   pthread_mutex_unlock( &bus->lock );
+
+   return( NULL );
+}
+
+
+/*
+* Name: frame_time_ns
+*
+* Description: Time a frame holds the bus, the data phase of a CAN FD
+*              frame runs at the data bitrate
+*
+* Inputs: bus - mapped bus
+*         frame - frame to send
+*
+* Outputs: frame_bits - bits of the frame
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t frame_time_ns( vbus *bus, const vbus_frame *frame, uint32_t *frame_bits )
+{
+   uint32_t data_bits;
+
+   if ( !frame->fd )
+   {
+      *frame_bits = vbus_frame_bits( frame );
+      return( (uint64_t) *frame_bits * NS_PER_SEC / bus->config.bitrate );
+   }
+
+   *frame_bits = vbus_fd_frame_bits( frame, &data_bits );
+   return(   (uint64_t) ( *frame_bits - data_bits ) * NS_PER_SEC / bus->config.bitrate
+           + (uint64_t) data_bits * NS_PER_SEC / bus->config.data_bitrate );
+}
+
+
+/*
+* Name: pick_frame
+*
+* Description: Arbitrate between the frames at the head of each
+*              node's transmit ring and the background traffic.  The
+*              lowest identifier wins, every other waiting frame
+*              counts an arbitration loss.  Called with the bus lock.
+*
+* Inputs: bus - mapped bus
+*         now_ns - start of the arbitration
+*
+* Outputs: frame - winning frame
+*
+* Returns: Winning node, VBUS_MAX_NODES for background traffic,
+*          -1 when nothing is waiting
+*
+*/
+int pick_frame( vbus *bus, uint64_t now_ns, vbus_frame *frame )
+{
+   vbus_node *slot;
+   vbus_frame *head;
+   int winner = -1;
+   int contenders = 0;
+   int i;
+
+   for ( i = 0; i < VBUS_MAX_NODES; i++ )
+   {
+      slot = &bus->nodes[ i ];
+      if ( slot->in_use && ( slot->tx_head != slot->tx_tail ) )
+      {
+         head = &slot->tx[ slot->tx_tail % VBUS_TX_SLOTS ];
+         contenders++;
+         if ( ( -1 == winner ) || ( head->id < frame->id ) )
+         {
+            winner = i;
+            *frame = *head;
+         }
+      }
+   }
+
+   if ( bus->config.background_fps > 0 )
+   {
+      if ( 0 == bus->background_ns )
+      {
+         bus->background_ns = now_ns;
+      }
+
+      if ( bus->background_ns <= now_ns )
+      {
+         contenders++;
+         if ( ( -1 == winner ) || ( VBUS_BACKGROUND_ID < frame->id ) )
+         {
+            winner = VBUS_MAX_NODES;
+            memset( frame, 0, sizeof( vbus_frame ) );
+            frame->id = VBUS_BACKGROUND_ID;
+            frame->dlc = VBUS_MAX_DLC;
+         }
+      }
+   }
+
+   if ( contenders > 1 )
+   {
+      bus->stats.arbitration_losses += (uint64_t) ( contenders - 1 );
+   }
+   return( winner );
+}
+
+
+/*
+* Name: deliver_frame
+*
+* Description: Copy a frame to the receive ring of every node except
+*              the sender and wake the receivers.  A full ring drops
+*              the frame, like a controller overrun.  Called with the
+*              bus lock.
+*
+* Inputs: bus - mapped bus
+*         source - sending node
+*         frame - frame to deliver
+*
+* Returns: None
+*
+*/
+void deliver_frame( vbus *bus, int source, const vbus_frame *frame )
+{
+   vbus_node *slot;
+   int i;
+
+   for ( i = 0; i < VBUS_MAX_NODES; i++ )
+   {
+      slot = &bus->nodes[ i ];
+      if ( !slot->in_use || ( i == source ) )
+      {
+         continue;
+      }
+
+      if ( slot->rx_head - slot->rx_tail >= VBUS_RX_SLOTS )
+      {
+         bus->stats.rx_overruns++;
+         continue;
+      }
+      slot->rx[ slot->rx_head % VBUS_RX_SLOTS ] = *frame;
+      slot->rx_head++;
+   }
+   pthread_cond_broadcast( &bus->rx_ready );
+   return;
+}
+
+
+/*
+* Name: wait_bus
+*
+* Description: Wait on a bus condition, called with the bus lock
+*
+* Inputs: bus - mapped bus
+*         condition - condition to wait on
+*         timeout_ms - maximum wait
+*
+* Returns: None
+*
+*/
+void wait_bus( vbus *bus, pthread_cond_t *condition, int timeout_ms )
+{
+   struct timespec deadline;
+   uint64_t deadline_ns = monotonic_ns() + (uint64_t) timeout_ms * NS_PER_MS;
+
+   deadline.tv_sec = (time_t) ( deadline_ns / NS_PER_SEC );
+   deadline.tv_nsec = (long) ( deadline_ns % NS_PER_SEC );
+   if ( EOWNERDEAD == pthread_cond_timedwait( condition, &bus->lock, &deadline ) )
+   {
+      pthread_mutex_consistent( &bus->lock );
+   }
+   return;
+}
+
+
+/*
+* Name: monotonic_ns
+*
+* Description: Monotonic clock in nanoseconds
+*
+* Inputs: None
+*
+* Returns: Nanoseconds
+*
+*/
+uint64_t monotonic_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
+
+
+/*
+* Name: sleep_until
+*
+* Description: Sleep until a monotonic time
+*
+* Inputs: deadline_ns - wake up time
+*
+* Returns: None
+*
+*/
+void sleep_until( uint64_t deadline_ns )
+{
+   struct timespec deadline;
+
+   deadline.tv_sec = (time_t) ( deadline_ns / NS_PER_SEC );
+   deadline.tv_nsec = (long) ( deadline_ns % NS_PER_SEC );
+   while ( EINTR == clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL ) )
+   {
+   }
+   return;
+}
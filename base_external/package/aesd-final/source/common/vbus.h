@@ -0,0 +1,139 @@
+/*
+* File: vbus.h
+*
+* Description: Virtual CAN bus for running the vehicle and scan tools
+*              without CAN hardware.
+*
+*              Nodes queue frames, the bus engine thread arbitrates
+*              between the queued frames (lowest identifier wins, as on
+*              a real bus), holds the bus for the bit time of the
+*              winning frame including stuff bits, then delivers it to
+*              every other node.  Frames can be corrupted at a
+*              configured rate, a corrupted frame costs the bits sent
+*              before the error plus an error frame and is sent again.
+*              Background traffic from other ECUs can be added at a
+*              fixed rate with a higher priority identifier.
+*
+*              A bus with a data bitrate also carries CAN FD frames of
+*              up to 64 data bytes.  Their arbitration and trailer run
+*              at the bitrate, the control, data and CRC fields at the
+*              data bitrate (bit rate switch).
+*
+*              The bus lives in a POSIX shared memory segment so nodes
+*              can be separate processes, or in an anonymous mapping
+*              for nodes that are threads of one process.  The engine
+*              runs in the process that creates the bus.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Bosch CAN Specification 2.0, Part A and B
+*   ISO 11898-1:2015, CAN FD
+*   man 3 pthread_mutexattr_setpshared
+*
+*/
+
+#ifndef VBUS_H
+#define VBUS_H
+
+// Includes
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// File defines and typedefs
+#define VBUS_NAME               "/aesd_vbus"
+#define VBUS_MAGIC              0x53554256
+#define VBUS_MAX_NODES          8
+#define VBUS_TX_SLOTS           32
+#define VBUS_RX_SLOTS           256
+#define VBUS_MAX_DLC            8
+#define VBUS_MAX_FD_LENGTH     64
+#define VBUS_NAME_SIZE          32
+
+// Standard identifiers are 11 bits, larger ones are sent extended
+#define VBUS_MAX_STANDARD_ID    0x7FF
+#define VBUS_BACKGROUND_ID      0x100
+
+#define VBUS_DEFAULT_BITRATE    125000
+
+// dlc is the number of data bytes, for a CAN FD frame one of the
+// lengths a CAN FD DLC can code
+typedef struct vbus_frame
+{
+   uint32_t id;
+   uint8_t  dlc;
+   bool     fd;
+   uint8_t  data[ VBUS_MAX_FD_LENGTH ];
+   uint64_t timestamp_ns;
+} vbus_frame;
+
+typedef struct vbus_config
+{
+   uint32_t bitrate;
+   uint32_t data_bitrate;   // CAN FD data phase, 0 for a classic bus
+   uint32_t error_ppm;
+   uint32_t background_fps;
+} vbus_config;
+
+typedef struct vbus_stats
+{
+   uint64_t start_ns;
+   uint64_t busy_ns;
+   uint64_t bits;
+   uint64_t frames;
+   uint64_t background_frames;
+   uint64_t errors;
+   uint64_t arbitration_losses;
+   uint64_t rx_overruns;
+} vbus_stats;
+
+// The transmit ring is filled by the node and emptied by the engine,
+// the receive ring the other way round, both under the bus lock
+typedef struct vbus_node
+{
+   bool       in_use;
+   pid_t      pid;
+   uint32_t   tx_head;
+   uint32_t   tx_tail;
+   uint32_t   rx_head;
+   uint32_t   rx_tail;
+   vbus_frame tx[ VBUS_TX_SLOTS ];
+   vbus_frame rx[ VBUS_RX_SLOTS ];
+} vbus_node;
+
+typedef struct vbus
+{
+   uint32_t        magic;
+   char            name[ VBUS_NAME_SIZE ];   // empty for a process local bus
+   bool            stop;
+   vbus_config     config;
+   pthread_mutex_t lock;
+   pthread_cond_t  tx_ready;
+   pthread_cond_t  rx_ready;
+   pthread_t       engine;        // valid in the creating process only
+   uint64_t        background_ns;
+   unsigned int    seed;
+   vbus_stats      stats;
+   vbus_node       nodes[ VBUS_MAX_NODES ];
+} vbus;
+
+int vbus_create( vbus **bus, const char *name, const vbus_config *config );
+int vbus_attach( vbus **bus, const char *name );
+int vbus_join( vbus *bus, int *node );
+void vbus_leave( vbus *bus, int node );
+int vbus_send( vbus *bus, int node, const vbus_frame *frame );
+int vbus_receive( vbus *bus, int node, vbus_frame *frame, int timeout_ms );
+void vbus_detach( vbus *bus );
+void vbus_destroy( vbus *bus );
+uint32_t vbus_frame_bits( const vbus_frame *frame );
+uint32_t vbus_fd_frame_bits( const vbus_frame *frame, uint32_t *data_bits );
+uint8_t vbus_fd_length( uint8_t length );
+void vbus_report( vbus *bus );
+
+#endif // VBUS_H
@@ -0,0 +1,580 @@
+/*
+ * devmem2.c: Simple program to read/write from/to any location in memory.
+ *
+ *  Copyright (C) 2000, Jan-Derk Bakker (J.D.Bakker@its.tudelft.nl)
+ *
+ *
+ * This software has been developed for the LART computing board
+ * (http://www.lart.tudelft.nl/). The development has been sponsored by
+ * the Mobile MultiMedia Communications (http://www.mmc.tudelft.nl/)
+ * and Ubiquitous Communications (http://www.ubicom.tudelft.nl/)
+ * projects.
+ *
+ * The author can be reached at:
+ *
+ *  Jan-Derk Bakker
+ *  Information and Communication Theory Group
+ *  Faculty of Information Technology and Systems
+ *  Delft University of Technology
+ *  P.O. Box 5031
+ *  2600 GA Delft
+ *  The Netherlands
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <termios.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+  
+#define FATAL do { fprintf(stderr, "Error at line %d, file %s (%d) [%s]\n", \
+  __LINE__, __FILE__, errno, strerror(errno)); exit(1); } while(0)
+ 
+#define MAP_SIZE 4096UL
+#define MAP_MASK (MAP_SIZE - 1)
+
+#define SNAPSHOT_MAGIC "DM2S"
+#define HEX_LINE_BYTES 16
+
+#define WATCH_MAGIC "DM2W"
+#define WATCH_MAX_ADDRESSES 64
+#define WATCH_RING_ENTRIES 65536
+#define NSEC_PER_SEC 1000000000LL
+
+/* Snapshot file: this header, then the bytes of the range as read */
+struct snapshot_header {
+	char magic[4];
+	uint32_t width;
+	uint64_t address;
+	uint64_t length;
+};
+
+/*
+ * Watch ring file: this header, the watched addresses as uint64_t, then
+ * the changes oldest first.  A change holds the index of the address.
+ */
+struct watch_header {
+	char magic[4];
+	uint32_t width;
+	uint32_t addresses;
+	uint32_t changes;
+	uint64_t dropped;
+};
+
+struct watch_change {
+	uint64_t time_ns;
+	uint32_t index;
+	uint32_t value;
+};
+
+static volatile sig_atomic_t stop_watch;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "\nUsage:\t%s { address } [ type [ data ] ]\n"
+		"\t%s -r address -n length [ -t type ] [ -f hex|bin ] [ -o snapshot ] [ -m device ]\n"
+		"\t%s -x snapshot snapshot\n"
+		"\t%s -w address[,address...] [ -t type ] [ -i interval_us ] [ -c samples ]\n"
+		"\t\t[ -d seconds ] [ -R entries ] [ -o ring ] [ -m device ]\n"
+		"\taddress : memory address to act upon\n"
+		"\ttype    : access operation type : [b]yte, [h]alfword, [w]ord\n"
+		"\tdata    : data to be written\n"
+		"\t-r      : read a range, mapped once, at the access width\n"
+		"\t-n      : length of the range in bytes\n"
+		"\t-f      : print hex (default) or write raw binary to stdout\n"
+		"\t-o      : save the range to a snapshot file instead\n"
+		"\t-m      : device or file to map, /dev/mem by default\n"
+		"\t-x      : print the values that differ between two snapshots\n"
+		"\t-w      : sample addresses until -c, -d or ^C, record the changes\n"
+		"\t-i      : sample period in us, 0 polls without sleeping (default 1000)\n"
+		"\t-R      : changes kept, the oldest are dropped (default %d)\n"
+		"\t-o      : with -w, save the changes to a ring file instead\n\n",
+		name, name, name, name, WATCH_RING_ENTRIES);
+	exit(1);
+}
+
+static int access_width(int access_type)
+{
+	switch(access_type) {
+		case 'b': return 1;
+		case 'h': return 2;
+		case 'w': return 4;
+	}
+	fprintf(stderr, "Illegal data type '%c'.\n", access_type);
+	exit(2);
+}
+
+/* Map the pages covering [target, target + length), returns the address of target */
+static volatile uint8_t *map_range(int fd, off_t target, size_t length, int prot,
+	void **map_base, size_t *map_size)
+{
+	off_t page = target & ~MAP_MASK;
+
+	*map_size = ((target - page) + length + MAP_MASK) & ~MAP_MASK;
+	*map_base = mmap(0, *map_size, prot, MAP_SHARED, fd, page);
+	if(*map_base == MAP_FAILED) FATAL;
+	return (volatile uint8_t *) *map_base + (target - page);
+}
+
+/* One access of the given width, registers must not be read piecewise */
+static uint32_t read_value(volatile uint8_t *virt_addr, int width)
+{
+	switch(width) {
+		case 1: return *virt_addr;
+		case 2: return *(volatile uint16_t *) virt_addr;
+	}
+	return *(volatile uint32_t *) virt_addr;
+}
+
+static uint32_t buffer_value(const uint8_t *buffer, int width)
+{
+	uint16_t half;
+	uint32_t word;
+
+	switch(width) {
+		case 1:
+			return *buffer;
+		case 2:
+			memcpy(&half, buffer, sizeof(half));
+			return half;
+	}
+	memcpy(&word, buffer, sizeof(word));
+	return word;
+}
+
+static void store_value(uint8_t *buffer, uint32_t value, int width)
+{
+	uint16_t half = value;
+
+	switch(width) {
+		case 1:
+			*buffer = value;
+			return;
+		case 2:
+			memcpy(buffer, &half, sizeof(half));
+			return;
+	}
+	memcpy(buffer, &value, sizeof(value));
+}
+
+static void print_hex(const uint8_t *buffer, size_t length, off_t target, int width)
+{
+	size_t offset;
+
+	for(offset = 0; offset < length; offset += width) {
+		if(offset % HEX_LINE_BYTES == 0)
+			printf("%s%08llX:", offset ? "\n" : "",
+				(unsigned long long) (target + offset));
+		printf(" %0*X", width * 2, buffer_value(buffer + offset, width));
+	}
+	printf("\n");
+}
+
+static uint8_t *read_snapshot(const char *path, struct snapshot_header *header)
+{
+	FILE *file;
+	uint8_t *buffer;
+
+	if((file = fopen(path, "rb")) == NULL) FATAL;
+	if(fread(header, sizeof(*header), 1, file) != 1
+	   || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s is not a snapshot.\n", path);
+		exit(1);
+	}
+	/* The diff steps through the buffer by the width */
+	if((header->width != 1 && header->width != 2 && header->width != 4)
+	   || header->length % header->width) {
+		fprintf(stderr, "%s has a bad access width.\n", path);
+		exit(1);
+	}
+	if((buffer = malloc(header->length ? header->length : 1)) == NULL) FATAL;
+	if(fread(buffer, 1, header->length, file) != header->length) {
+		fprintf(stderr, "%s is truncated.\n", path);
+		exit(1);
+	}
+	fclose(file);
+	return buffer;
+}
+
+static int diff_snapshots(const char *old_path, const char *new_path)
+{
+	struct snapshot_header old_header, new_header;
+	uint8_t *old_buffer, *new_buffer;
+	uint32_t old_value, new_value;
+	unsigned long changed = 0;
+	uint64_t offset;
+	int width;
+
+	old_buffer = read_snapshot(old_path, &old_header);
+	new_buffer = read_snapshot(new_path, &new_header);
+	if(old_header.address != new_header.address
+	   || old_header.length != new_header.length
+	   || old_header.width != new_header.width) {
+		fprintf(stderr, "Snapshots are of different ranges.\n");
+		exit(1);
+	}
+
+	width = old_header.width;
+	for(offset = 0; offset < old_header.length; offset += width) {
+		old_value = buffer_value(old_buffer + offset, width);
+		new_value = buffer_value(new_buffer + offset, width);
+		if(old_value != new_value) {
+			printf("%08llX: %0*X -> %0*X (bits %0*X)\n",
+				(unsigned long long) (old_header.address + offset),
+				width * 2, old_value, width * 2, new_value,
+				width * 2, old_value ^ new_value);
+			changed++;
+		}
+	}
+	fprintf(stderr, "%lu of %llu values differ.\n", changed,
+		(unsigned long long) (old_header.length / width));
+
+	free(old_buffer);
+	free(new_buffer);
+	return 0;
+}
+
+static void on_signal(int signal_number)
+{
+	(void) signal_number;
+	stop_watch = 1;
+}
+
+static int64_t elapsed_ns(const struct timespec *start, const struct timespec *now)
+{
+	return (now->tv_sec - start->tv_sec) * NSEC_PER_SEC + (now->tv_nsec - start->tv_nsec);
+}
+
+static int parse_addresses(char *list, off_t *addresses)
+{
+	char *token, *next;
+	int count = 0;
+
+	for(token = strtok_r(list, ",", &next); token; token = strtok_r(NULL, ",", &next)) {
+		if(count == WATCH_MAX_ADDRESSES) {
+			fprintf(stderr, "At most %d addresses can be watched.\n", WATCH_MAX_ADDRESSES);
+			exit(1);
+		}
+		addresses[count++] = strtoull(token, 0, 0);
+	}
+	return count;
+}
+
+static void save_changes(const char *path, const off_t *addresses, int count, int width,
+	const struct watch_change *ring, size_t entries, uint64_t recorded)
+{
+	struct watch_header header;
+	uint64_t address, n;
+	FILE *file;
+	int i;
+
+	memcpy(header.magic, WATCH_MAGIC, sizeof(header.magic));
+	header.width = width;
+	header.addresses = count;
+	header.changes = recorded < entries ? recorded : entries;
+	header.dropped = recorded - header.changes;
+
+	if((file = fopen(path, "wb")) == NULL) FATAL;
+	if(fwrite(&header, sizeof(header), 1, file) != 1) FATAL;
+	for(i = 0; i < count; i++) {
+		address = addresses[i];
+		if(fwrite(&address, sizeof(address), 1, file) != 1) FATAL;
+	}
+	for(n = header.dropped; n < recorded; n++)
+		if(fwrite(&ring[n % entries], sizeof(*ring), 1, file) != 1) FATAL;
+	if(fclose(file) != 0) FATAL;
+}
+
+static void print_changes(const off_t *addresses, int width,
+	const struct watch_change *ring, size_t entries, uint64_t recorded)
+{
+	uint64_t n = recorded < entries ? 0 : recorded - entries;
+	const struct watch_change *change;
+
+	for(; n < recorded; n++) {
+		change = &ring[n % entries];
+		printf("%llu.%06llu %08llX: %0*X\n",
+			(unsigned long long) (change->time_ns / NSEC_PER_SEC),
+			(unsigned long long) (change->time_ns % NSEC_PER_SEC / 1000),
+			(unsigned long long) addresses[change->index], width * 2, change->value);
+	}
+}
+
+/*
+ * Sample a few registers at a fixed period from one mapping.  Deadlines
+ * are absolute, so a late sample does not shift the ones after it; it is
+ * counted as an overrun.  Only changes are kept, the first sample records
+ * every address.
+ */
+static int watch_registers(const char *device, char *list, int width, long interval_us,
+	unsigned long samples, double seconds, size_t entries, const char *output)
+{
+	off_t addresses[WATCH_MAX_ADDRESSES], low, high;
+	uint32_t last[WATCH_MAX_ADDRESSES], value;
+	struct watch_change *ring;
+	struct timespec start, deadline, now;
+	struct sigaction action;
+	volatile uint8_t *virt_addr;
+	void *map_base;
+	size_t map_size;
+	uint64_t recorded = 0, taken = 0, overruns = 0;
+	int64_t time_ns, period_ns = interval_us * 1000LL;
+	int count, fd, i;
+
+	if((count = parse_addresses(list, addresses)) == 0) {
+		fprintf(stderr, "No address to watch.\n");
+		exit(1);
+	}
+	low = high = addresses[0];
+	for(i = 0; i < count; i++) {
+		if(addresses[i] % width) {
+			fprintf(stderr, "Addresses must be multiples of the access width.\n");
+			exit(1);
+		}
+		if(addresses[i] < low) low = addresses[i];
+		if(addresses[i] > high) high = addresses[i];
+	}
+	if(entries == 0 || (ring = malloc(entries * sizeof(*ring))) == NULL) FATAL;
+
+	if((fd = open(device, O_RDONLY | O_SYNC)) == -1) FATAL;
+	virt_addr = map_range(fd, low, high - low + width, PROT_READ, &map_base, &map_size);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = start;
+	while(!stop_watch && (samples == 0 || taken < samples)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		time_ns = elapsed_ns(&start, &now);
+		if(seconds > 0 && time_ns >= seconds * NSEC_PER_SEC)
+			break;
+
+		for(i = 0; i < count; i++) {
+			value = read_value(virt_addr + (addresses[i] - low), width);
+			if(taken == 0 || value != last[i]) {
+				ring[recorded % entries].time_ns = time_ns;
+				ring[recorded % entries].index = i;
+				ring[recorded % entries].value = value;
+				recorded++;
+				last[i] = value;
+			}
+		}
+		taken++;
+
+		if(period_ns > 0) {
+			deadline.tv_nsec += period_ns % NSEC_PER_SEC;
+			deadline.tv_sec += period_ns / NSEC_PER_SEC + deadline.tv_nsec / NSEC_PER_SEC;
+			deadline.tv_nsec %= NSEC_PER_SEC;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if(elapsed_ns(&deadline, &now) > 0)
+				overruns++;
+			else
+				while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR
+				      && !stop_watch);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_ns = elapsed_ns(&start, &now);
+
+	if(munmap(map_base, map_size) == -1) FATAL;
+	close(fd);
+
+	if(output)
+		save_changes(output, addresses, count, width, ring, entries, recorded);
+	else
+		print_changes(addresses, width, ring, entries, recorded);
+
+	fprintf(stderr, "%llu samples of %d addresses in %.3f s, %.0f samples/s, "
+		"%llu overruns, %llu changes, %llu dropped.\n",
+		(unsigned long long) taken, count, time_ns / (double) NSEC_PER_SEC,
+		time_ns ? taken * (double) NSEC_PER_SEC / time_ns : 0.0,
+		(unsigned long long) overruns, (unsigned long long) recorded,
+		(unsigned long long) (recorded > entries ? recorded - entries : 0));
+
+	free(ring);
+	return 0;
+}
+
+static int dump_range(int argc, char **argv)
+{
+	const char *device = "/dev/mem";
+	const char *snapshot = NULL;
+	char *watch = NULL;
+	long interval_us = 1000;
+	unsigned long samples = 0;
+	double seconds = 0;
+	size_t entries = WATCH_RING_ENTRIES;
+	int binary = 0;
+	int access_type = 'w';
+	int width, fd, option;
+	off_t target = 0;
+	size_t length = 0, offset, map_size;
+	void *map_base;
+	volatile uint8_t *virt_addr;
+	uint8_t *buffer;
+	struct snapshot_header header;
+	struct timespec start, end;
+	FILE *file;
+
+	while((option = getopt(argc, argv, "r:n:t:f:o:m:x:w:i:c:d:R:")) != -1) {
+		switch(option) {
+			case 'r': target = strtoull(optarg, 0, 0); break;
+			case 'n': length = strtoul(optarg, 0, 0); break;
+			case 't': access_type = tolower(optarg[0]); break;
+			case 'f': binary = (tolower(optarg[0]) == 'b'); break;
+			case 'o': snapshot = optarg; break;
+			case 'm': device = optarg; break;
+			case 'w': watch = optarg; break;
+			case 'i': interval_us = strtol(optarg, 0, 0); break;
+			case 'c': samples = strtoul(optarg, 0, 0); break;
+			case 'd': seconds = strtod(optarg, 0); break;
+			case 'R': entries = strtoul(optarg, 0, 0); break;
+			case 'x':
+				if(optind >= argc) usage(argv[0]);
+				return diff_snapshots(optarg, argv[optind]);
+			default: usage(argv[0]);
+		}
+	}
+
+	width = access_width(access_type);
+	if(watch)
+		return watch_registers(device, watch, width, interval_us, samples, seconds,
+			entries, snapshot);
+	if(length == 0 || length % width || target % width) {
+		fprintf(stderr, "Address and length must be multiples of the access width.\n");
+		exit(1);
+	}
+
+	if((fd = open(device, O_RDONLY | O_SYNC)) == -1) FATAL;
+	virt_addr = map_range(fd, target, length, PROT_READ, &map_base, &map_size);
+	if((buffer = malloc(length)) == NULL) FATAL;
+
+	/* Read everything first, formatting is slow next to the bus */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(offset = 0; offset < length; offset += width) {
+		store_value(buffer + offset, read_value(virt_addr + offset, width), width);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(munmap(map_base, map_size) == -1) FATAL;
+	close(fd);
+
+	if(snapshot) {
+		memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.width = width;
+		header.address = target;
+		header.length = length;
+		if((file = fopen(snapshot, "wb")) == NULL) FATAL;
+		if(fwrite(&header, sizeof(header), 1, file) != 1
+		   || fwrite(buffer, 1, length, file) != length
+		   || fclose(file) != 0) FATAL;
+		fprintf(stderr, "%zu bytes from 0x%llX read in %ld us.\n", length,
+			(unsigned long long) target,
+			(long) ((end.tv_sec - start.tv_sec) * 1000000L
+				+ (end.tv_nsec - start.tv_nsec) / 1000));
+	} else if(binary) {
+		if(fwrite(buffer, 1, length, stdout) != length) FATAL;
+	} else {
+		print_hex(buffer, length, target, width);
+	}
+
+	free(buffer);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+    int fd;
+    void *map_base, *virt_addr; 
+	unsigned long read_result, writeval;
+	off_t target;
+	int access_type = 'w';
+	
+	if(argc < 2)
+		usage(argv[0]);
+	if(argv[1][0] == '-')
+		return dump_range(argc, argv);
+	target = strtoul(argv[1], 0, 0);
+
+	if(argc > 2)
+		access_type = tolower(argv[2][0]);
+
+
+    if((fd = open("/dev/mem", O_RDWR | O_SYNC)) == -1) FATAL;
+    printf("/dev/mem opened.\n"); 
+    fflush(stdout);
+    
+    /* Map one page */
+    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, target & ~MAP_MASK);
+    if(map_base == (void *) -1) FATAL;
+    printf("Memory mapped at address %p.\n", map_base); 
+    fflush(stdout);
+    
+    virt_addr = map_base + (target & MAP_MASK);
+    switch(access_type) {
+		case 'b':
+			read_result = *((unsigned char *) virt_addr);
+			break;
+		case 'h':
+			read_result = *((unsigned short *) virt_addr);
+			break;
+		case 'w':
+			read_result = *((unsigned long *) virt_addr);
+			break;
+		default:
+			fprintf(stderr, "Illegal data type '%c'.\n", access_type);
+			exit(2);
+	}
+    printf("Value at address 0x%lX (%p): 0x%lX\n", (unsigned long) target, virt_addr, read_result); 
+    fflush(stdout);
+
+	if(argc > 3) {
+		writeval = strtoul(argv[3], 0, 0);
+		switch(access_type) {
+			case 'b':
+				*((unsigned char *) virt_addr) = writeval;
+				read_result = *((unsigned char *) virt_addr);
+				break;
+			case 'h':
+				*((unsigned short *) virt_addr) = writeval;
+				read_result = *((unsigned short *) virt_addr);
+				break;
+			case 'w':
+				*((unsigned long *) virt_addr) = writeval;
+				read_result = *((unsigned long *) virt_addr);
+				break;
+		}
+		printf("Written 0x%lX; readback 0x%lX\n", writeval, read_result); 
+		fflush(stdout);
+	}
+	
+	if(munmap(map_base, MAP_SIZE) == -1) FATAL;
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,1413 @@
+/*
+* File: gateway.c
+*
+* Description: Diagnostic gateway between the vehicle and local
+*              consumers such as a dashboard, a logger and an alert
+*              service.
+*
+*              The gateway holds one connection to the vehicle and
+*              accepts scan tool connections on GATEWAY_SOCKET_PATH.
+*              Requests for a PID that is already in flight upstream
+*              are merged, one upstream request is sent and the
+*              response is copied to every waiter.  Responses are kept
+*              for a short time and answer later requests directly, so
+*              upstream load follows the number of distinct PIDs and
+*              not the number of consumers.
+*
+*              Responses are sent to a client without blocking.  What
+*              its socket does not take waits in the client's outbox
+*              and is sent when epoll reports the socket writable.  A
+*              full outbox drops new responses, and a client that
+*              reads nothing for GATEWAY_STALL_MS is disconnected, so
+*              one stalled consumer cannot hold up the others.  The
+*              vehicle connection is sent to the same way, a vehicle
+*              that stops reading for GATEWAY_STALL_MS is reconnected.
+*
+*              With -b the gateway bridges two CAN interfaces instead,
+*              see can_bridge.h.
+*
+* Author: Royce Muchmore
+*
+* Tools:
+*
+* Leveraged Code:
+*
+* Links/References:
+*   Linux System Programming 2nd Edition
+*   man 7 epoll
+*   man 2 poll
+*
+*/
+
+// Includes
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "can_bridge.h"
+#include "obd2.h"
+#include "transport.h"
+
+// File defines and typedefs
+#define M_ARRAY_SIZE( x ) ( sizeof(x) / sizeof(x[0]) )
+#define SYSLOG_BUF_SIZE 80
+#define SERVER_PORT_STRING "9000"
+#define MS_PER_SEC     1000
+#define NS_PER_MS   1000000
+
+#define GATEWAY_MAX_CLIENTS         32
+#define GATEWAY_MAX_EVENTS        ( GATEWAY_MAX_CLIENTS + 2 )
+#define GATEWAY_MAX_PIDS           256
+#define GATEWAY_POLL_MS            100
+#define GATEWAY_BUSY_POLL_MS        10
+#define GATEWAY_CACHE_TTL_MS        50
+#define GATEWAY_REQUEST_TIMEOUT_MS 500
+#define GATEWAY_RECONNECT_MS      1000
+#define GATEWAY_OUTBOX_SIZE       ( 4 * TRANSPORT_BATCH_SIZE )
+#define GATEWAY_STALL_MS          1000
+
+#define MODE_SHOW_CURRENT_DATA      1
+
+#define MODE_RESPONSE            0x40
+#define MODE_NEGATIVE_RESPONSE   0x7F
+
+#define NRC_SERVICE_NOT_SUPPORTED   0x11
+#define NRC_RESPONSE_PENDING        0x78
+
+// Responses not yet taken by the client's socket, a ring from
+// outbox_head.  stalled_ms is when the socket last stopped taking
+// them, 0 while the outbox drains.
+typedef struct gateway_client
+{
+   bool         in_use;
+   transport    link;
+   obd2_message outbox[ GATEWAY_OUTBOX_SIZE ];
+   unsigned int outbox_head;
+   unsigned int outbox_count;
+   bool         want_write;
+   uint64_t     stalled_ms;
+} gateway_client;
+
+// Per PID state, waiters counts the requests of each client that are
+// waiting for the next upstream response
+typedef struct pid_entry
+{
+   bool         cached;
+   uint64_t     cached_ms;
+   obd2_message response;
+   bool         in_flight;
+   uint64_t     requested_ms;
+   unsigned int waiter_count;
+   uint8_t      waiters[ GATEWAY_MAX_CLIENTS ];
+} pid_entry;
+
+typedef struct gateway_stats
+{
+   unsigned long client_requests;
+   unsigned long cache_hits;
+   unsigned long coalesced;
+   unsigned long upstream_requests;
+   unsigned long upstream_responses;
+   unsigned long expired;
+   unsigned long dropped;
+   unsigned long stalled;
+} gateway_stats;
+
+typedef struct gateway
+{
+   int            listen_fd;
+   int            epoll_fd;
+   int            upstream_type;
+   bool           upstream_open;
+   transport      upstream;
+   uint64_t       next_connect_ms;
+   unsigned int   cache_ttl_ms;
+   obd2_message   upstream_outbox[ TRANSPORT_BATCH_SIZE ];
+   unsigned int   upstream_count;
+   bool           upstream_want_write;
+   uint64_t       upstream_stalled_ms;
+   gateway_client clients[ GATEWAY_MAX_CLIENTS ];
+   pid_entry      pids[ GATEWAY_MAX_PIDS ];
+   gateway_stats  stats;
+} gateway;
+
+
+// File data and functions
+static bool g_stop_signal = false;
+
+static uint32_t scan_tool_id = 0x000007DF;
+static uint32_t vehicle_id   = 0x000007EF;
+
+static gateway g_gateway;
+
+static can_bridge g_bridge;
+
+static int run_daemon( void );
+static int run_gateway( gateway *gw );
+static int run_bridge( can_bridge *bridge );
+static void open_upstream( gateway *gw, uint64_t now_ms );
+static void close_upstream( gateway *gw );
+static void accept_clients( gateway *gw );
+static bool receive_client( gateway *gw, gateway_client *client );
+static void close_client( gateway *gw, gateway_client *client );
+static void receive_upstream( gateway *gw );
+static void handle_client_request(
+   gateway *gw,
+   unsigned int client_index,
+   obd2_message* obd2_request,
+   uint64_t now_ms
+   );
+static void handle_upstream_response( gateway *gw, obd2_message* obd2_response, uint64_t now_ms );
+static void send_upstream_request( gateway *gw, uint8_t pid );
+static void queue_client_response( gateway *gw, gateway_client *client, obd2_message* obd2_response );
+static bool flush_client( gateway *gw, gateway_client *client, uint64_t now_ms );
+static bool flush_upstream( gateway *gw, uint64_t now_ms );
+static void expire_requests( gateway *gw, uint64_t now_ms );
+static void flush_messages( gateway *gw );
+static int gateway_timeout( gateway *gw );
+static uint64_t monotonic_ms( void );
+
+static int setup_signals( void );
+static void signal_handler( int signal );
+
+
+/*
+* Name: main
+*
+* Description: Start the diagnostic gateway.
+*
+* Inputs: argc - number of command line arguments
+*         argv[] - command line arguments
+*         argv[ 0 ] - program name
+*
+*         -d - run as a daemon
+*         -t tcp|unix - vehicle transport, TCP port 9000 or unix
+*                       SOCK_SEQPACKET socket
+*         -c ms - keep responses for ms, 0 only merges requests
+*                 in flight
+*         -b ifa,ifb - bridge two CAN interfaces instead of serving
+*                      scan tools
+*         -r rule - bridge rule ifname:id[/mask][=new_id], repeat for
+*                   more rules
+*         -k - bridge with the kernel CAN gateway when available
+*
+* Returns: program exit status
+*
+*/
+int main( int argc, char *argv[] )
+{
+   int return_status = EXIT_SUCCESS;
+   char program[ SYSLOG_BUF_SIZE+1 ];
+   bool run_as_daemon = false;
+   gateway *gw = &g_gateway;
+   can_bridge *bridge = &g_bridge;
+   char *bridge_ports = NULL;
+   char *bridge_rules[ CAN_BRIDGE_MAX_RULES ];
+   unsigned int rule_count = 0;
+   bool kernel_bridge = false;
+   char *separator;
+   unsigned int i;
+   int option;
+
+   memset( gw, 0, sizeof( gateway ) );
+   gw->upstream_type = TRANSPORT_TCP;
+   gw->cache_ttl_ms = GATEWAY_CACHE_TTL_MS;
+
+   // Check for program arguments
+   while ( ( option = getopt( argc, argv, "dt:c:b:r:k" ) ) != -1 )
+   {
+      switch( option )
+      {
+         case 'd':
+         {
+            run_as_daemon = true;
+            break;
+         }
+         case 't':
+         {
+            gw->upstream_type = transport_parse( optarg );
+            if ( ( gw->upstream_type != TRANSPORT_TCP ) && ( gw->upstream_type != TRANSPORT_UNIX ) )
+            {
+               fprintf( stderr, "Vehicle transport must be tcp or unix\n" );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'c':
+         {
+            gw->cache_ttl_ms = (unsigned int) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'b':
+         {
+            bridge_ports = optarg;
+            break;
+         }
+         case 'r':
+         {
+            if ( rule_count >= CAN_BRIDGE_MAX_RULES )
+            {
+               fprintf( stderr, "At most %d bridge rules\n", CAN_BRIDGE_MAX_RULES );
+               return( EXIT_FAILURE );
+            }
+            bridge_rules[ rule_count++ ] = optarg;
+            break;
+         }
+         case 'k':
+         {
+            kernel_bridge = true;
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+   }
+
+   // Use program name as identifier for system log entries:
+   //   /var/log/syslog
+   sprintf( program, "%.*s", SYSLOG_BUF_SIZE, argv[ 0 ] );
+   openlog( program, LOG_NDELAY, LOG_USER );
+   syslog( LOG_INFO, "Started as PID: %d", getpid() );
+
+   setup_signals();
+
+   if ( bridge_ports != NULL )
+   {
+      separator = strchr( bridge_ports, ',' );
+      if ( NULL == separator )
+      {
+         fprintf( stderr, "Bridge interfaces must be ifa,ifb\n" );
+         closelog();
+         return( EXIT_FAILURE );
+      }
+      *separator = '\0';
+
+      return_status = can_bridge_init( bridge, bridge_ports, separator + 1 );
+      for ( i = 0; ( EXIT_SUCCESS == return_status ) && ( i < rule_count ); i++ )
+      {
+         return_status = can_bridge_add_rule( bridge, bridge_rules[ i ] );
+         if ( return_status != EXIT_SUCCESS )
+         {
+            fprintf( stderr, "Bad bridge rule %s\n", bridge_rules[ i ] );
+         }
+      }
+
+      if ( ( EXIT_SUCCESS == return_status ) && run_as_daemon )
+      {
+         return_status = run_daemon();
+      }
+
+      if ( EXIT_SUCCESS == return_status )
+      {
+         return_status = can_bridge_start( bridge, kernel_bridge );
+      }
+
+      if ( EXIT_SUCCESS == return_status )
+      {
+         return_status = run_bridge( bridge );
+      }
+
+      closelog();
+      return( return_status );
+   }
+
+   return_status = transport_unix_listen( &gw->listen_fd, GATEWAY_SOCKET_PATH );
+   if ( EXIT_SUCCESS == return_status )
+   {
+      if ( run_as_daemon )
+      {
+         return_status = run_daemon();
+      }
+
+      if ( EXIT_SUCCESS == return_status )
+      {
+         return_status = run_gateway( gw );
+      }
+
+      unlink( GATEWAY_SOCKET_PATH );
+   }
+
+   syslog(
+      LOG_INFO,
+      "Requests %lu, cache hits %lu, merged %lu, upstream %lu, responses %lu, expired %lu, dropped %lu, stalled %lu",
+      gw->stats.client_requests,
+      gw->stats.cache_hits,
+      gw->stats.coalesced,
+      gw->stats.upstream_requests,
+      gw->stats.upstream_responses,
+      gw->stats.expired,
+      gw->stats.dropped,
+      gw->stats.stalled
+      );
+   printf(
+      "Requests %lu, cache hits %lu, merged %lu, upstream %lu, responses %lu, expired %lu, dropped %lu, stalled %lu\n",
+      gw->stats.client_requests,
+      gw->stats.cache_hits,
+      gw->stats.coalesced,
+      gw->stats.upstream_requests,
+      gw->stats.upstream_responses,
+      gw->stats.expired,
+      gw->stats.dropped,
+      gw->stats.stalled
+      );
+
+   closelog();
+   return( return_status );
+}
+
+
+/*
+* Name: run_daemon
+*
+* Description: Run program as a daemon
+*
+* Inputs: None
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_daemon( void )
+{
+   int return_status = EXIT_SUCCESS;
+   char error[ SYSLOG_BUF_SIZE+1 ];
+
+   // Run as a daemon
+   if ( -1 == daemon( 0, 0 ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return_status = EXIT_FAILURE;
+   }
+   else
+   {
+      syslog( LOG_INFO, "Started daemon as PID: %d", getpid() );
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: run_gateway
+*
+* Description: Serve the clients and the vehicle from one epoll loop.
+*              The vehicle connection is re-opened when it is lost.
+*
+* Inputs: gw - gateway
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_gateway( gateway *gw )
+{
+   int return_status = EXIT_SUCCESS;
+   int ready;
+   int i;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+   struct epoll_event event = { 0 };
+   struct epoll_event events[ GATEWAY_MAX_EVENTS ];
+   gateway_client *client;
+
+   gw->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+   // A NULL pointer marks the listening socket
+   event.events = EPOLLIN;
+   event.data.ptr = NULL;
+   if (   ( -1 == gw->epoll_fd )
+       || ( -1 == epoll_ctl( gw->epoll_fd, EPOLL_CTL_ADD, gw->listen_fd, &event ) )
+      )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return_status = EXIT_FAILURE;
+   }
+
+   while ( ( EXIT_SUCCESS == return_status ) && !g_stop_signal )
+   {
+      if ( !gw->upstream_open )
+      {
+         open_upstream( gw, monotonic_ms() );
+      }
+
+      ready = epoll_wait( gw->epoll_fd, events, GATEWAY_MAX_EVENTS, gateway_timeout( gw ) );
+      if ( ( -1 == ready ) && ( errno != EINTR ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return_status = EXIT_FAILURE;
+         break;
+      }
+
+      for ( i = 0; i < ready; i++ )
+      {
+         if ( NULL == events[ i ].data.ptr )
+         {
+            accept_clients( gw );
+         }
+         else if ( &gw->upstream == events[ i ].data.ptr )
+         {
+            // A writable vehicle is sent its requests by flush_messages()
+            if ( events[ i ].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+            {
+               receive_upstream( gw );
+            }
+         }
+         else
+         {
+            // A writable client is sent its outbox by flush_messages()
+            client = events[ i ].data.ptr;
+            if (   ( events[ i ].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+                && client->in_use
+                && !receive_client( gw, client )
+               )
+            {
+               close_client( gw, client );
+            }
+         }
+      }
+
+      expire_requests( gw, monotonic_ms() );
+      flush_messages( gw );
+   }
+
+   if ( g_stop_signal )
+   {
+      syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+   }
+
+   for ( i = 0; i < GATEWAY_MAX_CLIENTS; i++ )
+   {
+      if ( gw->clients[ i ].in_use )
+      {
+         close_client( gw, &gw->clients[ i ] );
+      }
+   }
+
+   if ( gw->upstream_open )
+   {
+      close_upstream( gw );
+   }
+
+   if ( gw->epoll_fd != -1 )
+   {
+      close( gw->epoll_fd );
+   }
+   close( gw->listen_fd );
+
+   return( return_status );
+}
+
+
+/*
+* Name: run_bridge
+*
+* Description: Forward frames until a signal is caught.  Frames
+*              forwarded by the kernel only need the process to stay
+*              alive, the userspace path polls both interfaces.
+*
+* Inputs: bridge - started bridge
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_bridge( can_bridge *bridge )
+{
+   int return_status = EXIT_SUCCESS;
+   struct pollfd fds[ CAN_BRIDGE_PORTS ];
+   int ready;
+   int port;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for ( port = 0; port < CAN_BRIDGE_PORTS; port++ )
+   {
+      fds[ port ].fd = bridge->fd[ port ];
+      fds[ port ].events = POLLIN;
+   }
+
+   while ( !g_stop_signal )
+   {
+      if ( bridge->kernel )
+      {
+         poll( NULL, 0, GATEWAY_POLL_MS );
+         continue;
+      }
+
+      ready = poll( fds, CAN_BRIDGE_PORTS, GATEWAY_POLL_MS );
+      if ( ( -1 == ready ) && ( errno != EINTR ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return_status = EXIT_FAILURE;
+         break;
+      }
+
+      for ( port = 0; ( ready > 0 ) && ( port < CAN_BRIDGE_PORTS ); port++ )
+      {
+         if ( ( fds[ port ].revents & POLLIN ) && ( -1 == can_bridge_forward( bridge, port ) ) )
+         {
+            return_status = EXIT_FAILURE;
+         }
+      }
+
+      if ( return_status != EXIT_SUCCESS )
+      {
+         break;
+      }
+   }
+
+   if ( g_stop_signal )
+   {
+      syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+   }
+
+   can_bridge_report( bridge );
+   can_bridge_close( bridge );
+
+   return( return_status );
+}
+
+
+/*
+* Name: open_upstream
+*
+* Description: Connect to the vehicle, at most once per
+*              GATEWAY_RECONNECT_MS.  Requests that were waiting for
+*              the connection are sent once it is open.
+*
+* Inputs: gw - gateway
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void open_upstream( gateway *gw, uint64_t now_ms )
+{
+   int status;
+   int pid;
+   struct epoll_event event = { 0 };
+
+   if ( now_ms < gw->next_connect_ms )
+   {
+      return;
+   }
+   gw->next_connect_ms = now_ms + GATEWAY_RECONNECT_MS;
+
+   if ( TRANSPORT_UNIX == gw->upstream_type )
+   {
+      status = transport_unix_connect( &gw->upstream, UNIX_SOCKET_PATH );
+   }
+   else
+   {
+      status = transport_tcp_connect( &gw->upstream, SERVER_PORT_STRING );
+   }
+
+   if ( EXIT_SUCCESS == status )
+   {
+      event.events = EPOLLIN;
+      event.data.ptr = &gw->upstream;
+      if ( 0 == epoll_ctl( gw->epoll_fd, EPOLL_CTL_ADD, gw->upstream.fd, &event ) )
+      {
+         gw->upstream_open = true;
+         syslog( LOG_INFO, "Connected to vehicle" );
+
+         for ( pid = 0; pid < GATEWAY_MAX_PIDS; pid++ )
+         {
+            if ( gw->pids[ pid ].waiter_count > 0 )
+            {
+               send_upstream_request( gw, (uint8_t) pid );
+            }
+         }
+      }
+      else
+      {
+         transport_close( &gw->upstream );
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: close_upstream
+*
+* Description: Close the vehicle connection.  Waiters are kept, their
+*              requests are sent again after reconnecting.
+*
+* Inputs: gw - gateway
+*
+* Returns: None
+*
+*/
+void close_upstream( gateway *gw )
+{
+   int pid;
+
+   epoll_ctl( gw->epoll_fd, EPOLL_CTL_DEL, gw->upstream.fd, NULL );
+   transport_close( &gw->upstream );
+   gw->upstream_open = false;
+   gw->upstream_count = 0;
+   gw->upstream_want_write = false;
+   gw->upstream_stalled_ms = 0;
+
+   for ( pid = 0; pid < GATEWAY_MAX_PIDS; pid++ )
+   {
+      gw->pids[ pid ].in_flight = false;
+   }
+
+   syslog( LOG_INFO, "Disconnected from vehicle" );
+   return;
+}
+
+
+/*
+* Name: accept_clients
+*
+* Description: Accept every pending client connection
+*
+* Inputs: gw - gateway
+*
+* Returns: None
+*
+*/
+void accept_clients( gateway *gw )
+{
+   int client_fd;
+   int i;
+   gateway_client *client;
+   struct epoll_event event = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for(;;)
+   {
+      client_fd = accept( gw->listen_fd, NULL, NULL );
+      if ( -1 == client_fd )
+      {
+         if (   ( errno != EAGAIN      )
+             && ( errno != EWOULDBLOCK )
+             && ( errno != EINTR       )
+            )
+         {
+            strerror_r( errno, error, SYSLOG_BUF_SIZE );
+            syslog( LOG_ERR, "%s: %s", __func__, error );
+         }
+         break;
+      }
+
+      client = NULL;
+      for ( i = 0; i < GATEWAY_MAX_CLIENTS; i++ )
+      {
+         if ( !gw->clients[ i ].in_use )
+         {
+            client = &gw->clients[ i ];
+            break;
+         }
+      }
+
+      if ( NULL == client )
+      {
+         syslog( LOG_ERR, "%s: Too many clients", __func__ );
+         close( client_fd );
+         continue;
+      }
+
+      fcntl( client_fd, F_SETFL, O_NONBLOCK );
+      memset( client, 0, sizeof( gateway_client ) );
+      transport_unix_init( &client->link, client_fd );
+
+      event.events = EPOLLIN;
+      event.data.ptr = client;
+      if ( -1 == epoll_ctl( gw->epoll_fd, EPOLL_CTL_ADD, client_fd, &event ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         transport_close( &client->link );
+         continue;
+      }
+
+      client->in_use = true;
+      syslog( LOG_INFO, "Accepted client %d", i );
+   }
+   return;
+}
+
+
+/*
+* Name: receive_client
+*
+* Description: Handle the requests queued on a client connection
+*
+* Inputs: gw - gateway
+*         client - client connection
+*
+* Returns: true - client is still connected
+*          false - connection closed or failed
+*
+*/
+bool receive_client( gateway *gw, gateway_client *client )
+{
+   obd2_message requests[ TRANSPORT_BATCH_SIZE ];
+   int rx_count;
+   int i;
+   uint64_t now_ms = monotonic_ms();
+
+   rx_count = transport_receive_batch(
+      &client->link,
+      requests,
+      sizeof( obd2_message ),
+      TRANSPORT_BATCH_SIZE,
+      0
+      );
+
+   for ( i = 0; i < rx_count; i++ )
+   {
+      handle_client_request(
+         gw,
+         (unsigned int) ( client - gw->clients ),
+         &requests[ i ],
+         now_ms
+         );
+   }
+
+   return( ( rx_count != TRANSPORT_CLOSED ) && ( rx_count != TRANSPORT_ERROR ) );
+}
+
+
+/*
+* Name: close_client
+*
+* Description: Close a client connection and drop its waiting
+*              requests
+*
+* Inputs: gw - gateway
+*         client - client connection
+*
+* Returns: None
+*
+*/
+void close_client( gateway *gw, gateway_client *client )
+{
+   unsigned int client_index = (unsigned int) ( client - gw->clients );
+   pid_entry *entry;
+   int pid;
+
+   for ( pid = 0; pid < GATEWAY_MAX_PIDS; pid++ )
+   {
+      entry = &gw->pids[ pid ];
+      entry->waiter_count -= entry->waiters[ client_index ];
+      entry->waiters[ client_index ] = 0;
+   }
+
+   epoll_ctl( gw->epoll_fd, EPOLL_CTL_DEL, client->link.fd, NULL );
+   transport_close( &client->link );
+   client->in_use = false;
+
+   syslog( LOG_INFO, "Closed client %u", client_index );
+   return;
+}
+
+
+/*
+* Name: receive_upstream
+*
+* Description: Handle the responses queued on the vehicle connection
+*
+* Inputs: gw - gateway
+*
+* Returns: None
+*
+*/
+void receive_upstream( gateway *gw )
+{
+   obd2_message responses[ TRANSPORT_BATCH_SIZE ];
+   int rx_count;
+   int i;
+   uint64_t now_ms = monotonic_ms();
+
+   rx_count = transport_receive_batch(
+      &gw->upstream,
+      responses,
+      sizeof( obd2_message ),
+      TRANSPORT_BATCH_SIZE,
+      0
+      );
+
+   for ( i = 0; i < rx_count; i++ )
+   {
+      handle_upstream_response( gw, &responses[ i ], now_ms );
+   }
+
+   if ( ( TRANSPORT_CLOSED == rx_count ) || ( TRANSPORT_ERROR == rx_count ) )
+   {
+      close_upstream( gw );
+   }
+   return;
+}
+
+
+/*
+* Name: handle_client_request
+*
+* Description: Answer a current data request from the cache, or wait
+*              for the upstream response.  Only the first request for
+*              a PID is sent upstream, the rest wait for its response.
+*              Other modes are answered with service not supported,
+*              the way the vehicle answers a mode it does not know.
+*
+* Inputs: gw - gateway
+*         client_index - requesting client
+*         obd2_request - client request
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void handle_client_request(
+   gateway *gw,
+   unsigned int client_index,
+   obd2_message* obd2_request,
+   uint64_t now_ms
+   )
+{
+   pid_entry *entry = &gw->pids[ obd2_request->pid ];
+   obd2_message obd2_response = { 0 };
+
+   if ( obd2_request->id != scan_tool_id )
+   {
+      return;
+   }
+
+   gw->stats.client_requests++;
+
+   if ( obd2_request->mode != MODE_SHOW_CURRENT_DATA )
+   {
+      // Laid out like the vehicle's: rejected mode, code, rejected PID
+      obd2_response.id = vehicle_id;
+      obd2_response.num_bytes = 4;
+      obd2_response.mode = MODE_NEGATIVE_RESPONSE;
+      obd2_response.pid = obd2_request->mode;
+      obd2_response.data[ 0 ] = NRC_SERVICE_NOT_SUPPORTED;
+      obd2_response.data[ 1 ] = obd2_request->pid;
+      queue_client_response( gw, &gw->clients[ client_index ], &obd2_response );
+      return;
+   }
+
+   if ( entry->cached && ( now_ms - entry->cached_ms <= gw->cache_ttl_ms ) )
+   {
+      gw->stats.cache_hits++;
+      queue_client_response( gw, &gw->clients[ client_index ], &entry->response );
+      return;
+   }
+
+   if ( 0 == entry->waiter_count )
+   {
+      entry->requested_ms = now_ms;
+   }
+   entry->waiters[ client_index ]++;
+   entry->waiter_count++;
+
+   if ( entry->in_flight )
+   {
+      gw->stats.coalesced++;
+   }
+   else if ( gw->upstream_open )
+   {
+      send_upstream_request( gw, obd2_request->pid );
+   }
+   return;
+}
+
+
+/*
+* Name: handle_upstream_response
+*
+* Description: Cache a vehicle response and copy it to every waiter.
+*              Negative responses are copied but not cached, a
+*              response pending keeps the waiters for the final
+*              response.
+*
+* Inputs: gw - gateway
+*         obd2_response - vehicle response
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void handle_upstream_response( gateway *gw, obd2_message* obd2_response, uint64_t now_ms )
+{
+   pid_entry *entry;
+   int i;
+
+   if ( ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) == obd2_response->mode )
+   {
+      entry = &gw->pids[ obd2_response->pid ];
+      entry->cached = true;
+      entry->cached_ms = now_ms;
+      entry->response = *obd2_response;
+   }
+   else if (   ( MODE_NEGATIVE_RESPONSE == obd2_response->mode )
+            && ( MODE_SHOW_CURRENT_DATA == obd2_response->pid  )
+           )
+   {
+      // The rejected PID follows the response code
+      entry = &gw->pids[ obd2_response->data[ 1 ] ];
+      if ( NRC_RESPONSE_PENDING == obd2_response->data[ 0 ] )
+      {
+         entry->requested_ms = now_ms;
+         for ( i = 0; i < GATEWAY_MAX_CLIENTS; i++ )
+         {
+            if ( entry->waiters[ i ] > 0 )
+            {
+               queue_client_response( gw, &gw->clients[ i ], obd2_response );
+            }
+         }
+         return;
+      }
+   }
+   else
+   {
+      return;
+   }
+
+   gw->stats.upstream_responses++;
+   entry->in_flight = false;
+
+   for ( i = 0; ( i < GATEWAY_MAX_CLIENTS ) && ( entry->waiter_count > 0 ); i++ )
+   {
+      while ( entry->waiters[ i ] > 0 )
+      {
+         queue_client_response( gw, &gw->clients[ i ], obd2_response );
+         entry->waiters[ i ]--;
+         entry->waiter_count--;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: send_upstream_request
+*
+* Description: Queue a current data request for the vehicle.  With
+*              the queue still full after a flush the request is not
+*              sent, a later request for the PID asks again.
+*
+* Inputs: gw - gateway
+*         pid - requested PID
+*
+* Returns: None
+*
+*/
+void send_upstream_request( gateway *gw, uint8_t pid )
+{
+   obd2_message *obd2_request;
+
+   if ( gw->upstream_count >= TRANSPORT_BATCH_SIZE )
+   {
+      flush_messages( gw );
+   }
+   if ( !gw->upstream_open || ( gw->upstream_count >= TRANSPORT_BATCH_SIZE ) )
+   {
+      return;
+   }
+
+   obd2_request = &gw->upstream_outbox[ gw->upstream_count++ ];
+   memset( obd2_request, 0, sizeof( obd2_message ) );
+   obd2_request->id = scan_tool_id;
+   obd2_request->num_bytes = 2;
+   obd2_request->mode = MODE_SHOW_CURRENT_DATA;
+   obd2_request->pid = pid;
+
+   gw->pids[ pid ].in_flight = true;
+   gw->stats.upstream_requests++;
+   return;
+}
+
+
+/*
+* Name: queue_client_response
+*
+* Description: Queue a response for a client, queues are sent by
+*              flush_messages().  The response is dropped when the
+*              outbox is full.
+*
+* Inputs: gw - gateway
+*         client - client connection
+*         obd2_response - response to send
+*
+* Returns: None
+*
+*/
+void queue_client_response( gateway *gw, gateway_client *client, obd2_message* obd2_response )
+{
+   unsigned int tail;
+
+   if ( client->outbox_count >= GATEWAY_OUTBOX_SIZE )
+   {
+      gw->stats.dropped++;
+      return;
+   }
+
+   tail = ( client->outbox_head + client->outbox_count ) % GATEWAY_OUTBOX_SIZE;
+   client->outbox[ tail ] = *obd2_response;
+   client->outbox_count++;
+   return;
+}
+
+
+/*
+* Name: flush_client
+*
+* Description: Send a client's outbox until its socket is full.  The
+*              socket is watched for EPOLLOUT while responses are left
+*              over.
+*
+* Inputs: gw - gateway
+*         client - client connection
+*         now_ms - monotonic time
+*
+* Returns: true - client is still connected
+*          false - connection failed or stalled for GATEWAY_STALL_MS
+*
+*/
+bool flush_client( gateway *gw, gateway_client *client, uint64_t now_ms )
+{
+   unsigned int batch;
+   int sent = 0;
+   struct epoll_event event = { 0 };
+
+   while ( client->outbox_count > 0 )
+   {
+      // The ring is sent in at most two pieces
+      batch = GATEWAY_OUTBOX_SIZE - client->outbox_head;
+      if ( batch > client->outbox_count )
+      {
+         batch = client->outbox_count;
+      }
+
+      sent = transport_try_send_batch(
+         &client->link,
+         &client->outbox[ client->outbox_head ],
+         sizeof( obd2_message ),
+         batch
+         );
+      if ( sent <= 0 )
+      {
+         break;
+      }
+
+      client->outbox_head = ( client->outbox_head + (unsigned int) sent ) % GATEWAY_OUTBOX_SIZE;
+      client->outbox_count -= (unsigned int) sent;
+      client->stalled_ms = 0;
+   }
+
+   if ( sent < 0 )
+   {
+      return( false );
+   }
+
+   if ( client->outbox_count > 0 )
+   {
+      if ( 0 == client->stalled_ms )
+      {
+         client->stalled_ms = now_ms;
+      }
+      else if ( now_ms - client->stalled_ms > GATEWAY_STALL_MS )
+      {
+         syslog( LOG_ERR, "%s: Client %u stopped reading", __func__, (unsigned int) ( client - gw->clients ) );
+         gw->stats.stalled++;
+         return( false );
+      }
+   }
+
+   if ( client->want_write != ( client->outbox_count > 0 ) )
+   {
+      client->want_write = ( client->outbox_count > 0 );
+      event.events = client->want_write ? ( EPOLLIN | EPOLLOUT ) : EPOLLIN;
+      event.data.ptr = client;
+      epoll_ctl( gw->epoll_fd, EPOLL_CTL_MOD, client->link.fd, &event );
+   }
+   return( true );
+}
+
+
+/*
+* Name: flush_upstream
+*
+* Description: Send the queued vehicle requests until the socket is
+*              full.  The socket is watched for EPOLLOUT while requests
+*              are left over.
+*
+* Inputs: gw - gateway
+*         now_ms - monotonic time
+*
+* Returns: true - vehicle is still connected
+*          false - connection failed or stalled for GATEWAY_STALL_MS
+*
+*/
+bool flush_upstream( gateway *gw, uint64_t now_ms )
+{
+   int sent;
+   struct epoll_event event = { 0 };
+
+   sent = transport_try_send_batch(
+      &gw->upstream,
+      gw->upstream_outbox,
+      sizeof( obd2_message ),
+      gw->upstream_count
+      );
+   if ( sent < 0 )
+   {
+      return( false );
+   }
+
+   if ( sent > 0 )
+   {
+      gw->upstream_count -= (unsigned int) sent;
+      memmove( gw->upstream_outbox, &gw->upstream_outbox[ sent ], gw->upstream_count * sizeof( obd2_message ) );
+      gw->upstream_stalled_ms = 0;
+   }
+
+   if ( gw->upstream_count > 0 )
+   {
+      if ( 0 == gw->upstream_stalled_ms )
+      {
+         gw->upstream_stalled_ms = now_ms;
+      }
+      else if ( now_ms - gw->upstream_stalled_ms > GATEWAY_STALL_MS )
+      {
+         syslog( LOG_ERR, "%s: Vehicle stopped reading", __func__ );
+         gw->stats.stalled++;
+         return( false );
+      }
+   }
+
+   if ( gw->upstream_want_write != ( gw->upstream_count > 0 ) )
+   {
+      gw->upstream_want_write = ( gw->upstream_count > 0 );
+      event.events = gw->upstream_want_write ? ( EPOLLIN | EPOLLOUT ) : EPOLLIN;
+      event.data.ptr = &gw->upstream;
+      epoll_ctl( gw->epoll_fd, EPOLL_CTL_MOD, gw->upstream.fd, &event );
+   }
+   return( true );
+}
+
+
+/*
+* Name: expire_requests
+*
+* Description: Drop waiters the vehicle has not answered within
+*              GATEWAY_REQUEST_TIMEOUT_MS, so an unsupported PID does
+*              not stay in flight forever
+*
+* Inputs: gw - gateway
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void expire_requests( gateway *gw, uint64_t now_ms )
+{
+   pid_entry *entry;
+   int pid;
+
+   for ( pid = 0; pid < GATEWAY_MAX_PIDS; pid++ )
+   {
+      entry = &gw->pids[ pid ];
+      if (   ( entry->waiter_count > 0 )
+          && ( now_ms - entry->requested_ms > GATEWAY_REQUEST_TIMEOUT_MS )
+         )
+      {
+         gw->stats.expired += entry->waiter_count;
+         memset( entry->waiters, 0, sizeof( entry->waiters ) );
+         entry->waiter_count = 0;
+         entry->in_flight = false;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: flush_messages
+*
+* Description: Send the queued vehicle requests and client responses.
+*              Clients that fail or stall are closed, a vehicle that
+*              does is reconnected.
+*
+* Inputs: gw - gateway
+*
+* Returns: None
+*
+*/
+void flush_messages( gateway *gw )
+{
+   gateway_client *client;
+   int i;
+   uint64_t now_ms = monotonic_ms();
+
+   if ( !gw->upstream_open )
+   {
+      // Waiters are sent again after reconnecting
+      gw->upstream_count = 0;
+   }
+   else if ( ( gw->upstream_count > 0 ) && !flush_upstream( gw, now_ms ) )
+   {
+      close_upstream( gw );
+   }
+
+   for ( i = 0; i < GATEWAY_MAX_CLIENTS; i++ )
+   {
+      client = &gw->clients[ i ];
+      if (   client->in_use
+          && ( client->outbox_count > 0 )
+          && !flush_client( gw, client, now_ms )
+         )
+      {
+         close_client( gw, client );
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: gateway_timeout
+*
+* Description: epoll timeout, short while requests are waiting so they
+*              expire on time or are sent after reconnecting, and
+*              while the vehicle has not taken its requests
+*
+* Inputs: gw - gateway
+*
+* Returns: timeout in milliseconds
+*
+*/
+int gateway_timeout( gateway *gw )
+{
+   int pid;
+
+   if ( gw->upstream_count > 0 )
+   {
+      return( GATEWAY_BUSY_POLL_MS );
+   }
+   for ( pid = 0; pid < GATEWAY_MAX_PIDS; pid++ )
+   {
+      if ( gw->pids[ pid ].waiter_count > 0 )
+      {
+         return( GATEWAY_BUSY_POLL_MS );
+      }
+   }
+   return( GATEWAY_POLL_MS );
+}
+
+
+/*
+* Name: monotonic_ms
+*
+* Description: Monotonic clock in milliseconds
+*
+* Inputs: None
+*
+* Returns: Milliseconds
+*
+*/
+uint64_t monotonic_ms( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * MS_PER_SEC + (uint64_t) now.tv_nsec / NS_PER_MS );
+}
+
+
+/*
+* Name: setup_signals
+*
+* Description: Setup signal handlers for:
+*                SIGINT
+*                SIGTERM
+*
+* Inputs: None
+*
+* Returns: EXIT_SUCCESS - signal handlers configured
+*          EXIT_FAILURE - failed to setup signal handlers
+*
+*/
+int setup_signals( void )
+{
+   int return_status = EXIT_SUCCESS;
+   int signal_status;
+   int i;
+   int signals[] = { SIGINT, SIGTERM };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+   struct sigaction program_action = { 0 };
+
+   program_action.sa_handler = signal_handler;
+   for ( i=0; i < M_ARRAY_SIZE( signals ); i++ )
+   {
+      signal_status = sigaction(
+         signals[ i ],
+         &program_action,
+         NULL
+         );
+      if ( -1 == signal_status )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         return_status = EXIT_FAILURE;
+      }
+   }
+
+   return( return_status );
+}
+
+
+/*
+* Name: signal_handler
+*
+* Description: Signal handler for this program, handles these signals:
+*                SIGINT
+*                SIGTERM
+*              Note: This function is called asynchronously and
+*                    must be reentrant.
+*
+* Inputs: None
+*
+* Returns: None
+*
+*/
+void signal_handler( int signal )
+{
+   switch( signal )
+   {
+      case SIGINT:
+      case SIGTERM:
+      {
+         g_stop_signal = true;
+         break;
+      }
+
+      default:
+         break;
+   }
+
+   return;
+}
@@ -22,8 +22,11 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -33,11 +36,28 @@
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "isotp.h"
+#include "obd2.h"
+#include "poll_scheduler.h"
+#include "probes.h"
+#include "rtt_estimator.h"
+#include "transport.h"
+#include "tsdb.h"
+
+// Static tracepoints, see probes.h and trace/README
+PROBE_SEMAPHORE( aesd_scan_tool, request__sent );
+PROBE_SEMAPHORE( aesd_scan_tool, response__received );
+PROBE_SEMAPHORE( aesd_scan_tool, reconnect );
+
 // File defines and typedefs
 #define M_ARRAY_SIZE( x ) ( sizeof(x) / sizeof(x[0]) )
 #define SYSLOG_BUF_SIZE 80
@@ -50,30 +70,176 @@
 
 #define MODE_SHOW_CURRENT_DATA      1
 #define MODE_REQUEST_VEHICLE_INFO   9
+#define MODE_PERIODIC_DATA       0x2A
 
 #define MODE_RESPONSE            0x40
+#define MODE_NEGATIVE_RESPONSE   0x7F
+
+#define NRC_RESPONSE_PENDING     0x78
+
+// Response timing, P2 for a response and P2* after response pending.
+// Mode 01 reads wait as long as the PID's RTT estimate asks, starting
+// at P2.
+#define P2_TIMEOUT_MS              50
+#define P2_STAR_TIMEOUT_MS       5000
+
+// recive_obd2_response() result when P2 expires
+#define RESPONSE_TIMEOUT            2
 
 #define PID_ENGINE_RPM             12
 #define PID_VEHICLE_SPEED          13
 #define PID_AMBIENT_AIR_TEMP       70
 #define PID_ODOMETER              166
 
+// PIDs 0x00, 0x20, ... 0xE0 report the next 32 supported PIDs
+#define PID_SUPPORTED_RANGE        32
+#define PID_SUPPORTED_RANGES        8
+
+// Mode 09 vehicle identification number
+#define PID_VIN                     2
+#define VIN_LENGTH                 17
+
+// A mode 01 request names at most 6 PIDs
+#define MAX_REQUEST_PIDS            6
+
 #define KMPH_TO_MPH       0.62137119f
 
-typedef struct obd2_message
+#define MS_PER_SEC        1000ULL
+#define NS_PER_MS         1000000ULL
+#define NS_PER_USEC       1000ULL
+#define NS_PER_SEC        1000000000ULL
+
+#define MAX_WATCHES          8
+#define JITTER_FRAMES     1000
+#define FLOOD_ID         0x7F0
+#define FLOOD_ID_MASK    0x7FF
+#define FLOOD_IDLE_MS     1000
+#define WATCH_POLL_MS      100
+#define MAX_LOAD_CLIENTS    64
+
+// Session layer.  Reconnects back off exponentially from
+// BACKOFF_BASE_MS to BACKOFF_MAX_MS with jitter, so scan tools that
+// lost the same vehicle do not reconnect in step.
+#define BACKOFF_BASE_MS          100
+#define BACKOFF_MAX_MS          5000
+#define BACKOFF_MAX_SHIFT          6
+
+// A silent TCP peer is dead after about KEEPALIVE_IDLE_S +
+// KEEPALIVE_COUNT * KEEPALIVE_INTERVAL_S, unacknowledged data after
+// USER_TIMEOUT_MS
+#define KEEPALIVE_IDLE_S           2
+#define KEEPALIVE_INTERVAL_S       1
+#define KEEPALIVE_COUNT            3
+#define USER_TIMEOUT_MS         5000
+
+// Watch mode asks for PID 0x00 after HEARTBEAT_MS without traffic,
+// the vehicle is lost after HEARTBEAT_MISSES such periods
+#define HEARTBEAT_MS            1000
+#define HEARTBEAT_MISSES           3
+
+// A mode 01 request is idempotent, it is sent again after a reconnect
+// at most MAX_RESENDS times and within REQUEST_RETRY_MS
+#define MAX_RESENDS                2
+#define REQUEST_RETRY_MS       10000
+
+// Poll scheduler defaults, the bitrate matches etc/network/interfaces
+#define CAN_BITRATE           125000
+#define POLL_LOAD_PERCENT         30
+#define POLL_REPORT_MS          5000
+
+// Fleet polling, every vehicle has one request in flight.  The
+// connect timeout bounds a SYN to an unreachable address.
+#define FLEET_MAX_VEHICLES      1024
+#define FLEET_EPOLL_EVENTS        64
+#define FLEET_CONNECT_TIMEOUT_MS 3000
+#define FLEET_NAME_LENGTH         64
+#define FLEET_LINE_LENGTH        256
+#define FLEET_SPARE_FDS           16
+
+#define FLEET_DOWN                 0
+#define FLEET_CONNECTING           1
+#define FLEET_READY                2
+#define FLEET_WAITING              3
+
+// Default freshness of cached PID values
+#define TTL_ENGINE_RPM_MS          100
+#define TTL_VEHICLE_SPEED_MS       500
+#define TTL_AMBIENT_AIR_TEMP_MS  10000
+#define TTL_ODOMETER_MS          60000
+
+// Flood benchmark frame, a sequence number shows lost frames
+typedef struct flood_frame
 {
    uint32_t id;
-   uint8_t  num_bytes;
-   uint8_t  mode;
-   uint8_t  pid;
-   uint8_t  data[ 4 ];
-   uint8_t  unused;
-} obd2_message;
+   uint32_t sequence;
+   uint32_t unused;
+} flood_frame;
+
+typedef struct flood_sender
+{
+   transport     link;
+   unsigned long count;
+   unsigned long sent;
+   _Atomic bool  stop;
+} flood_sender;
+
+// One connection of the -c load generator
+typedef struct load_client
+{
+   transport     link;
+   unsigned long count;
+   unsigned int  window;
+   unsigned long done;
+   int           status;
+} load_client;
+
+// Connection to the vehicle that survives outages
+typedef struct vehicle_session
+{
+   transport     link;
+   bool          connected;
+   unsigned int  failures;      // failed connects since the last success
+   unsigned int  seed;
+   uint64_t      retry_ms;      // next connect attempt
+   uint64_t      down_ms;       // connection lost, 0 while up
+   uint64_t      last_rx_ms;
+   uint64_t      heartbeat_ms;  // last heartbeat sent
+   unsigned long attempts;
+   unsigned long reconnects;
+   unsigned long resent;
+   uint64_t      outage_total_ms;
+   uint64_t      outage_max_ms;
+} vehicle_session;
+
+// One vehicle of the -M fleet.  The session keeps the link, backoff
+// and outage counts, the stream is read without blocking into rx.
+typedef struct fleet_vehicle
+{
+   char            name[ FLEET_NAME_LENGTH ];
+   struct sockaddr_storage address;
+   socklen_t       address_length;
+   vehicle_session session;
+   int             state;
+   poll_scheduler  scheduler;
+   poll_entry     *entry;         // PID in flight while FLEET_WAITING
+   uint64_t        deadline_ms;   // connect or response deadline
+   uint64_t        sent_us;       // first send of the PID in flight
+   uint64_t        hedge_ms;      // second send, 0 for none
+   bool            hedged;
+   bool            ambiguous;     // answer may belong to another send
+   rtt_estimator   rtt[ POLL_MAX_ENTRIES ];   // per schedule entry
+   uint8_t         rx[ sizeof( obd2_message ) ];
+   size_t          rx_length;
+   unsigned long   answers;
+   unsigned long   timeouts;
+   unsigned long   hedges;
+} fleet_vehicle;
 
 #define MAIN_MENU_ENGINE_RPM       '1'
 #define MAIN_MENU_VEHICLE_SPEED    '2'
 #define MAIN_MENU_AMBIENT_AIR_TEMP '3'
 #define MAIN_MENU_ODOMETER         '4'
+#define MAIN_MENU_BYPASS_CACHE     'r'
 #define MAIN_MENU_EXIT             '0'
 
 // File data and functions
@@ -82,24 +248,163 @@ const char main_menu[] = "\nMain Menu\n"
                          "2 - Vehicle Speed\n"
                          "3 - Ambient Air Temperature\n"
                          "4 - Odometer\n"
+                         "r - Read the next value from the vehicle\n"
                          "0 - Exit\n";
 
 static bool g_stop_signal = false;
 static char client_log_file[] = "/var/tmp/aesdscantool";
-static uint8_t client_buffer[ 2* MAX_CLIENT_CONNECTIONS ][ CLIENT_LOG_BUF_SIZE ];
 
 static uint32_t vehicle_id   = 0x000007EF;
 static uint32_t scan_tool_id = 0x000007DF;
 
+static bool g_store_enabled = false;
+static tsdb_store g_store;
+static int g_transport_type = TRANSPORT_TCP;
+static bool g_verbose = true;
+static bool g_use_gateway = false;
+static const char *g_ifname = CAN_INTERFACE;
+
+// Subscriptions requested with -S
+typedef struct watch_request
+{
+   uint8_t  pid;
+   uint16_t interval_ms;
+   uint16_t deadband;
+} watch_request;
+
+static watch_request g_watches[ MAX_WATCHES ];
+static unsigned int g_watch_count = 0;
+
+// Supported PIDs and how long a response stays fresh
+typedef struct pid_info
+{
+   uint8_t  pid;
+   uint32_t ttl_ms;
+} pid_info;
+
+static const pid_info g_pid_table[] =
+{
+   { PID_ENGINE_RPM,       TTL_ENGINE_RPM_MS       },
+   { PID_VEHICLE_SPEED,    TTL_VEHICLE_SPEED_MS    },
+   { PID_AMBIENT_AIR_TEMP, TTL_AMBIENT_AIR_TEMP_MS },
+   { PID_ODOMETER,         TTL_ODOMETER_MS         },
+};
+
+// Last response per PID, a TTL of 0 disables caching of the PID
+typedef struct cache_entry
+{
+   bool         valid;
+   uint32_t     ttl_ms;
+   uint64_t     received_ms;
+   obd2_message response;
+} cache_entry;
+
+static poll_scheduler g_scheduler;
+static const char *g_fleet_spec = NULL;
+static uint32_t g_bitrate = CAN_BITRATE;
+static double g_load_percent = POLL_LOAD_PERCENT;
+
+static cache_entry g_cache[ UINT8_MAX + 1 ];
+
+// Round trip estimate per PID, and the latency of every read as the
+// caller sees it, hedges and timeouts included
+static rtt_estimator g_rtt[ UINT8_MAX + 1 ];
+static bool g_hedge_enabled = false;
+static rtt_latency g_read_latency;
+static bool g_cache_enabled = true;
+static bool g_cached_response = false;
+
+// Supported PID bitmaps read from the vehicle at connect
+static bool g_supported_known = false;
+static uint32_t g_supported_pids[ PID_SUPPORTED_RANGES ];
+
 static int run_menu( void );
-static int create_socket( int *socket_fd );
+static int run_benchmark( unsigned long count, unsigned int window );
+static int run_load( unsigned int clients, unsigned long count, unsigned int window );
+static void *send_load( void *context );
+static int run_jitter( uint32_t can_id, unsigned long count );
+static int run_flood( unsigned long count );
+static void *send_flood( void *context );
+static int run_isotp( unsigned long count );
+static int measure_isotp( transport *link, bool fd, unsigned long count, const uint8_t *pids, size_t pid_count );
+static int isotp_request(
+   isotp_channel *channel,
+   const uint8_t *request,
+   size_t request_length,
+   uint8_t *response,
+   size_t size
+   );
+static int run_watch( void );
+static int run_poll( void );
+static void report_poll( uint64_t now_ms );
+static int parse_poll( poll_scheduler *scheduler, const char *spec );
+static int run_fleet( const char *spec );
+static int parse_fleet( const char *spec, fleet_vehicle *vehicles, unsigned int *count );
+static int add_fleet_vehicle( fleet_vehicle *vehicle, char *line );
+static void fleet_connect( fleet_vehicle *vehicle, int epoll_fd, uint64_t now_ms );
+static void fleet_lost( fleet_vehicle *vehicle, uint64_t now_ms, const char *reason );
+static void fleet_receive( fleet_vehicle *vehicle, uint64_t now_ms );
+static void fleet_response( fleet_vehicle *vehicle, obd2_message *obd2_response, uint64_t now_ms );
+static uint64_t fleet_service( fleet_vehicle *vehicle, int epoll_fd, uint64_t now_ms );
+static int fleet_request( fleet_vehicle *vehicle );
+static void fleet_finish( fleet_vehicle *vehicle, uint64_t now_us, bool answered );
+static void report_fleet( fleet_vehicle *vehicles, unsigned int count, double seconds, bool totals );
+static bool decode_obd2_value( const obd2_message *obd2_msg, double *value, const char **unit );
+static int send_subscriptions( transport *link, bool subscribe );
+static int parse_watch( const char *spec );
+static void cache_init( void );
+static int parse_cache_ttl( const char *spec );
+static int request_obd2_data(
+   transport *link,
+   uint8_t pid,
+   bool bypass_cache,
+   obd2_message* obd2_response
+   );
+static int exchange_obd2_request(
+   transport *link,
+   obd2_message *obd2_request,
+   rtt_estimator *rtt,
+   obd2_message* obd2_response
+   );
+static void discard_late_answers( transport *link, rtt_estimator *rtt );
+static void report_rtt( void );
+static int discover_supported_pids( transport *link );
+static bool pid_supported( uint8_t pid );
+static void session_init( vehicle_session *session );
+static bool session_connect( vehicle_session *session );
+static void session_sleep( vehicle_session *session, uint64_t limit_ms );
+static void session_lost( vehicle_session *session, const char *reason );
+static bool session_heartbeat( vehicle_session *session, uint64_t now_ms );
+static int session_request(
+   vehicle_session *session,
+   uint8_t pid,
+   bool bypass_cache,
+   obd2_message* obd2_response
+   );
+static void session_close( vehicle_session *session );
+static void session_report( vehicle_session *session );
+static uint64_t backoff_delay( vehicle_session *session );
+static int open_link( transport *link );
+static void set_keepalive( int socket_fd );
+static void set_nodelay( int socket_fd );
 static uint8_t get_menu_input( void );
-static void send_obd2_request( int socket_fd, obd2_message* obd2_request );
-static int recive_obd2_response( int socket_fd, obd2_message* obd2_response );
+static void send_obd2_request( transport *link, obd2_message* obd2_request );
+static int recive_obd2_response(
+   transport *link,
+   obd2_message* obd2_response,
+   int timeout_ms
+   );
+static void handle_obd2_response( obd2_message* obd2_msg );
 static void handle_obd2_engine_rpm( obd2_message* obd2_msg );
 static void handle_obd2_vehicle_speed( obd2_message* obd2_msg );
 static void handle_obd2_ambient_air_temp( obd2_message* obd2_msg );
 static void handle_obd2_odometer( obd2_message* obd2_msg );
+static void store_sample( uint8_t pid, double value );
+static int query_store( uint8_t pid, uint64_t start_ms, uint64_t end_ms );
+static bool print_sample( uint8_t pid, uint64_t timestamp_ms, double value, void *context );
+static uint64_t monotonic_ns( void );
+static uint64_t realtime_ns( void );
+static int compare_u64( const void *a, const void *b );
 
 static int setup_signals( void );
 static void signal_handler( int signal );
@@ -113,6 +418,49 @@ static void signal_handler( int signal );
 *         argv[] - command line arguments
 *         argv[ 0 ] - program name
 *
+*         -s file - store decoded samples in file
+*         -q pid - print the stored samples of pid and exit
+*         -a seconds - query window start, seconds since the epoch
+*         -b seconds - query window end, seconds since the epoch
+*         -t tcp|shm|unix|vbus|can - transport, TCP port 9000,
+*                                    shared memory, unix SOCK_SEQPACKET
+*                                    socket, the vehicle's virtual CAN
+*                                    bus or SocketCAN
+*         -i ifname - CAN interface, default can0
+*         -J id[:count] - measure the period jitter of count cyclic
+*                         frames with CAN identifier id and exit
+*         -F count - send count frames back to back on the bus and
+*                    report the receive rate and drops, then exit
+*         -X count - read the VIN and all supported PIDs at once count
+*                    times with ISO-TP in classic CAN frames, then in
+*                    CAN FD frames, report the rates and exit
+*         -g - connect through the diagnostic gateway
+*         -C pid:ttl - keep menu readings of pid for ttl ms, 0 always
+*                      reads the vehicle; repeatable
+*         -N - menu readings always read the vehicle
+*         -H - hedge mode 01 reads, send a second request once the
+*              first is slower than RTT_HEDGE_PERCENTILE of its PID's
+*              recent round trips
+*         -P pid:hz[:priority] - poll pid at up to hz, higher priority
+*                                keeps its rate under the bus load
+*                                ceiling; repeatable
+*         -L percent - bus load ceiling of the poll schedule
+*         -B bitrate - CAN bitrate for the bus load, a virtual bus
+*                      reports its own
+*         -n count - measure the round trip of count requests and exit
+*         -w window - requests in flight during the measurement
+*         -c clients - load generator, the -n measurement runs on
+*                      clients connections at once
+*         -S pid:interval[:deadband] - subscribe to pid, print updates
+*                                      no more often than interval ms
+*                                      when the raw value changes by
+*                                      more than deadband; repeatable
+*         -M host[:port][,...] | @file - poll the -P PIDs of many
+*                                        vehicles over TCP at once; a
+*                                        file line is host[:port]
+*                                        followed by its own pid:hz
+*                                        entries
+*
 * Returns: program exit status
 *
 */
@@ -120,15 +468,259 @@ int main( int argc, char *argv[] )
 {
    int return_status = EXIT_SUCCESS;
    char program[ SYSLOG_BUF_SIZE+1 ];
+   char *store_file = NULL;
+   bool query = false;
+   uint8_t query_pid = 0;
+   uint64_t start_ms = 0;
+   uint64_t end_ms = UINT64_MAX;
+   unsigned long bench_count = 0;
+   unsigned int bench_window = 1;
+   unsigned int load_clients = 1;
+   uint32_t jitter_id = 0;
+   unsigned long jitter_count = 0;
+   unsigned long flood_count = 0;
+   unsigned long isotp_count = 0;
+   char *next;
+   int option;
+
+   cache_init();
+   for ( option = 0; option <= UINT8_MAX; option++ )
+   {
+      rtt_init( &g_rtt[ option ] );
+   }
+   rtt_latency_reset( &g_read_latency );
+   poll_scheduler_init( &g_scheduler, CAN_BITRATE, POLL_LOAD_PERCENT / 100.0 );
+
+   // Check for program arguments
+   while ( ( option = getopt( argc, argv, "s:q:a:b:t:gC:NHP:L:B:n:w:c:S:i:J:F:X:M:" ) ) != -1 )
+   {
+      switch( option )
+      {
+         case 's':
+         {
+            store_file = optarg;
+            break;
+         }
+         case 'q':
+         {
+            query = true;
+            query_pid = (uint8_t) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'a':
+         {
+            start_ms = (uint64_t) ( strtod( optarg, NULL ) * MS_PER_SEC );
+            break;
+         }
+         case 'b':
+         {
+            end_ms = (uint64_t) ( strtod( optarg, NULL ) * MS_PER_SEC );
+            break;
+         }
+         case 't':
+         {
+            g_transport_type = transport_parse( optarg );
+            if ( g_transport_type < 0 )
+            {
+               fprintf( stderr, "Unknown transport: %s\n", optarg );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'g':
+         {
+            g_use_gateway = true;
+            break;
+         }
+         case 'C':
+         {
+            if ( parse_cache_ttl( optarg ) != EXIT_SUCCESS )
+            {
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'N':
+         {
+            g_cache_enabled = false;
+            break;
+         }
+         case 'H':
+         {
+            g_hedge_enabled = true;
+            break;
+         }
+         case 'P':
+         {
+            if ( parse_poll( &g_scheduler, optarg ) != EXIT_SUCCESS )
+            {
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'L':
+         {
+            g_load_percent = strtod( optarg, NULL );
+            if ( !( g_load_percent > 0 ) || ( g_load_percent > 100 ) )
+            {
+               fprintf( stderr, "Bus load must be above 0 and at most 100 percent\n" );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'B':
+         {
+            g_bitrate = (uint32_t) strtoul( optarg, NULL, 0 );
+            if ( 0 == g_bitrate )
+            {
+               fprintf( stderr, "Invalid bitrate: %s\n", optarg );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'n':
+         {
+            bench_count = strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'w':
+         {
+            bench_window = (unsigned int) strtoul( optarg, NULL, 0 );
+            if ( ( bench_window < 1 ) || ( bench_window > TRANSPORT_BATCH_SIZE ) )
+            {
+               fprintf( stderr, "Window must be 1 to %d\n", TRANSPORT_BATCH_SIZE );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'c':
+         {
+            load_clients = (unsigned int) strtoul( optarg, NULL, 0 );
+            if ( ( load_clients < 1 ) || ( load_clients > MAX_LOAD_CLIENTS ) )
+            {
+               fprintf( stderr, "Clients must be 1 to %d\n", MAX_LOAD_CLIENTS );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'S':
+         {
+            if ( parse_watch( optarg ) != EXIT_SUCCESS )
+            {
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'i':
+         {
+            g_ifname = optarg;
+            break;
+         }
+         case 'J':
+         {
+            jitter_id = (uint32_t) strtoul( optarg, &next, 0 );
+            jitter_count = JITTER_FRAMES;
+            if ( ':' == *next )
+            {
+               jitter_count = strtoul( next + 1, NULL, 0 );
+            }
+            if ( jitter_count < 2 )
+            {
+               fprintf( stderr, "Jitter needs at least 2 frames\n" );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'F':
+         {
+            flood_count = strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'X':
+         {
+            isotp_count = strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'M':
+         {
+            g_fleet_spec = optarg;
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+   }
 
    // Use program name as identifier for system log entries:
    //   /var/log/syslog
    sprintf( program, "%.*s", SYSLOG_BUF_SIZE, argv[ 0 ] ); 
    openlog( program, LOG_NDELAY, LOG_USER );
    syslog( LOG_INFO, "Started as PID: %d", getpid() );
+
+   if ( store_file != NULL )
+   {
+      if ( EXIT_SUCCESS == tsdb_open( &g_store, store_file ) )
+      {
+         g_store_enabled = true;
+      }
+   }
    
-   setup_signals();
-   run_menu();
+   if ( query )
+   {
+      return_status = query_store( query_pid, start_ms, end_ms );
+   }
+   else if ( ( bench_count > 0 ) && ( load_clients > 1 ) )
+   {
+      setup_signals();
+      return_status = run_load( load_clients, bench_count, bench_window );
+   }
+   else if ( bench_count > 0 )
+   {
+      setup_signals();
+      return_status = run_benchmark( bench_count, bench_window );
+   }
+   else if ( jitter_count > 0 )
+   {
+      setup_signals();
+      return_status = run_jitter( jitter_id, jitter_count );
+   }
+   else if ( flood_count > 0 )
+   {
+      setup_signals();
+      return_status = run_flood( flood_count );
+   }
+   else if ( isotp_count > 0 )
+   {
+      setup_signals();
+      return_status = run_isotp( isotp_count );
+   }
+   else if ( g_fleet_spec != NULL )
+   {
+      setup_signals();
+      return_status = run_fleet( g_fleet_spec );
+   }
+   else if ( g_watch_count > 0 )
+   {
+      setup_signals();
+      return_status = run_watch();
+   }
+   else if ( g_scheduler.count > 0 )
+   {
+      setup_signals();
+      return_status = run_poll();
+   }
+   else
+   {
+      setup_signals();
+      run_menu();
+   }
+
+   if ( g_store_enabled )
+   {
+      tsdb_close( &g_store );
+   }
 
    closelog();   
    return( return_status );
@@ -136,231 +728,3095 @@ int main( int argc, char *argv[] )
 
 
 /*
-* Name: run_menu
+* Name: run_menu
+*
+* Description: Read PIDs chosen from the menu.  The connection is
+*              re-opened with backoff when the vehicle is lost, a
+*              reading in flight is sent again once reconnected.
+*
+* Inputs: None
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_menu( void )
+{
+   int return_status = EXIT_SUCCESS;
+   vehicle_session session;
+   obd2_message obd2_response = { 0 };
+   uint8_t selection;
+   uint8_t pid;
+   bool bypass_cache = false;
+
+   session_init( &session );
+
+   while ( !g_stop_signal )
+   {
+      if ( !session_connect( &session ) )
+      {
+         session_sleep( &session, UINT64_MAX );
+         continue;
+      }
+
+      printf( main_menu );
+      selection = get_menu_input();
+
+      pid = 0;
+      switch( selection )
+      {
+         case MAIN_MENU_ENGINE_RPM:
+         {
+            printf( "Send RPM Request\n" );
+            pid = PID_ENGINE_RPM;
+            break;
+         }
+         case MAIN_MENU_VEHICLE_SPEED:
+         {
+            printf( "Send Speed Request\n" );
+            pid = PID_VEHICLE_SPEED;
+            break;
+         }
+         case MAIN_MENU_AMBIENT_AIR_TEMP:
+         {
+            printf( "Send Ambient Air Temp Request\n" );
+            pid = PID_AMBIENT_AIR_TEMP;
+            break;
+         }
+         case MAIN_MENU_ODOMETER:
+         {
+            printf( "Send Odometer Request\n" );
+            pid = PID_ODOMETER;
+            break;
+         }
+         case MAIN_MENU_BYPASS_CACHE:
+         {
+            printf( "Next value is read from the vehicle\n" );
+            bypass_cache = true;
+            break;
+         }
+         case MAIN_MENU_EXIT:
+         {
+            g_stop_signal = 1;
+            break;
+         }
+
+         default:
+         {
+            break;
+         }
+      }
+
+      if ( pid != 0 )
+      {
+         session_request( &session, pid, bypass_cache, &obd2_response );
+         handle_obd2_response( &obd2_response );
+         bypass_cache = false;
+      }
+   }
+
+   syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+   session_close( &session );
+   session_report( &session );
+   report_rtt();
+   remove( client_log_file );
+
+   return( return_status );
+}
+
+
+/*
+* Name: request_obd2_data
+*
+* Description: Read the current value of a PID.  A cached response
+*              younger than the PID TTL is returned without a vehicle
+*              round trip, otherwise the vehicle is asked and the
+*              response is cached.  PIDs the vehicle does not support
+*              are not requested.
+*
+* Inputs: link - vehicle transport
+*         pid - PID to read
+*         bypass_cache - true to always ask the vehicle
+*
+* Outputs: obd2_response - current value, negative response or
+*                         cleared when there is no answer
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - connection closed, link must be re-opened
+*
+*/
+int request_obd2_data(
+   transport *link,
+   uint8_t pid,
+   bool bypass_cache,
+   obd2_message* obd2_response
+   )
+{
+   int return_status;
+   cache_entry *entry = &g_cache[ pid ];
+   obd2_message obd2_request = { 0 };
+   uint64_t now_ms = monotonic_ns() / NS_PER_MS;
+
+   g_cached_response = false;
+   if ( !pid_supported( pid ) )
+   {
+      printf( "PID %u: Not supported by the vehicle\n", pid );
+      memset( obd2_response, 0, sizeof( obd2_message ) );
+      return( EXIT_SUCCESS );
+   }
+
+   if (   g_cache_enabled
+       && !bypass_cache
+       && entry->valid
+       && ( now_ms - entry->received_ms < entry->ttl_ms )
+      )
+   {
+      if ( g_verbose )
+      {
+         printf( "Cached %lu ms ago\n", (unsigned long) ( now_ms - entry->received_ms ) );
+      }
+      *obd2_response = entry->response;
+      g_cached_response = true;
+      return( EXIT_SUCCESS );
+   }
+
+   obd2_request.id = scan_tool_id;
+   obd2_request.num_bytes = 2;
+   obd2_request.mode = MODE_SHOW_CURRENT_DATA;
+   obd2_request.pid = pid;
+
+   return_status = exchange_obd2_request( link, &obd2_request, &g_rtt[ pid ], obd2_response );
+
+   if ( RESPONSE_TIMEOUT == return_status )
+   {
+      printf( "PID %u: No response\n", pid );
+      memset( obd2_response, 0, sizeof( obd2_message ) );
+      return_status = EXIT_SUCCESS;
+   }
+   else if (   ( EXIT_SUCCESS == return_status )
+       && ( ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) == obd2_response->mode )
+       && ( pid == obd2_response->pid )
+      )
+   {
+      entry->valid = true;
+      entry->received_ms = monotonic_ns() / NS_PER_MS;
+      entry->response = *obd2_response;
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: exchange_obd2_request
+*
+* Description: Send a current data request and wait for the answer, as
+*              long as the PID's RTT estimate allows.  Answers still
+*              queued for earlier requests of the PID are dropped
+*              first.  A response pending
+*              negative response extends the wait to P2*.  With -H a
+*              request still unanswered at the hedge delay is sent
+*              once more, the first answer wins.  Late answers to
+*              earlier requests are dropped.
+*
+* Inputs: link - vehicle transport
+*         obd2_request - mode 01 request
+*         rtt - round trip estimate of the PID
+*
+* Outputs: obd2_response - positive or negative response
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - connection closed, link must be re-opened
+*          RESPONSE_TIMEOUT - no answer
+*
+*/
+int exchange_obd2_request(
+   transport *link,
+   obd2_message *obd2_request,
+   rtt_estimator *rtt,
+   obd2_message* obd2_response
+   )
+{
+   int return_status;
+   uint8_t pid = obd2_request->pid;
+   uint64_t start_ns;
+   uint64_t now_ns;
+   uint64_t deadline_ns;
+   uint64_t hedge_ns = 0;
+   uint64_t wake_ns;
+   bool ambiguous;
+   bool hedged = false;
+
+   discard_late_answers( link, rtt );
+
+   // On one core the answer can be queued before send() returns
+   start_ns = monotonic_ns();
+   send_obd2_request( link, obd2_request );
+   now_ns = start_ns;
+   deadline_ns = start_ns + rtt_timeout_us( rtt ) * NS_PER_USEC;
+   ambiguous = ( start_ns / NS_PER_USEC < rtt->ambiguous_until_us );
+
+   if ( g_hedge_enabled && ( rtt_hedge_us( rtt ) > 0 ) )
+   {
+      hedge_ns = start_ns + rtt_hedge_us( rtt ) * NS_PER_USEC;
+   }
+
+   for(;;)
+   {
+      if ( now_ns >= deadline_ns )
+      {
+         return_status = RESPONSE_TIMEOUT;
+         rtt_expired( rtt );
+         break;
+      }
+
+      if ( ( hedge_ns != 0 ) && ( now_ns >= hedge_ns ) )
+      {
+         send_obd2_request( link, obd2_request );
+         rtt_hedged( rtt );
+         hedged = true;
+         ambiguous = true;
+         hedge_ns = 0;
+      }
+
+      wake_ns = ( ( hedge_ns != 0 ) && ( hedge_ns < deadline_ns ) ) ? hedge_ns : deadline_ns;
+      return_status = recive_obd2_response(
+         link,
+         obd2_response,
+         (int) ( ( wake_ns - now_ns + NS_PER_MS - 1 ) / NS_PER_MS )
+         );
+      now_ns = monotonic_ns();
+
+      if ( EXIT_FAILURE == return_status )
+      {
+         break;
+      }
+      else if ( RESPONSE_TIMEOUT == return_status )
+      {
+         if ( g_stop_signal )
+         {
+            break;
+         }
+      }
+      else if (   ( ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) == obd2_response->mode )
+               && ( pid == obd2_response->pid )
+              )
+      {
+         rtt_answered( rtt, ( now_ns - start_ns ) / NS_PER_USEC, ambiguous );
+         break;
+      }
+      else if (   ( MODE_NEGATIVE_RESPONSE == obd2_response->mode )
+               && ( MODE_SHOW_CURRENT_DATA == obd2_response->pid  )
+               && ( pid == obd2_response->data[ 1 ] )
+              )
+      {
+         if ( obd2_response->data[ 0 ] != NRC_RESPONSE_PENDING )
+         {
+            rtt_answered( rtt, ( now_ns - start_ns ) / NS_PER_USEC, true );
+            break;
+         }
+         // The vehicle is working on it, a hedge would only add load
+         deadline_ns = now_ns + P2_STAR_TIMEOUT_MS * NS_PER_MS;
+         hedge_ns = 0;
+         ambiguous = true;
+      }
+   }
+
+   // A timed out request or the other copy of a hedged one may still
+   // be answered, that answer must not be taken as the RTT of the next
+   // request
+   if ( hedged || ( RESPONSE_TIMEOUT == return_status ) )
+   {
+      rtt->ambiguous_until_us = now_ns / NS_PER_USEC + rtt_timeout_us( rtt );
+   }
+
+   if ( return_status != EXIT_FAILURE )
+   {
+      rtt_latency_add( &g_read_latency, ( now_ns - start_ns ) / NS_PER_USEC );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: discard_late_answers
+*
+* Description: Drop answers already queued for timed out or hedged
+*              requests of a PID before it is requested again.  OBD-II
+*              answers carry no request number, a late answer would
+*              otherwise be taken for the next request and every
+*              following one would read the previous value.
+*
+* Inputs: link - vehicle transport
+*         rtt - round trip estimate of the PID
+*
+* Returns: None
+*
+*/
+void discard_late_answers( transport *link, rtt_estimator *rtt )
+{
+   obd2_message obd2_response;
+
+   if ( monotonic_ns() / NS_PER_USEC < rtt->ambiguous_until_us )
+   {
+      while ( EXIT_SUCCESS == recive_obd2_response( link, &obd2_response, 0 ) )
+      {
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: report_rtt
+*
+* Description: Print the round trip estimate of every PID read and the
+*              read latency seen by the caller
+*
+* Inputs: None
+*
+* Returns: None
+*
+*/
+void report_rtt( void )
+{
+   char summary[ CLIENT_LOG_BUF_SIZE ];
+   unsigned int pid;
+
+   for ( pid = 0; pid <= UINT8_MAX; pid++ )
+   {
+      if ( ( g_rtt[ pid ].answers + g_rtt[ pid ].timeouts ) > 0 )
+      {
+         rtt_summary( &g_rtt[ pid ], summary, sizeof( summary ) );
+         printf( "PID %3u RTT: %s\n", pid, summary );
+      }
+   }
+
+   rtt_latency_summary( &g_read_latency, summary, sizeof( summary ) );
+   printf( "Read latency: %s\n", summary );
+   syslog( LOG_INFO, "Read latency: %s", summary );
+   return;
+}
+
+
+/*
+* Name: discover_supported_pids
+*
+* Description: Read the supported PID bitmaps, following the chain
+*              from PID 0x00 until a range does not announce the
+*              next one.  A vehicle that does not answer PID 0x00 is
+*              assumed to support every PID.
+*
+* Inputs: link - vehicle transport
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - connection closed, link must be re-opened
+*
+*/
+int discover_supported_pids( transport *link )
+{
+   int return_status = EXIT_SUCCESS;
+   obd2_message obd2_request = { 0 };
+   obd2_message obd2_response;
+   bool verbose = g_verbose;
+   uint32_t bitmap;
+   unsigned int range;
+   unsigned int pid;
+
+   g_supported_known = false;
+   memset( g_supported_pids, 0, sizeof( g_supported_pids ) );
+
+   obd2_request.id = scan_tool_id;
+   obd2_request.num_bytes = 2;
+   obd2_request.mode = MODE_SHOW_CURRENT_DATA;
+
+   g_verbose = false;
+   for ( range = 0; range < PID_SUPPORTED_RANGES; range++ )
+   {
+      obd2_request.pid = (uint8_t) ( range * PID_SUPPORTED_RANGE );
+      return_status = exchange_obd2_request( link, &obd2_request, &g_rtt[ obd2_request.pid ], &obd2_response );
+
+      if (   ( return_status != EXIT_SUCCESS )
+          || ( obd2_response.mode != ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) )
+         )
+      {
+         break;
+      }
+
+      bitmap  = (uint32_t) obd2_response.data[ 0 ] << 24;
+      bitmap |= (uint32_t) obd2_response.data[ 1 ] << 16;
+      bitmap |= (uint32_t) obd2_response.data[ 2 ] <<  8;
+      bitmap |= (uint32_t) obd2_response.data[ 3 ];
+      g_supported_pids[ range ] = bitmap;
+      g_supported_known = true;
+
+      // The last bit announces the next range
+      if ( 0 == ( bitmap & 1 ) )
+      {
+         break;
+      }
+   }
+   g_verbose = verbose;
+
+   if ( RESPONSE_TIMEOUT == return_status )
+   {
+      return_status = EXIT_SUCCESS;
+   }
+
+   if ( g_verbose && g_supported_known )
+   {
+      printf( "Supported PIDs:" );
+      for ( pid = 1; pid <= UINT8_MAX; pid++ )
+      {
+         if ( ( pid % PID_SUPPORTED_RANGE ) && pid_supported( (uint8_t) pid ) )
+         {
+            printf( " %u", pid );
+         }
+      }
+      printf( "\n" );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: pid_supported
+*
+* Description: Check a PID against the bitmaps read at connect.  The
+*              range PIDs themselves can always be requested.
+*
+* Inputs: pid - PID to check
+*
+* Returns: true - PID is supported or support is unknown
+*          false - PID is not supported
+*
+*/
+bool pid_supported( uint8_t pid )
+{
+   unsigned int range;
+   unsigned int offset;
+
+   if ( !g_supported_known || ( 0 == ( pid % PID_SUPPORTED_RANGE ) ) )
+   {
+      return( true );
+   }
+
+   range = ( pid - 1 ) / PID_SUPPORTED_RANGE;
+   offset = pid - range * PID_SUPPORTED_RANGE;
+   return( 0 != ( g_supported_pids[ range ] & ( 1U << ( PID_SUPPORTED_RANGE - offset ) ) ) );
+}
+
+
+/*
+* Name: cache_init
+*
+* Description: Set the cache TTLs from the PID table
+*
+* Inputs: None
+*
+* Returns: None
+*
+*/
+void cache_init( void )
+{
+   unsigned int i;
+
+   memset( g_cache, 0, sizeof( g_cache ) );
+   for ( i = 0; i < M_ARRAY_SIZE( g_pid_table ); i++ )
+   {
+      g_cache[ g_pid_table[ i ].pid ].ttl_ms = g_pid_table[ i ].ttl_ms;
+   }
+   return;
+}
+
+
+/*
+* Name: parse_cache_ttl
+*
+* Description: Override the TTL of a PID from a pid:ttl argument
+*
+* Inputs: spec - argument text
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - invalid argument
+*
+*/
+int parse_cache_ttl( const char *spec )
+{
+   char *end;
+   unsigned long pid;
+   unsigned long ttl_ms;
+
+   pid = strtoul( spec, &end, 0 );
+   if ( ( ':' == *end ) && ( pid <= UINT8_MAX ) )
+   {
+      ttl_ms = strtoul( end + 1, &end, 0 );
+      if ( ( '\0' == *end ) && ( ttl_ms <= UINT32_MAX ) )
+      {
+         g_cache[ pid ].ttl_ms = (uint32_t) ttl_ms;
+         return( EXIT_SUCCESS );
+      }
+   }
+
+   fprintf( stderr, "Invalid cache TTL: %s\n", spec );
+   return( EXIT_FAILURE );
+}
+
+
+/*
+* Name: run_benchmark
+*
+* Description: Measure the latency and throughput of the selected
+*              transport with RPM requests.  A window above one sends
+*              that many requests as one batch and waits for all of
+*              the responses, the latency is then per batch.  A link
+*              with kernel receive timestamps ends the round trip at
+*              the receive time of the last response.
+*
+* Inputs: count - number of requests
+*         window - requests per batch
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_benchmark( unsigned long count, unsigned int window )
+{
+   int return_status = EXIT_SUCCESS;
+   transport link;
+   obd2_message obd2_requests[ TRANSPORT_BATCH_SIZE ];
+   obd2_message obd2_responses[ TRANSPORT_BATCH_SIZE ];
+   uint64_t *samples;
+   uint64_t start_ns;
+   uint64_t start_wall_ns;
+   uint64_t last_rx_ns;
+   uint64_t bench_start_ns;
+   uint64_t elapsed_ns;
+   uint64_t total_ns = 0;
+   unsigned long batches;
+   unsigned long done;
+   unsigned int received;
+   unsigned int i;
+   int rx_count;
+   const char *names[] = { "tcp", "shm", "unix", "vbus", "can" };
+
+   batches = ( count + window - 1 ) / window;
+   samples = calloc( batches, sizeof( uint64_t ) );
+   if ( NULL == samples )
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   if ( EXIT_SUCCESS != open_link( &link ) )
+   {
+      free( samples );
+      return( EXIT_FAILURE );
+   }
+
+   g_verbose = false;
+   memset( obd2_requests, 0, sizeof( obd2_requests ) );
+   for ( i = 0; i < window; i++ )
+   {
+      obd2_requests[ i ].id = scan_tool_id;
+      obd2_requests[ i ].num_bytes = 2;
+      obd2_requests[ i ].mode = MODE_SHOW_CURRENT_DATA;
+      obd2_requests[ i ].pid = PID_ENGINE_RPM;
+   }
+
+   bench_start_ns = monotonic_ns();
+   for ( done = 0; ( done < batches ) && !g_stop_signal; done++ )
+   {
+      start_ns = monotonic_ns();
+      start_wall_ns = realtime_ns();
+      transport_send_batch( &link, obd2_requests, sizeof( obd2_message ), window );
+
+      received = 0;
+      last_rx_ns = 0;
+      while ( received < window )
+      {
+         rx_count = transport_receive_batch(
+            &link,
+            obd2_responses,
+            sizeof( obd2_message ),
+            window - received,
+            P2_STAR_TIMEOUT_MS
+            );
+         if ( ( TRANSPORT_CLOSED == rx_count ) || ( TRANSPORT_ERROR == rx_count ) )
+         {
+            return_status = EXIT_FAILURE;
+            break;
+         }
+         else if ( TRANSPORT_TIMEOUT == rx_count )
+         {
+            // Interrupted or the vehicle stopped answering
+            if ( !g_stop_signal )
+            {
+               printf( "No response within %u ms\n", P2_STAR_TIMEOUT_MS );
+               return_status = EXIT_FAILURE;
+            }
+            break;
+         }
+
+         // A shared bus also carries other nodes' frames
+         for ( i = 0; i < (unsigned int) rx_count; i++ )
+         {
+            if ( vehicle_id == obd2_responses[ i ].id )
+            {
+               received++;
+               last_rx_ns = link.rx_timestamp_ns[ i ];
+            }
+         }
+      }
+      if ( ( EXIT_SUCCESS != return_status ) || ( received < window ) )
+      {
+         break;
+      }
+
+      if ( last_rx_ns > start_wall_ns )
+      {
+         samples[ done ] = last_rx_ns - start_wall_ns;
+      }
+      else
+      {
+         samples[ done ] = monotonic_ns() - start_ns;
+      }
+      total_ns += samples[ done ];
+   }
+   elapsed_ns = monotonic_ns() - bench_start_ns;
+
+   if ( done > 0 )
+   {
+      qsort( samples, done, sizeof( uint64_t ), compare_u64 );
+      printf(
+         "%s: %lu x %u requests, round trip usec min %.1f avg %.1f "
+         "p50 %.1f p99 %.1f max %.1f, %.0f requests/sec\n",
+         g_use_gateway ? "gateway" : names[ g_transport_type ],
+         done,
+         window,
+         (double) samples[ 0 ] / NS_PER_USEC,
+         (double) total_ns / done / NS_PER_USEC,
+         (double) samples[ done / 2 ] / NS_PER_USEC,
+         (double) samples[ ( done * 99 ) / 100 ] / NS_PER_USEC,
+         (double) samples[ done - 1 ] / NS_PER_USEC,
+         (double) ( done * window ) * NS_PER_SEC / elapsed_ns
+         );
+   }
+
+   transport_close( &link );
+   free( samples );
+
+   return( return_status );
+}
+
+
+/*
+* Name: run_load
+*
+* Description: Load generator, every connection sends count requests
+*              window at a time from its own thread.  Reports the
+*              total request rate, the server reports its CPU time per
+*              request when it exits.
+*
+* Inputs: clients - connections
+*         count - requests per connection
+*         window - requests in flight per connection
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_load( unsigned int clients, unsigned long count, unsigned int window )
+{
+   int return_status = EXIT_SUCCESS;
+   load_client *load;
+   pthread_t threads[ MAX_LOAD_CLIENTS ];
+   unsigned int opened;
+   unsigned int started;
+   unsigned int i;
+   unsigned long done = 0;
+   unsigned long fewest = ULONG_MAX;
+   uint64_t start_ns;
+   uint64_t elapsed_ns;
+   const char *names[] = { "tcp", "shm", "unix", "vbus", "can" };
+
+   if ( ( TRANSPORT_TCP != g_transport_type ) && ( TRANSPORT_UNIX != g_transport_type ) )
+   {
+      fprintf( stderr, "The load generator needs the tcp or unix transport\n" );
+      return( EXIT_FAILURE );
+   }
+
+   load = calloc( clients, sizeof( load_client ) );
+   if ( NULL == load )
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   g_verbose = false;
+   for ( opened = 0; opened < clients; opened++ )
+   {
+      if ( EXIT_SUCCESS != open_link( &load[ opened ].link ) )
+      {
+         return_status = EXIT_FAILURE;
+         break;
+      }
+      load[ opened ].count = count;
+      load[ opened ].window = window;
+   }
+
+   started = 0;
+   start_ns = monotonic_ns();
+   if ( EXIT_SUCCESS == return_status )
+   {
+      for ( started = 0; started < clients; started++ )
+      {
+         if ( 0 != pthread_create( &threads[ started ], NULL, send_load, &load[ started ] ) )
+         {
+            syslog( LOG_ERR, "%s: Could not start client %u", __func__, started );
+            return_status = EXIT_FAILURE;
+            break;
+         }
+      }
+   }
+
+   for ( i = 0; i < started; i++ )
+   {
+      pthread_join( threads[ i ], NULL );
+      done += load[ i ].done;
+      if ( load[ i ].done < fewest )
+      {
+         fewest = load[ i ].done;
+      }
+      if ( load[ i ].status != EXIT_SUCCESS )
+      {
+         return_status = EXIT_FAILURE;
+      }
+   }
+   elapsed_ns = monotonic_ns() - start_ns;
+
+   if ( done > 0 )
+   {
+      printf(
+         "%s: %u clients x %lu requests, window %u, %.0f requests/sec, fewest done by one client %lu\n",
+         g_use_gateway ? "gateway" : names[ g_transport_type ],
+         started,
+         count,
+         window,
+         (double) done * NS_PER_SEC / elapsed_ns,
+         fewest
+         );
+   }
+
+   for ( i = 0; i < opened; i++ )
+   {
+      transport_close( &load[ i ].link );
+   }
+   free( load );
+
+   return( return_status );
+}
+
+
+/*
+* Name: send_load
+*
+* Description: Thread of one load generator connection
+*
+* Inputs: context - load_client
+*
+* Returns: NULL
+*
+*/
+void *send_load( void *context )
+{
+   load_client *client = context;
+   obd2_message obd2_requests[ TRANSPORT_BATCH_SIZE ];
+   obd2_message obd2_responses[ TRANSPORT_BATCH_SIZE ];
+   unsigned int batch;
+   unsigned int received;
+   unsigned int i;
+   int rx_count;
+
+   client->status = EXIT_SUCCESS;
+   memset( obd2_requests, 0, sizeof( obd2_requests ) );
+   for ( i = 0; i < client->window; i++ )
+   {
+      obd2_requests[ i ].id = scan_tool_id;
+      obd2_requests[ i ].num_bytes = 2;
+      obd2_requests[ i ].mode = MODE_SHOW_CURRENT_DATA;
+      obd2_requests[ i ].pid = PID_ENGINE_RPM;
+   }
+
+   while ( ( client->done < client->count ) && !g_stop_signal )
+   {
+      batch = client->window;
+      if ( batch > client->count - client->done )
+      {
+         batch = (unsigned int) ( client->count - client->done );
+      }
+      if ( EXIT_SUCCESS != transport_send_batch( &client->link, obd2_requests, sizeof( obd2_message ), batch ) )
+      {
+         client->status = EXIT_FAILURE;
+         break;
+      }
+
+      for ( received = 0; received < batch; received += (unsigned int) rx_count )
+      {
+         rx_count = transport_receive_batch(
+            &client->link,
+            obd2_responses,
+            sizeof( obd2_message ),
+            batch - received,
+            P2_STAR_TIMEOUT_MS
+            );
+         if ( rx_count <= 0 )
+         {
+            client->status = g_stop_signal ? EXIT_SUCCESS : EXIT_FAILURE;
+            return( NULL );
+         }
+      }
+      client->done += batch;
+   }
+   return( NULL );
+}
+
+
+/*
+* Name: run_jitter
+*
+* Description: Measure the period of a cyclic frame, from the time
+*              each frame is received.  The kernel receive time is
+*              used when the link has one, it does not include the
+*              scheduling delay of this process.
+*
+* Inputs: can_id - identifier of the cyclic frame
+*         count - frames to receive
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_jitter( uint32_t can_id, unsigned long count )
+{
+   int return_status = EXIT_SUCCESS;
+   transport link;
+   obd2_message frame;
+   uint64_t *samples;
+   uint64_t now_ns;
+   uint64_t last_ns = 0;
+   uint64_t total_ns = 0;
+   uint64_t deviation_ns;
+   uint64_t peak_ns = 0;
+   double average_ns;
+   unsigned long frames = 0;
+   unsigned long done;
+   unsigned long i;
+   int rx_bytes;
+
+   samples = calloc( count - 1, sizeof( uint64_t ) );
+   if ( NULL == samples )
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   if ( EXIT_SUCCESS != open_link( &link ) )
+   {
+      free( samples );
+      return( EXIT_FAILURE );
+   }
+
+   while ( ( frames < count ) && !g_stop_signal )
+   {
+      rx_bytes = transport_receive( &link, &frame, sizeof( frame ), P2_STAR_TIMEOUT_MS );
+      now_ns = ( link.rx_timestamp_ns[ 0 ] != 0 ) ? link.rx_timestamp_ns[ 0 ] : monotonic_ns();
+      if ( ( TRANSPORT_CLOSED == rx_bytes ) || ( TRANSPORT_ERROR == rx_bytes ) )
+      {
+         return_status = EXIT_FAILURE;
+         break;
+      }
+      else if ( TRANSPORT_TIMEOUT == rx_bytes )
+      {
+         if ( !g_stop_signal )
+         {
+            printf( "No frame 0x%X within %u ms\n", can_id, P2_STAR_TIMEOUT_MS );
+            return_status = EXIT_FAILURE;
+         }
+         break;
+      }
+
+      if ( frame.id != can_id )
+      {
+         continue;
+      }
+
+      if ( frames > 0 )
+      {
+         samples[ frames - 1 ] = now_ns - last_ns;
+         total_ns += now_ns - last_ns;
+      }
+      last_ns = now_ns;
+      frames++;
+   }
+
+   done = ( frames > 0 ) ? frames - 1 : 0;
+   if ( done > 0 )
+   {
+      average_ns = (double) total_ns / done;
+      for ( i = 0; i < done; i++ )
+      {
+         deviation_ns = ( samples[ i ] > average_ns )
+                      ? (uint64_t) ( samples[ i ] - average_ns )
+                      : (uint64_t) ( average_ns - samples[ i ] );
+         if ( deviation_ns > peak_ns )
+         {
+            peak_ns = deviation_ns;
+         }
+      }
+
+      qsort( samples, done, sizeof( uint64_t ), compare_u64 );
+      printf(
+         "0x%X: %lu periods, usec min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f, "
+         "peak jitter %.1f usec\n",
+         can_id,
+         done,
+         (double) samples[ 0 ] / NS_PER_USEC,
+         average_ns / NS_PER_USEC,
+         (double) samples[ done / 2 ] / NS_PER_USEC,
+         (double) samples[ ( done * 99 ) / 100 ] / NS_PER_USEC,
+         (double) samples[ done - 1 ] / NS_PER_USEC,
+         (double) peak_ns / NS_PER_USEC
+         );
+   }
+
+   transport_close( &link );
+   free( samples );
+
+   return( return_status );
+}
+
+
+/*
+* Name: run_flood
+*
+* Description: Send frames back to back from a second node on the bus
+*              and receive them in batches.  Reports the sustained
+*              receive rate, the frames the socket queue dropped and
+*              the frames missing from the sequence.  Only for the
+*              vbus and can transports.
+*
+* Inputs: count - frames to send
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_flood( unsigned long count )
+{
+   int return_status = EXIT_SUCCESS;
+   transport link;
+   flood_sender sender = { 0 };
+   flood_frame frames[ TRANSPORT_BATCH_SIZE ];
+   pthread_t thread;
+   uint64_t first_ns = 0;
+   uint64_t last_ns = 0;
+   uint64_t now_ns;
+   unsigned long received = 0;
+   unsigned long expected = 0;
+   unsigned long missing = 0;
+   int rx_count;
+   int i;
+
+   if ( TRANSPORT_CAN == g_transport_type )
+   {
+      return_status = transport_can_open( &link, g_ifname );
+      if ( EXIT_SUCCESS == return_status )
+      {
+         return_status = transport_can_open( &sender.link, g_ifname );
+         if ( EXIT_SUCCESS == return_status )
+         {
+            // Only the flood frames queue up on the receiving socket
+            transport_can_filter( &link, FLOOD_ID, FLOOD_ID_MASK );
+            transport_can_filter( &sender.link, FLOOD_ID, FLOOD_ID_MASK );
+         }
+         else
+         {
+            transport_close( &link );
+         }
+      }
+   }
+   else if ( TRANSPORT_VBUS == g_transport_type )
+   {
+      return_status = transport_vbus_attach( &link, VBUS_NAME );
+      if ( EXIT_SUCCESS == return_status )
+      {
+         return_status = transport_vbus_join( &sender.link, &link );
+         if ( return_status != EXIT_SUCCESS )
+         {
+            transport_close( &link );
+         }
+      }
+   }
+   else
+   {
+      fprintf( stderr, "Flood needs the vbus or can transport\n" );
+      return( EXIT_FAILURE );
+   }
+
+   if ( return_status != EXIT_SUCCESS )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   sender.count = count;
+   if ( 0 != pthread_create( &thread, NULL, send_flood, &sender ) )
+   {
+      syslog( LOG_ERR, "%s: Could not start the sender", __func__ );
+      transport_close( &sender.link );
+      transport_close( &link );
+      return( EXIT_FAILURE );
+   }
+
+   while ( ( received < count ) && !g_stop_signal )
+   {
+      rx_count = transport_receive_batch(
+         &link,
+         frames,
+         sizeof( flood_frame ),
+         TRANSPORT_BATCH_SIZE,
+         FLOOD_IDLE_MS
+         );
+      if ( ( TRANSPORT_CLOSED == rx_count ) || ( TRANSPORT_ERROR == rx_count ) )
+      {
+         return_status = EXIT_FAILURE;
+         break;
+      }
+      else if ( TRANSPORT_TIMEOUT == rx_count )
+      {
+         // Nothing for a while, the rest was lost
+         break;
+      }
+
+      now_ns = monotonic_ns();
+      for ( i = 0; i < rx_count; i++ )
+      {
+         if ( frames[ i ].id != FLOOD_ID )
+         {
+            continue;
+         }
+
+         last_ns = ( link.rx_timestamp_ns[ i ] != 0 ) ? link.rx_timestamp_ns[ i ] : now_ns;
+         if ( 0 == received )
+         {
+            first_ns = last_ns;
+         }
+         if ( frames[ i ].sequence > expected )
+         {
+            missing += frames[ i ].sequence - expected;
+         }
+         expected = frames[ i ].sequence + 1;
+         received++;
+      }
+   }
+
+   atomic_store( &sender.stop, true );
+   pthread_join( thread, NULL );
+
+   printf(
+      "%s: sent %lu, received %lu, %.0f frames/sec, socket queue drops %lu, missing %lu\n",
+      ( TRANSPORT_CAN == g_transport_type ) ? g_ifname : "vbus",
+      sender.sent,
+      received,
+      ( last_ns > first_ns ) ? (double) ( received - 1 ) * NS_PER_SEC / ( last_ns - first_ns ) : 0.0,
+      link.rx_dropped,
+      missing + ( sender.sent - expected )
+      );
+
+   transport_close( &sender.link );
+   transport_close( &link );
+
+   return( return_status );
+}
+
+
+/*
+* Name: send_flood
+*
+* Description: Sender thread of the flood benchmark, sends as fast as
+*              the bus takes the frames
+*
+* Inputs: context - flood_sender
+*
+* Returns: NULL
+*
+*/
+void *send_flood( void *context )
+{
+   flood_sender *sender = context;
+   flood_frame frame = { 0 };
+
+   frame.id = FLOOD_ID;
+   for (   sender->sent = 0;
+           ( sender->sent < sender->count ) && !atomic_load( &sender->stop );
+           sender->sent++
+       )
+   {
+      frame.sequence = (uint32_t) sender->sent;
+      if ( EXIT_SUCCESS != transport_send( &sender->link, &frame, sizeof( frame ) ) )
+      {
+         break;
+      }
+   }
+   return( NULL );
+}
+
+
+/*
+* Name: run_isotp
+*
+* Description: Compare ISO-TP in classic CAN and CAN FD frames.  Reads
+*              the VIN and all supported PIDs in one mode 01 request
+*              count times with each, the CAN FD run only when the bus
+*              and the link take CAN FD frames.  Only for the vbus and
+*              can transports.
+*
+* Inputs: count - requests of each kind per run
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_isotp( unsigned long count )
+{
+   int return_status;
+   transport link;
+   uint8_t pids[ MAX_REQUEST_PIDS ];
+   size_t pid_count = 0;
+   size_t i;
+
+   if ( ( g_transport_type != TRANSPORT_VBUS ) && ( g_transport_type != TRANSPORT_CAN ) )
+   {
+      fprintf( stderr, "ISO-TP needs the vbus or can transport\n" );
+      return( EXIT_FAILURE );
+   }
+
+   if ( EXIT_SUCCESS != open_link( &link ) )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   for ( i = 0; ( i < M_ARRAY_SIZE( g_pid_table ) ) && ( pid_count < MAX_REQUEST_PIDS ); i++ )
+   {
+      if ( pid_supported( g_pid_table[ i ].pid ) )
+      {
+         pids[ pid_count++ ] = g_pid_table[ i ].pid;
+      }
+   }
+
+   return_status = measure_isotp( &link, false, count, pids, pid_count );
+
+   if ( ( EXIT_SUCCESS == return_status ) && !g_stop_signal )
+   {
+      if ( ( EXIT_SUCCESS == transport_enable_fd( &link ) ) && link.fd_capable )
+      {
+         return_status = measure_isotp( &link, true, count, pids, pid_count );
+      }
+      else
+      {
+         printf( "CAN FD: not supported by the bus\n" );
+      }
+   }
+
+   transport_close( &link );
+   return( return_status );
+}
+
+
+/*
+* Name: measure_isotp
+*
+* Description: One run of the ISO-TP comparison.  Prints the VIN, the
+*              responses per second and the bus frames each response
+*              took, flow control included.
+*
+* Inputs: link - open vbus or can transport
+*         fd - send the requests in CAN FD frames, the vehicle answers
+*              in the same format
+*         count - requests of each kind
+*         pids - PIDs of the mode 01 request
+*         pid_count - number of PIDs
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - no or wrong response
+*
+*/
+int measure_isotp( transport *link, bool fd, unsigned long count, const uint8_t *pids, size_t pid_count )
+{
+   isotp_channel channel;
+   uint8_t vin_request[] = { MODE_REQUEST_VEHICLE_INFO, PID_VIN };
+   uint8_t pid_request[ 1 + MAX_REQUEST_PIDS ];
+   uint8_t response[ ISOTP_FD_FRAME ];
+   char vin[ VIN_LENGTH + 1 ] = { 0 };
+   uint64_t start_ns;
+   uint64_t elapsed_ns;
+   unsigned long done;
+   int vin_length = 0;
+   int pid_length = 0;
+
+   pid_request[ 0 ] = MODE_SHOW_CURRENT_DATA;
+   memcpy( &pid_request[ 1 ], pids, pid_count );
+
+   isotp_init( &channel, link, scan_tool_id, vehicle_id, fd );
+
+   start_ns = monotonic_ns();
+   for ( done = 0; ( done < count ) && !g_stop_signal; done++ )
+   {
+      vin_length = isotp_request( &channel, vin_request, sizeof( vin_request ), response, sizeof( response ) );
+      if ( vin_length < 3 + VIN_LENGTH )
+      {
+         break;
+      }
+      memcpy( vin, &response[ 3 ], VIN_LENGTH );
+
+      if ( pid_count > 0 )
+      {
+         pid_length = isotp_request( &channel, pid_request, 1 + pid_count, response, sizeof( response ) );
+         if ( pid_length < 2 )
+         {
+            break;
+         }
+      }
+   }
+   elapsed_ns = monotonic_ns() - start_ns;
+
+   if ( 0 == done )
+   {
+      fprintf( stderr, "%s: no ISO-TP response\n", fd ? "CAN FD" : "Classic CAN" );
+      return( EXIT_FAILURE );
+   }
+
+   printf(
+      "%-11s VIN %s (%d bytes), %zu PIDs (%d bytes): %.0f responses/sec, %.1f bus frames per response\n",
+      fd ? "CAN FD:" : "Classic CAN:",
+      vin,
+      vin_length,
+      pid_count,
+      pid_length,
+      (double) done * ( ( pid_count > 0 ) ? 2 : 1 ) * NS_PER_SEC / ( elapsed_ns ? elapsed_ns : 1 ),
+      (double) ( channel.tx_frames + channel.rx_frames ) / ( done * ( ( pid_count > 0 ) ? 2 : 1 ) )
+      );
+   return( ( done == count ) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+
+/*
+* Name: isotp_request
+*
+* Description: Send a request and wait for its positive response,
+*              skipping response pending and other modes' responses
+*
+* Inputs: channel - ISO-TP channel to the vehicle
+*         request - request, starting with the mode
+*         request_length - request length
+*         size - response buffer size
+*
+* Outputs: response - response
+*
+* Returns: Response length
+*          -1 - no response or a negative response
+*
+*/
+int isotp_request(
+   isotp_channel *channel,
+   const uint8_t *request,
+   size_t request_length,
+   uint8_t *response,
+   size_t size
+   )
+{
+   int length;
+
+   if ( EXIT_SUCCESS != isotp_send( channel, request, request_length ) )
+   {
+      return( -1 );
+   }
+
+   for(;;)
+   {
+      length = isotp_receive( channel, response, size, P2_STAR_TIMEOUT_MS );
+      if ( length <= 0 )
+      {
+         return( -1 );
+      }
+      if ( response[ 0 ] == ( request[ 0 ] | MODE_RESPONSE ) )
+      {
+         return( length );
+      }
+      if (   ( MODE_NEGATIVE_RESPONSE == response[ 0 ] )
+          && ( ( length < 3 ) || ( response[ 2 ] != NRC_RESPONSE_PENDING ) )
+         )
+      {
+         return( -1 );
+      }
+   }
+}
+
+
+/*
+* Name: run_watch
+*
+* Description: Subscribe to the -S PIDs and print the updates the
+*              vehicle pushes until stopped.  A vehicle that stays
+*              silent is probed with a heartbeat, a lost connection is
+*              re-opened with backoff and the subscriptions sent again.
+*
+* Inputs: None
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_watch( void )
+{
+   vehicle_session session;
+   obd2_message obd2_responses[ TRANSPORT_BATCH_SIZE ];
+   int rx_count;
+   int i;
+
+   g_verbose = false;
+   session_init( &session );
+
+   while ( !g_stop_signal )
+   {
+      if ( !session.connected )
+      {
+         if ( !session_connect( &session ) )
+         {
+            session_sleep( &session, UINT64_MAX );
+         }
+         else if ( send_subscriptions( &session.link, true ) != EXIT_SUCCESS )
+         {
+            session_lost( &session, "subscribe failed" );
+         }
+         continue;
+      }
+
+      rx_count = transport_receive_batch(
+         &session.link,
+         obd2_responses,
+         sizeof( obd2_message ),
+         TRANSPORT_BATCH_SIZE,
+         WATCH_POLL_MS
+         );
+
+      if ( ( TRANSPORT_CLOSED == rx_count ) || ( TRANSPORT_ERROR == rx_count ) )
+      {
+         session_lost( &session, "connection closed" );
+         continue;
+      }
+
+      if ( rx_count > 0 )
+      {
+         session.last_rx_ms = monotonic_ns() / NS_PER_MS;
+      }
+      for ( i = 0; i < rx_count; i++ )
+      {
+         handle_obd2_response( &obd2_responses[ i ] );
+      }
+
+      if ( !session_heartbeat( &session, monotonic_ns() / NS_PER_MS ) )
+      {
+         session_lost( &session, "no heartbeat" );
+      }
+   }
+
+   if ( session.connected )
+   {
+      send_subscriptions( &session.link, false );
+   }
+   session_close( &session );
+   session_report( &session );
+
+   syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: run_poll
+*
+* Description: Poll the -P PIDs on the rate monotonic schedule, one
+*              request at a time, and print values as they change.
+*              Expected and measured bus load are printed every
+*              POLL_REPORT_MS.  A lost connection is re-opened with
+*              backoff, the schedule carries on.
+*
+* Inputs: None
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_poll( void )
+{
+   vehicle_session session;
+   poll_scheduler *scheduler = &g_scheduler;
+   poll_entry *entry;
+   obd2_message obd2_request = { 0 };
+   obd2_message obd2_response;
+   int socket_status;
+   int wait_ms;
+   bool answered;
+   uint64_t now_ms;
+   uint64_t report_ms;
+   unsigned int i;
+
+   g_verbose = false;
+   session_init( &session );
+   while ( !session_connect( &session ) )
+   {
+      if ( g_stop_signal )
+      {
+         return( EXIT_FAILURE );
+      }
+      session_sleep( &session, UINT64_MAX );
+   }
+
+   // Never spend bus time on PIDs the vehicle does not have
+   i = 0;
+   while ( i < scheduler->count )
+   {
+      if ( pid_supported( scheduler->entries[ i ].pid ) )
+      {
+         i++;
+      }
+      else
+      {
+         printf( "PID %u: Not supported by the vehicle\n", scheduler->entries[ i ].pid );
+         scheduler->count--;
+         scheduler->entries[ i ] = scheduler->entries[ scheduler->count ];
+      }
+   }
+
+   scheduler->bitrate = g_bitrate;
+   scheduler->load_ceiling = g_load_percent / 100.0;
+   poll_scheduler_plan( scheduler );
+
+   obd2_request.id = scan_tool_id;
+   obd2_request.num_bytes = 2;
+   obd2_request.mode = MODE_SHOW_CURRENT_DATA;
+
+   now_ms = monotonic_ns() / NS_PER_MS;
+   report_ms = now_ms + POLL_REPORT_MS;
+   poll_scheduler_actual_load( scheduler, now_ms );
+
+   while ( ( scheduler->count > 0 ) && !g_stop_signal )
+   {
+      now_ms = monotonic_ns() / NS_PER_MS;
+      if ( now_ms >= report_ms )
+      {
+         report_poll( now_ms );
+         report_ms += POLL_REPORT_MS;
+      }
+
+      entry = poll_scheduler_next( scheduler, now_ms, &wait_ms );
+      if ( NULL == entry )
+      {
+         if ( ( report_ms - now_ms ) < (uint64_t) wait_ms )
+         {
+            wait_ms = (int) ( report_ms - now_ms );
+         }
+         usleep( (useconds_t) wait_ms * 1000 );
+         continue;
+      }
+
+      if ( !session_connect( &session ) )
+      {
+         session_sleep( &session, report_ms );
+         continue;
+      }
+
+      obd2_request.pid = entry->pid;
+      socket_status = exchange_obd2_request( &session.link, &obd2_request, &g_rtt[ entry->pid ], &obd2_response );
+      if ( EXIT_FAILURE == socket_status )
+      {
+         // This poll is lost, the PID's next period comes after the reconnect
+         session_lost( &session, "connection closed" );
+         continue;
+      }
+      session.last_rx_ms = monotonic_ns() / NS_PER_MS;
+
+      answered = ( EXIT_SUCCESS == socket_status )
+              && ( ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) == obd2_response.mode );
+      if ( poll_scheduler_complete( scheduler, entry, obd2_response.data, answered ) )
+      {
+         handle_obd2_response( &obd2_response );
+      }
+   }
+
+   session_close( &session );
+   session_report( &session );
+   report_rtt();
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: report_poll
+*
+* Description: Print the planned and measured bus load and each PID's
+*              target, planned and measured poll rate
+*
+* Inputs: now_ms - monotonic time
+* 
+* Returns: None
+*
+*/
+void report_poll( uint64_t now_ms )
+{
+   poll_scheduler *scheduler = &g_scheduler;
+   poll_entry *entry;
+   double seconds;
+   unsigned int i;
+
+   seconds = ( now_ms - scheduler->window_start_ms ) / (double) MS_PER_SEC;
+   for ( i = 0; i < scheduler->count; i++ )
+   {
+      entry = &scheduler->entries[ i ];
+      printf(
+         "PID %3u: target %.2f Hz, planned %.2f Hz, actual %.2f Hz\n",
+         entry->pid,
+         entry->target_hz,
+         entry->rate_hz,
+         entry->window_polls / seconds
+         );
+   }
+
+   // Reading the actual load starts the next measurement window
+   printf(
+      "Bus load: expected %.2f%%, actual %.2f%% of %u bit/s, ceiling %.0f%%\n",
+      scheduler->expected_load * 100,
+      poll_scheduler_actual_load( scheduler, now_ms ) * 100,
+      scheduler->bitrate,
+      scheduler->load_ceiling * 100
+      );
+   return;
+}
+
+
+/*
+* Name: run_fleet
+*
+* Description: Poll many vehicles at once from one epoll loop.  Each
+*              vehicle has its own rate monotonic schedule, the -P PIDs
+*              unless its file line names others, and one request in
+*              flight.  Changed values of every vehicle go to one
+*              stream, a line per value with the wall clock time:
+*                seconds.ms vehicle PID pid value unit
+*              Response timeouts and -H hedges follow the RTT of each
+*              vehicle and PID.  Lost vehicles are reconnected with
+*              backoff.  Fleet totals are printed every POLL_REPORT_MS
+*              and per vehicle counts on exit.  Samples are not stored, the store has
+*              no vehicle key.
+*
+* Inputs: spec - -M argument
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_fleet( const char *spec )
+{
+   fleet_vehicle *vehicles;
+   fleet_vehicle *vehicle;
+   unsigned int count = 0;
+   struct epoll_event events[ FLEET_EPOLL_EVENTS ];
+   struct rlimit limit;
+   int epoll_fd;
+   int ready;
+   int i;
+   unsigned int v;
+   uint64_t now_ms;
+   uint64_t wake_ms;
+   uint64_t next_ms;
+   uint64_t start_ms;
+   uint64_t report_ms;
+   int timeout_ms;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   vehicles = calloc( FLEET_MAX_VEHICLES, sizeof( fleet_vehicle ) );
+   if ( NULL == vehicles )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return( EXIT_FAILURE );
+   }
+
+   if ( ( parse_fleet( spec, vehicles, &count ) != EXIT_SUCCESS ) || ( 0 == count ) )
+   {
+      fprintf( stderr, "Fleet: No vehicles to poll\n" );
+      free( vehicles );
+      return( EXIT_FAILURE );
+   }
+
+   // One descriptor per vehicle, the default soft limit is often 1024
+   if (   ( 0 == getrlimit( RLIMIT_NOFILE, &limit ) )
+       && ( limit.rlim_cur < (rlim_t) count + FLEET_SPARE_FDS )
+      )
+   {
+      limit.rlim_cur = (rlim_t) count + FLEET_SPARE_FDS;
+      if ( limit.rlim_cur > limit.rlim_max )
+      {
+         limit.rlim_cur = limit.rlim_max;
+      }
+      setrlimit( RLIMIT_NOFILE, &limit );
+   }
+
+   epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+   if ( -1 == epoll_fd )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      free( vehicles );
+      return( EXIT_FAILURE );
+   }
+
+   g_verbose = false;
+   now_ms = monotonic_ns() / NS_PER_MS;
+   start_ms = now_ms;
+   report_ms = now_ms + POLL_REPORT_MS;
+   wake_ms = now_ms;
+
+   while ( !g_stop_signal )
+   {
+      now_ms = monotonic_ns() / NS_PER_MS;
+      timeout_ms = ( wake_ms > now_ms ) ? (int) ( wake_ms - now_ms ) : 0;
+      if ( ( report_ms > now_ms ) && ( report_ms - now_ms < (uint64_t) timeout_ms ) )
+      {
+         timeout_ms = (int) ( report_ms - now_ms );
+      }
+
+      ready = epoll_wait( epoll_fd, events, FLEET_EPOLL_EVENTS, timeout_ms );
+      if ( ( -1 == ready ) && ( errno != EINTR ) )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+         break;
+      }
+
+      now_ms = monotonic_ns() / NS_PER_MS;
+      for ( i = 0; i < ready; i++ )
+      {
+         vehicle = events[ i ].data.ptr;
+         if ( FLEET_CONNECTING == vehicle->state )
+         {
+            fleet_connect( vehicle, epoll_fd, now_ms );
+         }
+         else if ( vehicle->state != FLEET_DOWN )
+         {
+            fleet_receive( vehicle, now_ms );
+         }
+      }
+
+      // Timers are kept per vehicle, a pass over hundreds of vehicles
+      // costs less than one system call
+      wake_ms = UINT64_MAX;
+      for ( v = 0; v < count; v++ )
+      {
+         next_ms = fleet_service( &vehicles[ v ], epoll_fd, now_ms );
+         if ( next_ms < wake_ms )
+         {
+            wake_ms = next_ms;
+         }
+      }
+
+      if ( now_ms >= report_ms )
+      {
+         report_fleet( vehicles, count, ( now_ms - report_ms + POLL_REPORT_MS ) / (double) MS_PER_SEC, false );
+         report_ms = now_ms + POLL_REPORT_MS;
+      }
+
+      // Values of every vehicle found in this pass leave in one write
+      fflush( stdout );
+   }
+
+   report_fleet( vehicles, count, ( monotonic_ns() / NS_PER_MS - start_ms ) / (double) MS_PER_SEC, true );
+   report_rtt();
+
+   for ( v = 0; v < count; v++ )
+   {
+      session_close( &vehicles[ v ].session );
+   }
+   close( epoll_fd );
+   free( vehicles );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: parse_fleet
+*
+* Description: Read the vehicles of a -M argument, a comma separated
+*              list of host[:port] or @file with one vehicle a line.
+*              Empty lines and lines starting with # are skipped.
+*
+* Inputs: spec - -M argument
+*
+* Outputs: vehicles - vehicles, FLEET_MAX_VEHICLES long
+*          count - vehicles read
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - file not readable, bad vehicle or too many
+*
+*/
+int parse_fleet( const char *spec, fleet_vehicle *vehicles, unsigned int *count )
+{
+   FILE *file;
+   char line[ FLEET_LINE_LENGTH ];
+   char *copy;
+   char *item;
+   char *save;
+   char *text;
+   int return_status = EXIT_SUCCESS;
+
+   if ( '@' == spec[ 0 ] )
+   {
+      file = fopen( spec + 1, "r" );
+      if ( NULL == file )
+      {
+         fprintf( stderr, "Fleet: Cannot read %s\n", spec + 1 );
+         return( EXIT_FAILURE );
+      }
+
+      while ( ( EXIT_SUCCESS == return_status ) && ( fgets( line, sizeof( line ), file ) != NULL ) )
+      {
+         text = line + strspn( line, " \t" );
+         text[ strcspn( text, "\r\n" ) ] = '\0';
+         if ( ( '\0' == text[ 0 ] ) || ( '#' == text[ 0 ] ) )
+         {
+            continue;
+         }
+         if ( *count >= FLEET_MAX_VEHICLES )
+         {
+            fprintf( stderr, "Fleet: At most %d vehicles\n", FLEET_MAX_VEHICLES );
+            return_status = EXIT_FAILURE;
+            break;
+         }
+         return_status = add_fleet_vehicle( &vehicles[ *count ], text );
+         ( *count )++;
+      }
+      fclose( file );
+      return( return_status );
+   }
+
+   copy = strdup( spec );
+   if ( NULL == copy )
+   {
+      return( EXIT_FAILURE );
+   }
+
+   for ( item = strtok_r( copy, ",", &save ); item != NULL; item = strtok_r( NULL, ",", &save ) )
+   {
+      if ( *count >= FLEET_MAX_VEHICLES )
+      {
+         fprintf( stderr, "Fleet: At most %d vehicles\n", FLEET_MAX_VEHICLES );
+         return_status = EXIT_FAILURE;
+         break;
+      }
+      return_status = add_fleet_vehicle( &vehicles[ *count ], item );
+      if ( return_status != EXIT_SUCCESS )
+      {
+         break;
+      }
+      ( *count )++;
+   }
+   free( copy );
+   return( return_status );
+}
+
+
+/*
+* Name: add_fleet_vehicle
+*
+* Description: Resolve a host[:port] [pid:hz[:priority] ...] line and
+*              set up the vehicle's schedule, the -P PIDs when the line
+*              names none
+*
+* Inputs: vehicle - vehicle to set up
+*         line - text, modified
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - host not resolved or invalid PID
+*
+*/
+int add_fleet_vehicle( fleet_vehicle *vehicle, char *line )
+{
+   struct addrinfo select_address = { 0 };
+   struct addrinfo *socket_address = NULL;
+   const char *port = SERVER_PORT_STRING;
+   char *host;
+   char *item;
+   char *save;
+   char *colon;
+   int status;
+   unsigned int i;
+
+   host = strtok_r( line, " \t", &save );
+   if ( NULL == host )
+   {
+      return( EXIT_FAILURE );
+   }
+   snprintf( vehicle->name, sizeof( vehicle->name ), "%s", host );
+
+   colon = strrchr( host, ':' );
+   if ( colon != NULL )
+   {
+      *colon = '\0';
+      port = colon + 1;
+   }
+
+   select_address.ai_family   = AF_INET;
+   select_address.ai_socktype = SOCK_STREAM;
+   status = getaddrinfo( host, port, &select_address, &socket_address );
+   if ( status != 0 )
+   {
+      fprintf( stderr, "Fleet: %s: %s\n", vehicle->name, gai_strerror( status ) );
+      return( EXIT_FAILURE );
+   }
+   memcpy( &vehicle->address, socket_address->ai_addr, socket_address->ai_addrlen );
+   vehicle->address_length = socket_address->ai_addrlen;
+   freeaddrinfo( socket_address );
+
+   poll_scheduler_init( &vehicle->scheduler, g_bitrate, g_load_percent / 100.0 );
+   while ( ( item = strtok_r( NULL, " \t", &save ) ) != NULL )
+   {
+      if ( parse_poll( &vehicle->scheduler, item ) != EXIT_SUCCESS )
+      {
+         return( EXIT_FAILURE );
+      }
+   }
+   if ( 0 == vehicle->scheduler.count )
+   {
+      for ( i = 0; i < g_scheduler.count; i++ )
+      {
+         poll_scheduler_add(
+            &vehicle->scheduler,
+            g_scheduler.entries[ i ].pid,
+            g_scheduler.entries[ i ].target_hz,
+            g_scheduler.entries[ i ].priority
+            );
+      }
+   }
+   if ( 0 == vehicle->scheduler.count )
+   {
+      fprintf( stderr, "Fleet: %s: No PIDs to poll, use -P\n", vehicle->name );
+      return( EXIT_FAILURE );
+   }
+   poll_scheduler_plan( &vehicle->scheduler );
+   for ( i = 0; i < POLL_MAX_ENTRIES; i++ )
+   {
+      rtt_init( &vehicle->rtt[ i ] );
+   }
+
+   session_init( &vehicle->session );
+   vehicle->session.link.fd = -1;
+   vehicle->state = FLEET_DOWN;
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: fleet_connect
+*
+* Description: Start a non-blocking connect to a vehicle that is down,
+*              or finish one that epoll reported writable
+*
+* Inputs: vehicle - fleet vehicle
+*         epoll_fd - fleet epoll instance
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void fleet_connect( fleet_vehicle *vehicle, int epoll_fd, uint64_t now_ms )
+{
+   vehicle_session *session = &vehicle->session;
+   struct epoll_event event = { 0 };
+   int socket_fd;
+   int socket_error = 0;
+   socklen_t length = sizeof( socket_error );
+   uint64_t outage_ms;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( FLEET_CONNECTING == vehicle->state )
+   {
+      getsockopt( session->link.fd, SOL_SOCKET, SO_ERROR, &socket_error, &length );
+      if ( socket_error != 0 )
+      {
+         strerror_r( socket_error, error, SYSLOG_BUF_SIZE );
+         fleet_lost( vehicle, now_ms, error );
+         return;
+      }
+
+      event.events = EPOLLIN;
+      event.data.ptr = vehicle;
+      epoll_ctl( epoll_fd, EPOLL_CTL_MOD, session->link.fd, &event );
+
+      // The backoff is reset by the first answer, a vehicle that
+      // accepts and drops connections is not retried at once
+      session->connected = true;
+      session->last_rx_ms = now_ms;
+      if ( session->down_ms != 0 )
+      {
+         outage_ms = now_ms - session->down_ms;
+         session->reconnects++;
+         session->outage_total_ms += outage_ms;
+         if ( outage_ms > session->outage_max_ms )
+         {
+            session->outage_max_ms = outage_ms;
+         }
+         session->down_ms = 0;
+         syslog( LOG_INFO, "%s: Reconnected after %lu ms", vehicle->name, (unsigned long) outage_ms );
+         PROBE( aesd_scan_tool, reconnect, session->link.fd, outage_ms, monotonic_ns() );
+      }
+      vehicle->rx_length = 0;
+      vehicle->state = FLEET_READY;
+      return;
+   }
+
+   session->attempts++;
+   socket_fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   if ( -1 == socket_fd )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      fleet_lost( vehicle, now_ms, error );
+      return;
+   }
+   set_keepalive( socket_fd );
+   set_nodelay( socket_fd );
+   transport_tcp_init( &session->link, socket_fd );
+
+   if (   ( -1 == connect( socket_fd, (struct sockaddr *) &vehicle->address, vehicle->address_length ) )
+       && ( errno != EINPROGRESS )
+      )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      fleet_lost( vehicle, now_ms, error );
+      return;
+   }
+
+   // Writable once connected, also when connected already
+   event.events = EPOLLOUT;
+   event.data.ptr = vehicle;
+   if ( -1 == epoll_ctl( epoll_fd, EPOLL_CTL_ADD, socket_fd, &event ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      fleet_lost( vehicle, now_ms, error );
+      return;
+   }
+   vehicle->state = FLEET_CONNECTING;
+   vehicle->deadline_ms = now_ms + FLEET_CONNECT_TIMEOUT_MS;
+   return;
+}
+
+
+/*
+* Name: fleet_lost
+*
+* Description: Close a vehicle's connection, closing removes it from
+*              epoll, and schedule the reconnect with backoff.  A
+*              request in flight counts as unanswered.
+*
+* Inputs: vehicle - fleet vehicle
+*         now_ms - monotonic time
+*         reason - logged
+*
+* Returns: None
+*
+*/
+void fleet_lost( fleet_vehicle *vehicle, uint64_t now_ms, const char *reason )
+{
+   vehicle_session *session = &vehicle->session;
+
+   if ( ( FLEET_WAITING == vehicle->state ) && ( vehicle->entry != NULL ) )
+   {
+      poll_scheduler_complete( &vehicle->scheduler, vehicle->entry, NULL, false );
+   }
+   vehicle->entry = NULL;
+
+   transport_close( &session->link );
+   session->link.fd = -1;
+   if ( session->connected )
+   {
+      session->connected = false;
+      session->down_ms = now_ms;
+      syslog( LOG_ERR, "%s: Vehicle connection lost: %s", vehicle->name, reason );
+      printf( "%s: Vehicle connection lost: %s\n", vehicle->name, reason );
+   }
+   else if ( 0 == session->failures )
+   {
+      syslog( LOG_ERR, "%s: Vehicle not reachable: %s", vehicle->name, reason );
+   }
+
+   session->retry_ms = now_ms + backoff_delay( session );
+   session->failures++;
+   vehicle->state = FLEET_DOWN;
+   return;
+}
+
+
+/*
+* Name: fleet_receive
+*
+* Description: Read what the vehicle sent without blocking and handle
+*              each whole response.  A partial response is kept in rx
+*              for the next read.
+*
+* Inputs: vehicle - fleet vehicle
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void fleet_receive( fleet_vehicle *vehicle, uint64_t now_ms )
+{
+   ssize_t rx_bytes;
+   obd2_message obd2_response;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for(;;)
+   {
+      rx_bytes = recv(
+         vehicle->session.link.fd,
+         vehicle->rx + vehicle->rx_length,
+         sizeof( vehicle->rx ) - vehicle->rx_length,
+         0
+         );
+      if ( 0 == rx_bytes )
+      {
+         fleet_lost( vehicle, now_ms, "connection closed" );
+         return;
+      }
+      if ( -1 == rx_bytes )
+      {
+         if ( EINTR == errno )
+         {
+            continue;
+         }
+         if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) )
+         {
+            strerror_r( errno, error, SYSLOG_BUF_SIZE );
+            fleet_lost( vehicle, now_ms, error );
+         }
+         return;
+      }
+
+      vehicle->rx_length += (size_t) rx_bytes;
+      if ( vehicle->rx_length == sizeof( vehicle->rx ) )
+      {
+         memcpy( &obd2_response, vehicle->rx, sizeof( obd2_response ) );
+         PROBE(
+            aesd_scan_tool,
+            response__received,
+            vehicle->session.link.fd,
+            obd2_response.mode,
+            obd2_response.pid,
+            EXIT_SUCCESS,
+            monotonic_ns()
+            );
+         vehicle->rx_length = 0;
+         vehicle->session.last_rx_ms = now_ms;
+         vehicle->session.failures = 0;
+         fleet_response( vehicle, &obd2_response, now_ms );
+      }
+   }
+}
+
+
+/*
+* Name: fleet_response
+*
+* Description: Match a response to the PID in flight.  A changed value
+*              is printed, a response pending extends the wait to P2*,
+*              a PID the vehicle refuses is dropped from its schedule.
+*
+* Inputs: vehicle - fleet vehicle
+*         obd2_response - received response
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void fleet_response( fleet_vehicle *vehicle, obd2_message *obd2_response, uint64_t now_ms )
+{
+   poll_scheduler *scheduler = &vehicle->scheduler;
+   poll_entry *entry = vehicle->entry;
+   unsigned int index;
+   uint64_t time_ms;
+   double value;
+   const char *unit;
+
+   // Late answers to timed out requests are dropped
+   if (   ( obd2_response->id != vehicle_id )
+       || ( vehicle->state != FLEET_WAITING )
+       || ( NULL == entry )
+      )
+   {
+      return;
+   }
+
+   if (   ( ( MODE_SHOW_CURRENT_DATA | MODE_RESPONSE ) == obd2_response->mode )
+       && ( entry->pid == obd2_response->pid )
+      )
+   {
+      vehicle->answers++;
+      fleet_finish( vehicle, monotonic_ns() / NS_PER_USEC, true );
+      if (   poll_scheduler_complete( scheduler, entry, obd2_response->data, true )
+          && decode_obd2_value( obd2_response, &value, &unit )
+         )
+      {
+         time_ms = realtime_ns() / NS_PER_MS;
+         printf(
+            "%llu.%03llu %s PID %u %.2f %s\n",
+            (unsigned long long) ( time_ms / MS_PER_SEC ),
+            (unsigned long long) ( time_ms % MS_PER_SEC ),
+            vehicle->name,
+            obd2_response->pid,
+            value,
+            unit
+            );
+      }
+   }
+   else if (   ( MODE_NEGATIVE_RESPONSE == obd2_response->mode )
+            && ( MODE_SHOW_CURRENT_DATA == obd2_response->pid )
+            && ( entry->pid == obd2_response->data[ 1 ] )
+           )
+   {
+      if ( NRC_RESPONSE_PENDING == obd2_response->data[ 0 ] )
+      {
+         vehicle->deadline_ms = now_ms + P2_STAR_TIMEOUT_MS;
+         vehicle->hedge_ms = 0;
+         vehicle->ambiguous = true;
+         return;
+      }
+
+      vehicle->ambiguous = true;
+      fleet_finish( vehicle, monotonic_ns() / NS_PER_USEC, true );
+
+      printf( "%s: PID %u: Not supported by the vehicle\n", vehicle->name, entry->pid );
+      index = (unsigned int) ( entry - scheduler->entries );
+      scheduler->count--;
+      *entry = scheduler->entries[ scheduler->count ];
+      vehicle->rtt[ index ] = vehicle->rtt[ scheduler->count ];
+      poll_scheduler_plan( scheduler );
+   }
+   else
+   {
+      return;
+   }
+
+   vehicle->entry = NULL;
+   vehicle->state = FLEET_READY;
+   return;
+}
+
+
+/*
+* Name: fleet_service
+*
+* Description: Run a vehicle's timers: reconnect after the backoff,
+*              give up on a connect or response past its deadline,
+*              hedge a slow response and send the next due poll when
+*              nothing is in flight
+*
+* Inputs: vehicle - fleet vehicle
+*         epoll_fd - fleet epoll instance
+*         now_ms - monotonic time
+*
+* Returns: Monotonic time the vehicle next needs service
+*
+*/
+uint64_t fleet_service( fleet_vehicle *vehicle, int epoll_fd, uint64_t now_ms )
+{
+   poll_entry *entry;
+   rtt_estimator *rtt;
+   uint64_t timeout_us;
+   uint64_t hedge_us;
+   int wait_ms;
+
+   switch( vehicle->state )
+   {
+      case FLEET_DOWN:
+      {
+         if ( now_ms < vehicle->session.retry_ms )
+         {
+            return( vehicle->session.retry_ms );
+         }
+         fleet_connect( vehicle, epoll_fd, now_ms );
+         return( ( FLEET_DOWN == vehicle->state ) ? vehicle->session.retry_ms : vehicle->deadline_ms );
+      }
+
+      case FLEET_CONNECTING:
+      {
+         if ( now_ms < vehicle->deadline_ms )
+         {
+            return( vehicle->deadline_ms );
+         }
+         fleet_lost( vehicle, now_ms, "connect timed out" );
+         return( vehicle->session.retry_ms );
+      }
+
+      case FLEET_WAITING:
+      {
+         if ( ( vehicle->hedge_ms != 0 ) && ( now_ms >= vehicle->hedge_ms ) )
+         {
+            vehicle->hedge_ms = 0;
+            vehicle->hedged = true;
+            vehicle->ambiguous = true;
+            vehicle->hedges++;
+            rtt_hedged( &vehicle->rtt[ vehicle->entry - vehicle->scheduler.entries ] );
+            if ( fleet_request( vehicle ) != EXIT_SUCCESS )
+            {
+               fleet_lost( vehicle, now_ms, "request failed" );
+               return( vehicle->session.retry_ms );
+            }
+         }
+         if ( now_ms < vehicle->deadline_ms )
+         {
+            return( ( ( vehicle->hedge_ms != 0 ) && ( vehicle->hedge_ms < vehicle->deadline_ms ) )
+                    ? vehicle->hedge_ms
+                    : vehicle->deadline_ms );
+         }
+         vehicle->timeouts++;
+         fleet_finish( vehicle, monotonic_ns() / NS_PER_USEC, false );
+         poll_scheduler_complete( &vehicle->scheduler, vehicle->entry, NULL, false );
+         vehicle->entry = NULL;
+         vehicle->state = FLEET_READY;
+         break;
+      }
+
+      default:
+      {
+         break;
+      }
+   }
+
+   if ( 0 == vehicle->scheduler.count )
+   {
+      return( UINT64_MAX );
+   }
+
+   entry = poll_scheduler_next( &vehicle->scheduler, now_ms, &wait_ms );
+   if ( NULL == entry )
+   {
+      return( now_ms + (uint64_t) wait_ms );
+   }
+
+   vehicle->entry = entry;
+   vehicle->sent_us = monotonic_ns() / NS_PER_USEC;
+   if ( fleet_request( vehicle ) != EXIT_SUCCESS )
+   {
+      fleet_lost( vehicle, now_ms, "request failed" );
+      return( vehicle->session.retry_ms );
+   }
+
+   rtt = &vehicle->rtt[ entry - vehicle->scheduler.entries ];
+   timeout_us = rtt_timeout_us( rtt );
+   hedge_us = g_hedge_enabled ? rtt_hedge_us( rtt ) : 0;
+   vehicle->ambiguous = ( vehicle->sent_us < rtt->ambiguous_until_us );
+   vehicle->hedged = false;
+   vehicle->hedge_ms = ( hedge_us != 0 ) ? now_ms + ( hedge_us + 999 ) / 1000 : 0;
+   vehicle->deadline_ms = now_ms + ( timeout_us + 999 ) / 1000;
+   vehicle->state = FLEET_WAITING;
+   return( ( vehicle->hedge_ms != 0 ) ? vehicle->hedge_ms : vehicle->deadline_ms );
+}
+
+
+/*
+* Name: fleet_request
+*
+* Description: Send the mode 01 request of the PID in flight without
+*              waiting.  A vehicle that stopped reading leaves the
+*              request unsent, it then times out like one that is not
+*              answered.
+*
+* Inputs: vehicle - fleet vehicle
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - connection failed
+*
+*/
+int fleet_request( fleet_vehicle *vehicle )
+{
+   obd2_message obd2_request = { 0 };
+   int sent;
+
+   obd2_request.id = scan_tool_id;
+   obd2_request.num_bytes = 2;
+   obd2_request.mode = MODE_SHOW_CURRENT_DATA;
+   obd2_request.pid = vehicle->entry->pid;
+   sent = transport_try_send_batch( &vehicle->session.link, &obd2_request, sizeof( obd2_request ), 1 );
+   if ( sent < 0 )
+   {
+      return( EXIT_FAILURE );
+   }
+   if ( sent > 0 )
+   {
+      PROBE(
+         aesd_scan_tool,
+         request__sent,
+         vehicle->session.link.fd,
+         obd2_request.mode,
+         obd2_request.pid,
+         monotonic_ns()
+         );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: fleet_finish
+*
+* Description: Record the RTT or timeout of the PID in flight and its
+*              read latency
+*
+* Inputs: vehicle - fleet vehicle
+*         now_us - monotonic time
+*         answered - false on a timeout
+*
+* Returns: None
+*
+*/
+void fleet_finish( fleet_vehicle *vehicle, uint64_t now_us, bool answered )
+{
+   rtt_estimator *rtt = &vehicle->rtt[ vehicle->entry - vehicle->scheduler.entries ];
+
+   if ( answered )
+   {
+      rtt_answered( rtt, now_us - vehicle->sent_us, vehicle->ambiguous );
+   }
+   else
+   {
+      rtt_expired( rtt );
+   }
+
+   // A timed out request or the other copy of a hedged one may still
+   // be answered
+   if ( vehicle->hedged || !answered )
+   {
+      rtt->ambiguous_until_us = now_us + rtt_timeout_us( rtt );
+   }
+   rtt_latency_add( &g_read_latency, now_us - vehicle->sent_us );
+   return;
+}
+
+
+/*
+* Name: report_fleet
+*
+* Description: Print the fleet's connected vehicles, poll rate and
+*              timeouts, and with totals each vehicle's counts
+*
+* Inputs: vehicles - fleet
+*         count - vehicles
+*         seconds - time the counts cover
+*         totals - true on exit
+*
+* Returns: None
+*
+*/
+void report_fleet( fleet_vehicle *vehicles, unsigned int count, double seconds, bool totals )
+{
+   static unsigned long last_answers = 0;
+   static unsigned long last_timeouts = 0;
+   fleet_vehicle *vehicle;
+   unsigned long answers = 0;
+   unsigned long timeouts = 0;
+   unsigned long reconnects = 0;
+   unsigned int connected = 0;
+   unsigned int v;
+
+   for ( v = 0; v < count; v++ )
+   {
+      vehicle = &vehicles[ v ];
+      answers += vehicle->answers;
+      timeouts += vehicle->timeouts;
+      reconnects += vehicle->session.reconnects;
+      if ( vehicle->session.connected )
+      {
+         connected++;
+      }
+
+      if ( totals )
+      {
+         printf(
+            "%s: %lu answers, %lu timeouts, %lu hedged, %lu reconnects, outage ms max %lu\n",
+            vehicle->name,
+            vehicle->answers,
+            vehicle->timeouts,
+            vehicle->hedges,
+            vehicle->session.reconnects,
+            (unsigned long) vehicle->session.outage_max_ms
+            );
+      }
+   }
+
+   if ( totals )
+   {
+      last_answers = 0;
+      last_timeouts = 0;
+   }
+   printf(
+      "Fleet: %u of %u vehicles connected, %.0f answers/s, %lu timeouts, %lu reconnects\n",
+      connected,
+      count,
+      ( seconds > 0 ) ? ( answers - last_answers ) / seconds : 0.0,
+      timeouts - last_timeouts,
+      reconnects
+      );
+   last_answers = answers;
+   last_timeouts = timeouts;
+   return;
+}
+
+
+/*
+* Name: decode_obd2_value
+*
+* Description: Convert a current data response to a value, with the
+*              units of the menu handlers
+*
+* Inputs: obd2_msg - positive mode 01 response
+*
+* Outputs: value - decoded value
+*          unit - unit text
+*
+* Returns: true - decoded
+*          false - PID unknown or response too short
+*
+*/
+bool decode_obd2_value( const obd2_message *obd2_msg, double *value, const char **unit )
+{
+   const uint8_t *data = obd2_msg->data;
+
+   switch( obd2_msg->pid )
+   {
+      case PID_ENGINE_RPM:
+      {
+         *value = ( ( (uint32_t) data[ 0 ] << 8 ) + data[ 1 ] ) >> 2;
+         *unit = "rpm";
+         return( 4 == obd2_msg->num_bytes );
+      }
+      case PID_VEHICLE_SPEED:
+      {
+         *value = data[ 0 ] * KMPH_TO_MPH;
+         *unit = "mph";
+         return( 3 == obd2_msg->num_bytes );
+      }
+      case PID_AMBIENT_AIR_TEMP:
+      {
+         *value = ( data[ 0 ] - 40 ) * 1.8 + 32.0;
+         *unit = "F";
+         return( 3 == obd2_msg->num_bytes );
+      }
+      case PID_ODOMETER:
+      {
+         *value = (uint32_t) ( (   ( (uint32_t) data[ 0 ] << 24 )
+                                 + ( (uint32_t) data[ 1 ] << 16 )
+                                 + ( (uint32_t) data[ 2 ] <<  8 )
+                                 + data[ 3 ] ) / 10.0f * KMPH_TO_MPH );
+         *unit = "Miles";
+         return( 6 == obd2_msg->num_bytes );
+      }
+      default:
+      {
+         return( false );
+      }
+   }
+}
+
+
+/*
+* Name: parse_poll
+*
+* Description: Add a PID to a poll schedule from a
+*              pid:hz[:priority] argument
+*
+* Inputs: scheduler - schedule to add to
+*         spec - argument text
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - schedule full or invalid argument
+*
+*/
+int parse_poll( poll_scheduler *scheduler, const char *spec )
+{
+   char *end;
+   unsigned long pid;
+   double target_hz;
+   unsigned long priority = 0;
+
+   pid = strtoul( spec, &end, 0 );
+   if ( ( ':' == *end ) && ( pid <= UINT8_MAX ) )
+   {
+      target_hz = strtod( end + 1, &end );
+      if ( ':' == *end )
+      {
+         priority = strtoul( end + 1, &end, 0 );
+      }
+
+      if (   ( '\0' == *end )
+          && ( priority <= UINT8_MAX )
+          && ( EXIT_SUCCESS == poll_scheduler_add(
+                                  scheduler,
+                                  (uint8_t) pid,
+                                  target_hz,
+                                  (uint8_t) priority
+                                  ) )
+         )
+      {
+         return( EXIT_SUCCESS );
+      }
+   }
+
+   fprintf( stderr, "Invalid poll: %s\n", spec );
+   return( EXIT_FAILURE );
+}
+
+
+/*
+* Name: send_subscriptions
+*
+* Description: Send a periodic data request for every -S PID
+*                data[ 0..1 ] - interval in ms, 0 unsubscribes
+*                data[ 2..3 ] - deadband in raw PID units
+*
+* Inputs: link - vehicle transport
+*         subscribe - true to subscribe, false to unsubscribe
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int send_subscriptions( transport *link, bool subscribe )
+{
+   obd2_message obd2_requests[ MAX_WATCHES ];
+   uint16_t interval_ms;
+   unsigned int i;
+
+   memset( obd2_requests, 0, sizeof( obd2_requests ) );
+   for ( i = 0; i < g_watch_count; i++ )
+   {
+      interval_ms = subscribe ? g_watches[ i ].interval_ms : 0;
+
+      obd2_requests[ i ].id = scan_tool_id;
+      obd2_requests[ i ].num_bytes = 6;
+      obd2_requests[ i ].mode = MODE_PERIODIC_DATA;
+      obd2_requests[ i ].pid = g_watches[ i ].pid;
+      obd2_requests[ i ].data[ 0 ] = (uint8_t) ( interval_ms >> 8 );
+      obd2_requests[ i ].data[ 1 ] = (uint8_t) interval_ms;
+      obd2_requests[ i ].data[ 2 ] = (uint8_t) ( g_watches[ i ].deadband >> 8 );
+      obd2_requests[ i ].data[ 3 ] = (uint8_t) g_watches[ i ].deadband;
+   }
+
+   if ( transport_send_batch( link, obd2_requests, sizeof( obd2_message ), g_watch_count ) < 0 )
+   {
+      transport_close( link );
+      return( EXIT_FAILURE );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: parse_watch
+*
+* Description: Add a subscription from a pid:interval[:deadband]
+*              argument
+*
+* Inputs: spec - argument text
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - too many subscriptions or invalid argument
+*
+*/
+int parse_watch( const char *spec )
+{
+   char *end;
+   unsigned long pid;
+   unsigned long interval_ms;
+   unsigned long deadband = 0;
+
+   pid = strtoul( spec, &end, 0 );
+   if ( ( *end != ':' ) || ( pid > UINT8_MAX ) )
+   {
+      fprintf( stderr, "Invalid subscription: %s\n", spec );
+      return( EXIT_FAILURE );
+   }
+
+   interval_ms = strtoul( end + 1, &end, 0 );
+   if ( ':' == *end )
+   {
+      deadband = strtoul( end + 1, &end, 0 );
+   }
+
+   if (   ( *end != '\0' )
+       || ( 0 == interval_ms )
+       || ( interval_ms > UINT16_MAX )
+       || ( deadband > UINT16_MAX )
+      )
+   {
+      fprintf( stderr, "Invalid subscription: %s\n", spec );
+      return( EXIT_FAILURE );
+   }
+
+   if ( g_watch_count >= MAX_WATCHES )
+   {
+      fprintf( stderr, "At most %d subscriptions\n", MAX_WATCHES );
+      return( EXIT_FAILURE );
+   }
+
+   g_watches[ g_watch_count ].pid = (uint8_t) pid;
+   g_watches[ g_watch_count ].interval_ms = (uint16_t) interval_ms;
+   g_watches[ g_watch_count ].deadband = (uint16_t) deadband;
+   g_watch_count++;
+
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: session_init
+*
+* Description: Start a session without a connection, the first connect
+*              is attempted at once
+*
+* Inputs: session - session to initialize
+*
+* Returns: None
+*
+*/
+void session_init( vehicle_session *session )
+{
+   memset( session, 0, sizeof( vehicle_session ) );
+   session->seed = (unsigned int) ( getpid() ^ realtime_ns() );
+   return;
+}
+
+
+/*
+* Name: session_connect
+*
+* Description: Open the connection when it is down and the backoff has
+*              passed.  A failure schedules the next attempt.
+*
+* Inputs: session - vehicle session
+*
+* Returns: true - connected
+*          false - not connected, see session_sleep()
+*
+*/
+bool session_connect( vehicle_session *session )
+{
+   uint64_t now_ms;
+   uint64_t delay_ms;
+   uint64_t outage_ms;
+
+   if ( session->connected )
+   {
+      return( true );
+   }
+
+   now_ms = monotonic_ns() / NS_PER_MS;
+   if ( now_ms < session->retry_ms )
+   {
+      return( false );
+   }
+
+   session->attempts++;
+   if ( EXIT_SUCCESS == open_link( &session->link ) )
+   {
+      now_ms = monotonic_ns() / NS_PER_MS;
+      session->connected = true;
+      session->failures = 0;
+      session->last_rx_ms = now_ms;
+      session->heartbeat_ms = 0;
+
+      if ( session->down_ms != 0 )
+      {
+         outage_ms = now_ms - session->down_ms;
+         session->reconnects++;
+         session->outage_total_ms += outage_ms;
+         if ( outage_ms > session->outage_max_ms )
+         {
+            session->outage_max_ms = outage_ms;
+         }
+         session->down_ms = 0;
+         syslog( LOG_INFO, "Reconnected after %lu ms", (unsigned long) outage_ms );
+         PROBE( aesd_scan_tool, reconnect, session->link.fd, outage_ms, monotonic_ns() );
+         printf( "Reconnected after %lu ms\n", (unsigned long) outage_ms );
+      }
+      return( true );
+   }
+
+   // A link opened before the PID discovery failed is closed too
+   transport_close( &session->link );
+   delay_ms = backoff_delay( session );
+   session->failures++;
+   session->retry_ms = now_ms + delay_ms;
+   if ( g_verbose )
+   {
+      printf( "Vehicle not reachable, retrying in %lu ms\n", (unsigned long) delay_ms );
+   }
+   return( false );
+}
+
+
+/*
+* Name: session_sleep
+*
+* Description: Sleep until the next connect attempt, a signal ends the
+*              sleep early
+*
+* Inputs: session - vehicle session
+*         limit_ms - monotonic time to wake up at the latest
+*
+* Returns: None
+*
+*/
+void session_sleep( vehicle_session *session, uint64_t limit_ms )
+{
+   uint64_t now_ms = monotonic_ns() / NS_PER_MS;
+   uint64_t wake_ms = ( session->retry_ms < limit_ms ) ? session->retry_ms : limit_ms;
+
+   if ( wake_ms > now_ms )
+   {
+      usleep( (useconds_t) ( ( wake_ms - now_ms ) * 1000 ) );
+   }
+   return;
+}
+
+
+/*
+* Name: session_lost
+*
+* Description: Close a failed connection, the next attempt waits a
+*              short jittered delay
+*
+* Inputs: session - vehicle session
+*         reason - logged
+*
+* Returns: None
+*
+*/
+void session_lost( vehicle_session *session, const char *reason )
+{
+   uint64_t now_ms = monotonic_ns() / NS_PER_MS;
+
+   transport_close( &session->link );
+   if ( session->connected )
+   {
+      session->connected = false;
+      session->down_ms = now_ms;
+      syslog( LOG_ERR, "Vehicle connection lost: %s", reason );
+      printf( "Vehicle connection lost: %s\n", reason );
+   }
+   session->retry_ms = now_ms + backoff_delay( session );
+   return;
+}
+
+
+/*
+* Name: session_heartbeat
+*
+* Description: Detect a dead vehicle on a connection that only receives.
+*              After HEARTBEAT_MS without traffic PID 0x00 is requested,
+*              any answer or update counts as alive.
+*
+* Inputs: session - vehicle session, last_rx_ms kept by the caller
+*         now_ms - monotonic time
+*
+* Returns: true - vehicle alive or not yet overdue
+*          false - nothing heard for HEARTBEAT_MISSES periods
+*
+*/
+bool session_heartbeat( vehicle_session *session, uint64_t now_ms )
+{
+   obd2_message obd2_request = { 0 };
+
+   if ( now_ms - session->last_rx_ms >= (uint64_t) HEARTBEAT_MS * HEARTBEAT_MISSES )
+   {
+      return( false );
+   }
+
+   if (   ( now_ms - session->last_rx_ms >= HEARTBEAT_MS )
+       && ( now_ms - session->heartbeat_ms >= HEARTBEAT_MS )
+      )
+   {
+      obd2_request.id = scan_tool_id;
+      obd2_request.num_bytes = 2;
+      obd2_request.mode = MODE_SHOW_CURRENT_DATA;
+      send_obd2_request( &session->link, &obd2_request );
+      session->heartbeat_ms = now_ms;
+   }
+   return( true );
+}
+
+
+/*
+* Name: session_request
+*
+* Description: Read a PID, reconnecting as needed.  Mode 01 requests
+*              are idempotent, one lost with the connection is sent
+*              again after the reconnect, at most MAX_RESENDS times
+*              and within REQUEST_RETRY_MS.
+*
+* Inputs: session - vehicle session
+*         pid - PID to read
+*         bypass_cache - true to always ask the vehicle
+*
+* Outputs: obd2_response - as request_obd2_data(), cleared when the
+*                          vehicle could not be reached
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - vehicle not reachable
+*
+*/
+int session_request(
+   vehicle_session *session,
+   uint8_t pid,
+   bool bypass_cache,
+   obd2_message* obd2_response
+   )
+{
+   uint64_t deadline_ms = monotonic_ns() / NS_PER_MS + REQUEST_RETRY_MS;
+   unsigned int sends = 0;
+
+   while ( !g_stop_signal && ( monotonic_ns() / NS_PER_MS < deadline_ms ) )
+   {
+      if ( !session_connect( session ) )
+      {
+         session_sleep( session, deadline_ms );
+         continue;
+      }
+
+      if ( sends > 0 )
+      {
+         session->resent++;
+      }
+      sends++;
+      if ( EXIT_SUCCESS == request_obd2_data( &session->link, pid, bypass_cache, obd2_response ) )
+      {
+         session->last_rx_ms = monotonic_ns() / NS_PER_MS;
+         return( EXIT_SUCCESS );
+      }
+
+      session_lost( session, "request failed" );
+      if ( sends > MAX_RESENDS )
+      {
+         break;
+      }
+   }
+
+   printf( "PID %u: Vehicle not reachable\n", pid );
+   memset( obd2_response, 0, sizeof( obd2_message ) );
+   return( EXIT_FAILURE );
+}
+
+
+/*
+* Name: session_close
+*
+* Description: Close the connection of a session
+*
+* Inputs: session - vehicle session
+*
+* Returns: None
+*
+*/
+void session_close( vehicle_session *session )
+{
+   transport_close( &session->link );
+   session->connected = false;
+   return;
+}
+
+
+/*
+* Name: session_report
+*
+* Description: Print and log the connect attempts, reconnects, outage
+*              times and re-sent requests of a session
+*
+* Inputs: session - vehicle session
+*
+* Returns: None
+*
+*/
+void session_report( vehicle_session *session )
+{
+   char report[ CLIENT_LOG_BUF_SIZE ];
+
+   snprintf(
+      report,
+      sizeof( report ),
+      "Session: %lu connect attempts, %lu reconnects, outage ms avg %.0f max %lu, %lu requests re-sent",
+      session->attempts,
+      session->reconnects,
+      ( session->reconnects > 0 ) ? (double) session->outage_total_ms / session->reconnects : 0.0,
+      (unsigned long) session->outage_max_ms,
+      session->resent
+      );
+   syslog( LOG_INFO, "%s", report );
+   printf( "%s\n", report );
+   return;
+}
+
+
+/*
+* Name: backoff_delay
 *
-* Description: 
+* Description: Delay before the next connect attempt, doubling with
+*              every failure up to BACKOFF_MAX_MS.  Half the delay is
+*              random so scan tools do not retry in step.
 *
-* Inputs: 
-* 
-* Returns: EXIT_SUCCESS
-*          EXIT_FAILURE
+* Inputs: session - vehicle session
+*
+* Returns: Milliseconds
 *
 */
-int run_menu( void )
+uint64_t backoff_delay( vehicle_session *session )
 {
-   int return_status = EXIT_SUCCESS;
-   int socket_status;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
-   int socket_fd;
-   obd2_message obd2_request = { 0 };
-   obd2_message obd2_response = { 0 };
-   uint8_t selection;
-   int i = 0;
-
-   socket_status = create_socket( &socket_fd );
+   unsigned int shift = session->failures;
+   uint64_t delay_ms;
 
-   for(;;)
+   if ( shift > BACKOFF_MAX_SHIFT )
    {
-      if ( socket_status == EXIT_FAILURE )
-      {
-         // Try to re-open the connection
-         socket_status = create_socket( &socket_fd );
-      }
-      else
-      {   
-         printf( main_menu );
-         selection = get_menu_input();
-
-         switch( selection )
-         {
-            case MAIN_MENU_ENGINE_RPM:
-            {
-               i = 0;
-               obd2_request.id = scan_tool_id;
-               obd2_request.num_bytes = 2;
-               obd2_request.mode = MODE_SHOW_CURRENT_DATA;
-               obd2_request.pid = PID_ENGINE_RPM;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-
-               printf( "Send RPM Request\n" );
-               send_obd2_request( socket_fd, &obd2_request );
-               socket_status = recive_obd2_response( socket_fd, &obd2_response );
-               handle_obd2_engine_rpm( &obd2_response );
-
-               break;
-            }
-            case MAIN_MENU_VEHICLE_SPEED:
-            {
-               i = 0;
-               obd2_request.id = scan_tool_id;
-               obd2_request.num_bytes = 2;
-               obd2_request.mode = MODE_SHOW_CURRENT_DATA;
-               obd2_request.pid = PID_VEHICLE_SPEED;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-
-               printf( "Send Speed Request\n" );
-               send_obd2_request( socket_fd, &obd2_request );
-               socket_status = recive_obd2_response( socket_fd, &obd2_response );
-               handle_obd2_vehicle_speed( &obd2_response );
-
-               break;
-            }
-            case MAIN_MENU_AMBIENT_AIR_TEMP:
-            {
-               i = 0;
-               obd2_request.id = scan_tool_id;
-               obd2_request.num_bytes = 2;
-               obd2_request.mode = MODE_SHOW_CURRENT_DATA;
-               obd2_request.pid = PID_AMBIENT_AIR_TEMP;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-
-               printf( "Send RPM Request\n" );
-               send_obd2_request( socket_fd, &obd2_request );
-               socket_status = recive_obd2_response( socket_fd, &obd2_response );
-               handle_obd2_ambient_air_temp( &obd2_response );
-
-               break;
-            }
-            case MAIN_MENU_ODOMETER:
-            {
-               i = 0;
-               obd2_request.id = scan_tool_id;
-               obd2_request.num_bytes = 2;
-               obd2_request.mode = MODE_SHOW_CURRENT_DATA;
-               obd2_request.pid = PID_ODOMETER;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-               obd2_request.data[ i++ ] = 0;
-
-               printf( "Send Speed Request\n" );
-               send_obd2_request( socket_fd, &obd2_request );
-               socket_status = recive_obd2_response( socket_fd, &obd2_response );
-               handle_obd2_odometer( &obd2_response );
-
-               break;
-            }
-            case MAIN_MENU_EXIT:
-            {
-               g_stop_signal = 1;
-               break;
-            }
-
-            default:
-            {
-               break;
-            }
-         }
-      }
-      
-      if ( g_stop_signal )
-      {
-         syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
-         break;
-      }
-    
+      shift = BACKOFF_MAX_SHIFT;
    }
-   
-   close( socket_fd );
-   remove( client_log_file );
-
-   return( return_status );
+   delay_ms = (uint64_t) BACKOFF_BASE_MS << shift;
+   if ( delay_ms > BACKOFF_MAX_MS )
+   {
+      delay_ms = BACKOFF_MAX_MS;
+   }
+   return( delay_ms / 2 + (uint64_t) rand_r( &session->seed ) % ( delay_ms / 2 + 1 ) );
 }
 
 
 /*
-* Name: create_socket
+* Name: open_link
 *
-* Description: Create and connect a socket.
+* Description: Connect to the vehicle with the selected transport
+*              and read the PIDs it supports
 *
 * Inputs: None
 * 
-* Outputs: sockef_fd - new socket file descriptor
+* Outputs: link - connected transport
 *
-* Returns: EXIT_SUCCESS - socket was created
-*          EXIT_FAILURE - failed to create socket
+* Returns: EXIT_SUCCESS - connected
+*          EXIT_FAILURE - failed to connect
 *
 */
-int create_socket( int *socket_fd )
+int open_link( transport *link )
 {
-   int temp_socket_fd;
-   int return_status = EXIT_FAILURE;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
-      
-   if ( socket_fd != NULL )
-   {   
-      temp_socket_fd = socket(
-	      AF_INET,
-	      SOCK_STREAM,
-	      0
-	      );
-
-      if ( temp_socket_fd != -1 )
-      {
-         int status;
-         struct addrinfo select_address = { 0 };
-         struct addrinfo *socket_address = NULL;
-         
-         select_address.ai_family   = AF_INET;
-         select_address.ai_socktype = SOCK_STREAM;
-         select_address.ai_flags    = AI_PASSIVE; 
-
-         status = getaddrinfo(
-            NULL, 
-            SERVER_PORT_STRING, 
-            &select_address, 
-            &socket_address
-            );
-            
-         if ( 0 == status )
-         { 
-            status = connect(
-               temp_socket_fd,
-               socket_address->ai_addr,
-               socket_address->ai_addrlen
-               );
-               
-            if ( 0 == status )
-            { 
-               fcntl( 
-                  temp_socket_fd, 
-                  F_SETFL, 
-                  O_NONBLOCK
-                  );
+   int return_status;
 
-               *socket_fd = temp_socket_fd;
-	            return_status = EXIT_SUCCESS;
-            } 
-         }
-         
-         if ( socket_address != NULL )
-         {
-            freeaddrinfo( socket_address );
-         }
-      }
-      
-	   if ( return_status != EXIT_SUCCESS )
+   if ( g_use_gateway )
+   {
+      return_status = transport_unix_connect( link, GATEWAY_SOCKET_PATH );
+   }
+   else if ( TRANSPORT_SHM == g_transport_type )
+   {
+      return_status = transport_shm_attach( link );
+   }
+   else if ( TRANSPORT_UNIX == g_transport_type )
+   {
+      return_status = transport_unix_connect( link, UNIX_SOCKET_PATH );
+   }
+   else if ( TRANSPORT_CAN == g_transport_type )
+   {
+      return_status = transport_can_open( link, g_ifname );
+   }
+   else if ( TRANSPORT_VBUS == g_transport_type )
+   {
+      return_status = transport_vbus_attach( link, VBUS_NAME );
+      if ( EXIT_SUCCESS == return_status )
       {
-         strerror_r( errno, error, SYSLOG_BUF_SIZE );
-         syslog( LOG_ERR, "%s: %s", __func__, error );
+         g_bitrate = link->bus->config.bitrate;
       }
-   }  
+   }
    else
    {
-      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+      return_status = transport_tcp_connect( link, SERVER_PORT_STRING );
+      if ( EXIT_SUCCESS == return_status )
+      {
+         set_keepalive( link->fd );
+         set_nodelay( link->fd );
+      }
+   }
+
+   if ( EXIT_SUCCESS == return_status )
+   {
+      return_status = discover_supported_pids( link );
    }
    return( return_status );
 }
 
+
+/*
+* Name: set_keepalive
+*
+* Description: Detect a dead vehicle on an idle connection with TCP
+*              keepalive, and on a connection with unacknowledged data
+*              with the user timeout
+*
+* Inputs: socket_fd - connected TCP socket
+*
+* Returns: None
+*
+*/
+void set_keepalive( int socket_fd )
+{
+   int enable = 1;
+   int idle_s = KEEPALIVE_IDLE_S;
+   int interval_s = KEEPALIVE_INTERVAL_S;
+   int count = KEEPALIVE_COUNT;
+   unsigned int timeout_ms = USER_TIMEOUT_MS;
+
+   // Failures only delay the detection, they are not fatal
+   setsockopt( socket_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof( enable ) );
+   setsockopt( socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof( idle_s ) );
+   setsockopt( socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof( interval_s ) );
+   setsockopt( socket_fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof( count ) );
+#ifdef TCP_USER_TIMEOUT
+   setsockopt( socket_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof( timeout_ms ) );
+#else
+   (void) timeout_ms;
+#endif
+   return;
+}
+
+/*
+* Name: set_nodelay
+*
+* Description: Send requests at once.  The vehicle does not acknowledge
+*              a request it is stalled on until its delayed ACK timer
+*              fires, with Nagle a hedged copy would wait for that ACK.
+*
+* Inputs: socket_fd - connected TCP socket
+*
+* Returns: None
+*
+*/
+void set_nodelay( int socket_fd )
+{
+   int enable = 1;
+
+   setsockopt( socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof( enable ) );
+   return;
+}
+
 /*
 * Name: get_menu_input
 *
@@ -407,42 +3863,28 @@ uint8_t get_menu_input( void )
 /*
 * Name: send_obd2_request
 *
-* Description: Send an OBD2 response
+* Description: Send an OBD2 request
 *
-* Inputs: obd2_request
+* Inputs: link - vehicle transport
+*         obd2_request
 *
 * Returns: None
 *
 */
-void send_obd2_request( int socket_fd, obd2_message* obd2_request )
+void send_obd2_request( transport *link, obd2_message* obd2_request )
 {
-   size_t tx_length = sizeof( obd2_message );
-   size_t tx_bytes;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
-
    if ( obd2_request != NULL )
    {
-      while ( tx_length )
-      {
-         tx_bytes = send(
-            socket_fd,
-            obd2_request,
-            tx_length,
-            0
-            );
-
-         if ( -1 == tx_bytes )
-         {
-            // Socket errror occurred
-            strerror_r( errno, error, SYSLOG_BUF_SIZE );
-            syslog( LOG_ERR, "%s: %s", __func__, error );
-            break;
-         }
-         else
-         {
-            tx_length -= tx_bytes;
-         }
-      }
+      PROBE(
+         aesd_scan_tool,
+         request__sent,
+         link->fd,
+         obd2_request->mode,
+         obd2_request->pid,
+         monotonic_ns()
+         );
+      // Errors are logged by the transport
+      transport_send( link, obd2_request, sizeof( obd2_message ) );
    }
    return;
 }
@@ -450,88 +3892,178 @@ void send_obd2_request( int socket_fd, obd2_message* obd2_request )
 /*
 * Name: recive_obd2_response
 *
-* Description: Recieve data over the client socket connection
+* Description: Recieve a response over the vehicle connection
 *
-* Inputs: client_socket_fd
+* Inputs: link - vehicle transport
+*         timeout_ms - time to wait, TRANSPORT_WAIT_FOREVER to block
 *
-* Returns: None
+* Outputs: obd2_response - received response
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - connection closed, link must be re-opened
+*          RESPONSE_TIMEOUT - nothing received in time, or interrupted
 *
 */
-int recive_obd2_response( int socket_fd, obd2_message* obd2_response )
+int recive_obd2_response(
+   transport *link,
+   obd2_message* obd2_response,
+   int timeout_ms
+   )
 {
    int return_status = EXIT_SUCCESS;
    int rx_bytes;
    size_t msg_bytes;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
+   uint8_t *bytes = (uint8_t *) obd2_response;
    
    msg_bytes = sizeof ( obd2_message );
    
    if ( obd2_response != NULL )
    {
-      for(;;)
-      {
-         rx_bytes = recv(
-            socket_fd, 
-            client_buffer[ 0 ], 
-            CLIENT_LOG_BUF_SIZE, 
-            0
-            );
+      rx_bytes = transport_receive(
+         link,
+         obd2_response,
+         msg_bytes,
+         timeout_ms
+         );
 
-         // Assume data is received in the size of a message,
-         // this corresponds to a CAN frame.         
-         if ( rx_bytes == msg_bytes )
+      // Each message corresponds to a CAN frame.  On a shared bus
+      // the requests of other scan tools are seen too.
+      if ( ( rx_bytes == msg_bytes ) && ( obd2_response->id != vehicle_id ) )
+      {
+         return_status = RESPONSE_TIMEOUT;
+      }
+      else if ( rx_bytes == msg_bytes )
+      {
+         if ( g_verbose )
          {
-            // Write received data to the end of the file
-            //tx_bytes = write(
-            //   client_log_file_fd,
-            //   client_buffer[ 0 ],
-            //   msg_bytes
-            //   );
-
             printf( "Received CAN Response\n" );
             printf( 
                "RX: %02X %02X %02X %02X %02X %02X "
                    "%02X %02X %02X %02X %02X %02X\n",
-               client_buffer[ 0 ][  0 ],
-               client_buffer[ 0 ][  1 ],
-               client_buffer[ 0 ][  2 ],
-               client_buffer[ 0 ][  3 ],
-               client_buffer[ 0 ][  4 ],
-               client_buffer[ 0 ][  5 ],
-               client_buffer[ 0 ][  6 ],
-               client_buffer[ 0 ][  7 ],
-               client_buffer[ 0 ][  8 ],
-               client_buffer[ 0 ][  9 ],
-               client_buffer[ 0 ][ 10 ],
-               client_buffer[ 0 ][ 11 ]
+               bytes[  0 ],
+               bytes[  1 ],
+               bytes[  2 ],
+               bytes[  3 ],
+               bytes[  4 ],
+               bytes[  5 ],
+               bytes[  6 ],
+               bytes[  7 ],
+               bytes[  8 ],
+               bytes[  9 ],
+               bytes[ 10 ],
+               bytes[ 11 ]
+               );
+         }
+      }
+      else if ( TRANSPORT_TIMEOUT == rx_bytes )
+      {
+         return_status = RESPONSE_TIMEOUT;
+      }
+      else
+      {
+         // Assume connection is closed
+         transport_close( link );
+         return_status = EXIT_FAILURE;
+      }      
+
+      // The message is only valid with EXIT_SUCCESS
+      PROBE(
+         aesd_scan_tool,
+         response__received,
+         link->fd,
+         obd2_response->mode,
+         obd2_response->pid,
+         return_status,
+         monotonic_ns()
+         );
+   }       
+   
+   return( return_status );
+}
+
+
+/*
+* Name: handle_obd2_response
+*
+* Description: Dispatch a response or pushed update to its handler
+*
+* Inputs: obd2_msg
+* 
+* Returns: None
+*
+*/
+void handle_obd2_response( obd2_message* obd2_msg )
+{
+   uint16_t interval_ms;
+
+   if ( obd2_msg != NULL )
+   {
+      switch( obd2_msg->mode )
+      {
+         case MODE_SHOW_CURRENT_DATA | MODE_RESPONSE:
+         {
+            switch( obd2_msg->pid )
+            {
+               case PID_ENGINE_RPM:
+               {
+                  handle_obd2_engine_rpm( obd2_msg );
+                  break;
+               }
+               case PID_VEHICLE_SPEED:
+               {
+                  handle_obd2_vehicle_speed( obd2_msg );
+                  break;
+               }
+               case PID_AMBIENT_AIR_TEMP:
+               {
+                  handle_obd2_ambient_air_temp( obd2_msg );
+                  break;
+               }
+               case PID_ODOMETER:
+               {
+                  handle_obd2_odometer( obd2_msg );
+                  break;
+               }
+               default:
+               {
+                  break;
+               }
+            }
+            break;
+         }
+
+         case MODE_NEGATIVE_RESPONSE:
+         {
+            printf(
+               "Mode %u PID %u: Negative response 0x%02X\n",
+               obd2_msg->pid,
+               obd2_msg->data[ 1 ],
+               obd2_msg->data[ 0 ]
                );
-            memcpy( obd2_response, client_buffer[ 0 ], msg_bytes );
-            
-            break;         
+            break;
          }
-         else if ( -1 == rx_bytes )
+
+         case MODE_PERIODIC_DATA | MODE_RESPONSE:
          {
-            if (   ( errno != EAGAIN      ) 
-                && ( errno != EWOULDBLOCK )
-               )
+            interval_ms = (uint16_t) ( ( obd2_msg->data[ 0 ] << 8 ) | obd2_msg->data[ 1 ] );
+            if ( interval_ms > 0 )
             {
-               // Socket errror occurred
-               strerror_r( errno, error, SYSLOG_BUF_SIZE );
-               syslog( LOG_ERR, "%s: %s", __func__, error );
-               break;
+               printf( "Subscribed: PID %u every %u ms\n", obd2_msg->pid, interval_ms );
             }
+            else
+            {
+               printf( "Subscription ended: PID %u\n", obd2_msg->pid );
+            }
+            break;
          }
-         else
+
+         default:
          {
-            // Assume socket is closed
-            close( socket_fd );
-            return_status = EXIT_FAILURE;
             break;
-         }      
-      }   
-   }       
-   
-   return( return_status );
+         }
+      }
+   }
+   return;
 }
 
 
@@ -548,7 +4080,6 @@ int recive_obd2_response( int socket_fd, obd2_message* obd2_response )
 void handle_obd2_engine_rpm( obd2_message* obd2_msg )
 {
    static uint32_t rpm = 0;
-   int i = 0;
    uint8_t mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
    
    if ( obd2_msg != NULL )
@@ -567,6 +4098,7 @@ void handle_obd2_engine_rpm( obd2_message* obd2_msg )
          rpm += obd2_msg->data[ 1 ];
          rpm = rpm >> 2;
          printf( "Engine: %u rpm\n", rpm );
+         store_sample( PID_ENGINE_RPM, (double) rpm );
       }
       else
       {
@@ -591,7 +4123,6 @@ void handle_obd2_engine_rpm( obd2_message* obd2_msg )
 void handle_obd2_vehicle_speed( obd2_message* obd2_msg )
 {
    static float speed = 0;
-   int i = 0;
    uint8_t mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
    
    if ( obd2_msg != NULL )
@@ -609,6 +4140,7 @@ void handle_obd2_vehicle_speed( obd2_message* obd2_msg )
          speed = (float) obd2_msg->data[ 0 ]; 
          speed *= KMPH_TO_MPH;
          printf( "Speed: %.2f mph\n", speed );
+         store_sample( PID_VEHICLE_SPEED, (double) speed );
       }
       else
       {
@@ -633,7 +4165,6 @@ void handle_obd2_vehicle_speed( obd2_message* obd2_msg )
 void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
 {
    static float temperature = 0;
-   int i = 0;
    uint8_t mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
    
    if ( obd2_msg != NULL )
@@ -651,6 +4182,7 @@ void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
          temperature = (float) obd2_msg->data[ 0 ]; 
          temperature = (temperature - 40) * 1.8f + 32.0f;
          printf( "Ambient Air Temp: %.2f F\n", temperature );
+         store_sample( PID_AMBIENT_AIR_TEMP, (double) temperature );
       }
       else
       {
@@ -675,7 +4207,6 @@ void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
 void handle_obd2_odometer( obd2_message* obd2_msg )
 {
    static uint32_t odometer = 0;
-   int i = 0;
    uint8_t mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
    
    if ( obd2_msg != NULL )
@@ -696,6 +4227,7 @@ void handle_obd2_odometer( obd2_message* obd2_msg )
          odometer += obd2_msg->data[ 3 ];
          odometer = (uint32_t) ((odometer / 10.0f) * KMPH_TO_MPH);
          printf( "Odometer: %u Miles\n", odometer );
+         store_sample( PID_ODOMETER, (double) odometer );
       }
       else
       {
@@ -707,6 +4239,145 @@ void handle_obd2_odometer( obd2_message* obd2_msg )
 }
 
 
+/*
+* Name: store_sample
+*
+* Description: Add a decoded value to the sample store, if enabled.
+*              Values served from the response cache were already
+*              stored when they were received.
+*
+* Inputs: pid - PID of the value
+*         value - decoded value
+* 
+* Returns: None
+*
+*/
+void store_sample( uint8_t pid, double value )
+{
+   struct timespec now;
+
+   if ( g_store_enabled && !g_cached_response )
+   {
+      clock_gettime( CLOCK_REALTIME, &now );
+      tsdb_append(
+         &g_store,
+         pid,
+         (uint64_t) now.tv_sec * MS_PER_SEC + (uint64_t) now.tv_nsec / NS_PER_MS,
+         value
+         );
+   }
+   return;
+}
+
+
+/*
+* Name: query_store
+*
+* Description: Print the stored samples of a PID
+*
+* Inputs: pid - PID to print
+*         start_ms, end_ms - time window, inclusive
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - no sample store
+*
+*/
+int query_store( uint8_t pid, uint64_t start_ms, uint64_t end_ms )
+{
+   size_t samples;
+
+   if ( !g_store_enabled )
+   {
+      printf( "Query: No sample store, use -s\n" );
+      return( EXIT_FAILURE );
+   }
+
+   samples = tsdb_query( &g_store, pid, start_ms, end_ms, print_sample, NULL );
+   printf( "%zu samples, store %zu bytes\n", samples, tsdb_size( &g_store ) );
+
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: print_sample
+*
+* Description: Print one stored sample
+*
+* Inputs: pid - PID of the sample
+*         timestamp_ms - sample time
+*         value - decoded value
+*         context - unused
+* 
+* Returns: true to continue the query
+*
+*/
+bool print_sample( uint8_t pid, uint64_t timestamp_ms, double value, void *context )
+{
+   printf(
+      "%llu.%03llu %02X %.2f\n",
+      (unsigned long long) ( timestamp_ms / MS_PER_SEC ),
+      (unsigned long long) ( timestamp_ms % MS_PER_SEC ),
+      pid,
+      value
+      );
+   return( true );
+}
+
+
+/*
+* Name: monotonic_ns
+*
+* Description: Monotonic clock for latency measurements
+*
+* Inputs: None
+* 
+* Returns: Nanoseconds
+*
+*/
+uint64_t monotonic_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
+
+
+/*
+* Name: realtime_ns
+*
+* Description: Wall clock, the clock of kernel receive timestamps
+*
+* Inputs: None
+* 
+* Returns: Nanoseconds
+*
+*/
+uint64_t realtime_ns( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_REALTIME, &now );
+   return( (uint64_t) now.tv_sec * NS_PER_SEC + (uint64_t) now.tv_nsec );
+}
+
+
+/*
+* Name: compare_u64
+*
+* Description: qsort comparison for latency samples
+*
+*/
+int compare_u64( const void *a, const void *b )
+{
+   uint64_t left = *(const uint64_t *) a;
+   uint64_t right = *(const uint64_t *) b;
+
+   return( ( left > right ) - ( left < right ) );
+}
+
+
 /*
 * Name: setup_signals
 *
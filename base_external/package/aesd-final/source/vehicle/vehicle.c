@@ -19,12 +19,17 @@
 */
 
 // Includes
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -34,55 +39,361 @@
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <linux/can.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "can_bcm.h"
+#include "capture.h"
+#include "handoff.h"
+#include "isotp.h"
+#include "obd2.h"
+#include "probes.h"
+#include "rt_profile.h"
+#include "transport.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
+// Static tracepoints, see probes.h and trace/README
+PROBE_SEMAPHORE( aesd_vehicle, request__received );
+PROBE_SEMAPHORE( aesd_vehicle, request__dispatch );
+PROBE_SEMAPHORE( aesd_vehicle, handler__start );
+PROBE_SEMAPHORE( aesd_vehicle, handler__end );
+PROBE_SEMAPHORE( aesd_vehicle, response__sent );
+
 // File defines and typedefs
 #define M_ARRAY_SIZE( x ) ( sizeof(x) / sizeof(x[0]) )
 #define SYSLOG_BUF_SIZE 80
-#define MAX_CLIENT_CONNECTIONS 1
+#define MAX_CLIENT_CONNECTIONS 64
+#define MAX_EPOLL_EVENTS ( MAX_CLIENT_CONNECTIONS + 1 )
 #define CLIENT_LOG_BUF_SIZE 4096
 #define SERVER_PORT_STRING "9000" 
 #define SERVER_PORT 9000
+#define SERVER_POLL_MS 100
+#define MAX_WORKERS     64
+
+// Longest a replaced server keeps serving its remaining sessions
+#define HANDOFF_DRAIN_MS    30000
+
+// Fair share of a socket server between sessions.  Requests wait in a
+// bounded inbox, sessions are served deficit round-robin a quantum at a
+// time and optionally rate limited by a token bucket.  A session whose
+// responses are not drained is not served and, once its inbox is full,
+// not read.
+#define SESSION_QUEUE           64
+#define SESSION_QUANTUM          8
+#define SESSION_OUTPUT_LIMIT  4096
+#define SESSION_WAIT_MS          1
+#define TOKEN_SCALE           1000
+#define MS_PER_SEC     1000
+#define NS_PER_MS   1000000
 
 #define MODE_SHOW_CURRENT_DATA      1
 #define MODE_REQUEST_VEHICLE_INFO   9
 
+#define MODE_PERIODIC_DATA       0x2A
+
 #define MODE_RESPONSE            0x40
+#define MODE_NEGATIVE_RESPONSE   0x7F
+
+// Negative response codes
+#define NRC_SERVICE_NOT_SUPPORTED   0x11
+#define NRC_REQUEST_OUT_OF_RANGE    0x31
 
 #define PID_ENGINE_RPM             12
 #define PID_VEHICLE_SPEED          13
 #define PID_AMBIENT_AIR_TEMP       70
 #define PID_ODOMETER              166
 
-typedef struct obd2_message
+#ifdef USE_IO_URING
+// io_uring request kinds, in the top byte of the user data
+#define URING_OP_ACCEPT             1
+#define URING_OP_RECV               2
+#define URING_OP_SEND               3
+#define URING_OP_CANCEL             4
+#define URING_OP_SHIFT             56
+#define URING_INDEX_SHIFT          32
+#define URING_INDEX_MASK       0xFFFF
+
+// Provided receive buffers shared by all sessions
+#define URING_BUFFER_GROUP          0
+#define URING_BUFFER_COUNT        256
+#define URING_BUFFER_LENGTH       512
+
+// Responses collected while the previous send is in flight
+#define URING_TX_MESSAGES  ( 4 * TRANSPORT_BATCH_SIZE )
+
+// Received buffer whose requests do not fit the inbox yet, it goes
+// back to the kernel once they all do
+typedef struct held_buffer
+{
+   uint16_t id;
+   uint16_t offset;
+   uint16_t length;
+} held_buffer;
+#endif
+
+// Mode 09 PIDs
+#define PID_VEHICLE_INFO_SUPPORTED  0
+#define PID_VIN                     2
+#define VIN_LENGTH                 17
+
+// A mode 01 request names at most 6 PIDs
+#define MAX_REQUEST_PIDS            6
+
+// PIDs 0x00, 0x20, ... 0xE0 report the next 32 supported PIDs
+#define PID_SUPPORTED_RANGE        32
+
+// Simulated signals step through their range at these rates
+#define SIM_RPM_STEP_MS           100
+#define SIM_SPEED_STEP_MS        1000
+#define SIM_TEMPERATURE_STEP_MS 10000
+#define SIM_ODOMETER_STEP_MS    60000
+
+// Periodic data (subscription) limits
+#define MAX_SUBSCRIPTIONS           8
+#define SUBSCRIPTION_MIN_MS        10
+
+// Cyclic broadcast frames, sent by the kernel or by a userspace timer
+#define CYCLIC_OFF                  0
+#define CYCLIC_BCM                  1
+#define CYCLIC_USER                 2
+
+typedef struct subscription
 {
-   uint32_t id;
-   uint8_t  num_bytes;
-   uint8_t  mode;
+   bool     active;
+   bool     sent;
    uint8_t  pid;
-   uint8_t  data[ 4 ];
-   uint8_t  unused;
-} obd2_message;
+   uint16_t interval_ms;
+   uint16_t deadband;
+   uint32_t last_value;
+   uint64_t last_sent_ms;
+} subscription;
+
+typedef struct client_session
+{
+   bool         in_use;
+   transport    link;
+   char         peer[ INET_ADDRSTRLEN + 1 ];
+   subscription subscriptions[ MAX_SUBSCRIPTIONS ];
+   unsigned int subscription_count;
+   obd2_message outbox[ TRANSPORT_BATCH_SIZE ];
+   unsigned int outbox_count;
+   bool         fd_request;   // request came in a CAN FD frame
+   // Fair share, see serve_sessions()
+   obd2_message  inbox[ SESSION_QUEUE ];
+   // Kernel receive time and CAN FD frame of each inbox entry, taken
+   // from the link when the entry is queued
+   uint64_t      inbox_timestamp_ns[ SESSION_QUEUE ];
+   bool          inbox_fd[ SESSION_QUEUE ];
+   unsigned int  inbox_head;
+   unsigned int  inbox_count;
+   unsigned int  deficit;
+   uint64_t      tokens;       // 1/TOKEN_SCALE requests
+   uint64_t      refill_ms;
+   bool          reading;
+   unsigned long served;
+   unsigned long throttled;    // passes with requests but no tokens
+   unsigned long paused;       // passes skipped for undrained output
+   unsigned long dropped;      // requests beyond a full inbox
+   unsigned long unsent;       // responses beyond a full outbox
+#ifdef USE_IO_URING
+   // Served by the io_uring loop.  Requests in flight carry the
+   // generation, completions of an earlier connection are ignored.
+   bool         uring;
+   bool         seqpacket;
+   bool         recv_armed;
+   uint32_t     generation;
+   uint8_t      rx_partial[ sizeof( obd2_message ) ];
+   size_t       rx_partial_length;
+   // Buffers received after the inbox filled, oldest first
+   held_buffer  rx_held[ URING_BUFFER_COUNT ];
+   unsigned int rx_held_head;
+   unsigned int rx_held_count;
+   // Two send buffers, one collects responses while the other is sent
+   obd2_message tx_buffer[ 2 ][ URING_TX_MESSAGES ];
+   unsigned int tx_count[ 2 ];
+   unsigned int tx_fill;
+   unsigned int tx_in_flight;
+#endif
+} client_session;
+
+typedef struct cyclic_frame
+{
+   uint32_t     id;
+   uint8_t      pid;
+   uint32_t     period_ms;
+   uint32_t     step_ms;
+   obd2_message frame;
+   uint64_t     next_ms;
+} cyclic_frame;
+
+typedef struct vehicle_server
+{
+   int            listen_fd;
+   int            epoll_fd;
+   client_session sessions[ MAX_CLIENT_CONNECTIONS ];
+   unsigned int   next_session;
+   unsigned long  requests;
+   unsigned long  throttled;
+   unsigned long  paused;
+   unsigned long  dropped;
+   // Wakeup to responses sent, or kernel receive time to responses
+   // sent where the transport has it
+   jitter_stats   response;
+#ifdef USE_IO_URING
+   uint32_t       generation;
+#endif
+} vehicle_server;
+
+// A worker thread pinned to one core, serving its own listener
+typedef struct server_worker
+{
+   pthread_t      thread;
+   int            index;
+   int            socket_fd;
+   int            status;
+   vehicle_server server;
+} server_worker;
 
 
 // File data and functions
-static bool g_stop_signal = false;
+// Set by the signal handler, read by every worker thread
+static atomic_bool g_stop_signal = false;
+static atomic_bool g_handoff_signal = false;
 static char client_log_file[] = "/var/tmp/aesdvehicle";
-static uint8_t client_buffer[ 2* MAX_CLIENT_CONNECTIONS ][ CLIENT_LOG_BUF_SIZE ];
 
 static uint32_t vehicle_id   = 0x000007EF;
 static uint32_t scan_tool_id = 0x000007DF;
 
+static bool g_capture_enabled = false;
+static capture_writer g_capture;
+static bool g_quiet = false;
+static uint32_t g_session_rate = 0;
+static uint32_t g_session_burst = SESSION_QUEUE;
+static uint64_t g_start_ms = 0;
+static bool g_rt_enabled = false;
+static rt_profile g_rt_profile;
+
+// Graceful upgrade.  The server listens for its replacement on
+// g_handoff_fd, once its listener is handed off it drains until
+// g_drain_ms.  Sessions handed to this server wait for run_server().
+static int g_handoff_fd = -1;
+static bool g_handed_off = false;
+static uint64_t g_drain_ms = 0;
+static int g_adopted_fds[ MAX_CLIENT_CONNECTIONS ];
+static unsigned int g_adopted_count = 0;
+
+// Every worker thread serves its own sessions from its own event loop,
+// without workers the main thread's are used
+static vehicle_server g_main_server;
+static _Thread_local vehicle_server *g_server = &g_main_server;
+static _Thread_local int g_worker = -1;
+#ifdef USE_IO_URING
+static _Thread_local uring g_uring;
+#endif
+
+// Each frame carries a mode 1 response for its PID, step_ms is how
+// often the simulated value can change
+static cyclic_frame g_cyclic_frames[] =
+{
+   { 0x201, PID_ENGINE_RPM,         20, SIM_RPM_STEP_MS },
+   { 0x202, PID_VEHICLE_SPEED,     100, SIM_SPEED_STEP_MS },
+   { 0x203, PID_AMBIENT_AIR_TEMP, 1000, SIM_TEMPERATURE_STEP_MS },
+   { 0x204, PID_ODOMETER,         1000, SIM_ODOMETER_STEP_MS }
+};
+
+static int g_cyclic_mode = CYCLIC_OFF;
+static int g_bcm_fd = -1;
+static unsigned long g_cyclic_writes = 0;
+
+static const char g_vin[ VIN_LENGTH + 1 ] = "5AESD2024CAN00001";
+
+static const uint8_t g_supported_pids[] =
+{
+   PID_ENGINE_RPM,
+   PID_VEHICLE_SPEED,
+   PID_AMBIENT_AIR_TEMP,
+   PID_ODOMETER
+};
+
 static int run_daemon( void );
-static int create_socket( int *socket_fd );
+static int run_jitter_test( unsigned int seconds );
+static int take_over_server( int *server_fd, int family, bool want_sessions );
+static void hand_off_server( vehicle_server *server );
+static bool hand_off_session( vehicle_server *server, client_session *session, int connection_fd );
+static void adopt_sessions( vehicle_server *server );
+static bool server_drained( vehicle_server *server, uint64_t now_ms );
+static int create_socket( int *socket_fd, bool reuse_port );
+static int run_workers( unsigned int workers );
+static void *run_worker( void *context );
 static int run_server( int socket_fd );
-static void transfer_data( int client_socket_fd );
+static int run_shm_server( transport *server_link );
+static int run_bus_server( transport *bus_link );
+static int start_cyclic_frames( const char *ifname );
+static int service_cyclic_frames( transport *bus_link, uint64_t now_ms );
+static void stop_cyclic_frames( void );
+static void build_cyclic_frame( cyclic_frame *entry, obd2_message *frame );
+static void accept_sessions( vehicle_server *server );
+static void start_session( vehicle_server *server, int client_fd );
+static bool transfer_data( client_session *session, int timeout_ms );
+static void handle_requests( client_session *session, obd2_message *requests, int count );
+static void answer_requests(
+   client_session *session,
+   obd2_message *requests,
+   const uint64_t *timestamps_ns,
+   const bool *fd_frames,
+   int count
+   );
+static void close_session( vehicle_server *server, client_session *session );
+static bool receive_requests( vehicle_server *server, client_session *session );
+static void queue_requests( client_session *session, const obd2_message *requests, unsigned int count );
+static void set_reading( vehicle_server *server, client_session *session, bool reading );
+static void serve_sessions( vehicle_server *server, uint64_t now_ms );
+static unsigned int session_tokens( client_session *session, uint64_t now_ms );
+static bool output_drained( client_session *session );
+static void report_server( vehicle_server *server, const char *backend );
+#ifdef USE_IO_URING
+static int run_uring_server( int socket_fd );
+static void handle_uring_completion( vehicle_server *server, struct io_uring_cqe *cqe );
+static void start_uring_session( vehicle_server *server, int client_fd );
+static void arm_uring_receive( client_session *session, unsigned int index );
+static size_t receive_uring_data( client_session *session, const uint8_t *data, size_t length );
+static bool drain_uring_buffers( client_session *session );
+static void release_uring_buffers( client_session *session );
+static void queue_uring_send( client_session *session );
+static void submit_uring_send( client_session *session, unsigned int index );
+#endif
+static void publish_subscriptions( client_session *session, uint64_t now_ms );
+static int service_timeout( vehicle_server *server );
 
-static void handle_obd2_request( int client_socket_fd, obd2_message* obd2_request );
-static void send_obd2_response( int client_socket_fd, obd2_message* obd2_response );
+static void handle_obd2_request( client_session *session, obd2_message* obd2_request );
+static bool handle_obd2_current_data( obd2_message* obd2_response, uint8_t pid );
+static bool handle_obd2_supported_pids( obd2_message* obd2_response, uint8_t base );
+static bool handle_obd2_multi_pid( client_session *session, obd2_message* obd2_request );
+static bool handle_obd2_vehicle_info( client_session *session, obd2_message* obd2_request );
+static void send_isotp_response( client_session *session, const uint8_t *payload, size_t length );
+static void handle_obd2_negative(
+   obd2_message* obd2_request,
+   obd2_message* obd2_response,
+   uint8_t code
+   );
+static void handle_obd2_subscription(
+   client_session *session,
+   obd2_message* obd2_request,
+   obd2_message* obd2_response
+   );
+static void send_obd2_response( client_session *session, obd2_message* obd2_response );
+static void flush_obd2_responses( client_session *session );
+static uint64_t monotonic_ms( void );
+static uint64_t simulation_ms( void );
 static void handle_obd2_engine_rpm( obd2_message* obd2_msg );
 static void handle_obd2_vehicle_speed( obd2_message* obd2_msg );
 static void handle_obd2_ambient_air_temp( obd2_message* obd2_msg );
@@ -101,6 +412,48 @@ static void signal_handler( int signal );
 *         argv[] - command line arguments
 *         argv[ 0 ] - program name
 *
+*         -d - run as a daemon
+*         -c file - capture frames to file (index in file.idx)
+*         -t tcp|shm|unix|vbus|can - transport, TCP port 9000,
+*                                    shared memory, unix SOCK_SEQPACKET
+*                                    socket, a virtual CAN bus created
+*                                    here or SocketCAN
+*         -i ifname - CAN interface, default can0
+*         -Y bcm|user - broadcast cyclic frames on a CAN bus, sent by
+*                       the kernel broadcast manager (-t can only) or
+*                       by a userspace timer
+*         -B bitrate - virtual bus bitrate, default 125000
+*         -E ppm - virtual bus frame error rate, parts per million
+*         -b fps - virtual bus background frames per second
+*         -D bitrate - CAN FD data bitrate of the virtual bus; with
+*                      -t can any value accepts CAN FD frames, the
+*                      interface sets its own data bitrate
+*         -q - do not print received frames
+*
+*         -R rate[:burst] - limit every TCP or unix session to rate
+*                           requests per second, bursts of up to
+*                           burst, default 64
+*         -w workers - serve TCP from workers threads, each pinned to
+*                      a core with its own SO_REUSEPORT listener and
+*                      event loop
+*
+*         -P priority[:cpu] - real-time profile, SCHED_FIFO priority,
+*                             default 80, memory locked and stack
+*                             prefaulted, pinned to cpu if given.
+*                             Workers keep their own cores.
+*         -J seconds - measure wakeup jitter for seconds with the
+*                      real-time profile off, then again with it on,
+*                      and exit
+*         -U listener|sessions - take over the listening socket of the
+*                                running vehicle, and with sessions
+*                                its idle connections too.  The old
+*                                vehicle drains its other sessions and
+*                                exits.  Starts normally when no
+*                                vehicle is running.
+*
+*         Built with make IO_URING=1 the TCP and unix servers run on
+*         io_uring, or on epoll when the kernel has no usable io_uring.
+*
 * Returns: program exit status
 *
 */
@@ -109,16 +462,184 @@ int main( int argc, char *argv[] )
    int return_status = EXIT_SUCCESS;
    bool run_as_daemon = false;
    char program[ SYSLOG_BUF_SIZE+1 ];
+   char *capture_file = NULL;
+   int transport_type = TRANSPORT_TCP;
+   vbus_config bus_config = { VBUS_DEFAULT_BITRATE, 0, 0, 0 };
+   const char *ifname = CAN_INTERFACE;
    int server_fd;
+   transport server_link;
+   unsigned int workers = 1;
+   unsigned int jitter_seconds = 0;
+   bool take_over = false;
+   bool want_sessions = false;
+   char *next;
+   int option;
+
+   rt_profile_init( &g_rt_profile );
 
    // Check for program arguments
-   if ( argc > 1 )
+   while ( ( option = getopt( argc, argv, "dc:t:qB:E:b:D:i:Y:w:R:P:J:U:" ) ) != -1 )
    {
-      if ( 0 == strncmp( argv[ 1 ], "-d", 2 ) )
+      switch( option )
       {
-         run_as_daemon = true;
+         case 'd':
+         {
+            run_as_daemon = true;
+            break;
+         }
+         case 'c':
+         {
+            capture_file = optarg;
+            break;
+         }
+         case 't':
+         {
+            transport_type = transport_parse( optarg );
+            if ( transport_type < 0 )
+            {
+               fprintf( stderr, "Unknown transport: %s\n", optarg );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'q':
+         {
+            g_quiet = true;
+            break;
+         }
+         case 'B':
+         {
+            bus_config.bitrate = (uint32_t) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'E':
+         {
+            bus_config.error_ppm = (uint32_t) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'b':
+         {
+            bus_config.background_fps = (uint32_t) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'D':
+         {
+            bus_config.data_bitrate = (uint32_t) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'i':
+         {
+            ifname = optarg;
+            break;
+         }
+         case 'R':
+         {
+            g_session_rate = (uint32_t) strtoul( optarg, &next, 0 );
+            if ( ':' == *next )
+            {
+               g_session_burst = (uint32_t) strtoul( next + 1, NULL, 0 );
+            }
+            if ( 0 == g_session_burst )
+            {
+               fprintf( stderr, "Burst must be at least 1\n" );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'P':
+         {
+            g_rt_enabled = true;
+            g_rt_profile.priority = (int) strtol( optarg, &next, 0 );
+            if ( ':' == *next )
+            {
+               g_rt_profile.cpu = (int) strtol( next + 1, NULL, 0 );
+            }
+            if (   ( g_rt_profile.priority < sched_get_priority_min( SCHED_FIFO ) )
+                || ( g_rt_profile.priority > sched_get_priority_max( SCHED_FIFO ) )
+               )
+            {
+               fprintf( stderr, "SCHED_FIFO priority must be %d to %d\n",
+                        sched_get_priority_min( SCHED_FIFO ),
+                        sched_get_priority_max( SCHED_FIFO ) );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'U':
+         {
+            take_over = true;
+            if ( 0 == strcmp( optarg, "sessions" ) )
+            {
+               want_sessions = true;
+            }
+            else if ( strcmp( optarg, "listener" ) != 0 )
+            {
+               fprintf( stderr, "Unknown takeover: %s\n", optarg );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'J':
+         {
+            jitter_seconds = (unsigned int) strtoul( optarg, NULL, 0 );
+            break;
+         }
+         case 'w':
+         {
+            workers = (unsigned int) strtoul( optarg, NULL, 0 );
+            if ( ( workers < 1 ) || ( workers > MAX_WORKERS ) )
+            {
+               fprintf( stderr, "Workers must be 1 to %d\n", MAX_WORKERS );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         case 'Y':
+         {
+            if ( 0 == strcmp( optarg, "bcm" ) )
+            {
+               g_cyclic_mode = CYCLIC_BCM;
+            }
+            else if ( 0 == strcmp( optarg, "user" ) )
+            {
+               g_cyclic_mode = CYCLIC_USER;
+            }
+            else
+            {
+               fprintf( stderr, "Unknown cyclic mode: %s\n", optarg );
+               return( EXIT_FAILURE );
+            }
+            break;
+         }
+         default:
+         {
+            break;
+         }
       }
-   } 
+   }
+
+   if (   ( ( g_cyclic_mode != CYCLIC_OFF ) && ( transport_type != TRANSPORT_VBUS ) && ( transport_type != TRANSPORT_CAN ) )
+       || ( ( CYCLIC_BCM == g_cyclic_mode ) && ( transport_type != TRANSPORT_CAN ) )
+      )
+   {
+      fprintf( stderr, "Cyclic frames need a CAN bus, the broadcast manager needs -t can\n" );
+      return( EXIT_FAILURE );
+   }
+
+   // Each worker has its own listener, they run side by side with the
+   // old ones through SO_REUSEPORT instead
+   if ( take_over && ( ( workers > 1 ) || ( ( transport_type != TRANSPORT_TCP ) && ( transport_type != TRANSPORT_UNIX ) ) ) )
+   {
+      fprintf( stderr, "Takeover needs -t tcp or unix without workers\n" );
+      return( EXIT_FAILURE );
+   }
+
+   // The capture writer is not shared between threads
+   if ( ( workers > 1 ) && ( ( transport_type != TRANSPORT_TCP ) || ( capture_file != NULL ) ) )
+   {
+      fprintf( stderr, "Workers need -t tcp and no capture\n" );
+      return( EXIT_FAILURE );
+   }
 
    // Use program name as identifier for system log entries:
    //   /var/log/syslog
@@ -127,22 +648,144 @@ int main( int argc, char *argv[] )
    syslog( LOG_INFO, "Started as PID: %d", getpid() );
    
    setup_signals();
+   g_start_ms = monotonic_ms();
+
+   if ( jitter_seconds > 0 )
+   {
+      return_status = run_jitter_test( jitter_seconds );
+      closelog();
+      return( return_status );
+   }
+
+   if ( capture_file != NULL )
+   {
+      if ( EXIT_SUCCESS == capture_open( &g_capture, capture_file, 0, 0 ) )
+      {
+         g_capture_enabled = true;
+      }
+   }
    
-   return_status = create_socket( &server_fd );
+   if ( TRANSPORT_SHM == transport_type )
+   {
+      return_status = transport_shm_create( &server_link );
+   }
+   else if ( TRANSPORT_UNIX == transport_type )
+   {
+      if ( !take_over || ( EXIT_SUCCESS != take_over_server( &server_fd, AF_UNIX, want_sessions ) ) )
+      {
+         return_status = transport_unix_listen( &server_fd, UNIX_SOCKET_PATH );
+      }
+   }
+   else if ( ( TRANSPORT_VBUS == transport_type ) || ( TRANSPORT_CAN == transport_type ) )
+   {
+      // Opened after the daemon fork, the virtual bus engine is a thread
+   }
+   else if ( 1 == workers )
+   {
+      if ( !take_over || ( EXIT_SUCCESS != take_over_server( &server_fd, AF_INET, want_sessions ) ) )
+      {
+         return_status = create_socket( &server_fd, false );
+      }
+   }
+
    if ( EXIT_SUCCESS == return_status )
    {
       if ( run_as_daemon )
       {
          return_status = run_daemon();
-         if ( EXIT_SUCCESS == return_status )
+      }
+
+      // After the fork, memory locks are not inherited, and before any
+      // thread, threads inherit the policy and affinity
+      if ( ( EXIT_SUCCESS == return_status ) && g_rt_enabled )
+      {
+         return_status = rt_profile_apply( &g_rt_profile );
+         if ( return_status != EXIT_SUCCESS )
+         {
+            fprintf( stderr, "Real-time profile failed, see syslog\n" );
+         }
+      }
+
+      // After the fork, a replacement signals the process that listens.
+      // Failing only rules out a later handoff.
+      if (   ( EXIT_SUCCESS == return_status )
+          && ( ( TRANSPORT_UNIX == transport_type ) || ( ( TRANSPORT_TCP == transport_type ) && ( 1 == workers ) ) )
+         )
+      {
+         handoff_listen( &g_handoff_fd, HANDOFF_SOCKET_PATH );
+      }
+
+      if ( EXIT_SUCCESS == return_status )
+      {
+         if ( TRANSPORT_SHM == transport_type )
+         {
+            return_status = run_shm_server( &server_link );
+         }
+         else if ( ( TRANSPORT_VBUS == transport_type ) || ( TRANSPORT_CAN == transport_type ) )
+         {
+            if ( TRANSPORT_CAN == transport_type )
+            {
+               return_status = transport_can_open( &server_link, ifname );
+               if ( EXIT_SUCCESS == return_status )
+               {
+                  transport_can_filter( &server_link, scan_tool_id, CAN_SFF_MASK );
+               }
+            }
+            else
+            {
+               return_status = transport_vbus_create( &server_link, VBUS_NAME, &bus_config );
+            }
+
+            if ( ( EXIT_SUCCESS == return_status ) && ( bus_config.data_bitrate > 0 ) )
+            {
+               return_status = transport_enable_fd( &server_link );
+            }
+
+            if ( EXIT_SUCCESS == return_status )
+            {
+               return_status = start_cyclic_frames( ifname );
+               if ( EXIT_SUCCESS == return_status )
+               {
+                  return_status = run_bus_server( &server_link );
+               }
+               stop_cyclic_frames();
+               transport_close( &server_link );
+            }
+         }
+         else if ( workers > 1 )
+         {
+            return_status = run_workers( workers );
+         }
+         else
          {
+#ifdef USE_IO_URING
+            return_status = run_uring_server( server_fd );
+#else
             return_status = run_server( server_fd );
-         } 
+#endif
+         }
       }
-      else
+
+      if ( TRANSPORT_SHM == transport_type )
       {
-         return_status = run_server( server_fd );
+         transport_close( &server_link );
       }
+      else if ( ( TRANSPORT_UNIX == transport_type ) && !g_handed_off )
+      {
+         // A replacement serves the path now
+         unlink( UNIX_SOCKET_PATH );
+      }
+   }
+
+   if ( g_handoff_fd != -1 )
+   {
+      close( g_handoff_fd );
+      unlink( HANDOFF_SOCKET_PATH );
+   }
+
+   if ( g_capture_enabled )
+   {
+      capture_close( &g_capture );
    }
 
    closelog();   
@@ -182,417 +825,3245 @@ int run_daemon( void )
 
 
 /*
-* Name: create_socket
+* Name: run_jitter_test
 *
-* Description: Create and bind a socket.
+* Description: cyclictest style measurement of how late the process
+*              wakes up, first with the default scheduling and then
+*              with the real-time profile.  Load the system meanwhile,
+*              for example with a scan tool flood against another
+*              vehicle, the worst case is what matters.
 *
-* Inputs: None
-* 
-* Outputs: sockef_fd - new socket file descriptor
+* Inputs: seconds - length of each measurement
 *
-* Returns: EXIT_SUCCESS - socket was created
-*          EXIT_FAILURE - failed to create socket
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - the profile could not be applied
 *
 */
-int create_socket( int *socket_fd )
+int run_jitter_test( unsigned int seconds )
 {
-   int temp_socket_fd;
-   int return_status = EXIT_FAILURE;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
-      
-   if ( socket_fd != NULL )
-   {   
-      temp_socket_fd = socket(
-	      AF_INET,
-	      SOCK_STREAM,
-	      0
-	      );
+   static jitter_stats off;
+   static jitter_stats on;
+   unsigned long loops = (unsigned long) seconds * MS_PER_SEC * 1000 / JITTER_INTERVAL_US;
+   char summary[ CLIENT_LOG_BUF_SIZE ];
 
-      if ( temp_socket_fd != -1 )
-      {
-         int status;
-         struct addrinfo select_address = { 0 };
-         struct addrinfo *socket_address = NULL;
-         
-         select_address.ai_family   = AF_INET;
-         select_address.ai_socktype = SOCK_STREAM;
-         select_address.ai_flags    = AI_PASSIVE; 
+   jitter_reset( &off );
+   jitter_reset( &on );
 
-         status = getaddrinfo(
-            NULL, 
-            SERVER_PORT_STRING, 
-            &select_address, 
-            &socket_address
-            );
-            
-         if ( 0 == status )
-         { 
-            status = bind(
-               temp_socket_fd,
-               socket_address->ai_addr,
-               socket_address->ai_addrlen
-               );
-               
-            if ( 0 == status )
-            { 
-               fcntl( 
-                  temp_socket_fd, 
-                  F_SETFL, 
-                  O_NONBLOCK
-                  );
+   printf( "Wakeup every %d usec for %u seconds, profile off then on\n", JITTER_INTERVAL_US, seconds );
+   fflush( stdout );
+   jitter_measure( &off, JITTER_INTERVAL_US, loops, &g_stop_signal );
+   jitter_summary( &off, summary, sizeof( summary ) );
+   printf( "profile off: %s\n", summary );
+   syslog( LOG_INFO, "Jitter, profile off: %s", summary );
+   fflush( stdout );
 
-               *socket_fd = temp_socket_fd;
-	            return_status = EXIT_SUCCESS;
-            } 
-         }
-         
-         if ( socket_address != NULL )
-         {
-            freeaddrinfo( socket_address );
-         }
-      }
-      
-	   if ( return_status != EXIT_SUCCESS )
+   if ( g_stop_signal )
+   {
+      return( EXIT_SUCCESS );
+   }
+
+   if ( EXIT_SUCCESS != rt_profile_apply( &g_rt_profile ) )
+   {
+      fprintf( stderr, "Real-time profile failed, see syslog\n" );
+      return( EXIT_FAILURE );
+   }
+
+   jitter_measure( &on, JITTER_INTERVAL_US, loops, &g_stop_signal );
+   jitter_summary( &on, summary, sizeof( summary ) );
+   printf( "profile on, SCHED_FIFO %d: %s\n", g_rt_profile.priority, summary );
+   syslog( LOG_INFO, "Jitter, profile on: %s", summary );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: take_over_server
+*
+* Description: Take the listening socket of the running vehicle, and
+*              with want_sessions its idle connections.  The running
+*              vehicle is signalled once the request is queued and
+*              answers at the end of its current pass.
+*
+* Inputs: family - listener wanted, AF_INET or AF_UNIX
+*         want_sessions - also take idle connections
+*
+* Outputs: server_fd - listening socket
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE - no vehicle running, or it handed nothing off
+*
+*/
+int take_over_server( int *server_fd, int family, bool want_sessions )
+{
+   int connection_fd;
+   int passed_fd;
+   int listen_fd = -1;
+   pid_t running;
+   handoff_message message = { 0 };
+
+   if ( EXIT_SUCCESS != handoff_connect( &connection_fd, HANDOFF_SOCKET_PATH, &running ) )
+   {
+      syslog( LOG_INFO, "No running vehicle to take over, starting normally" );
+      return( EXIT_FAILURE );
+   }
+
+   message.kind = HANDOFF_REQUEST;
+   message.flags = want_sessions ? HANDOFF_WANT_SESSIONS : 0;
+   message.family = family;
+   if (   ( EXIT_SUCCESS != handoff_send( connection_fd, &message, -1 ) )
+       || ( -1 == kill( running, SIGUSR2 ) )
+      )
+   {
+      close( connection_fd );
+      return( EXIT_FAILURE );
+   }
+
+   // One message per socket, then one without
+   while ( EXIT_SUCCESS == handoff_receive( connection_fd, &message, &passed_fd, HANDOFF_TIMEOUT_MS ) )
+   {
+      if ( HANDOFF_DONE == message.kind )
+      {
+         break;
+      }
+
+      if ( ( HANDOFF_LISTENER == message.kind ) && ( -1 == listen_fd ) )
+      {
+         listen_fd = passed_fd;
+      }
+      else if ( ( HANDOFF_SESSION == message.kind ) && ( g_adopted_count < MAX_CLIENT_CONNECTIONS ) )
+      {
+         g_adopted_fds[ g_adopted_count++ ] = passed_fd;
+      }
+      else if ( passed_fd != -1 )
+      {
+         close( passed_fd );
+      }
+   }
+   close( connection_fd );
+
+   if ( -1 == listen_fd )
+   {
+      syslog( LOG_ERR, "%s: Vehicle %d did not hand off its listener", __func__, (int) running );
+      return( EXIT_FAILURE );
+   }
+
+   *server_fd = listen_fd;
+   syslog( LOG_INFO, "Took over the listener and %u sessions of vehicle %d", g_adopted_count, (int) running );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: hand_off_server
+*
+* Description: Hand the listener, and idle sessions when asked, to a
+*              waiting replacement.  Connections still queued on the
+*              listener are accepted by the replacement.  This server
+*              keeps serving its other sessions until they close or
+*              HANDOFF_DRAIN_MS passes, see server_drained().
+*
+* Inputs: server - vehicle server
+*
+* Returns: None
+*
+*/
+void hand_off_server( vehicle_server *server )
+{
+   int connection_fd;
+   int passed_fd;
+   int i;
+   unsigned int moved = 0;
+   handoff_message request;
+   handoff_message message = { 0 };
+   struct sockaddr_storage address = { 0 };
+   socklen_t address_length = sizeof( address );
+#ifdef USE_IO_URING
+   struct io_uring_sqe *sqe;
+#endif
+
+   g_handoff_signal = false;
+   if (   ( -1 == g_handoff_fd )
+       || ( -1 == server->listen_fd )
+       || ( EXIT_SUCCESS != handoff_accept( g_handoff_fd, &connection_fd ) )
+      )
+   {
+      return;
+   }
+
+   getsockname( server->listen_fd, (struct sockaddr *) &address, &address_length );
+   if ( EXIT_SUCCESS != handoff_receive( connection_fd, &request, &passed_fd, HANDOFF_TIMEOUT_MS ) )
+   {
+      close( connection_fd );
+      return;
+   }
+   if ( passed_fd != -1 )
+   {
+      close( passed_fd );
+   }
+
+   message.kind = HANDOFF_LISTENER;
+   if (   ( request.kind != HANDOFF_REQUEST )
+       || ( request.family != address.ss_family )
+       || ( EXIT_SUCCESS != handoff_send( connection_fd, &message, server->listen_fd ) )
+      )
+   {
+      syslog( LOG_ERR, "%s: Replacement refused, it serves another transport", __func__ );
+      message.kind = HANDOFF_DONE;
+      handoff_send( connection_fd, &message, -1 );
+      close( connection_fd );
+      return;
+   }
+
+   // The replacement listens for its own replacement once it is done
+   close( g_handoff_fd );
+   g_handoff_fd = -1;
+   unlink( HANDOFF_SOCKET_PATH );
+
+#ifdef USE_IO_URING
+   if ( -1 == server->epoll_fd )
+   {
+      sqe = uring_get_sqe( &g_uring );
+      if ( sqe != NULL )
+      {
+         uring_prep_cancel(
+            sqe,
+            (uint64_t) URING_OP_ACCEPT << URING_OP_SHIFT,
+            (uint64_t) URING_OP_CANCEL << URING_OP_SHIFT
+            );
+      }
+   }
+   else
+#endif
+   {
+      epoll_ctl( server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd, NULL );
+   }
+   close( server->listen_fd );
+   server->listen_fd = -1;
+   g_handed_off = true;
+   g_drain_ms = monotonic_ms() + HANDOFF_DRAIN_MS;
+
+   if ( request.flags & HANDOFF_WANT_SESSIONS )
+   {
+      for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+      {
+         if ( server->sessions[ i ].in_use && hand_off_session( server, &server->sessions[ i ], connection_fd ) )
+         {
+            moved++;
+         }
+      }
+   }
+
+   message.kind = HANDOFF_DONE;
+   handoff_send( connection_fd, &message, -1 );
+   close( connection_fd );
+
+   syslog( LOG_INFO, "Handed off the listener and %u sessions, draining the others", moved );
+   return;
+}
+
+
+/*
+* Name: hand_off_session
+*
+* Description: Pass an idle connection to the replacement.  Only a
+*              session with nothing queued, no partly received
+*              request and no subscriptions moves, the client cannot
+*              tell.  An io_uring session may hold received data in its
+*              buffers and stays.
+*
+* Inputs: server - vehicle server
+*         session - session to pass
+*         connection_fd - handoff connection
+*
+* Returns: true - handed off and released here
+*          false - stays with this server
+*
+*/
+bool hand_off_session( vehicle_server *server, client_session *session, int connection_fd )
+{
+   handoff_message message = { 0 };
+
+#ifdef USE_IO_URING
+   if ( session->uring )
+   {
+      return( false );
+   }
+#endif
+   if ( ( session->subscription_count > 0 ) || ( session->inbox_count > 0 ) || ( session->outbox_count > 0 ) ||
+        ( session->link.rx_partial_length > 0 ) )
+   {
+      return( false );
+   }
+
+   message.kind = HANDOFF_SESSION;
+   if ( EXIT_SUCCESS != handoff_send( connection_fd, &message, session->link.fd ) )
+   {
+      return( false );
+   }
+
+   // Only this descriptor closes, the connection stays open
+   epoll_ctl( server->epoll_fd, EPOLL_CTL_DEL, session->link.fd, NULL );
+   transport_close( &session->link );
+   session->in_use = false;
+
+   server->throttled += session->throttled;
+   server->paused += session->paused;
+   server->dropped += session->dropped;
+   syslog( LOG_INFO, "Handed off connection from %s, served %lu", session->peer, session->served );
+   return( true );
+}
+
+
+/*
+* Name: adopt_sessions
+*
+* Description: Serve the connections handed over by the replaced server
+*
+* Inputs: server - vehicle server
+*
+* Returns: None
+*
+*/
+void adopt_sessions( vehicle_server *server )
+{
+   unsigned int i;
+
+   for ( i = 0; i < g_adopted_count; i++ )
+   {
+#ifdef USE_IO_URING
+      if ( -1 == server->epoll_fd )
+      {
+         start_uring_session( server, g_adopted_fds[ i ] );
+         continue;
+      }
+#endif
+      start_session( server, g_adopted_fds[ i ] );
+   }
+   g_adopted_count = 0;
+   return;
+}
+
+
+/*
+* Name: server_drained
+*
+* Description: Whether a server that handed off its listener is done,
+*              all its sessions closed or the drain time is up
+*
+* Inputs: server - vehicle server
+*         now_ms - monotonic time
+*
+* Returns: true - stop serving, remaining sessions are closed
+*          false - keep serving
+*
+*/
+bool server_drained( vehicle_server *server, uint64_t now_ms )
+{
+   unsigned int open = 0;
+   int i;
+
+   if ( !g_handed_off )
+   {
+      return( false );
+   }
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( server->sessions[ i ].in_use )
+      {
+         open++;
+      }
+   }
+
+   if ( 0 == open )
+   {
+      syslog( LOG_INFO, "%s: All sessions closed, exiting", __func__ );
+      return( true );
+   }
+   if ( now_ms >= g_drain_ms )
+   {
+      syslog( LOG_INFO, "%s: Drain time is up, closing %u sessions", __func__, open );
+      return( true );
+   }
+   return( false );
+}
+
+
+/*
+* Name: create_socket
+*
+* Description: Create and bind a socket.
+*
+* Inputs: reuse_port - let every worker bind its own socket to the
+*                      port, the kernel spreads connections over them
+* 
+* Outputs: sockef_fd - new socket file descriptor
+*
+* Returns: EXIT_SUCCESS - socket was created
+*          EXIT_FAILURE - failed to create socket
+*
+*/
+int create_socket( int *socket_fd, bool reuse_port )
+{
+   int temp_socket_fd;
+   int return_status = EXIT_FAILURE;
+   int enable = 1;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+      
+   if ( socket_fd != NULL )
+   {   
+      temp_socket_fd = socket(
+	      AF_INET,
+	      SOCK_STREAM,
+	      0
+	      );
+
+      if ( temp_socket_fd != -1 )
+      {
+         int status;
+         struct addrinfo select_address = { 0 };
+         struct addrinfo *socket_address = NULL;
+         
+         select_address.ai_family   = AF_INET;
+         select_address.ai_socktype = SOCK_STREAM;
+         select_address.ai_flags    = AI_PASSIVE; 
+
+         status = getaddrinfo(
+            NULL, 
+            SERVER_PORT_STRING, 
+            &select_address, 
+            &socket_address
+            );
+
+         // A restart binds while connections of the previous server
+         // are still in TIME_WAIT
+         if ( 0 == status )
+         {
+            status = setsockopt( temp_socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof( enable ) );
+         }
+
+         if ( ( 0 == status ) && reuse_port )
+         {
+            status = setsockopt( temp_socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof( enable ) );
+         }
+            
+         if ( 0 == status )
+         { 
+            status = bind(
+               temp_socket_fd,
+               socket_address->ai_addr,
+               socket_address->ai_addrlen
+               );
+               
+            if ( 0 == status )
+            { 
+               fcntl( 
+                  temp_socket_fd, 
+                  F_SETFL, 
+                  O_NONBLOCK
+                  );
+
+               *socket_fd = temp_socket_fd;
+	            return_status = EXIT_SUCCESS;
+            } 
+         }
+         
+         if ( socket_address != NULL )
+         {
+            freeaddrinfo( socket_address );
+         }
+      }
+      
+	   if ( return_status != EXIT_SUCCESS )
+      {
+         strerror_r( errno, error, SYSLOG_BUF_SIZE );
+         syslog( LOG_ERR, "%s: %s", __func__, error );
+      }
+   }  
+   else
+   {
+      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+   }
+   return( return_status );
+}
+
+
+/*
+* Name: run_workers
+*
+* Description: Serve TCP from worker threads.  Every worker binds its
+*              own SO_REUSEPORT listener and runs its own event loop
+*              and session table, the kernel spreads new connections
+*              over the listeners.  Nothing on the request path is
+*              shared between workers.
+*
+* Inputs: workers - number of worker threads
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_workers( unsigned int workers )
+{
+   int return_status = EXIT_SUCCESS;
+   server_worker *pool;
+   unsigned int opened;
+   unsigned int started;
+   unsigned int i;
+
+   pool = calloc( workers, sizeof( server_worker ) );
+   if ( NULL == pool )
+   {
+      syslog( LOG_ERR, "%s: Out of memory", __func__ );
+      return( EXIT_FAILURE );
+   }
+
+   // Bind every listener first, a port in use fails before any thread
+   for ( opened = 0; opened < workers; opened++ )
+   {
+      pool[ opened ].index = (int) opened;
+      if ( EXIT_SUCCESS != create_socket( &pool[ opened ].socket_fd, true ) )
+      {
+         return_status = EXIT_FAILURE;
+         break;
+      }
+   }
+
+   started = 0;
+   if ( EXIT_SUCCESS == return_status )
+   {
+      for ( started = 0; started < workers; started++ )
+      {
+         if ( 0 != pthread_create( &pool[ started ].thread, NULL, run_worker, &pool[ started ] ) )
+         {
+            syslog( LOG_ERR, "%s: Could not start worker %u", __func__, started );
+            g_stop_signal = true;
+            return_status = EXIT_FAILURE;
+            break;
+         }
+      }
+   }
+
+   for ( i = 0; i < started; i++ )
+   {
+      pthread_join( pool[ i ].thread, NULL );
+      if ( pool[ i ].status != EXIT_SUCCESS )
+      {
+         return_status = EXIT_FAILURE;
+      }
+   }
+
+   // Started workers close their own listener
+   for ( i = started; i < opened; i++ )
+   {
+      close( pool[ i ].socket_fd );
+   }
+   free( pool );
+
+   return( return_status );
+}
+
+
+/*
+* Name: run_worker
+*
+* Description: Worker thread, pins itself to a core and serves its
+*              listener until stopped
+*
+* Inputs: context - server_worker
+*
+* Returns: NULL
+*
+*/
+void *run_worker( void *context )
+{
+   server_worker *worker = context;
+   cpu_set_t cores;
+   long online = sysconf( _SC_NPROCESSORS_ONLN );
+
+   g_worker = worker->index;
+   g_server = &worker->server;
+
+   CPU_ZERO( &cores );
+   CPU_SET( worker->index % ( ( online > 0 ) ? online : 1 ), &cores );
+   if ( 0 != pthread_setaffinity_np( pthread_self(), sizeof( cores ), &cores ) )
+   {
+      // Still correct unpinned, only slower
+      syslog( LOG_ERR, "%s: Could not pin worker %d", __func__, worker->index );
+   }
+
+#ifdef USE_IO_URING
+   worker->status = run_uring_server( worker->socket_fd );
+#else
+   worker->status = run_server( worker->socket_fd );
+#endif
+   return( NULL );
+}
+
+
+/*
+* Name: run_server
+*
+* Description: Listen and accept socket connections, TCP or unix.
+*              All client sessions are served from one epoll loop.
+*              Also the fallback of the io_uring server.
+*
+* Inputs: socket_fd - soacket file descriptor
+* 
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_server( int socket_fd )
+{
+   int return_status = EXIT_SUCCESS;
+   int status;
+   int ready;
+   int i;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+   vehicle_server *server = g_server;
+   struct epoll_event event = { 0 };
+   struct epoll_event events[ MAX_EPOLL_EVENTS ];
+   client_session *session;
+   uint64_t now_ms;
+   uint64_t wake_ns;
+   unsigned long requests;
+
+   memset( server, 0, sizeof( vehicle_server ) );
+   jitter_reset( &server->response );
+   server->listen_fd = socket_fd;
+   server->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+   status = listen( socket_fd, MAX_CLIENT_CONNECTIONS );
+   if ( ( 0 == status ) && ( server->epoll_fd != -1 ) )
+   {
+      // A NULL pointer marks the listening socket
+      event.events = EPOLLIN;
+      event.data.ptr = NULL;
+      status = epoll_ctl( server->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event );
+   }
+   else
+   {
+      status = -1;
+   }
+
+   if ( 0 == status )
+   {
+      adopt_sessions( server );
+   }
+
+   if ( 0 == status )
+   {
+      for(;;)
+      {
+         ready = epoll_wait(
+            server->epoll_fd,
+            events,
+            MAX_EPOLL_EVENTS,
+            service_timeout( server )
+            );
+
+         if ( ( -1 == ready ) && ( errno != EINTR ) )
+         {
+            strerror_r( errno, error, SYSLOG_BUF_SIZE );
+            syslog( LOG_ERR, "%s: %s", __func__, error );
+            return_status = EXIT_FAILURE;
+            break;
+         }
+
+         wake_ns = jitter_clock_ns();
+         requests = server->requests;
+         for ( i = 0; i < ready; i++ )
+         {
+            session = events[ i ].data.ptr;
+            if ( NULL == session )
+            {
+               accept_sessions( server );
+            }
+            else if (   ( events[ i ].events & ( EPOLLHUP | EPOLLERR ) )
+                     || !receive_requests( server, session )
+                    )
+            {
+               // A hung up client gets no more responses
+               close_session( server, session );
+            }
+         }
+
+         now_ms = monotonic_ms();
+         serve_sessions( server, now_ms );
+         if ( server->requests != requests )
+         {
+            jitter_add( &server->response, jitter_clock_ns() - wake_ns );
+         }
+         for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+         {
+            session = &server->sessions[ i ];
+            if ( session->in_use && ( session->subscription_count > 0 ) )
+            {
+               publish_subscriptions( session, now_ms );
+               flush_obd2_responses( session );
+            }
+         }
+
+         if ( g_handoff_signal )
+         {
+            hand_off_server( server );
+         }
+         if ( server_drained( server, now_ms ) )
+         {
+            break;
+         }
+
+         if ( g_stop_signal )
+         {
+            syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+            break;
+         }
+      }
+   }
+   else
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return_status = EXIT_FAILURE;
+   }
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( server->sessions[ i ].in_use )
+      {
+         close_session( server, &server->sessions[ i ] );
+      }
+   }
+   
+   if ( server->epoll_fd != -1 )
+   {
+      close( server->epoll_fd );
+   }
+   if ( server->listen_fd != -1 )
+   {
+      close( server->listen_fd );
+   }
+   remove( client_log_file );
+
+   report_server( server, "epoll" );
+   return( return_status );
+}
+
+
+/*
+* Name: run_shm_server
+*
+* Description: Serve scan tools attached through shared memory,
+*              one at a time
+*
+* Inputs: server_link - vehicle shared memory transport
+* 
+* Returns: EXIT_SUCCESS
+*
+*/
+int run_shm_server( transport *server_link )
+{
+   client_session *session = &g_server->sessions[ 0 ];
+   int timeout_ms;
+
+   jitter_reset( &g_server->response );
+   for(;;)
+   {
+      if ( EXIT_SUCCESS == transport_shm_wait( server_link, SERVER_POLL_MS ) )
+      {
+         syslog( LOG_INFO, "Scan tool attached to %s", SHM_NAME );
+
+         // The session borrows the server transport, it is never closed
+         memset( session, 0, sizeof( client_session ) );
+         session->in_use = true;
+         session->link = *server_link;
+         strcpy( session->peer, "shm" );
+
+         do
+         {
+            timeout_ms = ( session->subscription_count > 0 )
+                       ? SUBSCRIPTION_MIN_MS
+                       : SERVER_POLL_MS;
+            if ( !transfer_data( session, timeout_ms ) )
+            {
+               break;
+            }
+            publish_subscriptions( session, monotonic_ms() );
+            flush_obd2_responses( session );
+         } while ( !g_stop_signal );
+
+         session->in_use = false;
+         syslog( LOG_INFO, "Scan tool detached from %s", SHM_NAME );
+      }
+
+      if ( g_stop_signal )
+      {
+         syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+         break;
+      }
+   }
+
+   remove( client_log_file );
+
+   report_server( g_server, "shm" );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: run_bus_server
+*
+* Description: Serve every scan tool on a CAN bus as one session,
+*              requests and responses are broadcast frames.  Cyclic
+*              frames are kept up to date between requests.
+*
+* Inputs: bus_link - vehicle node on the bus
+* 
+* Returns: EXIT_SUCCESS
+*
+*/
+int run_bus_server( transport *bus_link )
+{
+   client_session *session = &g_server->sessions[ 0 ];
+   int timeout_ms;
+   int cyclic_ms;
+
+   jitter_reset( &g_server->response );
+
+   // The session borrows the bus transport, it is closed by main()
+   memset( session, 0, sizeof( client_session ) );
+   session->in_use = true;
+   session->link = *bus_link;
+   strcpy( session->peer, "vbus" );
+
+   while ( !g_stop_signal )
+   {
+      timeout_ms = ( session->subscription_count > 0 )
+                 ? SUBSCRIPTION_MIN_MS
+                 : SERVER_POLL_MS;
+      if ( g_cyclic_mode != CYCLIC_OFF )
+      {
+         cyclic_ms = service_cyclic_frames( bus_link, monotonic_ms() );
+         if ( cyclic_ms < timeout_ms )
+         {
+            timeout_ms = cyclic_ms;
+         }
+      }
+      if ( !transfer_data( session, timeout_ms ) )
+      {
+         break;
+      }
+      publish_subscriptions( session, monotonic_ms() );
+      flush_obd2_responses( session );
+   }
+
+   session->in_use = false;
+   syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+
+   remove( client_log_file );
+
+   report_server( g_server, "bus" );
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: start_cyclic_frames
+*
+* Description: Start the cyclic broadcast frames.  With the broadcast
+*              manager the kernel sends them from now on, the
+*              userspace timer sends the first ones on the next
+*              service_cyclic_frames() call.
+*
+* Inputs: ifname - CAN interface for the broadcast manager
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int start_cyclic_frames( const char *ifname )
+{
+   cyclic_frame *entry;
+   unsigned int i;
+   uint64_t now_ms = monotonic_ms();
+
+   if ( CYCLIC_BCM == g_cyclic_mode )
+   {
+      if ( EXIT_SUCCESS != can_bcm_open( &g_bcm_fd, ifname ) )
+      {
+         return( EXIT_FAILURE );
+      }
+   }
+
+   for ( i = 0; i < M_ARRAY_SIZE( g_cyclic_frames ); i++ )
+   {
+      entry = &g_cyclic_frames[ i ];
+      build_cyclic_frame( entry, &entry->frame );
+      entry->next_ms = now_ms;
+
+      if ( CYCLIC_BCM == g_cyclic_mode )
+      {
+         if ( EXIT_SUCCESS != can_bcm_tx_start(
+                                 g_bcm_fd,
+                                 entry->id,
+                                 entry->period_ms,
+                                 &entry->frame.num_bytes,
+                                 sizeof( obd2_message ) - sizeof( entry->frame.id )
+                                 )
+            )
+         {
+            return( EXIT_FAILURE );
+         }
+         g_cyclic_writes++;
+      }
+   }
+
+   if ( g_cyclic_mode != CYCLIC_OFF )
+   {
+      syslog(
+         LOG_INFO,
+         "Cyclic frames sent by %s",
+         ( CYCLIC_BCM == g_cyclic_mode ) ? "the broadcast manager" : "a userspace timer"
+         );
+   }
+   return( EXIT_SUCCESS );
+}
+
+
+/*
+* Name: service_cyclic_frames
+*
+* Description: With the broadcast manager, hand the kernel a new
+*              payload for every frame whose value has changed.  With
+*              the userspace timer, send every frame that is due.
+*
+* Inputs: bus_link - vehicle node on the bus
+*         now_ms - monotonic time
+*
+* Returns: Milliseconds until the next call is needed
+*
+*/
+int service_cyclic_frames( transport *bus_link, uint64_t now_ms )
+{
+   cyclic_frame *entry;
+   obd2_message frame;
+   uint64_t wait_ms = SERVER_POLL_MS;
+   uint64_t entry_wait_ms;
+   unsigned int i;
+
+   for ( i = 0; i < M_ARRAY_SIZE( g_cyclic_frames ); i++ )
+   {
+      entry = &g_cyclic_frames[ i ];
+
+      if ( CYCLIC_BCM == g_cyclic_mode )
+      {
+         build_cyclic_frame( entry, &frame );
+         if ( memcmp( &frame, &entry->frame, sizeof( frame ) ) != 0 )
+         {
+            entry->frame = frame;
+            can_bcm_tx_update(
+               g_bcm_fd,
+               entry->id,
+               &entry->frame.num_bytes,
+               sizeof( obd2_message ) - sizeof( entry->frame.id )
+               );
+            g_cyclic_writes++;
+         }
+
+         // Wake when the simulated value can next change
+         entry_wait_ms = entry->step_ms - simulation_ms() % entry->step_ms;
+      }
+      else
+      {
+         if ( entry->next_ms <= now_ms )
+         {
+            build_cyclic_frame( entry, &entry->frame );
+            transport_send( bus_link, &entry->frame, sizeof( obd2_message ) );
+            g_cyclic_writes++;
+
+            // A late frame does not make the next one early
+            entry->next_ms += entry->period_ms;
+            if ( entry->next_ms <= now_ms )
+            {
+               entry->next_ms = now_ms + entry->period_ms;
+            }
+         }
+         entry_wait_ms = entry->next_ms - now_ms;
+      }
+
+      if ( entry_wait_ms < wait_ms )
+      {
+         wait_ms = entry_wait_ms;
+      }
+   }
+   return( (int) wait_ms );
+}
+
+
+/*
+* Name: stop_cyclic_frames
+*
+* Description: Stop the cyclic frames and report the CPU time used
+*              by the vehicle, to compare the broadcast manager with
+*              the userspace timer
+*
+* Inputs: None
+*
+* Returns: None
+*
+*/
+void stop_cyclic_frames( void )
+{
+   struct rusage usage;
+   double user_ms;
+   double system_ms;
+
+   if ( CYCLIC_OFF == g_cyclic_mode )
+   {
+      return;
+   }
+
+   // Closing the socket deletes every broadcast manager operation
+   if ( g_bcm_fd != -1 )
+   {
+      close( g_bcm_fd );
+      g_bcm_fd = -1;
+   }
+
+   getrusage( RUSAGE_SELF, &usage );
+   user_ms = usage.ru_utime.tv_sec * MS_PER_SEC + usage.ru_utime.tv_usec / 1000.0;
+   system_ms = usage.ru_stime.tv_sec * MS_PER_SEC + usage.ru_stime.tv_usec / 1000.0;
+
+   syslog(
+      LOG_INFO,
+      "Cyclic frames: %lu writes, CPU user %.1f ms system %.1f ms, %ld context switches",
+      g_cyclic_writes,
+      user_ms,
+      system_ms,
+      usage.ru_nvcsw + usage.ru_nivcsw
+      );
+   printf(
+      "Cyclic frames (%s): %lu writes, CPU user %.1f ms system %.1f ms, %ld context switches\n",
+      ( CYCLIC_BCM == g_cyclic_mode ) ? "bcm" : "user",
+      g_cyclic_writes,
+      user_ms,
+      system_ms,
+      usage.ru_nvcsw + usage.ru_nivcsw
+      );
+   return;
+}
+
+
+/*
+* Name: build_cyclic_frame
+*
+* Description: Fill a cyclic frame with the current value of its PID
+*
+* Inputs: entry - cyclic frame
+*
+* Outputs: frame - frame to send
+*
+* Returns: None
+*
+*/
+void build_cyclic_frame( cyclic_frame *entry, obd2_message *frame )
+{
+   memset( frame, 0, sizeof( obd2_message ) );
+   frame->mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
+   handle_obd2_current_data( frame, entry->pid );
+   frame->id = entry->id;
+   return;
+}
+
+
+/*
+* Name: accept_sessions
+*
+* Description: Accept every pending connection and add it to the
+*              epoll set.  Connections beyond the session table are
+*              refused.
+*
+* Inputs: server - vehicle server
+* 
+* Returns: None
+*
+*/
+void accept_sessions( vehicle_server *server )
+{
+   int client_fd;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for(;;)
+   {
+      client_fd = accept( server->listen_fd, NULL, NULL );
+      if ( -1 == client_fd )
+      {
+         if (   ( errno != EAGAIN      ) 
+             && ( errno != EWOULDBLOCK )
+             && ( errno != EINTR       )
+            )
+         {
+            strerror_r( errno, error, SYSLOG_BUF_SIZE );
+            syslog( LOG_ERR, "%s: %s", __func__, error );
+         }
+         break;
+      }
+
+      start_session( server, client_fd );
+   }
+
+   return;
+}
+
+
+/*
+* Name: start_session
+*
+* Description: Start a session for a connection, accepted here or
+*              handed over by the server this one replaced, and add it
+*              to the epoll set
+*
+* Inputs: server - vehicle server
+*         client_fd - connected socket, closed on failure
+* 
+* Returns: None
+*
+*/
+void start_session( vehicle_server *server, int client_fd )
+{
+   struct sockaddr_storage client_address = { 0 };
+   socklen_t address_length = sizeof( client_address );
+   int i;
+   client_session *session = NULL;
+   struct epoll_event event = { 0 };
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( !server->sessions[ i ].in_use )
+      {
+         session = &server->sessions[ i ];
+         break;
+      }
+   }
+
+   if ( NULL == session )
+   {
+      syslog( LOG_ERR, "%s: Too many connections", __func__ );
+      close( client_fd );
+      return;
+   }
+
+   memset( session, 0, sizeof( client_session ) );
+   fcntl( client_fd, F_SETFL, O_NONBLOCK );
+   strcpy( session->peer, "local" );
+
+   getpeername( client_fd, (struct sockaddr *) &client_address, &address_length );
+   if ( AF_INET == client_address.ss_family )
+   {
+      inet_ntop(
+         AF_INET, 
+         &( ( (struct sockaddr_in *) &client_address )->sin_addr ),
+         session->peer, 
+         INET_ADDRSTRLEN
+         );
+      transport_tcp_init( &session->link, client_fd );
+   }
+   else
+   {
+      transport_unix_init( &session->link, client_fd );
+   }
+
+   event.events = EPOLLIN;
+   event.data.ptr = session;
+   if ( -1 == epoll_ctl( server->epoll_fd, EPOLL_CTL_ADD, client_fd, &event ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      transport_close( &session->link );
+      return;
+   }
+
+   session->in_use = true;
+   session->reading = true;
+   syslog( LOG_INFO, "Accepted connection from %s", session->peer );
+   return;
+}
+
+
+/*
+* Name: close_session
+*
+* Description: Close a client connection and free its session
+*
+* Inputs: server - vehicle server
+*         session - session to close
+* 
+* Returns: None
+*
+*/
+void close_session( vehicle_server *server, client_session *session )
+{
+#ifdef USE_IO_URING
+   struct io_uring_sqe *sqe;
+
+   if ( session->uring )
+   {
+      release_uring_buffers( session );
+
+      // Stop the multishot receive, its last completion is stale
+      sqe = uring_get_sqe( &g_uring );
+      if ( sqe != NULL )
+      {
+         uring_prep_cancel(
+            sqe,
+            ( (uint64_t) URING_OP_RECV << URING_OP_SHIFT )
+            | ( (uint64_t) ( session - server->sessions ) << URING_INDEX_SHIFT )
+            | session->generation,
+            (uint64_t) URING_OP_CANCEL << URING_OP_SHIFT
+            );
+      }
+   }
+   else
+#endif
+   {
+      epoll_ctl( server->epoll_fd, EPOLL_CTL_DEL, session->link.fd, NULL );
+   }
+   transport_close( &session->link );
+   session->in_use = false;
+
+   server->throttled += session->throttled;
+   server->paused += session->paused;
+   server->dropped += session->dropped;
+   syslog(
+      LOG_INFO,
+      "Closed connection from %s, served %lu, throttled %lu, paused %lu, dropped %lu, unsent %lu",
+      session->peer,
+      session->served,
+      session->throttled,
+      session->paused,
+      session->dropped,
+      session->unsent
+      );
+   return;
+}
+
+
+/*
+* Name: report_server
+*
+* Description: Report the requests served and the CPU time per request,
+*              to compare the epoll and io_uring servers under the
+*              scan tool load generator
+*
+* Inputs: server - vehicle server
+*         backend - event loop name
+*
+* Returns: None
+*
+*/
+void report_server( vehicle_server *server, const char *backend )
+{
+   struct rusage usage;
+   double cpu_usec;
+   char enter_calls[ SYSLOG_BUF_SIZE + 1 ] = "";
+   char name[ SYSLOG_BUF_SIZE + 1 ];
+   char response[ CLIENT_LOG_BUF_SIZE ];
+
+   if ( 0 == server->requests )
+   {
+      return;
+   }
+
+   if ( g_worker >= 0 )
+   {
+      snprintf( name, sizeof( name ), "Worker %d (%s)", g_worker, backend );
+   }
+   else
+   {
+      snprintf( name, sizeof( name ), "Server (%s)", backend );
+   }
+
+#ifdef USE_IO_URING
+   if ( g_uring.enter_calls > 0 )
+   {
+      snprintf( enter_calls, sizeof( enter_calls ), ", %lu io_uring_enter calls", g_uring.enter_calls );
+   }
+#endif
+
+   // A worker reports its own thread
+   getrusage( ( g_worker >= 0 ) ? RUSAGE_THREAD : RUSAGE_SELF, &usage );
+   cpu_usec = ( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000.0
+            + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+   syslog(
+      LOG_INFO,
+      "%s: %lu requests, %.2f usec CPU per request%s, %ld context switches, "
+      "throttled %lu, paused %lu, dropped %lu",
+      name,
+      server->requests,
+      cpu_usec / server->requests,
+      enter_calls,
+      usage.ru_nvcsw + usage.ru_nivcsw,
+      server->throttled,
+      server->paused,
+      server->dropped
+      );
+   printf(
+      "%s: %lu requests, %.2f usec CPU per request%s, %ld context switches, "
+      "throttled %lu, paused %lu, dropped %lu\n",
+      name,
+      server->requests,
+      cpu_usec / server->requests,
+      enter_calls,
+      usage.ru_nvcsw + usage.ru_nivcsw,
+      server->throttled,
+      server->paused,
+      server->dropped
+      );
+
+   jitter_summary( &server->response, response, sizeof( response ) );
+   syslog( LOG_INFO, "%s response: %s", name, response );
+   printf( "%s response: %s\n", name, response );
+   return;
+}
+
+
+#ifdef USE_IO_URING
+/*
+* Name: run_uring_server
+*
+* Description: Serve TCP or unix connections from one io_uring.  A
+*              multishot accept and one multishot receive per session
+*              stay armed, receives land in provided buffers, and the
+*              responses of a whole pass are submitted with the wait
+*              for the next completions in a single io_uring_enter().
+*              Falls back to the epoll server when the kernel has no
+*              usable io_uring.
+*
+* Inputs: socket_fd - bound socket file descriptor
+*
+* Returns: EXIT_SUCCESS
+*          EXIT_FAILURE
+*
+*/
+int run_uring_server( int socket_fd )
+{
+   int return_status = EXIT_SUCCESS;
+   int i;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+   vehicle_server *server = g_server;
+   uring *ring = &g_uring;
+   struct io_uring_sqe *sqe;
+   struct io_uring_cqe *cqe;
+   client_session *session;
+   uint64_t now_ms;
+   uint64_t wake_ns;
+   unsigned long requests;
+
+   if (   ( EXIT_SUCCESS != uring_init( ring, URING_ENTRIES ) )
+       || ( EXIT_SUCCESS != uring_setup_buffers( ring, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_LENGTH ) )
+      )
+   {
+      uring_close( ring );
+      syslog( LOG_INFO, "%s: io_uring not available, using epoll", __func__ );
+      return( run_server( socket_fd ) );
+   }
+
+   memset( server, 0, sizeof( vehicle_server ) );
+   jitter_reset( &server->response );
+   server->listen_fd = socket_fd;
+   server->epoll_fd = -1;
+
+   sqe = uring_get_sqe( ring );
+   if ( ( -1 == listen( socket_fd, MAX_CLIENT_CONNECTIONS ) ) || ( NULL == sqe ) )
+   {
+      strerror_r( errno, error, SYSLOG_BUF_SIZE );
+      syslog( LOG_ERR, "%s: %s", __func__, error );
+      return_status = EXIT_FAILURE;
+   }
+   else
+   {
+      uring_prep_accept_multishot( sqe, socket_fd, (uint64_t) URING_OP_ACCEPT << URING_OP_SHIFT );
+      adopt_sessions( server );
+   }
+
+   while ( EXIT_SUCCESS == return_status )
+   {
+      return_status = uring_submit_and_wait( ring, 1, service_timeout( server ) );
+
+      wake_ns = jitter_clock_ns();
+      requests = server->requests;
+      while ( ( cqe = uring_peek_cqe( ring ) ) != NULL )
+      {
+         handle_uring_completion( server, cqe );
+         uring_cqe_seen( ring );
+      }
+
+      now_ms = monotonic_ms();
+      serve_sessions( server, now_ms );
+      if ( server->requests != requests )
+      {
+         jitter_add( &server->response, jitter_clock_ns() - wake_ns );
+      }
+      for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+      {
+         session = &server->sessions[ i ];
+         if ( !session->in_use )
+         {
+            continue;
+         }
+         if ( session->subscription_count > 0 )
+         {
+            publish_subscriptions( session, now_ms );
+         }
+
+         // Also retries responses the submission queue had no room for
+         flush_obd2_responses( session );
+      }
+
+      if ( g_handoff_signal )
+      {
+         hand_off_server( server );
+      }
+      if ( server_drained( server, now_ms ) )
+      {
+         break;
+      }
+
+      if ( g_stop_signal )
+      {
+         syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
+         break;
+      }
+   }
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( server->sessions[ i ].in_use )
+      {
+         close_session( server, &server->sessions[ i ] );
+      }
+   }
+
+   // Closing the ring cancels the requests still in flight
+   uring_close( ring );
+   if ( server->listen_fd != -1 )
+   {
+      close( server->listen_fd );
+   }
+   remove( client_log_file );
+
+   report_server( server, "io_uring" );
+   return( return_status );
+}
+
+
+/*
+* Name: handle_uring_completion
+*
+* Description: Handle one completion of the io_uring server.  The user
+*              data holds the request kind, the session index and the
+*              session generation.
+*
+* Inputs: server - vehicle server
+*         cqe - completion
+*
+* Returns: None
+*
+*/
+void handle_uring_completion( vehicle_server *server, struct io_uring_cqe *cqe )
+{
+   unsigned int op = (unsigned int) ( cqe->user_data >> URING_OP_SHIFT );
+   unsigned int index = (unsigned int) ( cqe->user_data >> URING_INDEX_SHIFT ) & URING_INDEX_MASK;
+   uint32_t generation = (uint32_t) cqe->user_data;
+   client_session *session = NULL;
+   bool current = false;
+   bool more = ( 0 != ( cqe->flags & IORING_CQE_F_MORE ) );
+   uint16_t buffer_id;
+   held_buffer *held;
+   struct io_uring_sqe *sqe;
+   char error[ SYSLOG_BUF_SIZE + 1 ];
+
+   if ( index < MAX_CLIENT_CONNECTIONS )
+   {
+      session = &server->sessions[ index ];
+      current = session->in_use && session->uring && ( session->generation == generation );
+   }
+
+   switch( op )
+   {
+      case URING_OP_ACCEPT:
+      {
+         if ( cqe->res >= 0 )
+         {
+            start_uring_session( server, cqe->res );
+         }
+         else if ( cqe->res != -ECANCELED )
+         {
+            strerror_r( -cqe->res, error, SYSLOG_BUF_SIZE );
+            syslog( LOG_ERR, "%s: accept: %s", __func__, error );
+         }
+
+         // The kernel ends a multishot accept on some errors, and when
+         // cancelled after a handoff
+         if ( !more && !g_stop_signal && ( server->listen_fd != -1 ) )
+         {
+            sqe = uring_get_sqe( &g_uring );
+            if ( sqe != NULL )
+            {
+               uring_prep_accept_multishot( sqe, server->listen_fd, cqe->user_data );
+            }
+         }
+         break;
+      }
+
+      case URING_OP_RECV:
+      {
+         if ( cqe->flags & IORING_CQE_F_BUFFER )
+         {
+            buffer_id = (uint16_t) ( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+            if ( current && ( cqe->res > 0 ) )
+            {
+               // Held until its requests fit the inbox, a receive
+               // still armed after the inbox filled must not lose them
+               held = &session->rx_held[ ( session->rx_held_head + session->rx_held_count ) % URING_BUFFER_COUNT ];
+               held->id = buffer_id;
+               held->offset = 0;
+               held->length = (uint16_t) cqe->res;
+               session->rx_held_count++;
+               if (   !drain_uring_buffers( session )
+                   || ( SESSION_QUEUE == session->inbox_count )
+                  )
+               {
+                  set_reading( server, session, false );
+               }
+            }
+            else
+            {
+               uring_recycle_buffer( &g_uring, buffer_id );
+            }
+         }
+
+         if ( !current )
+         {
+            break;
+         }
+
+         if ( !more )
+         {
+            session->recv_armed = false;
+         }
+
+         // A cancel from set_reading() can complete after reading was
+         // turned back on, the receive is then armed again below
+         if ( ( 0 == cqe->res ) || ( ( cqe->res < 0 ) && ( cqe->res != -ENOBUFS ) && ( cqe->res != -ECANCELED ) ) )
+         {
+            if ( cqe->res < 0 )
+            {
+               strerror_r( -cqe->res, error, SYSLOG_BUF_SIZE );
+               syslog( LOG_ERR, "%s: receive: %s", __func__, error );
+            }
+            close_session( server, session );
+         }
+         else if ( !more && session->reading )
+         {
+            // Out of buffers, cancelled or ended by the kernel, start
+            // again
+            arm_uring_receive( session, index );
+         }
+         break;
+      }
+
+      case URING_OP_SEND:
+      {
+         if ( !current )
+         {
+            break;
+         }
+
+         if ( cqe->res < 0 )
+         {
+            // A failed send cancels the rest of its chain
+            if ( cqe->res != -ECANCELED )
+            {
+               strerror_r( -cqe->res, error, SYSLOG_BUF_SIZE );
+               syslog( LOG_ERR, "%s: send: %s", __func__, error );
+            }
+            close_session( server, session );
+            break;
+         }
+
+         session->tx_in_flight--;
+         if ( 0 == session->tx_in_flight )
+         {
+            session->tx_count[ session->tx_fill ^ 1 ] = 0;
+            queue_uring_send( session );
+         }
+         break;
+      }
+
+      default:
+      {
+         // Cancel completions need no handling
+         break;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: start_uring_session
+*
+* Description: Take a connection from the multishot accept and arm its
+*              multishot receive.  Connections beyond the session table
+*              are refused.
+*
+* Inputs: server - vehicle server
+*         client_fd - accepted socket, non-blocking
+*
+* Returns: None
+*
+*/
+void start_uring_session( vehicle_server *server, int client_fd )
+{
+   struct sockaddr_storage client_address;
+   socklen_t address_length = sizeof( client_address );
+   client_session *session = NULL;
+   int i;
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( !server->sessions[ i ].in_use )
+      {
+         session = &server->sessions[ i ];
+         break;
+      }
+   }
+
+   if ( NULL == session )
+   {
+      syslog( LOG_ERR, "%s: Too many connections", __func__ );
+      close( client_fd );
+      return;
+   }
+
+   memset( session, 0, sizeof( client_session ) );
+   strcpy( session->peer, "local" );
+
+   getpeername( client_fd, (struct sockaddr *) &client_address, &address_length );
+   if ( AF_INET == client_address.ss_family )
+   {
+      inet_ntop(
+         AF_INET,
+         &( ( (struct sockaddr_in *) &client_address )->sin_addr ),
+         session->peer,
+         INET_ADDRSTRLEN
+         );
+      transport_tcp_init( &session->link, client_fd );
+   }
+   else
+   {
+      // SOCK_SEQPACKET keeps one response per send
+      transport_unix_init( &session->link, client_fd );
+      session->seqpacket = true;
+   }
+
+   session->uring = true;
+   session->generation = ++server->generation;
+   session->in_use = true;
+   session->reading = true;
+   arm_uring_receive( session, (unsigned int) i );
+
+   syslog( LOG_INFO, "Accepted connection from %s", session->peer );
+   return;
+}
+
+
+/*
+* Name: arm_uring_receive
+*
+* Description: Queue the multishot receive of a session
+*
+* Inputs: session - io_uring session
+*         index - session index
+*
+* Returns: None
+*
+*/
+void arm_uring_receive( client_session *session, unsigned int index )
+{
+   struct io_uring_sqe *sqe;
+
+   sqe = uring_get_sqe( &g_uring );
+   if ( NULL == sqe )
+   {
+      syslog( LOG_ERR, "%s: Submission queue full", __func__ );
+      close_session( g_server, session );
+      return;
+   }
+
+   uring_prep_recv_multishot(
+      sqe,
+      session->link.fd,
+      URING_BUFFER_GROUP,
+      ( (uint64_t) URING_OP_RECV << URING_OP_SHIFT )
+      | ( (uint64_t) index << URING_INDEX_SHIFT )
+      | session->generation
+      );
+   session->recv_armed = true;
+   return;
+}
+
+
+/*
+* Name: receive_uring_data
+*
+* Description: Split received bytes into requests for the session's
+*              inbox, as many as it has room for.  A TCP stream can end
+*              a buffer inside a message, the start is kept until the
+*              rest arrives.
+*
+* Inputs: session - io_uring session
+*         data - received bytes
+*         length - number of bytes
+*
+* Returns: Number of bytes taken
+*
+*/
+size_t receive_uring_data( client_session *session, const uint8_t *data, size_t length )
+{
+   obd2_message requests[ TRANSPORT_BATCH_SIZE ];
+   size_t chunk;
+   size_t taken = 0;
+   unsigned int room = SESSION_QUEUE - session->inbox_count;
+   unsigned int count = 0;
+
+   // No kernel timestamps or CAN FD frames on a socket session
+   memset( session->link.rx_timestamp_ns, 0, sizeof( session->link.rx_timestamp_ns ) );
+   memset( session->link.rx_fd, 0, sizeof( session->link.rx_fd ) );
+
+   if ( 0 == room )
+   {
+      return( 0 );
+   }
+
+   if ( session->rx_partial_length > 0 )
+   {
+      chunk = sizeof( obd2_message ) - session->rx_partial_length;
+      if ( chunk > length )
+      {
+         chunk = length;
+      }
+      memcpy( session->rx_partial + session->rx_partial_length, data, chunk );
+      session->rx_partial_length += chunk;
+      taken += chunk;
+
+      if ( session->rx_partial_length < sizeof( obd2_message ) )
+      {
+         return( taken );
+      }
+      memcpy( &requests[ count++ ], session->rx_partial, sizeof( obd2_message ) );
+      session->rx_partial_length = 0;
+      room--;
+   }
+
+   while ( ( room > 0 ) && ( length - taken >= sizeof( obd2_message ) ) )
+   {
+      memcpy( &requests[ count++ ], data + taken, sizeof( obd2_message ) );
+      taken += sizeof( obd2_message );
+      room--;
+
+      if ( TRANSPORT_BATCH_SIZE == count )
+      {
+         queue_requests( session, requests, count );
+         count = 0;
+      }
+   }
+
+   if ( ( room > 0 ) && ( taken < length ) )
+   {
+      memcpy( session->rx_partial, data + taken, length - taken );
+      session->rx_partial_length = length - taken;
+      taken = length;
+   }
+
+   queue_requests( session, requests, count );
+   return( taken );
+}
+
+
+/*
+* Name: drain_uring_buffers
+*
+* Description: Move the requests of the held receive buffers into the
+*              inbox, oldest first, and give every emptied buffer back
+*              to the kernel
+*
+* Inputs: session - io_uring session
+*
+* Returns: true - no buffer is held
+*          false - the inbox filled first
+*
+*/
+bool drain_uring_buffers( client_session *session )
+{
+   held_buffer *held;
+
+   while ( session->rx_held_count > 0 )
+   {
+      held = &session->rx_held[ session->rx_held_head ];
+      held->offset += (uint16_t) receive_uring_data(
+         session,
+         uring_buffer( &g_uring, held->id ) + held->offset,
+         held->length - held->offset
+         );
+      if ( held->offset < held->length )
+      {
+         return( false );
+      }
+
+      uring_recycle_buffer( &g_uring, held->id );
+      session->rx_held_head = ( session->rx_held_head + 1 ) % URING_BUFFER_COUNT;
+      session->rx_held_count--;
+   }
+   return( true );
+}
+
+
+/*
+* Name: release_uring_buffers
+*
+* Description: Give the held receive buffers of a closed session back
+*              to the kernel
+*
+* Inputs: session - io_uring session
+*
+* Returns: None
+*
+*/
+void release_uring_buffers( client_session *session )
+{
+   while ( session->rx_held_count > 0 )
+   {
+      uring_recycle_buffer( &g_uring, session->rx_held[ session->rx_held_head ].id );
+      session->rx_held_head = ( session->rx_held_head + 1 ) % URING_BUFFER_COUNT;
+      session->rx_held_count--;
+   }
+   return;
+}
+
+
+/*
+* Name: queue_uring_send
+*
+* Description: Move the queued responses to the session's send buffer
+*              and send it unless the previous send is in flight.  The
+*              send is submitted with the next wait of the server loop.
+*              Responses that do not fit stay in the outbox and a
+*              buffer the submission queue had no room for stays
+*              filling, both go with a later call.
+*
+* Inputs: session - io_uring session
+*
+* Returns: None
+*
+*/
+void queue_uring_send( client_session *session )
+{
+   unsigned int fill = session->tx_fill;
+   unsigned int room = URING_TX_MESSAGES - session->tx_count[ fill ];
+   unsigned int count = ( session->outbox_count < room ) ? session->outbox_count : room;
+
+   if ( count > 0 )
+   {
+      memcpy( &session->tx_buffer[ fill ][ session->tx_count[ fill ] ], session->outbox, count * sizeof( obd2_message ) );
+      session->tx_count[ fill ] += count;
+      session->outbox_count -= count;
+      memmove( session->outbox, &session->outbox[ count ], session->outbox_count * sizeof( obd2_message ) );
+   }
+
+   if ( ( 0 == session->tx_in_flight ) && ( session->tx_count[ fill ] > 0 ) )
+   {
+      submit_uring_send( session, (unsigned int) ( session - g_server->sessions ) );
+   }
+   return;
+}
+
+
+/*
+* Name: submit_uring_send
+*
+* Description: Send the filling buffer and switch to the other one.  A
+*              TCP stream takes the buffer in one send.  A seqpacket
+*              socket takes one response per send, the sends are linked
+*              so they complete in order.  The whole chain is reserved
+*              first, without room the buffer stays filling.
+*
+* Inputs: session - io_uring session, no send in flight
+*         index - session index
+*
+* Returns: None
+*
+*/
+void submit_uring_send( client_session *session, unsigned int index )
+{
+   unsigned int buffer = session->tx_fill;
+   unsigned int count = session->tx_count[ buffer ];
+   unsigned int sends = session->seqpacket ? count : 1;
+   struct io_uring_sqe *sqe;
+   struct io_uring_sqe *previous = NULL;
+   unsigned int i;
+
+   if ( !uring_reserve( &g_uring, sends ) )
+   {
+      return;
+   }
+
+   session->tx_fill ^= 1;
+   for ( i = 0; i < sends; i++ )
+   {
+      sqe = uring_get_sqe( &g_uring );
+      if ( previous != NULL )
+      {
+         previous->flags |= IOSQE_IO_LINK;
+      }
+
+      uring_prep_send(
+         sqe,
+         session->link.fd,
+         &session->tx_buffer[ buffer ][ i ],
+         session->seqpacket ? sizeof( obd2_message ) : count * sizeof( obd2_message ),
+         ( (uint64_t) URING_OP_SEND << URING_OP_SHIFT )
+         | ( (uint64_t) index << URING_INDEX_SHIFT )
+         | session->generation
+         );
+      session->tx_in_flight++;
+      previous = sqe;
+   }
+   return;
+}
+#endif
+
+
+/*
+* Name: receive_requests
+*
+* Description: Read the requests queued on a client connection into its
+*              inbox, at most the free room.  A full inbox stops reading
+*              until serve_sessions() makes room, the socket buffers
+*              then push back on the client.
+*
+* Inputs: server - vehicle server
+*         session - client session
+*
+* Returns: true - session is still open
+*          false - connection closed or failed
+*
+*/
+bool receive_requests( vehicle_server *server, client_session *session )
+{
+   obd2_message requests[ TRANSPORT_BATCH_SIZE ];
+   unsigned int room = SESSION_QUEUE - session->inbox_count;
+   int rx_count;
+
+   if ( room > TRANSPORT_BATCH_SIZE )
+   {
+      room = TRANSPORT_BATCH_SIZE;
+   }
+   if ( 0 == room )
+   {
+      set_reading( server, session, false );
+      return( true );
+   }
+
+   rx_count = transport_receive_batch(
+      &session->link,
+      requests,
+      sizeof( obd2_message ),
+      room,
+      0
+      );
+   if ( rx_count > 0 )
+   {
+      queue_requests( session, requests, (unsigned int) rx_count );
+   }
+
+   // Connection closed or failed, errors are logged by the transport
+   return( ( rx_count != TRANSPORT_CLOSED ) && ( rx_count != TRANSPORT_ERROR ) );
+}
+
+
+/*
+* Name: queue_requests
+*
+* Description: Add received requests to a session's inbox, requests
+*              beyond a full inbox are dropped and counted
+*
+* Inputs: session - client session
+*         requests - received requests
+*         count - number of requests
+*
+* Returns: None
+*
+*/
+void queue_requests( client_session *session, const obd2_message *requests, unsigned int count )
+{
+   unsigned int i;
+   unsigned int tail;
+
+   for ( i = 0; i < count; i++ )
+   {
+      if ( SESSION_QUEUE == session->inbox_count )
+      {
+         session->dropped += count - i;
+         break;
+      }
+      tail = ( session->inbox_head + session->inbox_count ) % SESSION_QUEUE;
+      session->inbox[ tail ] = requests[ i ];
+      session->inbox_timestamp_ns[ tail ] = session->link.rx_timestamp_ns[ i ];
+      session->inbox_fd[ tail ] = session->link.rx_fd[ i ];
+      session->inbox_count++;
+      PROBE(
+         aesd_vehicle,
+         request__received,
+         session->link.fd,
+         requests[ i ].id,
+         requests[ i ].mode,
+         requests[ i ].pid,
+         jitter_clock_ns()
+         );
+   }
+   return;
+}
+
+
+/*
+* Name: set_reading
+*
+* Description: Start or stop reading a session's connection
+*
+* Inputs: server - vehicle server
+*         session - client session
+*         reading - true to read
+*
+* Returns: None
+*
+*/
+void set_reading( vehicle_server *server, client_session *session, bool reading )
+{
+   struct epoll_event event = { 0 };
+#ifdef USE_IO_URING
+   struct io_uring_sqe *sqe;
+#endif
+
+   if ( session->reading == reading )
+   {
+      return;
+   }
+
+#ifdef USE_IO_URING
+   // Data received before the receive stopped goes first
+   if ( reading && session->uring && !drain_uring_buffers( session ) )
+   {
+      return;
+   }
+#endif
+   session->reading = reading;
+
+#ifdef USE_IO_URING
+   if ( session->uring )
+   {
+      if ( !reading && session->recv_armed )
+      {
+         // The final completion of the receive clears recv_armed
+         sqe = uring_get_sqe( &g_uring );
+         if ( sqe != NULL )
+         {
+            uring_prep_cancel(
+               sqe,
+               ( (uint64_t) URING_OP_RECV << URING_OP_SHIFT )
+               | ( (uint64_t) ( session - server->sessions ) << URING_INDEX_SHIFT )
+               | session->generation,
+               (uint64_t) URING_OP_CANCEL << URING_OP_SHIFT
+               );
+         }
+      }
+      else if ( reading && !session->recv_armed )
+      {
+         arm_uring_receive( session, (unsigned int) ( session - server->sessions ) );
+      }
+      return;
+   }
+#endif
+
+   // Errors and hang ups are still reported without EPOLLIN
+   event.events = reading ? EPOLLIN : 0;
+   event.data.ptr = session;
+   epoll_ctl( server->epoll_fd, EPOLL_CTL_MOD, session->link.fd, &event );
+   return;
+}
+
+
+/*
+* Name: serve_sessions
+*
+* Description: Answer the requests waiting in the session inboxes,
+*              deficit round-robin.  Each round a session may answer a
+*              quantum more requests, as far as its tokens allow, so a
+*              client sending many requests cannot delay the others by
+*              more than one quantum per round.  Sessions whose output
+*              is not drained wait.  The first session served moves on
+*              every pass.
+*
+* Inputs: server - vehicle server
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void serve_sessions( vehicle_server *server, uint64_t now_ms )
+{
+   client_session *session;
+   unsigned int start = server->next_session;
+   unsigned int available;
+   unsigned int count;
+   unsigned int i;
+   bool progress;
+
+   do
+   {
+      progress = false;
+      for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+      {
+         session = &server->sessions[ ( start + i ) % MAX_CLIENT_CONNECTIONS ];
+         if ( !session->in_use || ( 0 == session->inbox_count ) )
+         {
+            continue;
+         }
+
+         // A session cut short loses its deficit, as in deficit
+         // round-robin, or it would save up more than a quantum
+         if ( !output_drained( session ) )
+         {
+            session->paused++;
+            session->deficit = 0;
+            continue;
+         }
+
+         available = session_tokens( session, now_ms );
+         if ( 0 == available )
+         {
+            session->throttled++;
+            session->deficit = 0;
+            continue;
+         }
+
+         // Requests cost one each, what the ring end cut off last
+         // round is not added on top of this round's quantum
+         session->deficit += SESSION_QUANTUM;
+         if ( session->deficit > SESSION_QUANTUM )
+         {
+            session->deficit = SESSION_QUANTUM;
+         }
+         count = session->deficit;
+         if ( count > session->inbox_count )
+         {
+            count = session->inbox_count;
+         }
+         if ( count > available )
+         {
+            count = available;
+         }
+         // Requests are handled in place, up to the end of the ring
+         if ( count > SESSION_QUEUE - session->inbox_head )
+         {
+            count = SESSION_QUEUE - session->inbox_head;
+         }
+
+         answer_requests(
+            session,
+            &session->inbox[ session->inbox_head ],
+            &session->inbox_timestamp_ns[ session->inbox_head ],
+            &session->inbox_fd[ session->inbox_head ],
+            (int) count
+            );
+         session->inbox_head = ( session->inbox_head + count ) % SESSION_QUEUE;
+         session->inbox_count -= count;
+         session->deficit -= count;
+         session->served += count;
+         if ( g_session_rate > 0 )
+         {
+            session->tokens -= (uint64_t) count * TOKEN_SCALE;
+         }
+         if ( ( 0 == session->inbox_count ) || ( count == available ) )
+         {
+            session->deficit = 0;
+         }
+
+         if ( session->in_use && !session->reading )
+         {
+            set_reading( server, session, true );
+         }
+         progress = true;
+      }
+   } while ( progress );
+
+   // One send per session and pass, a chunk per round would split a
+   // pipelined batch into small segments held back by Nagle's
+   // algorithm until the client's delayed ACK
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      session = &server->sessions[ i ];
+      if ( session->in_use && ( session->outbox_count > 0 ) )
+      {
+         flush_obd2_responses( session );
+      }
+   }
+
+   server->next_session = ( start + 1 ) % MAX_CLIENT_CONNECTIONS;
+   return;
+}
+
+
+/*
+* Name: session_tokens
+*
+* Description: Refill a session's token bucket and return the whole
+*              requests it may answer now
+*
+* Inputs: session - client session
+*         now_ms - monotonic time
+*
+* Returns: Requests allowed, UINT_MAX without a rate limit
+*
+*/
+unsigned int session_tokens( client_session *session, uint64_t now_ms )
+{
+   uint64_t burst = (uint64_t) g_session_burst * TOKEN_SCALE;
+
+   if ( 0 == g_session_rate )
+   {
+      return( UINT_MAX );
+   }
+
+   if ( 0 == session->refill_ms )
+   {
+      session->tokens = burst;
+   }
+   else
+   {
+      // rate requests per second is rate thousandths per millisecond
+      session->tokens += ( now_ms - session->refill_ms ) * g_session_rate;
+      if ( session->tokens > burst )
+      {
+         session->tokens = burst;
+      }
+   }
+   session->refill_ms = now_ms;
+
+   return( (unsigned int) ( session->tokens / TOKEN_SCALE ) );
+}
+
+
+/*
+* Name: output_drained
+*
+* Description: Whether a session's earlier responses have left, so
+*              more can be queued without blocking the server
+*
+* Inputs: session - client session
+*
+* Returns: true - room for another quantum of responses
+*          false - the client is not reading
+*
+*/
+bool output_drained( client_session *session )
+{
+   int queued = 0;
+
+#ifdef USE_IO_URING
+   if ( session->uring )
+   {
+      return(   ( 0 == session->tx_in_flight )
+             || ( session->tx_count[ session->tx_fill ] + SESSION_QUANTUM <= URING_TX_MESSAGES / 2 ) );
+   }
+#endif
+
+   // Bytes not yet sent or acknowledged
+   if ( -1 == ioctl( session->link.fd, SIOCOUTQ, &queued ) )
+   {
+      return( true );
+   }
+   return( queued < SESSION_OUTPUT_LIMIT );
+}
+
+
+/*
+* Name: transfer_data
+*
+* Description: Handle every request queued on a client connection,
+*              then send the responses together
+*
+* Inputs: session - client session
+*         timeout_ms - time to wait for the first request
+*
+* Returns: true - session is still open
+*          false - connection closed or failed
+*
+*/
+bool transfer_data( client_session *session, int timeout_ms )
+{
+   int rx_count;
+   obd2_message requests[ TRANSPORT_BATCH_SIZE ];
+   
+   rx_count = transport_receive_batch(
+      &session->link,
+      requests,
+      sizeof( obd2_message ),
+      TRANSPORT_BATCH_SIZE,
+      timeout_ms
+      );
+
+   handle_requests( session, requests, rx_count );
+
+   // Connection closed or failed, errors are logged by the transport
+   return( ( rx_count != TRANSPORT_CLOSED ) && ( rx_count != TRANSPORT_ERROR ) );
+}
+
+
+/*
+* Name: handle_requests
+*
+* Description: Answer received requests, then send the responses
+*              together.  The response time is taken from the kernel
+*              receive time of the first request where the transport
+*              has one, otherwise from the call.
+*
+* Inputs: session - client session
+*         requests - received requests
+*         count - number of requests, nothing to do when not positive
+*
+* Returns: None
+*
+*/
+void handle_requests( client_session *session, obd2_message *requests, int count )
+{
+   uint64_t start_ns = jitter_clock_ns();
+   uint64_t received_ns = session->link.rx_timestamp_ns[ 0 ];
+   uint64_t now_ns;
+   int i;
+
+   if ( count <= 0 )
+   {
+      return;
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      PROBE(
+         aesd_vehicle,
+         request__received,
+         session->link.fd,
+         requests[ i ].id,
+         requests[ i ].mode,
+         requests[ i ].pid,
+         start_ns
+         );
+   }
+
+   answer_requests(
+      session,
+      requests,
+      session->link.rx_timestamp_ns,
+      session->link.rx_fd,
+      count
+      );
+   flush_obd2_responses( session );
+
+   // The kernel stamps with the wall clock, capture times are monotonic
+   if ( received_ns != 0 )
+   {
+      received_ns = capture_from_realtime( received_ns );
+   }
+   now_ns = capture_timestamp();
+   if ( ( received_ns != 0 ) && ( now_ns > received_ns ) )
+   {
+      jitter_add( &g_server->response, now_ns - received_ns );
+   }
+   else
+   {
+      jitter_add( &g_server->response, jitter_clock_ns() - start_ns );
+   }
+   return;
+}
+
+
+/*
+* Name: answer_requests
+*
+* Description: Print, capture and answer received requests, the
+*              responses are queued in the session outbox
+*
+* Inputs: session - client session
+*         requests - received requests
+*         timestamps_ns - kernel receive time of each request, wall
+*                         clock, 0 when unknown
+*         fd_frames - which requests came in CAN FD frames
+*         count - number of requests, nothing to do when not positive
+*
+* Returns: None
+*
+*/
+void answer_requests(
+   client_session *session,
+   obd2_message *requests,
+   const uint64_t *timestamps_ns,
+   const bool *fd_frames,
+   int count
+   )
+{
+   int i;
+   size_t msg_bytes;
+   uint8_t *bytes;
+   uint64_t timestamp_ns;
+   
+   msg_bytes = sizeof ( obd2_message );
+
+   // Each message corresponds to a CAN frame.         
+   for ( i = 0; i < count; i++ )
+   {
+      bytes = (uint8_t *) &requests[ i ];
+      if ( !g_quiet )
+      {
+         printf( 
+            "RX: %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX "
+                "%02hhX %02hhX %02hhX %02hhX %02hhX %02hhX\n",
+            bytes[  0 ],
+            bytes[  1 ],
+            bytes[  2 ],
+            bytes[  3 ],
+            bytes[  4 ],
+            bytes[  5 ],
+            bytes[  6 ],
+            bytes[  7 ],
+            bytes[  8 ],
+            bytes[  9 ],
+            bytes[ 10 ],
+            bytes[ 11 ]
+            );
+      }
+
+      if ( g_capture_enabled )
+      {
+         // Prefer the kernel receive time, it is not delayed by the
+         // batch or by scheduling
+         timestamp_ns = timestamps_ns[ i ];
+         if ( 0 == timestamp_ns )
+         {
+            timestamp_ns = capture_timestamp();
+         }
+         else
+         {
+            timestamp_ns = capture_from_realtime( timestamp_ns );
+         }
+         capture_write(
+            &g_capture,
+            timestamp_ns,
+            requests[ i ].id,
+            requests[ i ].pid,
+            CAPTURE_DIR_RX,
+            &requests[ i ],
+            msg_bytes
+            );
+      }
+      
+      session->fd_request = fd_frames[ i ];
+      handle_obd2_request( session, &requests[ i ] );
+      g_server->requests++;
+   }
+   return;
+}
+
+
+/*
+* Name: publish_subscriptions
+*
+* Description: Queue an update for every subscribed PID whose interval
+*              has passed and whose value moved by more than its
+*              deadband since the last update.  Changes between two
+*              checks are coalesced into a single update, as are the
+*              changes while the client is not reading.
+*
+* Inputs: session - client session
+*         now_ms - monotonic time
+*
+* Returns: None
+*
+*/
+void publish_subscriptions( client_session *session, uint64_t now_ms )
+{
+   int i;
+   int j;
+   subscription *entry;
+   obd2_message obd2_update;
+   uint32_t value;
+   uint32_t change;
+
+   if ( !output_drained( session ) )
+   {
+      return;
+   }
+
+   for ( i = 0; i < MAX_SUBSCRIPTIONS; i++ )
+   {
+      entry = &session->subscriptions[ i ];
+      if (   !entry->active
+          || ( entry->sent && ( now_ms - entry->last_sent_ms < entry->interval_ms ) )
+         )
+      {
+         continue;
+      }
+
+      memset( &obd2_update, 0, sizeof( obd2_update ) );
+      obd2_update.id = vehicle_id;
+      obd2_update.mode = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
+      if ( !handle_obd2_current_data( &obd2_update, entry->pid ) )
+      {
+         continue;
+      }
+
+      // Compare the raw PID bytes, the deadband is in PID units
+      value = 0;
+      for ( j = 0; ( j < obd2_update.num_bytes - 2 ) && ( j < 4 ); j++ )
+      {
+         value = ( value << 8 ) | obd2_update.data[ j ];
+      }
+      change = ( value > entry->last_value )
+             ? ( value - entry->last_value )
+             : ( entry->last_value - value );
+
+      if ( !entry->sent || ( change > entry->deadband ) )
+      {
+         send_obd2_response( session, &obd2_update );
+         entry->sent = true;
+         entry->last_value = value;
+         entry->last_sent_ms = now_ms;
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: service_timeout
+*
+* Description: Time until the next subscription could be due or a
+*              waiting request could be served
+*
+* Inputs: server - vehicle server
+*
+* Returns: epoll timeout in milliseconds
+*
+*/
+int service_timeout( vehicle_server *server )
+{
+   int timeout_ms = SERVER_POLL_MS;
+   int i;
+
+   for ( i = 0; i < MAX_CLIENT_CONNECTIONS; i++ )
+   {
+      if ( !server->sessions[ i ].in_use )
+      {
+         continue;
+      }
+      if (   ( server->sessions[ i ].inbox_count > 0 )
+          || ( server->sessions[ i ].outbox_count > 0 )
+         )
+      {
+         // Waiting for tokens or for the client to drain its output
+         timeout_ms = SESSION_WAIT_MS;
+         break;
+      }
+      if ( server->sessions[ i ].subscription_count > 0 )
+      {
+         timeout_ms = SUBSCRIPTION_MIN_MS;
+      }
+   }
+   return( timeout_ms );
+}
+
+
+/*
+* Name: handle_obd2_request
+*
+* Description: Handle OBD2 messages.
+*              Send response to supported message
+*
+* Inputs: session - client session
+*         obd2_request - obd2 message to process
+*
+* Returns: None
+*
+*/
+void handle_obd2_request( client_session *session, obd2_message* obd2_request )
+{
+   obd2_message obd2_response = { 0 };
+
+   obd2_response.id = vehicle_id;
+   
+   if ( obd2_request != NULL )
+   {
+      //printf( "Received OBD2 Request: %u\n",  obd2_request->id );
+      PROBE(
+         aesd_vehicle,
+         request__dispatch,
+         session->link.fd,
+         obd2_request->id,
+         obd2_request->mode,
+         obd2_request->pid,
+         jitter_clock_ns()
+         );
+   
+      // Filter message ids
+      if ( obd2_request->id == scan_tool_id )
+      {
+         //printf( "Received Scan Tool Request\n" );         
+         PROBE(
+            aesd_vehicle,
+            handler__start,
+            session->link.fd,
+            obd2_request->mode,
+            obd2_request->pid,
+            jitter_clock_ns()
+            );
+         obd2_response.mode = obd2_request->mode | MODE_RESPONSE;
+         switch( obd2_request->mode )
+         {
+            case MODE_SHOW_CURRENT_DATA:
+            {
+               //printf( "Mode: Current Data\n" );
+               if ( handle_obd2_multi_pid( session, obd2_request ) )
+               {
+                  break;
+               }
+               if ( !handle_obd2_current_data( &obd2_response, obd2_request->pid ) )
+               {
+                  handle_obd2_negative(
+                     obd2_request,
+                     &obd2_response,
+                     NRC_REQUEST_OUT_OF_RANGE
+                     );
+               }
+               send_obd2_response( session, &obd2_response );
+               break;
+            }
+
+            case MODE_PERIODIC_DATA:
+            {
+               handle_obd2_subscription( session, obd2_request, &obd2_response );
+               send_obd2_response( session, &obd2_response );
+               break;
+            }
+
+            case MODE_REQUEST_VEHICLE_INFO:
+            {
+               if ( !handle_obd2_vehicle_info( session, obd2_request ) )
+               {
+                  handle_obd2_negative(
+                     obd2_request,
+                     &obd2_response,
+                     ( ( TRANSPORT_VBUS == session->link.type ) || ( TRANSPORT_CAN == session->link.type ) )
+                     ? NRC_REQUEST_OUT_OF_RANGE
+                     : NRC_SERVICE_NOT_SUPPORTED
+                     );
+                  send_obd2_response( session, &obd2_response );
+               }
+               break;
+            }
+            
+            default:
+            {
+               handle_obd2_negative(
+                  obd2_request,
+                  &obd2_response,
+                  NRC_SERVICE_NOT_SUPPORTED
+                  );
+               send_obd2_response( session, &obd2_response );
+               break;
+            }
+         }
+         PROBE(
+            aesd_vehicle,
+            handler__end,
+            session->link.fd,
+            obd2_request->mode,
+            obd2_request->pid,
+            jitter_clock_ns()
+            );
+      }
+   }
+   return;
+}
+
+
+/*
+* Name: handle_obd2_current_data
+*
+* Description: Fill a mode 01 response for a PID
+*
+* Inputs: obd2_response - response with id and mode set
+*         pid - requested PID
+*
+* Returns: true - PID is supported
+*          false - PID is not supported, response unchanged
+*
+*/
+bool handle_obd2_current_data( obd2_message* obd2_response, uint8_t pid )
+{
+   bool supported = true;
+
+   if ( 0 == ( pid % PID_SUPPORTED_RANGE ) )
+   {
+      return( handle_obd2_supported_pids( obd2_response, pid ) );
+   }
+
+   switch( pid )
+   {
+      case PID_ENGINE_RPM:
+      {
+         //printf( "Received RPM Request\n" );
+         handle_obd2_engine_rpm( obd2_response );
+         break;
+      }
+
+      case PID_VEHICLE_SPEED:
+      {
+         //printf( "Received Speed Request\n" );
+         handle_obd2_vehicle_speed( obd2_response );
+         break;
+      }
+      
+      case PID_AMBIENT_AIR_TEMP:
+      {
+         //printf( "Received Ambient Air Temp Request\n" );
+         handle_obd2_ambient_air_temp( obd2_response );
+         break;
+      }
+
+      case PID_ODOMETER:
+      {
+         //printf( "Received Odometer Request\n" );
+         handle_obd2_odometer( obd2_response );
+         break;
+      }
+      
+      default:
+      {
+         supported = false;
+         break;
+      }
+   }
+   return( supported );
+}
+
+
+/*
+* Name: handle_obd2_supported_pids
+*
+* Description: Fill the supported PID bitmap for PIDs base + 1 to
+*              base + 32.  The bit of PID base + n is bit 7 of A for
+*              n = 1 down to bit 0 of D for n = 32, and the last bit
+*              announces the next range.  Only ranges announced by the
+*              range before are answered.
+*
+* Inputs: obd2_response - response with id and mode set
+*         base - 0x00, 0x20, ... 0xE0
+*
+* Returns: true - range is supported
+*          false - range is not supported, response unchanged
+*
+*/
+bool handle_obd2_supported_pids( obd2_message* obd2_response, uint8_t base )
+{
+   uint32_t bitmap = 0;
+   unsigned int offset;
+   int i;
+
+   for ( i = 0; i < M_ARRAY_SIZE( g_supported_pids ); i++ )
+   {
+      if ( g_supported_pids[ i ] > base )
+      {
+         offset = g_supported_pids[ i ] - base;
+         if ( offset > PID_SUPPORTED_RANGE )
+         {
+            // Announce the next range
+            offset = PID_SUPPORTED_RANGE;
+         }
+         bitmap |= 1U << ( PID_SUPPORTED_RANGE - offset );
+      }
+   }
+
+   if ( ( base != 0 ) && ( 0 == bitmap ) )
+   {
+      return( false );
+   }
+
+   obd2_response->num_bytes = 6;
+   obd2_response->pid = base;
+   obd2_response->data[ 0 ] = (uint8_t) ( bitmap >> 24 );
+   obd2_response->data[ 1 ] = (uint8_t) ( bitmap >> 16 );
+   obd2_response->data[ 2 ] = (uint8_t) ( bitmap >>  8 );
+   obd2_response->data[ 3 ] = (uint8_t) bitmap;
+   return( true );
+}
+
+
+/*
+* Name: handle_obd2_multi_pid
+*
+* Description: Answer a mode 01 request for several PIDs with one
+*              ISO-TP response, each supported PID followed by its
+*              data.  Unsupported PIDs are left out.  Only on a CAN
+*              bus, the other transports carry single frames.
+*                num_bytes - 1 + number of PIDs
+*                pid, data[ 0..3 ], unused - up to 6 PIDs
+*
+* Inputs: session - client session
+*         obd2_request - mode 01 request
+*
+* Returns: true - request answered
+*          false - request names one PID or not on a CAN bus
+*
+*/
+bool handle_obd2_multi_pid( client_session *session, obd2_message* obd2_request )
+{
+   uint8_t payload[ 1 + MAX_REQUEST_PIDS * ( 1 + sizeof( obd2_request->data ) ) ];
+   obd2_message value = { 0 };
+   const uint8_t *pids = &obd2_request->pid;
+   size_t length = 0;
+   size_t data_bytes;
+   unsigned int count;
+   unsigned int i;
+
+   if (   ( obd2_request->num_bytes <= 2 )
+       || ( ( session->link.type != TRANSPORT_VBUS ) && ( session->link.type != TRANSPORT_CAN ) )
+      )
+   {
+      return( false );
+   }
+
+   count = obd2_request->num_bytes - 1u;
+   if ( count > MAX_REQUEST_PIDS )
+   {
+      count = MAX_REQUEST_PIDS;
+   }
+
+   payload[ length++ ] = MODE_SHOW_CURRENT_DATA | MODE_RESPONSE;
+   for ( i = 0; i < count; i++ )
+   {
+      if ( handle_obd2_current_data( &value, pids[ i ] ) )
       {
-         strerror_r( errno, error, SYSLOG_BUF_SIZE );
-         syslog( LOG_ERR, "%s: %s", __func__, error );
+         data_bytes = value.num_bytes - 2u;
+         payload[ length++ ] = pids[ i ];
+         memcpy( &payload[ length ], value.data, data_bytes );
+         length += data_bytes;
       }
-   }  
-   else
+   }
+
+   if ( 1 == length )
    {
-      syslog( LOG_ERR, "%s: Invalid Parameter", __func__ );
+      // None supported, the caller sends the negative response
+      return( false );
    }
-   return( return_status );
+
+   send_isotp_response( session, payload, length );
+   return( true );
 }
 
 
 /*
-* Name: run_server
+* Name: handle_obd2_vehicle_info
 *
-* Description: Listen and accept socket connections
+* Description: Answer a mode 09 request, the supported PIDs or the
+*              VIN.  The VIN does not fit a classic single frame and
+*              is sent with ISO-TP, so only on a CAN bus.
 *
-* Inputs: socket_fd - soacket file descriptor
-* 
-* Returns: EXIT_SUCCESS
-*          EXIT_FAILURE
+* Inputs: session - client session
+*         obd2_request - mode 09 request
+*
+* Returns: true - request answered
+*          false - PID not supported or not on a CAN bus
 *
 */
-int run_server( int socket_fd )
+bool handle_obd2_vehicle_info( client_session *session, obd2_message* obd2_request )
 {
-   int return_status = EXIT_SUCCESS;
-   int status;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
+   uint8_t payload[ 3 + VIN_LENGTH ];
+   uint32_t bitmap = 1U << ( PID_SUPPORTED_RANGE - PID_VIN );
 
-   status = listen( socket_fd, MAX_CLIENT_CONNECTIONS );
-   if ( 0 == status )
+   if ( ( session->link.type != TRANSPORT_VBUS ) && ( session->link.type != TRANSPORT_CAN ) )
    {
-      struct sockaddr_storage client_address;
-      socklen_t address_length;      
-      int client_fd;
-      
-      address_length = sizeof( client_address );
-      for(;;)
+      return( false );
+   }
+
+   payload[ 0 ] = MODE_REQUEST_VEHICLE_INFO | MODE_RESPONSE;
+   payload[ 1 ] = obd2_request->pid;
+   switch( obd2_request->pid )
+   {
+      case PID_VEHICLE_INFO_SUPPORTED:
       {
-         client_fd = accept(
-            socket_fd,
-            (struct sockaddr *) &client_address,
-            &address_length
-            );
-            
-         if ( client_fd != -1 )
-         {
-            struct sockaddr_in *client_in = (struct sockaddr_in *) &client_address;
-            char client_ip[ INET_ADDRSTRLEN + 1 ];
-            
-            inet_ntop(
-               AF_INET, 
-               &(client_in->sin_addr), 
-               client_ip, 
-               INET_ADDRSTRLEN
-               );
-            syslog( LOG_INFO, "Accepted connection from %s", client_ip );
-            
-            transfer_data( client_fd );            
-            close( client_fd );
-            
-            syslog( LOG_INFO, "Closed connection from %s", client_ip );
-         }          
-         else
-         {
-            if (   ( errno != EAGAIN      ) 
-                && ( errno != EWOULDBLOCK )
-               )
-            {
-               strerror_r( errno, error, SYSLOG_BUF_SIZE );
-               syslog( LOG_ERR, "%s: %s", __func__, error );
-               break;
-            }
-         }
+         payload[ 2 ] = (uint8_t) ( bitmap >> 24 );
+         payload[ 3 ] = (uint8_t) ( bitmap >> 16 );
+         payload[ 4 ] = (uint8_t) ( bitmap >>  8 );
+         payload[ 5 ] = (uint8_t) bitmap;
+         send_isotp_response( session, payload, 6 );
+         return( true );
+      }
 
-         if ( g_stop_signal )
-         {
-            syslog( LOG_INFO, "%s: %s", __func__, "Caught signal, exiting" );
-            break;
-         }
+      case PID_VIN:
+      {
+         // One data item follows
+         payload[ 2 ] = 1;
+         memcpy( &payload[ 3 ], g_vin, VIN_LENGTH );
+         send_isotp_response( session, payload, sizeof( payload ) );
+         return( true );
+      }
+
+      default:
+      {
+         return( false );
       }
    }
-   else
+}
+
+
+/*
+* Name: send_isotp_response
+*
+* Description: Send a response with ISO-TP, in CAN FD frames when the
+*              request came in one.  Queued single frame responses are
+*              sent first to keep the order.
+*
+* Inputs: session - client session on a CAN bus
+*         payload - response, starting with the mode
+*         length - response length
+*
+* Returns: None
+*
+*/
+void send_isotp_response( client_session *session, const uint8_t *payload, size_t length )
+{
+   isotp_channel channel;
+
+   flush_obd2_responses( session );
+
+   if ( g_capture_enabled )
    {
-      strerror_r( errno, error, SYSLOG_BUF_SIZE );
-      syslog( LOG_ERR, "%s: %s", __func__, error );
+      capture_write(
+         &g_capture,
+         capture_timestamp(),
+         vehicle_id,
+         payload[ 1 ],
+         CAPTURE_DIR_TX,
+         payload,
+         (uint16_t) length
+         );
    }
-   
-   close( socket_fd );
-   remove( client_log_file );
 
-   return( return_status );
+   isotp_init(
+      &channel,
+      &session->link,
+      vehicle_id,
+      scan_tool_id,
+      session->fd_request && session->link.fd_capable
+      );
+   // Errors are logged by ISO-TP and the transport
+   isotp_send( &channel, payload, length );
+   return;
 }
 
 
 /*
-* Name: transfer_data
+* Name: handle_obd2_negative
 *
-* Description: Transfer data over the client socket connection
+* Description: Fill a negative response, so the scan tool does not
+*              wait for an answer that will never come.
+*                pid - rejected mode (service)
+*                data[ 0 ] - negative response code
+*                data[ 1 ] - rejected PID
 *
-* Inputs: client_socket_fd
+* Inputs: obd2_request - rejected request
+*         code - negative response code
+*
+* Outputs: obd2_response - negative response
 *
 * Returns: None
 *
 */
-void transfer_data( int client_socket_fd )
+void handle_obd2_negative(
+   obd2_message* obd2_request,
+   obd2_message* obd2_response,
+   uint8_t code
+   )
 {
-   int client_log_file_fd;
-   int rx_bytes;
-   int tx_bytes;
-   int tx_length;
-   struct stat file_stat;
-   obd2_message obd2_msg;
-   size_t msg_bytes;
-   char *start_packet;
-   char *end_packet;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
-   
-   client_log_file_fd = open( 
-      client_log_file,
-      O_RDWR | O_CREAT | O_APPEND,
-      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
-      );
-      
-   fcntl( 
-      client_socket_fd, 
-      F_SETFL, 
-      O_NONBLOCK
-      );
-   
-   msg_bytes = sizeof ( obd2_message );
-   
-   for(;;)
-   {
-      rx_bytes = recv(
-         client_socket_fd, 
-         client_buffer[ 0 ], 
-         CLIENT_LOG_BUF_SIZE, 
-         0
-         );
+   memset( obd2_response->data, 0, sizeof( obd2_response->data ) );
+   obd2_response->num_bytes = 4;
+   obd2_response->mode = MODE_NEGATIVE_RESPONSE;
+   obd2_response->pid = obd2_request->mode;
+   obd2_response->data[ 0 ] = code;
+   obd2_response->data[ 1 ] = obd2_request->pid;
+   return;
+}
 
-      // Assume data is received in the size of a message,
-      // this corresponds to a CAN frame.         
-      if ( rx_bytes == msg_bytes )
-      {
-         // Write received data to the end of the file
-         //tx_bytes = write(
-         //   client_log_file_fd,
-         //   client_buffer[ 0 ],
-         //   msg_bytes
-         //   );
 
-         printf( 
-            "RX: %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX "
-                "%02hhX %02hhX %02hhX %02hhX %02hhX %02hhX\n",
-            client_buffer[ 0 ][  0 ],
-            client_buffer[ 0 ][  1 ],
-            client_buffer[ 0 ][  2 ],
-            client_buffer[ 0 ][  3 ],
-            client_buffer[ 0 ][  4 ],
-            client_buffer[ 0 ][  5 ],
-            client_buffer[ 0 ][  6 ],
-            client_buffer[ 0 ][  7 ],
-            client_buffer[ 0 ][  8 ],
-            client_buffer[ 0 ][  9 ],
-            client_buffer[ 0 ][ 10 ],
-            client_buffer[ 0 ][ 11 ]
-            );
-         memcpy( &obd2_msg, client_buffer[ 0 ], msg_bytes );
-         
-         if ( -1 == tx_bytes )
+/*
+* Name: handle_obd2_subscription
+*
+* Description: Add, change or remove a periodic data subscription.
+*                data[ 0..1 ] - minimum interval in ms, 0 unsubscribes
+*                data[ 2..3 ] - deadband in raw PID units
+*              The acknowledgement echoes the granted interval and
+*              deadband, an interval of 0 means rejected or removed.
+*
+* Inputs: session - client session
+*         obd2_request - subscription request
+*
+* Outputs: obd2_response - acknowledgement
+*
+* Returns: None
+*
+*/
+void handle_obd2_subscription(
+   client_session *session,
+   obd2_message* obd2_request,
+   obd2_message* obd2_response
+   )
+{
+   int i;
+   subscription *entry = NULL;
+   subscription *free_entry = NULL;
+   uint16_t interval_ms;
+   uint16_t deadband;
+   obd2_message probe = { 0 };
+
+   interval_ms = (uint16_t) ( ( obd2_request->data[ 0 ] << 8 ) | obd2_request->data[ 1 ] );
+   deadband    = (uint16_t) ( ( obd2_request->data[ 2 ] << 8 ) | obd2_request->data[ 3 ] );
+
+   for ( i = 0; i < MAX_SUBSCRIPTIONS; i++ )
+   {
+      if ( session->subscriptions[ i ].active )
+      {
+         if ( session->subscriptions[ i ].pid == obd2_request->pid )
          {
-            // File write errror occurred
-            strerror_r( errno, error, SYSLOG_BUF_SIZE );
-            syslog( LOG_ERR, "%s: %s", __func__, error );
+            entry = &session->subscriptions[ i ];
          }
-         
-         handle_obd2_request( client_socket_fd, &obd2_msg );
       }
-      else if ( -1 == rx_bytes )
+      else if ( NULL == free_entry )
       {
-         if (   ( errno != EAGAIN      ) 
-             && ( errno != EWOULDBLOCK )
-            )
+         free_entry = &session->subscriptions[ i ];
+      }
+   }
+
+   if ( 0 == interval_ms )
+   {
+      if ( entry != NULL )
+      {
+         entry->active = false;
+         session->subscription_count--;
+      }
+   }
+   else if ( handle_obd2_current_data( &probe, obd2_request->pid ) )
+   {
+      if ( ( NULL == entry ) && ( free_entry != NULL ) )
+      {
+         entry = free_entry;
+         memset( entry, 0, sizeof( subscription ) );
+         entry->active = true;
+         entry->pid = obd2_request->pid;
+         session->subscription_count++;
+      }
+
+      if ( entry != NULL )
+      {
+         if ( interval_ms < SUBSCRIPTION_MIN_MS )
          {
-            // Socket errror occurred
-            strerror_r( errno, error, SYSLOG_BUF_SIZE );
-            syslog( LOG_ERR, "%s: %s", __func__, error );
-            break;
+            interval_ms = SUBSCRIPTION_MIN_MS;
          }
+         entry->interval_ms = interval_ms;
+         entry->deadband = deadband;
+         entry->sent = false;
       }
       else
       {
-         // Assume socket is closed
-         break;
-      }
-      
-      if ( g_stop_signal )
-      {
-         break;
+         interval_ms = 0;
       }
-      
-   }   
-       
-   close( client_log_file_fd );
-    
+   }
+   else
+   {
+      interval_ms = 0;
+   }
+
+   obd2_response->num_bytes = 6;
+   obd2_response->pid = obd2_request->pid;
+   obd2_response->data[ 0 ] = (uint8_t) ( interval_ms >> 8 );
+   obd2_response->data[ 1 ] = (uint8_t) interval_ms;
+   obd2_response->data[ 2 ] = (uint8_t) ( deadband >> 8 );
+   obd2_response->data[ 3 ] = (uint8_t) deadband;
    return;
 }
 
 
 /*
-* Name: handle_obd2_request
+* Name: send_obd2_response
 *
-* Description: Handle OBD2 messages.
-*              Send response to supported message
+* Description: Queue an OBD2 response, the queue is sent by
+*              flush_obd2_responses() once the current batch of
+*              requests has been handled
 *
-* Inputs: obd2_request - obd2 message to process
+* Inputs: session - client session
+*         obd2_response
 *
 * Returns: None
 *
 */
-void handle_obd2_request( int client_socket_fd, obd2_message* obd2_request )
+void send_obd2_response( client_session *session, obd2_message* obd2_response )
 {
-   obd2_message obd2_response = { 0 };
+   size_t tx_length = sizeof( obd2_message );
 
-   obd2_response.id = vehicle_id;
-   
-   if ( obd2_request != NULL )
+   if ( obd2_response != NULL )
    {
-      //printf( "Received OBD2 Request: %u\n",  obd2_request->id );
-   
-      // Filter message ids
-      if ( obd2_request->id == scan_tool_id )
+      if ( g_capture_enabled )
       {
-         //printf( "Received Scan Tool Request\n" );         
-         obd2_response.mode = obd2_request->mode | MODE_RESPONSE;
-         switch( obd2_request->mode )
-         {
-            case MODE_SHOW_CURRENT_DATA:
-            {
-               //printf( "Mode: Current Data\n" );
-               switch( obd2_request->pid )
-               {
-                  case PID_ENGINE_RPM:
-                  {
-                     //printf( "Received RPM Request\n" );
-                     handle_obd2_engine_rpm( &obd2_response );
-                     send_obd2_response( client_socket_fd, &obd2_response );
-                     break;
-                  }
-
-                  case PID_VEHICLE_SPEED:
-                  {
-                     //printf( "Received Speed Request\n" );
-                     handle_obd2_vehicle_speed( &obd2_response );
-                     send_obd2_response( client_socket_fd, &obd2_response );
-                     break;
-                  }
-                  
-                  case PID_AMBIENT_AIR_TEMP:
-                  {
-                     //printf( "Received Ambient Air Temp Request\n" );
-                     handle_obd2_ambient_air_temp( &obd2_response );
-                     send_obd2_response( client_socket_fd, &obd2_response );
-                     break;
-                  }
-
-                  case PID_ODOMETER:
-                  {
-                     //printf( "Received Odometer Request\n" );
-                     handle_obd2_odometer( &obd2_response );
-                     send_obd2_response( client_socket_fd, &obd2_response );
-                     break;
-                  }
-                  
-                  default:
-                  {
-                     break;
-                  }
-               }
-               break;
-            }
-            
-            default:
-            {
-               break;
-            }
-         }
+         capture_write(
+            &g_capture,
+            capture_timestamp(),
+            obd2_response->id,
+            obd2_response->pid,
+            CAPTURE_DIR_TX,
+            obd2_response,
+            tx_length
+            );
+      }
+
+      if ( session->outbox_count >= TRANSPORT_BATCH_SIZE )
+      {
+         flush_obd2_responses( session );
+      }
+      if ( session->outbox_count >= TRANSPORT_BATCH_SIZE )
+      {
+         // The client has not read its earlier responses
+         session->unsent++;
+         return;
       }
+      session->outbox[ session->outbox_count++ ] = *obd2_response;
    }
    return;
 }
 
 
 /*
-* Name: send_obd2_response
+* Name: flush_obd2_responses
 *
-* Description: Send an OBD2 response
+* Description: Send the queued OBD2 responses in one batch, without
+*              waiting for a client that is not reading.  Responses
+*              the socket does not take stay queued for the next
+*              flush.
 *
-* Inputs: obd2_response
+* Inputs: session - client session
 *
 * Returns: None
 *
 */
-void send_obd2_response( int client_socket_fd, obd2_message* obd2_response )
+void flush_obd2_responses( client_session *session )
 {
-   size_t tx_length = sizeof( obd2_message );
-   size_t tx_bytes;
-   char error[ SYSLOG_BUF_SIZE + 1 ];
+   unsigned int count = session->outbox_count;
+   int sent;
 
-    
-   if ( obd2_response != NULL )
+#ifdef USE_IO_URING
+   if ( session->uring )
    {
-      while ( tx_length )
+      // Submitted with the next wait of the server loop
+      queue_uring_send( session );
+      count -= session->outbox_count;
+      if ( count > 0 )
       {
-         tx_bytes = send(
-            client_socket_fd,
-            obd2_response,
-            tx_length,
-            0
+         PROBE( aesd_vehicle, response__sent, session->link.fd, count, jitter_clock_ns() );
+      }
+      return;
+   }
+#endif
+   if ( count > 0 )
+   {
+      // Errors are logged by the transport, a failed connection is
+      // noticed by the next receive
+      sent = transport_try_send_batch(
+         &session->link,
+         session->outbox,
+         sizeof( obd2_message ),
+         count
+         );
+      if ( ( sent > 0 ) && ( (unsigned int) sent < count ) )
+      {
+         memmove(
+            session->outbox,
+            &session->outbox[ sent ],
+            ( count - (unsigned int) sent ) * sizeof( obd2_message )
             );
+         session->outbox_count = count - (unsigned int) sent;
+      }
+      else if ( sent != 0 )
+      {
+         session->outbox_count = 0;
+      }
 
-         if ( -1 == tx_bytes )
-         {
-            // Socket errror occurred
-            strerror_r( errno, error, SYSLOG_BUF_SIZE );
-            syslog( LOG_ERR, "%s: %s", __func__, error );
-            break;
-         }
-         else
-         {
-            tx_length -= tx_bytes;
-         }
+      if ( sent > 0 )
+      {
+         PROBE( aesd_vehicle, response__sent, session->link.fd, (unsigned int) sent, jitter_clock_ns() );
       }
    }
    return;
 }
 
 
+/*
+* Name: monotonic_ms
+*
+* Description: Monotonic clock in milliseconds
+*
+* Inputs: None
+*
+* Returns: Milliseconds
+*
+*/
+uint64_t monotonic_ms( void )
+{
+   struct timespec now;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return( (uint64_t) now.tv_sec * MS_PER_SEC + (uint64_t) now.tv_nsec / NS_PER_MS );
+}
+
+
+/*
+* Name: simulation_ms
+*
+* Description: Time since the vehicle started, drives the simulated
+*              signals so they change with time and not with how
+*              often they are read
+*
+* Inputs: None
+*
+* Returns: Milliseconds
+*
+*/
+uint64_t simulation_ms( void )
+{
+   return( monotonic_ms() - g_start_ms );
+}
+
+
 /*
 * Name: handle_obd2_engine_rpm
 *
@@ -605,23 +4076,20 @@ void send_obd2_response( int client_socket_fd, obd2_message* obd2_response )
 */
 void handle_obd2_engine_rpm( obd2_message* obd2_msg )
 {
-   static uint32_t rpm = 1000;
+   uint32_t rpm;
    int i = 0;
    
    if ( obd2_msg != NULL )
    {
+      // 1000 to 10000 rpm in steps of 100
+      rpm = 1000 + 100 * (uint32_t) ( ( simulation_ms() / SIM_RPM_STEP_MS ) % 91 );
+
       obd2_msg->num_bytes = 4;
       obd2_msg->pid = PID_ENGINE_RPM;
       obd2_msg->data[ i++ ] = (uint8_t) (((rpm * 4) & 0xFF00) >> 8 );
       obd2_msg->data[ i++ ] = (uint8_t)  ((rpm * 4) & 0x00FF);
       obd2_msg->data[ i++ ] = 0;
       obd2_msg->data[ i++ ] = 0;
-
-      rpm += 100;
-      if ( rpm > 10000 )
-      {
-         rpm = 1000;
-      }
    }   
    return;
 }
@@ -639,24 +4107,20 @@ void handle_obd2_engine_rpm( obd2_message* obd2_msg )
 */
 void handle_obd2_vehicle_speed( obd2_message* obd2_msg )
 {
-   static uint32_t speed = 10;
+   uint32_t speed;
    int i = 0;
    
    if ( obd2_msg != NULL )
    {
-      // Speed in km/h
+      // Speed in km/h, 10 to 200 in steps of 10
+      speed = 10 + 10 * (uint32_t) ( ( simulation_ms() / SIM_SPEED_STEP_MS ) % 20 );
+
       obd2_msg->num_bytes = 3;
       obd2_msg->pid = PID_VEHICLE_SPEED;
       obd2_msg->data[ i++ ] = (uint8_t) speed;
       obd2_msg->data[ i++ ] = 0;
       obd2_msg->data[ i++ ] = 0;
       obd2_msg->data[ i++ ] = 0;
-
-      speed += 10;
-      if ( speed > 200 )
-      {
-         speed = 10;
-      }
    }   
    return;
 }
@@ -674,11 +4138,14 @@ void handle_obd2_vehicle_speed( obd2_message* obd2_msg )
 */
 void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
 {
-   static int32_t temperature = -40;
+   int32_t temperature;
    int i = 0;
    
    if ( obd2_msg != NULL )
    {
+      // -40 to 200 C in steps of 5
+      temperature = -40 + 5 * (int32_t) ( ( simulation_ms() / SIM_TEMPERATURE_STEP_MS ) % 49 );
+
       // Temperature scaled by 40 C
       obd2_msg->num_bytes = 3;
       obd2_msg->pid = PID_AMBIENT_AIR_TEMP;
@@ -686,12 +4153,6 @@ void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
       obd2_msg->data[ i++ ] = 0;
       obd2_msg->data[ i++ ] = 0;
       obd2_msg->data[ i++ ] = 0;
-
-      temperature += 5;
-      if ( temperature > 200 )
-      {
-         temperature = -40;
-      }
    }   
    return;
 }
@@ -709,24 +4170,20 @@ void handle_obd2_ambient_air_temp( obd2_message* obd2_msg )
 */
 void handle_obd2_odometer( obd2_message* obd2_msg )
 {
-   static uint32_t odometer = 10000;
+   uint32_t odometer;
    int i = 0;
    
    if ( obd2_msg != NULL )
    {
-      // Odometer in km
+      // Odometer in km, 10000 to 1000000 in steps of 1000
+      odometer = 10000 + 1000 * (uint32_t) ( ( simulation_ms() / SIM_ODOMETER_STEP_MS ) % 991 );
+
       obd2_msg->num_bytes = 6;
       obd2_msg->pid = PID_ODOMETER;
       obd2_msg->data[ i++ ] = (uint8_t) (((odometer * 10) & 0xFF000000) >> 24 );
       obd2_msg->data[ i++ ] = (uint8_t) (((odometer * 10) & 0x00FF0000) >> 16 );
       obd2_msg->data[ i++ ] = (uint8_t) (((odometer * 10) & 0x0000FF00) >>  8 );
       obd2_msg->data[ i++ ] = (uint8_t)  ((odometer * 10) & 0x000000FF);
-
-      odometer += 1000;
-      if ( odometer > 1000000 )
-      {
-         odometer = 10000;
-      }
    }   
    return;
 }
@@ -750,7 +4207,7 @@ int setup_signals( void )
    int return_status = EXIT_SUCCESS;
    int signal_status;
    int i;
-   int signals[] = { SIGINT, SIGTERM };
+   int signals[] = { SIGINT, SIGTERM, SIGUSR2 };
    char error[ SYSLOG_BUF_SIZE + 1 ];
    struct sigaction program_action = { 0 };
    
@@ -780,6 +4237,7 @@ int setup_signals( void )
 * Description: Signal handler for this program, handles these signals:
 *                SIGINT
 *                SIGTERM
+*                SIGUSR2 - hand the listener to a replacement
 *              Note: This function is called asynchronously and
 *                    must be reentrant.
 *
@@ -798,6 +4256,13 @@ void signal_handler( int signal )
          g_stop_signal = true;
          break;
       }
+
+      case SIGUSR2:
+      {
+         // A replacement server is waiting for the listener
+         g_handoff_signal = true;
+         break;
+      }
       
       default:
          break;